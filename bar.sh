@@ -13,7 +13,7 @@ clang main.c glad.c -o shader_app \
     -Iinclude -Iinclude/KHR \
     -I/opt/homebrew/Cellar/glfw/3.4/include \
     -L/opt/homebrew/Cellar/glfw/3.4/lib \
-    -lglfw -framework OpenGL
+    -lglfw -framework OpenGL -pthread
 
 # Vérifie si la compilation a réussi
 if [ $? -eq 0 ]; then
@@ -1,3 +1,14 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // fallocate, sync_file_range
+#endif
+// stb_image_write compresses PNGs with the bundled deflater (see
+// deflateCompress); build with -DSTBIW_BUILTIN_DEFLATE to keep stb's
+// own compressor
+#ifndef STBIW_BUILTIN_DEFLATE
+unsigned char* deflateCompress(unsigned char* data, int dataLength,
+                               int* outLength, int quality);
+#define STBIW_ZLIB_COMPRESS deflateCompress
+#endif
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "include/stb_image_write.h"
 
@@ -23,15 +34,60 @@
  * SOFTWARE.
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <io.h>
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+#if defined(HAVE_SSE2) && defined(__GNUC__)
+// SSSE3 and AVX2 kernels are compiled per function and only used when the CPU
+// has them
+#include <immintrin.h>
+#define HAVE_SSSE3 1
+#define HAVE_AVX2  1
+#endif
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
+#ifdef __linux__
+// Headless rendering goes through EGL; keep its headers away from X11
+#define EGL_NO_X11
+#define MESA_EGL_NO_X11_HEADERS
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 // Global log file pointer for logging messages
 FILE* g_logFile = NULL;
 
@@ -182,252 +238,525 @@ unsigned int createShaderProgram(unsigned int vertexShader, unsigned int fragmen
 }
 
 /**
- * Callback used by GLFW to adjust the OpenGL viewport when the window is resized.
+ * Returns a monotonic timestamp in seconds, usable from any thread.
  */
-void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
-#ifdef __APPLE__
-    // On macOS with Retina displays, the viewport typically needs a 2x scaling.
-    glViewport(0, 0, width * 2, height * 2);
+double nowSeconds(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
 #else
-    glViewport(0, 0, width, height);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+/**
+ * Returns the number of online CPU cores.
+ */
+int cpuCoreCount(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
 #endif
-    log_and_print("Window resized: width = %d, height = %d\n", width, height);
 }
 
+// Upper bound for the number of idle buffers kept by the frame pool
+#define FRAME_POOL_MAX 64
+
 /**
- * Reads the current framebuffer (RGBA) and saves it as a PNG file using stb_image_write.
+ * Thread-safe pool of page-aligned frame buffers.
  *
- * @param filename Output filename for the PNG (e.g., "frames/frame_00000.png").
- * @param width    Current framebuffer width.
- * @param height   Current framebuffer height.
+ * Buffers are recycled as long as the requested size stays the same; when the
+ * framebuffer is resized, idle buffers of the old size are released and
+ * buffers of the old size coming back are freed instead of being kept.
  */
-void captureFrame(const char* filename, int width, int height) {
-    unsigned char* pixels = (unsigned char*)malloc(width * height * 4);
-    if (!pixels) {
-        log_and_print("Error: Unable to allocate memory for pixel data.\n");
-        return;
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned char*  idle[FRAME_POOL_MAX];
+    int             idleCount;
+    size_t          bufferBytes;  // Size of the buffers currently handed out
+    bool            hugePages;    // Back buffers with transparent huge pages
+                                  // when available
+    long            allocations;  // Buffers allocated from the system
+    long            reuses;       // Requests served from the idle list
+    size_t          liveBytes;    // Bytes currently allocated (idle or in use)
+    size_t          peakBytes;
+} FramePool;
+
+// Process-wide frame buffer pool shared by the render and encoder threads
+FramePool g_framePool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static size_t framePoolAlignment(const FramePool* pool) {
+#ifdef __linux__
+    if (pool->hugePages) {
+        return (size_t)2 << 20;
     }
-    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+#else
+    (void)pool;
+#endif
+    return 4096;
+}
 
-    // Flip the image vertically because OpenGL's origin is at the lower left.
-    unsigned char* flipped = (unsigned char*)malloc(width * height * 4);
-    if (!flipped) {
-        log_and_print("Error: Unable to allocate memory for flipped data.\n");
-        free(pixels);
-        return;
+static unsigned char* framePoolAllocate(FramePool* pool, size_t bytes) {
+    size_t alignment = framePoolAlignment(pool);
+    bytes            = (bytes + alignment - 1) / alignment * alignment;
+#ifdef _WIN32
+    unsigned char* buffer = (unsigned char*)_aligned_malloc(bytes, alignment);
+#else
+    void* buffer = NULL;
+    if (posix_memalign(&buffer, alignment, bytes) != 0) {
+        buffer = NULL;
     }
-    for (int y = 0; y < height; y++) {
-        memcpy(flipped + (height - 1 - y) * width * 4,
-               pixels + y * width * 4,
-               width * 4);
+#endif
+#ifdef __linux__
+    if (buffer && pool->hugePages) {
+        madvise(buffer, bytes, MADV_HUGEPAGE);
     }
+#endif
+    return (unsigned char*)buffer;
+}
 
-    if (!stbi_write_png(filename, width, height, 4, flipped, width * 4)) {
-        log_and_print("Error: Failed to write PNG file: %s\n", filename);
-    } else {
-        log_and_print("Saved frame to: %s\n", filename);
+static void framePoolFree(unsigned char* buffer) {
+#ifdef _WIN32
+    _aligned_free(buffer);
+#else
+    free(buffer);
+#endif
+}
+
+/**
+ * Hands out a buffer of at least `bytes` bytes, reusing an idle one when the
+ * size matches the current frame size.
+ *
+ * @return The buffer, or NULL if it could not be allocated.
+ */
+unsigned char* framePoolAcquire(FramePool* pool, size_t bytes) {
+    pthread_mutex_lock(&pool->lock);
+    if (bytes != pool->bufferBytes) {
+        // The frame size changed: idle buffers of the old size are useless now
+        for (int i = 0; i < pool->idleCount; i++) {
+            framePoolFree(pool->idle[i]);
+        }
+        pool->liveBytes -= (size_t)pool->idleCount * pool->bufferBytes;
+        pool->idleCount   = 0;
+        pool->bufferBytes = bytes;
+    }
+    if (pool->idleCount > 0) {
+        unsigned char* buffer = pool->idle[--pool->idleCount];
+        pool->reuses++;
+        pthread_mutex_unlock(&pool->lock);
+        return buffer;
+    }
+    pool->allocations++;
+    pool->liveBytes += bytes;
+    if (pool->liveBytes > pool->peakBytes) {
+        pool->peakBytes = pool->liveBytes;
     }
+    pthread_mutex_unlock(&pool->lock);
 
-    free(flipped);
-    free(pixels);
+    unsigned char* buffer = framePoolAllocate(pool, bytes);
+    if (!buffer) {
+        pthread_mutex_lock(&pool->lock);
+        pool->liveBytes -= bytes;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return buffer;
 }
 
-int main(int argc, char** argv) {
-    // Default parameters
-    int         windowWidth        = 2560;
-    int         windowHeight       = 1440;
-    const char* windowTitle        = "My First Shader!";
-    const char* vertexShaderPath   = "shaders/vertex_shader.glsl";
-    const char* fragmentShaderPath = "shaders/fragment_shader.glsl";
-
-    // Parameters for optional video recording
-    bool        recordVideo       = false;
-    int         fps               = 30;
-    float       duration          = 5.0f;
-    char        outputFolder[256] = "frames";
-    char        outputVideo[256]  = "output.mp4";
+/**
+ * Returns a buffer obtained from framePoolAcquire.
+ *
+ * @param bytes The size the buffer was acquired with.
+ */
+void framePoolRelease(FramePool* pool, unsigned char* buffer, size_t bytes) {
+    if (!buffer) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (bytes == pool->bufferBytes && pool->idleCount < FRAME_POOL_MAX) {
+        pool->idle[pool->idleCount++] = buffer;
+        buffer                        = NULL;
+    } else {
+        pool->liveBytes -= bytes;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    framePoolFree(buffer);
+}
 
-    // Open log file
-    g_logFile = fopen("shaderapp_logs.log", "w");
-    if (!g_logFile) {
-        printf("Error: Unable to open log file.\n");
-        return -1;
+/**
+ * Frees every idle buffer and logs the allocation statistics.
+ */
+void framePoolDestroy(FramePool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    log_and_print("Frame pool: %ld allocations, %ld reuses, peak %.1f MB%s.\n",
+                  pool->allocations, pool->reuses,
+                  pool->peakBytes / (1024.0 * 1024.0),
+                  pool->hugePages ? " (huge pages requested)" : "");
+    for (int i = 0; i < pool->idleCount; i++) {
+        framePoolFree(pool->idle[i]);
     }
-    log_and_print("----- Program Start -----\n");
+    pool->liveBytes  -= (size_t)pool->idleCount * pool->bufferBytes;
+    pool->idleCount   = 0;
+    pool->bufferBytes = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
 
-    // Parsing command-line arguments
-    // Example:
-    //   ./app 1024 768 "Window Title" vertex.glsl fragment.glsl --video 1 30 5 frames out.mp4
-    if (argc >= 3) {
-        windowWidth  = atoi(argv[1]);
-        windowHeight = atoi(argv[2]);
-        if (argc >= 4) {
-            windowTitle = argv[3];
-        }
-        if (argc >= 5) {
-            vertexShaderPath = argv[4];
+/**
+ * An OpenGL context that is not tied to any window or display server.
+ */
+typedef struct {
+#ifdef __linux__
+    EGLDisplay display;
+    EGLContext context;
+    EGLSurface surface;  // EGL_NO_SURFACE when the context is surfaceless
+#else
+    int unused;
+#endif
+} HeadlessContext;
+
+#ifdef __linux__
+/**
+ * Returns true if `name` appears in the space-separated extension list.
+ */
+static bool hasEglExtension(const char* extensions, const char* name) {
+    size_t length = strlen(name);
+    for (const char* p = extensions; p && (p = strstr(p, name)) != NULL;
+         p += length) {
+        bool startOk = (p == extensions || p[-1] == ' ');
+        bool endOk   = (p[length] == ' ' || p[length] == '\0');
+        if (startOk && endOk) {
+            return true;
         }
-        if (argc >= 6) {
-            fragmentShaderPath = argv[5];
+    }
+    return false;
+}
+
+/**
+ * Opens an EGL display that does not need X11 or Wayland: Mesa's surfaceless
+ * platform first, then the first EGL device, then the default display.
+ */
+static EGLDisplay openHeadlessDisplay(void) {
+    const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY,
+                                                  EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+            "eglGetPlatformDisplayEXT");
+
+    if (getPlatformDisplay &&
+        hasEglExtension(clientExtensions, "EGL_MESA_platform_surfaceless")) {
+        EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                                EGL_DEFAULT_DISPLAY, NULL);
+        if (display != EGL_NO_DISPLAY) {
+            log_and_print("Using the EGL surfaceless platform.\n");
+            return display;
         }
-        // Look for --video flag
-        for (int i = 6; i < argc; i++) {
-            if (strcmp(argv[i], "--video") == 0) {
-                // Expecting 5 more arguments (bool, fps, duration, folder, filename)
-                if (i + 5 < argc) {
-                    recordVideo = (atoi(argv[i + 1]) != 0);
-                    fps         = atoi(argv[i + 2]);
-                    duration    = (float)atof(argv[i + 3]);
-                    strncpy(outputFolder, argv[i + 4], sizeof(outputFolder) - 1);
-                    strncpy(outputVideo, argv[i + 5], sizeof(outputVideo) - 1);
-                } else {
-                    log_and_print("Warning: --video flag provided but not enough parameters.\n");
-                }
-                break;
+    }
+
+    PFNEGLQUERYDEVICESEXTPROC queryDevices =
+        (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress("eglQueryDevicesEXT");
+    if (getPlatformDisplay && queryDevices &&
+        hasEglExtension(clientExtensions, "EGL_EXT_platform_device")) {
+        EGLDeviceEXT device;
+        EGLint       deviceCount = 0;
+        if (queryDevices(1, &device, &deviceCount) && deviceCount > 0) {
+            EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT,
+                                                    device, NULL);
+            if (display != EGL_NO_DISPLAY) {
+                log_and_print("Using the first EGL device.\n");
+                return display;
             }
         }
-        log_and_print("Command line parameters received.\n");
-    } else {
-        // If insufficient arguments, ask interactively
-        log_and_print("No command line parameters detected, launching interactive menu.\n");
-        printf("Welcome to ShaderApp!\n");
-        printf("1. Use default parameters\n");
-        printf("2. Customize parameters\n");
-        printf("Enter your choice (1 or 2): ");
-        int choice = 0;
-        if (scanf("%d", &choice) != 1) {
-            log_and_print("Error reading choice. Using default parameters.\n");
-            choice = 1;
-        }
-        if (choice == 2) {
-            printf("Enter window width: ");
-            scanf("%d", &windowWidth);
-            printf("Enter window height: ");
-            scanf("%d", &windowHeight);
+    }
 
-            static char titleBuffer[256];
-            printf("Enter window title: ");
-            scanf(" %[^\n]", titleBuffer);
-            windowTitle = titleBuffer;
+    log_and_print("Using the default EGL display.\n");
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+#endif
 
-            static char vertexBuffer[256];
-            printf("Enter vertex shader path: ");
-            scanf(" %[^\n]", vertexBuffer);
-            vertexShaderPath = vertexBuffer;
+/**
+ * Creates a headless OpenGL 4.1 core context and makes it current. The context
+ * is surfaceless when the driver allows it; otherwise a tiny pbuffer surface
+ * is used only to make it current. Rendering always goes into an FBO.
+ *
+ * @param ctx Context to create.
+ * @return true on success, false otherwise.
+ */
+bool headlessContextCreate(HeadlessContext* ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+#ifdef __linux__
+    ctx->display = openHeadlessDisplay();
+    EGLint major, minor;
+    if (ctx->display == EGL_NO_DISPLAY ||
+        !eglInitialize(ctx->display, &major, &minor)) {
+        log_and_print("Error: Unable to initialize an EGL display.\n");
+        return false;
+    }
+    log_and_print("EGL %d.%d initialized (%s).\n", major, minor,
+                  eglQueryString(ctx->display, EGL_VENDOR));
 
-            static char fragmentBuffer[256];
-            printf("Enter fragment shader path: ");
-            scanf(" %[^\n]", fragmentBuffer);
-            fragmentShaderPath = fragmentBuffer;
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        log_and_print("Error: EGL does not support desktop OpenGL.\n");
+        eglTerminate(ctx->display);
+        return false;
+    }
 
-            // Video recording options
-            printf("Record video? (0/1): ");
-            int videoChoice = 0;
-            scanf("%d", &videoChoice);
-            recordVideo = (videoChoice != 0);
-            if (recordVideo) {
-                printf("Enter FPS: ");
-                scanf("%d", &fps);
-                printf("Enter duration (seconds): ");
-                scanf("%f", &duration);
+    bool surfaceless = hasEglExtension(
+        eglQueryString(ctx->display, EGL_EXTENSIONS),
+        "EGL_KHR_surfaceless_context");
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_ALPHA_SIZE, 8,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint    configCount = 0;
+    if (!eglChooseConfig(ctx->display, configAttribs, &config, 1,
+                         &configCount) ||
+        configCount == 0) {
+        log_and_print("Error: No suitable EGL config found.\n");
+        eglTerminate(ctx->display);
+        return false;
+    }
 
-                printf("Output frames folder: ");
-                scanf(" %[^\n]", outputFolder);
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 1,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    ctx->context = eglCreateContext(ctx->display, config, EGL_NO_CONTEXT,
+                                    contextAttribs);
+    if (ctx->context == EGL_NO_CONTEXT) {
+        log_and_print("Error: Unable to create an OpenGL 4.1 core context "
+                      "through EGL.\n");
+        eglTerminate(ctx->display);
+        return false;
+    }
 
-                printf("Output video file: ");
-                scanf(" %[^\n]", outputVideo);
-            }
-            log_and_print("User provided custom parameters.\n");
-        } else {
-            log_and_print("Using default parameters.\n");
+    ctx->surface = EGL_NO_SURFACE;
+    if (!surfaceless) {
+        const EGLint pbufferAttribs[] = {EGL_WIDTH, 16, EGL_HEIGHT, 16,
+                                         EGL_NONE};
+        ctx->surface = eglCreatePbufferSurface(ctx->display, config,
+                                               pbufferAttribs);
+        if (ctx->surface == EGL_NO_SURFACE) {
+            log_and_print("Error: Unable to create an EGL pbuffer surface.\n");
+            eglDestroyContext(ctx->display, ctx->context);
+            eglTerminate(ctx->display);
+            return false;
         }
     }
 
-    // Log final configuration
-    log_and_print("Configuration:\n");
-    log_and_print("  Window Size   : %d x %d\n", windowWidth, windowHeight);
-    log_and_print("  Title         : %s\n", windowTitle);
-    log_and_print("  Vertex Shader : %s\n", vertexShaderPath);
-    log_and_print("  Fragment Shdr : %s\n", fragmentShaderPath);
-    if (recordVideo) {
-        log_and_print("  Video Capture : YES\n");
-        log_and_print("    FPS         : %d\n", fps);
-        log_and_print("    Duration    : %.2f sec\n", duration);
-        log_and_print("    Frames Dir  : %s\n", outputFolder);
-        log_and_print("    Output Video: %s\n", outputVideo);
-    } else {
-        log_and_print("  Video Capture : NO\n");
+    if (!eglMakeCurrent(ctx->display, ctx->surface, ctx->surface,
+                        ctx->context)) {
+        log_and_print("Error: Unable to make the headless context current.\n");
+        if (ctx->surface != EGL_NO_SURFACE) {
+            eglDestroySurface(ctx->display, ctx->surface);
+        }
+        eglDestroyContext(ctx->display, ctx->context);
+        eglTerminate(ctx->display);
+        return false;
     }
+    log_and_print("Headless %s context created.\n",
+                  surfaceless ? "surfaceless" : "pbuffer");
+    return true;
+#else
+    log_and_print("Error: Headless rendering requires EGL and is only "
+                  "available on Linux.\n");
+    return false;
+#endif
+}
 
-    // Initialize GLFW
-    if (!glfwInit()) {
-        log_and_print("Error initializing GLFW.\n");
-        fclose(g_logFile);
-        return -1;
+/**
+ * Looks up an OpenGL entry point in the headless context (for GLAD).
+ */
+void* headlessGetProcAddress(const char* name) {
+#ifdef __linux__
+    return (void*)eglGetProcAddress(name);
+#else
+    (void)name;
+    return NULL;
+#endif
+}
+
+/**
+ * Releases the headless context.
+ */
+void headlessContextDestroy(HeadlessContext* ctx) {
+#ifdef __linux__
+    eglMakeCurrent(ctx->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   EGL_NO_CONTEXT);
+    if (ctx->surface != EGL_NO_SURFACE) {
+        eglDestroySurface(ctx->display, ctx->surface);
     }
-    log_and_print("GLFW initialized successfully.\n");
+    eglDestroyContext(ctx->display, ctx->context);
+    eglTerminate(ctx->display);
+#else
+    (void)ctx;
+#endif
+}
 
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+/**
+ * Offscreen framebuffer with an RGBA8 color texture.
+ */
+typedef struct {
+    GLuint fbo;
+    GLuint colorTexture;
+    int    width;
+    int    height;
+} RenderTarget;
 
-    GLFWwindow* window = glfwCreateWindow(windowWidth, windowHeight, windowTitle, NULL, NULL);
-    if (!window) {
-        log_and_print("Error creating the window.\n");
-        glfwTerminate();
-        fclose(g_logFile);
-        return -1;
-    }
-    log_and_print("Window created successfully.\n");
+/**
+ * Creates an offscreen render target of the given size.
+ *
+ * @return true if the framebuffer is complete, false otherwise.
+ */
+bool renderTargetInit(RenderTarget* target, int width, int height) {
+    memset(target, 0, sizeof(*target));
+    target->width  = width;
+    target->height = height;
 
-    glfwMakeContextCurrent(window);
+    glGenTextures(1, &target->colorTexture);
+    glBindTexture(GL_TEXTURE_2D, target->colorTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
 
-    // Load OpenGL function pointers via GLAD
-    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
-        log_and_print("Error loading GLAD.\n");
-        glfwTerminate();
-        fclose(g_logFile);
-        return -1;
+    glGenFramebuffers(1, &target->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           target->colorTexture, 0);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        log_and_print(
+            "Error: Offscreen framebuffer of %d x %d is incomplete (0x%x).\n",
+            width, height, status);
+        glDeleteFramebuffers(1, &target->fbo);
+        glDeleteTextures(1, &target->colorTexture);
+        return false;
     }
-    log_and_print("GLAD loaded successfully.\n");
+    return true;
+}
+
+/**
+ * Releases the framebuffer and its texture.
+ */
+void renderTargetDestroy(RenderTarget* target) {
+    glDeleteFramebuffers(1, &target->fbo);
+    glDeleteTextures(1, &target->colorTexture);
+    memset(target, 0, sizeof(*target));
+}
+
+/**
+ * Locations of the per-frame uniforms a fragment shader may declare.
+ * Shaders that do not use a uniform get -1, which glUniform* ignores.
+ */
+typedef struct {
+    GLint time;        // float iTime: seconds since the first frame
+    GLint frame;       // int iFrame: index of the frame being rendered
+    GLint timeDelta;   // float iTimeDelta: seconds between this frame and the
+                       // previous one
+    GLint resolution;  // vec3 iResolution: size of the whole output image
+                       // in pixels
+    GLint tileOffset;  // vec2 iTileOffset: pixel offset of the tile
+                       // being rendered
+} FrameUniforms;
+
+/**
+ * Looks up the per-frame uniforms of a linked program.
+ */
+FrameUniforms queryFrameUniforms(unsigned int program) {
+    FrameUniforms uniforms;
+    uniforms.time       = glGetUniformLocation(program, "iTime");
+    uniforms.frame      = glGetUniformLocation(program, "iFrame");
+    uniforms.timeDelta  = glGetUniformLocation(program, "iTimeDelta");
+    uniforms.resolution = glGetUniformLocation(program, "iResolution");
+    uniforms.tileOffset = glGetUniformLocation(program, "iTileOffset");
+    return uniforms;
+}
+
+/**
+ * Uploads the per-frame uniforms for an untiled frame of the given size.
+ * The program must be in use.
+ */
+void setFrameUniforms(const FrameUniforms* uniforms, double time, int frame,
+                      double timeDelta, int width, int height) {
+    glUniform1f(uniforms->time, (float)time);
+    glUniform1i(uniforms->frame, frame);
+    glUniform1f(uniforms->timeDelta, (float)timeDelta);
+    glUniform3f(uniforms->resolution, (float)width, (float)height, 1.0f);
+    glUniform2f(uniforms->tileOffset, 0.0f, 0.0f);
+}
 
-    // Adjust viewport based on actual framebuffer size
-    int fbWidth, fbHeight;
-    glfwGetFramebufferSize(window, &fbWidth, &fbHeight);
-    glViewport(0, 0, fbWidth, fbHeight);
-    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+/**
+ * A linked shader program and the full-screen triangle it is drawn over.
+ */
+typedef struct {
+    unsigned int  program;
+    unsigned int  vao;
+    unsigned int  vbo;
+    FrameUniforms uniforms;
+} ShaderPipeline;
 
-    // Load and compile shaders
-    char* vertexSource   = loadShaderSource(vertexShaderPath);
-    char* fragmentSource = loadShaderSource(fragmentShaderPath);
+/**
+ * Loads, compiles and links a vertex and fragment shader.
+ *
+ * @return The program, or 0 on failure.
+ */
+static unsigned int buildShaderProgram(const char* vertexPath,
+                                       const char* fragmentPath) {
+    char* vertexSource   = loadShaderSource(vertexPath);
+    char* fragmentSource = loadShaderSource(fragmentPath);
     if (!vertexSource || !fragmentSource) {
         log_and_print("Error: Failed to load shader sources.\n");
-        glfwTerminate();
-        fclose(g_logFile);
-        return 1;
+        free(vertexSource);
+        free(fragmentSource);
+        return 0;
     }
 
     unsigned int vertexShader   = compileShader(GL_VERTEX_SHADER, vertexSource);
-    unsigned int fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+    unsigned int fragmentShader = compileShader(GL_FRAGMENT_SHADER,
+                                                fragmentSource);
     free(vertexSource);
     free(fragmentSource);
 
     if (vertexShader == 0 || fragmentShader == 0) {
         log_and_print("Error: Shader compilation failed.\n");
-        glfwTerminate();
-        fclose(g_logFile);
-        return 1;
+        glDeleteShader(vertexShader);
+        glDeleteShader(fragmentShader);
+        return 0;
     }
 
-    unsigned int shaderProgram = createShaderProgram(vertexShader, fragmentShader);
-    if (shaderProgram == 0) {
+    unsigned int program = createShaderProgram(vertexShader, fragmentShader);
+    if (program == 0) {
         log_and_print("Error: Shader program linking failed.\n");
-        glfwTerminate();
-        fclose(g_logFile);
-        return 1;
+        glDeleteShader(vertexShader);
+        glDeleteShader(fragmentShader);
     }
+    return program;
+}
 
+/**
+ * Uploads the triangle covering the viewport into a pipeline's buffers.
+ */
+static void shaderPipelineUploadTriangle(ShaderPipeline* pipeline) {
     // A large triangle to cover the entire screen
     float vertices[] = {
         -1.0f, -1.0f,  // bottom-left
@@ -435,103 +764,11228 @@ int main(int argc, char** argv) {
         -1.0f,  3.0f   // top-left
     };
 
-    // Create VAO/VBO
-    unsigned int VAO, VBO;
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
+    glGenVertexArrays(1, &pipeline->vao);
+    glGenBuffers(1, &pipeline->vbo);
 
-    glBindVertexArray(VAO);
+    glBindVertexArray(pipeline->vao);
 
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBindBuffer(GL_ARRAY_BUFFER, pipeline->vbo);
     glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
 
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float),
+                          (void*)0);
     glEnableVertexAttribArray(0);
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
+}
 
-    // If we want to record video, create the output folder if it doesn't exist
-    if (recordVideo) {
-#ifdef _WIN32
-        char mkdirCmd[512];
-        snprintf(mkdirCmd, 512, "mkdir %s 2> NUL", outputFolder);
-        system(mkdirCmd);
-#else
-        char mkdirCmd[512];
-        snprintf(mkdirCmd, 512, "mkdir -p %s", outputFolder);
-        system(mkdirCmd);
+/**
+ * Builds the program of a pipeline and uploads the triangle covering the
+ * viewport. Needs a current context.
+ *
+ * @param pipeline     Pipeline to initialize.
+ * @param vertexPath   Vertex shader file.
+ * @param fragmentPath Fragment shader file.
+ * @return true on success, false otherwise (nothing is left allocated).
+ */
+bool shaderPipelineInit(ShaderPipeline* pipeline, const char* vertexPath,
+                        const char* fragmentPath) {
+    memset(pipeline, 0, sizeof(*pipeline));
+    pipeline->program = buildShaderProgram(vertexPath, fragmentPath);
+    if (pipeline->program == 0) {
+        return false;
+    }
+    pipeline->uniforms = queryFrameUniforms(pipeline->program);
+    shaderPipelineUploadTriangle(pipeline);
+    return true;
+}
+
+/**
+ * Replaces the program of a pipeline, keeping its triangle.
+ *
+ * @return true on success; on failure the previous program stays in place.
+ */
+bool shaderPipelineSetProgram(ShaderPipeline* pipeline, const char* vertexPath,
+                              const char* fragmentPath) {
+    unsigned int program = buildShaderProgram(vertexPath, fragmentPath);
+    if (program == 0) {
+        return false;
+    }
+    glDeleteProgram(pipeline->program);
+    pipeline->program  = program;
+    pipeline->uniforms = queryFrameUniforms(program);
+    return true;
+}
+
+/**
+ * Releases the program and the triangle's buffers.
+ */
+void shaderPipelineDestroy(ShaderPipeline* pipeline) {
+    glDeleteVertexArrays(1, &pipeline->vao);
+    glDeleteBuffers(1, &pipeline->vbo);
+    glDeleteProgram(pipeline->program);
+    memset(pipeline, 0, sizeof(*pipeline));
+}
+
+/**
+ * Renders output images larger than the driver's viewport/FBO limits as a grid
+ * of tiles. Each tile is drawn into a tile-sized render target with
+ * iTileOffset set to its position, then read straight into its place in the
+ * full image; shaders must use gl_FragCoord.xy + iTileOffset as pixel position.
+ */
+typedef struct {
+    RenderTarget target;  // A single tile
+    int          outputWidth;
+    int          outputHeight;
+    int          tileSize;
+    int          tilesX;
+    int          tilesY;
+} TiledRenderer;
+
+/**
+ * Prepares a tiled renderer, clamping the tile size to the driver limits.
+ *
+ * @param tiler        Renderer to initialize.
+ * @param outputWidth  Width of the whole output image.
+ * @param outputHeight Height of the whole output image.
+ * @param tileSize     Requested tile edge in pixels.
+ * @return true on success, false otherwise.
+ */
+bool tiledRendererInit(TiledRenderer* tiler, int outputWidth, int outputHeight,
+                       int tileSize) {
+    memset(tiler, 0, sizeof(*tiler));
+
+    GLint maxViewport[2] = {0, 0};
+    GLint maxTexture     = 0;
+    glGetIntegerv(GL_MAX_VIEWPORT_DIMS, maxViewport);
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexture);
+    int limit = maxViewport[0];
+    if (maxViewport[1] < limit) {
+        limit = maxViewport[1];
+    }
+    if (maxTexture < limit) {
+        limit = maxTexture;
+    }
+    if (tileSize < 1 || tileSize > limit) {
+        log_and_print(
+            "Warning: Tile size %d clamped to the driver limit of %d.\n",
+            tileSize, limit);
+        tileSize = limit;
+    }
+    if (tileSize > outputWidth && tileSize > outputHeight) {
+        tileSize = outputWidth > outputHeight ? outputWidth : outputHeight;
+    }
+
+    tiler->outputWidth  = outputWidth;
+    tiler->outputHeight = outputHeight;
+    tiler->tileSize     = tileSize;
+    tiler->tilesX       = (outputWidth + tileSize - 1) / tileSize;
+    tiler->tilesY       = (outputHeight + tileSize - 1) / tileSize;
+
+    if (!renderTargetInit(&tiler->target, tileSize, tileSize)) {
+        return false;
+    }
+    log_and_print(
+        "Tiled rendering: %d x %d output as %d x %d tiles of %d px.\n",
+        outputWidth, outputHeight, tiler->tilesX, tiler->tilesY, tileSize);
+    return true;
+}
+
+/**
+ * Receives finished rows of a tiled frame, top to bottom.
+ */
+typedef void (*TileRowsFunc)(void* context, const unsigned char* rows,
+                             int rowCount, ptrdiff_t stride);
+
+/**
+ * Renders one frame tile by tile, one row of tiles (a band) at a time from the
+ * top of the image, and hands each finished band to `emit`. Only one band is
+ * ever held in memory. The program must be in use with its per-frame uniforms
+ * set; iResolution and iTileOffset are set here.
+ *
+ * @param tiler    Initialized tiled renderer.
+ * @param uniforms Uniform locations of the program in use.
+ * @param vao      Vertex array holding the full-screen triangle.
+ * @param emit     Callback receiving the rows of each band.
+ * @param context  Passed to the callback.
+ * @return true on success, false if the band buffer could not be allocated.
+ */
+bool tiledRendererRender(TiledRenderer* tiler, const FrameUniforms* uniforms,
+                         unsigned int vao, TileRowsFunc emit, void* context) {
+    size_t         rowBytes  = (size_t)tiler->outputWidth * 4;
+    size_t         bandBytes = rowBytes * (size_t)tiler->tileSize;
+    unsigned char* band      = framePoolAcquire(&g_framePool, bandBytes);
+    if (!band) {
+        log_and_print(
+            "Error: Unable to allocate %.1f MB for a band of tiles.\n",
+            bandBytes / (1024.0 * 1024.0));
+        return false;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, tiler->target.fbo);
+    glBindVertexArray(vao);
+    glUniform3f(uniforms->resolution, (float)tiler->outputWidth,
+                (float)tiler->outputHeight, 1.0f);
+
+    // Tiles are read straight into their place in the band
+    glPixelStorei(GL_PACK_ROW_LENGTH, tiler->outputWidth);
+    for (int ty = tiler->tilesY - 1; ty >= 0; ty--) {
+        int y0         = ty * tiler->tileSize;
+        int bandHeight = tiler->outputHeight - y0 < tiler->tileSize
+                             ? tiler->outputHeight - y0
+                             : tiler->tileSize;
+
+        for (int tx = 0; tx < tiler->tilesX; tx++) {
+            int x0    = tx * tiler->tileSize;
+            int width = tiler->outputWidth - x0 < tiler->tileSize
+                            ? tiler->outputWidth - x0
+                            : tiler->tileSize;
+
+            glViewport(0, 0, width, bandHeight);
+            glClear(GL_COLOR_BUFFER_BIT);
+            glUniform2f(uniforms->tileOffset, (float)x0, (float)y0);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            glReadPixels(0, 0, width, bandHeight, GL_RGBA, GL_UNSIGNED_BYTE,
+                         band + (size_t)x0 * 4);
+        }
+
+        // The band is bottom-up like any readback: emit it from its last row
+        emit(context, band + (size_t)(bandHeight - 1) * rowBytes, bandHeight,
+             -(ptrdiff_t)rowBytes);
+    }
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    framePoolRelease(&g_framePool, band, bandBytes);
+    return true;
+}
+
+/**
+ * Releases the tile render target.
+ */
+void tiledRendererDestroy(TiledRenderer* tiler) {
+    renderTargetDestroy(&tiler->target);
+}
+
+/**
+ * Planar YUV layouts a frame can be converted to before it is read back.
+ */
+typedef enum {
+    YUV_OFF,  // Frames are read back as RGBA
+    YUV_444,  // Y, Cb and Cr planes at full resolution
+    YUV_420,  // Cb and Cr planes subsampled 2x2 (averaged)
+} YuvLayout;
+
+/**
+ * User-facing settings of the YUV conversion.
+ */
+typedef struct {
+    YuvLayout layout;
+    bool      fullRange;  // Full (0-255) instead of limited (16-235/240) range
+    bool      validate;   // Compare every GPU-converted frame with the
+                          // CPU conversion
+} YuvOptions;
+
+/**
+ * BT.709 R'G'B' to Y'CbCr matrix for 8-bit samples: row i maps (R, G, B, 1)
+ * to plane i, as floats and in 2.14 fixed point (with the rounding term
+ * folded into the offset), which the SIMD kernels multiply in 16-bit lanes.
+ */
+typedef struct {
+    float   rows[3][4];
+    int32_t fixed[3][4];
+} YuvMatrix;
+
+/**
+ * Builds the BT.709 conversion matrix for limited or full range output.
+ */
+YuvMatrix yuvMatrix(bool fullRange) {
+    const double kr = 0.2126, kb = 0.0722, kg = 1.0 - kr - kb;
+    const double coefficients[3][3] = {
+        {kr, kg, kb},
+        {-kr / (2.0 * (1.0 - kb)), -kg / (2.0 * (1.0 - kb)), 0.5},
+        {0.5, -kg / (2.0 * (1.0 - kr)), -kb / (2.0 * (1.0 - kr))},
+    };
+    const double scales[3]  = {fullRange ? 1.0 : 219.0 / 255.0,
+                               fullRange ? 1.0 : 224.0 / 255.0,
+                               fullRange ? 1.0 : 224.0 / 255.0};
+    const double offsets[3] = {fullRange ? 0.0 : 16.0, 128.0, 128.0};
+
+    YuvMatrix m;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            m.rows[i][j]  = (float)(coefficients[i][j] * scales[i]);
+            m.fixed[i][j] = (int32_t)lround(
+                coefficients[i][j] * scales[i] * 16384.0);
+        }
+        m.rows[i][3]  = (float)offsets[i];
+        m.fixed[i][3] = (int32_t)lround(offsets[i] * 16384.0) + 8192;
+    }
+    // Keep grey exactly on the chroma midpoint despite the rounding
+    for (int i = 1; i < 3; i++) {
+        m.fixed[i][1] -= m.fixed[i][0] + m.fixed[i][1] + m.fixed[i][2];
+    }
+    return m;
+}
+
+/**
+ * Returns the size of the chroma planes of a `width` x `height` frame.
+ */
+static void yuvChromaSize(YuvLayout layout, int width, int height,
+                          int* chromaWidth, int* chromaHeight) {
+    *chromaWidth  = layout == YUV_420 ? (width + 1) / 2 : width;
+    *chromaHeight = layout == YUV_420 ? (height + 1) / 2 : height;
+}
+
+/**
+ * Returns the size of a planar YUV frame (Y, then Cb, then Cr).
+ */
+size_t yuvFrameBytes(YuvLayout layout, int width, int height) {
+    int chromaWidth, chromaHeight;
+    yuvChromaSize(layout, width, height, &chromaWidth, &chromaHeight);
+    return (size_t)width * height + 2 * (size_t)chromaWidth * chromaHeight;
+}
+
+static inline unsigned char yuvClamp(int32_t value) {
+    return (unsigned char)(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+/**
+ * Pixel formats the host can turn a bottom-up RGBA readback into.
+ */
+typedef enum {
+    PIXEL_RGBA,     // Rows flipped to top-down only
+    PIXEL_RGB24,    // Alpha stripped
+    PIXEL_BGR24,    // Alpha stripped, red and blue swapped
+    PIXEL_YUV444P,  // Planar BT.709 Y'CbCr
+    PIXEL_YUV420P,  // Planar BT.709 Y'CbCr, chroma averaged over 2x2 blocks
+} PixelFormat;
+
+// ffmpeg names of the pixel formats, indexed by PixelFormat
+static const char* g_pixelFormatNames[] = {"rgba", "rgb24", "bgr24", "yuv444p",
+                                           "yuv420p"};
+
+/**
+ * Parses a pixel format from its ffmpeg name.
+ *
+ * @return true if the name is known, false otherwise (format is left
+ *         untouched).
+ */
+bool parsePixelFormat(const char* name, PixelFormat* format) {
+    for (int i = 0; i <= PIXEL_YUV420P; i++) {
+        if (strcmp(name, g_pixelFormatNames[i]) == 0) {
+            *format = (PixelFormat)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Returns the size of a `width` x `height` frame in the given format.
+ */
+size_t pixelFormatFrameBytes(PixelFormat format, int width, int height) {
+    switch (format) {
+        case PIXEL_RGBA:
+            return (size_t)width * height * 4;
+        case PIXEL_RGB24:
+        case PIXEL_BGR24:
+            return (size_t)width * height * 3;
+        case PIXEL_YUV444P:
+            return yuvFrameBytes(YUV_444, width, height);
+        case PIXEL_YUV420P:
+            return yuvFrameBytes(YUV_420, width, height);
+    }
+    return 0;
+}
+
+/**
+ * Row kernels of the pixel format conversion, one set per instruction set.
+ * All sets produce identical output.
+ */
+typedef struct {
+    const char* name;
+    // Packs RGBA into RGB24, or BGR24 when `bgr` is set
+    void (*packRgb)(unsigned char* out, const unsigned char* rgba, int width,
+                    bool bgr);
+    // Converts a row to Y, Cb and Cr samples at full resolution
+    void (*yuv444)(const YuvMatrix* m, const unsigned char* rgba, int width,
+                   unsigned char* y, unsigned char* u, unsigned char* v);
+    // Converts a row to Y samples only
+    void (*luma)(const YuvMatrix* m, const unsigned char* rgba, int width,
+                 unsigned char* y);
+    // Converts a pair of rows to (width + 1) / 2 Cb and Cr samples
+    void (*chroma420)(const YuvMatrix* m, const unsigned char* row0,
+                      const unsigned char* row1, int width, unsigned char* u,
+                      unsigned char* v);
+} PixelKernels;
+
+static void packRgbScalarFrom(unsigned char* out, const unsigned char* rgba,
+                              int begin, int width, bool bgr) {
+    int red  = bgr ? 2 : 0;
+    int blue = bgr ? 0 : 2;
+    for (int x = begin; x < width; x++) {
+        out[3 * x]     = rgba[4 * x + red];
+        out[3 * x + 1] = rgba[4 * x + 1];
+        out[3 * x + 2] = rgba[4 * x + blue];
+    }
+}
+
+static inline unsigned char yuvSample(const int32_t* row, int32_t r, int32_t g,
+                                      int32_t b) {
+    return yuvClamp((row[0] * r + row[1] * g + row[2] * b + row[3]) >> 14);
+}
+
+static void yuv444ScalarFrom(const YuvMatrix* m, const unsigned char* rgba,
+                             int begin, int width, unsigned char* y,
+                             unsigned char* u, unsigned char* v) {
+    for (int x = begin; x < width; x++) {
+        const unsigned char* p = rgba + 4 * x;
+        y[x]                   = yuvSample(m->fixed[0], p[0], p[1], p[2]);
+        u[x]                   = yuvSample(m->fixed[1], p[0], p[1], p[2]);
+        v[x]                   = yuvSample(m->fixed[2], p[0], p[1], p[2]);
+    }
+}
+
+static void lumaScalarFrom(const YuvMatrix* m, const unsigned char* rgba,
+                           int begin, int width, unsigned char* y) {
+    for (int x = begin; x < width; x++) {
+        const unsigned char* p = rgba + 4 * x;
+        y[x]                   = yuvSample(m->fixed[0], p[0], p[1], p[2]);
+    }
+}
+
+static void chroma420ScalarFrom(const YuvMatrix* m, const unsigned char* row0,
+                                const unsigned char* row1, int begin, int width,
+                                unsigned char* u, unsigned char* v) {
+    const int32_t(*f)[4] = m->fixed;
+    for (int cx = begin; cx < (width + 1) / 2; cx++) {
+        // The last column is repeated for odd widths
+        int     x0 = 8 * cx;
+        int     x1 = 2 * cx + 1 < width ? x0 + 4 : x0;
+        int32_t r  = row0[x0] + row0[x1] + row1[x0] + row1[x1];
+        int32_t g  = row0[x0 + 1] + row0[x1 + 1] + row1[x0 + 1] + row1[x1 + 1];
+        int32_t b  = row0[x0 + 2] + row0[x1 + 2] + row1[x0 + 2] + row1[x1 + 2];
+        // Sums of four samples: scale by 1/4 and round once
+        u[cx] = yuvClamp(
+            (f[1][0] * r + f[1][1] * g + f[1][2] * b + 4 * f[1][3]) >> 16);
+        v[cx] = yuvClamp(
+            (f[2][0] * r + f[2][1] * g + f[2][2] * b + 4 * f[2][3]) >> 16);
+    }
+}
+
+static void packRgbScalar(unsigned char* out, const unsigned char* rgba,
+                          int width, bool bgr) {
+    packRgbScalarFrom(out, rgba, 0, width, bgr);
+}
+
+static void yuv444Scalar(const YuvMatrix* m, const unsigned char* rgba,
+                         int width, unsigned char* y, unsigned char* u,
+                         unsigned char* v) {
+    yuv444ScalarFrom(m, rgba, 0, width, y, u, v);
+}
+
+static void lumaScalar(const YuvMatrix* m, const unsigned char* rgba, int width,
+                       unsigned char* y) {
+    lumaScalarFrom(m, rgba, 0, width, y);
+}
+
+static void chroma420Scalar(const YuvMatrix* m, const unsigned char* row0,
+                            const unsigned char* row1, int width,
+                            unsigned char* u, unsigned char* v) {
+    chroma420ScalarFrom(m, row0, row1, 0, width, u, v);
+}
+
+#ifdef HAVE_SSSE3
+// pshufb masks gathering the RGB (or BGR) bytes of four RGBA pixels into the
+// low 12 bytes
+#define PIXEL_RGB_MASK  0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+#define PIXEL_BGR_MASK  2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+__attribute__((target("ssse3"))) static void packRgbSsse3(
+    unsigned char* out, const unsigned char* rgba, int width, bool bgr) {
+    __m128i mask = bgr ? _mm_setr_epi8(PIXEL_BGR_MASK)
+                       : _mm_setr_epi8(PIXEL_RGB_MASK);
+    int     x    = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m128i* in = (const __m128i*)(rgba + 4 * x);
+        __m128i        s0 = _mm_shuffle_epi8(_mm_loadu_si128(in), mask);
+        __m128i        s1 = _mm_shuffle_epi8(_mm_loadu_si128(in + 1), mask);
+        __m128i        s2 = _mm_shuffle_epi8(_mm_loadu_si128(in + 2), mask);
+        __m128i        s3 = _mm_shuffle_epi8(_mm_loadu_si128(in + 3), mask);
+        __m128i*       o  = (__m128i*)(out + 3 * x);
+        _mm_storeu_si128(o, _mm_or_si128(s0, _mm_slli_si128(s1, 12)));
+        _mm_storeu_si128(
+            o + 1, _mm_or_si128(_mm_srli_si128(s1, 4), _mm_slli_si128(s2, 8)));
+        _mm_storeu_si128(
+            o + 2, _mm_or_si128(_mm_srli_si128(s2, 8), _mm_slli_si128(s3, 4)));
+    }
+    packRgbScalarFrom(out, rgba, x, width, bgr);
+}
+
+// Dot products of four RGBA pixels with a matrix row (R, G, B, 0 coefficients):
+// four 32-bit sums
+__attribute__((target("ssse3"))) static inline __m128i yuvDot4Ssse3(
+    __m128i pixels, __m128i coefficients) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo   = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero),
+                                  coefficients);
+    __m128i hi   = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero),
+                                  coefficients);
+    return _mm_hadd_epi32(lo, hi);
+}
+
+// One plane of sixteen pixels, rounded, shifted and clamped to bytes
+__attribute__((target("ssse3"))) static inline __m128i yuvPlane16Ssse3(
+    const __m128i* pixels, const int32_t* row) {
+    __m128i coefficients = _mm_setr_epi16((short)row[0], (short)row[1],
+                                          (short)row[2], 0, (short)row[0],
+                                          (short)row[1], (short)row[2], 0);
+    __m128i offset       = _mm_set1_epi32(row[3]);
+    __m128i d[4];
+    for (int i = 0; i < 4; i++) {
+        d[i] = _mm_srai_epi32(
+            _mm_add_epi32(yuvDot4Ssse3(pixels[i], coefficients), offset), 14);
+    }
+    return _mm_packus_epi16(_mm_packs_epi32(d[0], d[1]),
+                            _mm_packs_epi32(d[2], d[3]));
+}
+
+__attribute__((target("ssse3"))) static void yuv444Ssse3(
+    const YuvMatrix* m, const unsigned char* rgba, int width, unsigned char* y,
+    unsigned char* u, unsigned char* v) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i pixels[4];
+        for (int i = 0; i < 4; i++) {
+            pixels[i] = _mm_loadu_si128((const __m128i*)(rgba + 4 * x) + i);
+        }
+        _mm_storeu_si128((__m128i*)(y + x),
+                         yuvPlane16Ssse3(pixels, m->fixed[0]));
+        _mm_storeu_si128((__m128i*)(u + x),
+                         yuvPlane16Ssse3(pixels, m->fixed[1]));
+        _mm_storeu_si128((__m128i*)(v + x),
+                         yuvPlane16Ssse3(pixels, m->fixed[2]));
+    }
+    yuv444ScalarFrom(m, rgba, x, width, y, u, v);
+}
+
+__attribute__((target("ssse3"))) static void lumaSsse3(
+    const YuvMatrix* m, const unsigned char* rgba, int width,
+    unsigned char* y) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i pixels[4];
+        for (int i = 0; i < 4; i++) {
+            pixels[i] = _mm_loadu_si128((const __m128i*)(rgba + 4 * x) + i);
+        }
+        _mm_storeu_si128((__m128i*)(y + x),
+                         yuvPlane16Ssse3(pixels, m->fixed[0]));
+    }
+    lumaScalarFrom(m, rgba, x, width, y);
+}
+
+// One chroma plane of a 16 x 2 block: eight samples in the low half
+__attribute__((target("ssse3"))) static inline __m128i yuvChroma8Ssse3(
+    const __m128i* sumsLo, const __m128i* sumsHi, const int32_t* row) {
+    __m128i coefficients = _mm_setr_epi16((short)row[0], (short)row[1],
+                                          (short)row[2], 0, (short)row[0],
+                                          (short)row[1], (short)row[2], 0);
+    __m128i offset       = _mm_set1_epi32(4 * row[3]);
+    __m128i perPixel[4];
+    for (int i = 0; i < 4; i++) {
+        perPixel[i] = _mm_hadd_epi32(_mm_madd_epi16(sumsLo[i], coefficients),
+                                     _mm_madd_epi16(sumsHi[i], coefficients));
+    }
+    // Add horizontal neighbours: one sum per 2 x 2 block
+    __m128i c0 = _mm_srai_epi32(
+        _mm_add_epi32(_mm_hadd_epi32(perPixel[0], perPixel[1]), offset), 16);
+    __m128i c1 = _mm_srai_epi32(
+        _mm_add_epi32(_mm_hadd_epi32(perPixel[2], perPixel[3]), offset), 16);
+    __m128i packed = _mm_packs_epi32(c0, c1);
+    return _mm_packus_epi16(packed, packed);
+}
+
+__attribute__((target("ssse3"))) static void chroma420Ssse3(
+    const YuvMatrix* m, const unsigned char* row0, const unsigned char* row1,
+    int width, unsigned char* u, unsigned char* v) {
+    __m128i zero = _mm_setzero_si128();
+    int     x    = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i sumsLo[4], sumsHi[4];
+        for (int i = 0; i < 4; i++) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(row0 + 4 * x) + i);
+            __m128i b = _mm_loadu_si128((const __m128i*)(row1 + 4 * x) + i);
+            sumsLo[i] = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+                                      _mm_unpacklo_epi8(b, zero));
+            sumsHi[i] = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+                                      _mm_unpackhi_epi8(b, zero));
+        }
+        _mm_storel_epi64((__m128i*)(u + x / 2),
+                         yuvChroma8Ssse3(sumsLo, sumsHi, m->fixed[1]));
+        _mm_storel_epi64((__m128i*)(v + x / 2),
+                         yuvChroma8Ssse3(sumsLo, sumsHi, m->fixed[2]));
+    }
+    chroma420ScalarFrom(m, row0, row1, x / 2, width, u, v);
+}
 #endif
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2"))) static void packRgbAvx2(
+    unsigned char* out, const unsigned char* rgba, int width, bool bgr) {
+    __m256i mask    = bgr ? _mm256_setr_epi8(PIXEL_BGR_MASK, PIXEL_BGR_MASK)
+                          : _mm256_setr_epi8(PIXEL_RGB_MASK, PIXEL_RGB_MASK);
+    __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    int     x       = 0;
+    for (; x + 8 <= width; x += 8) {
+        // Twelve bytes per lane, then the two lanes' bytes moved together
+        __m256i packed = _mm256_permutevar8x32_epi32(
+            _mm256_shuffle_epi8(
+                _mm256_loadu_si256((const __m256i*)(rgba + 4 * x)), mask),
+            compact);
+        _mm_storeu_si128((__m128i*)(out + 3 * x),
+                         _mm256_castsi256_si128(packed));
+        _mm_storel_epi64((__m128i*)(out + 3 * x + 16),
+                         _mm256_extracti128_si256(packed, 1));
     }
+    packRgbScalarFrom(out, rgba, x, width, bgr);
+}
 
-    log_and_print("Starting render loop.\n");
+// Dot products of eight RGBA pixels with a matrix row: eight 32-bit sums, in
+// pixel order
+__attribute__((target("avx2"))) static inline __m256i yuvDot8Avx2(
+    __m256i pixels, __m256i coefficients) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo   = _mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, zero),
+                                     coefficients);
+    __m256i hi   = _mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, zero),
+                                     coefficients);
+    return _mm256_hadd_epi32(lo, hi);
+}
 
-    int frameCount   = 0;
-    int totalFrames  = recordVideo ? (int)(fps * duration) : -1;
+__attribute__((target("avx2"))) static inline __m256i yuvCoefficientsAvx2(
+    const int32_t* row) {
+    return _mm256_setr_epi16((short)row[0], (short)row[1], (short)row[2], 0,
+                             (short)row[0], (short)row[1], (short)row[2], 0,
+                             (short)row[0], (short)row[1], (short)row[2], 0,
+                             (short)row[0], (short)row[1], (short)row[2], 0);
+}
 
-    // Main loop
-    while (!glfwWindowShouldClose(window)) {
-        glClear(GL_COLOR_BUFFER_BIT);
+// One plane of thirty-two pixels, rounded, shifted and clamped to bytes
+__attribute__((target("avx2"))) static inline __m256i yuvPlane32Avx2(
+    const __m256i* pixels, const int32_t* row) {
+    __m256i coefficients = yuvCoefficientsAvx2(row);
+    __m256i offset       = _mm256_set1_epi32(row[3]);
+    __m256i d[4];
+    for (int i = 0; i < 4; i++) {
+        d[i] = _mm256_srai_epi32(
+            _mm256_add_epi32(yuvDot8Avx2(pixels[i], coefficients), offset), 14);
+    }
+    // Packing works per 128-bit lane; the final permute restores pixel order
+    __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(d[0], d[1]),
+                                         _mm256_packs_epi32(d[2], d[3]));
+    return _mm256_permutevar8x32_epi32(
+        packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
 
-        glUseProgram(shaderProgram);
-        glBindVertexArray(VAO);
-        glDrawArrays(GL_TRIANGLES, 0, 3);
+__attribute__((target("avx2"))) static void yuv444Avx2(
+    const YuvMatrix* m, const unsigned char* rgba, int width, unsigned char* y,
+    unsigned char* u, unsigned char* v) {
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i pixels[4];
+        for (int i = 0; i < 4; i++) {
+            pixels[i] = _mm256_loadu_si256((const __m256i*)(rgba + 4 * x) + i);
+        }
+        _mm256_storeu_si256((__m256i*)(y + x),
+                            yuvPlane32Avx2(pixels, m->fixed[0]));
+        _mm256_storeu_si256((__m256i*)(u + x),
+                            yuvPlane32Avx2(pixels, m->fixed[1]));
+        _mm256_storeu_si256((__m256i*)(v + x),
+                            yuvPlane32Avx2(pixels, m->fixed[2]));
+    }
+    yuv444ScalarFrom(m, rgba, x, width, y, u, v);
+}
 
-        // Capture frames if recording
-        if (recordVideo) {
-            char frameFile[512];
-            snprintf(frameFile, 512, "%s/frame_%05d.png", outputFolder, frameCount);
-            captureFrame(frameFile, fbWidth, fbHeight);
+__attribute__((target("avx2"))) static void lumaAvx2(
+    const YuvMatrix* m, const unsigned char* rgba, int width,
+    unsigned char* y) {
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i pixels[4];
+        for (int i = 0; i < 4; i++) {
+            pixels[i] = _mm256_loadu_si256((const __m256i*)(rgba + 4 * x) + i);
+        }
+        _mm256_storeu_si256((__m256i*)(y + x),
+                            yuvPlane32Avx2(pixels, m->fixed[0]));
+    }
+    lumaScalarFrom(m, rgba, x, width, y);
+}
 
-            frameCount++;
-            if (frameCount >= totalFrames) {
-                break;
-            }
+// One chroma plane of a 32 x 2 block: sixteen samples
+__attribute__((target("avx2"))) static inline __m128i yuvChroma16Avx2(
+    const __m256i* sumsLo, const __m256i* sumsHi, const int32_t* row) {
+    __m256i coefficients = yuvCoefficientsAvx2(row);
+    __m256i offset       = _mm256_set1_epi32(4 * row[3]);
+    __m256i perPixel[4];
+    for (int i = 0; i < 4; i++) {
+        perPixel[i] = _mm256_hadd_epi32(
+            _mm256_madd_epi16(sumsLo[i], coefficients),
+            _mm256_madd_epi16(sumsHi[i], coefficients));
+    }
+    // Horizontal neighbours summed per lane: blocks 0 1 4 5 | 2 3 6 7, then 8 9
+    // 12 13 | 10 11 14 15
+    __m256i c0     = _mm256_srai_epi32(
+        _mm256_add_epi32(_mm256_hadd_epi32(perPixel[0], perPixel[1]), offset),
+        16);
+    __m256i c1     = _mm256_srai_epi32(
+        _mm256_add_epi32(_mm256_hadd_epi32(perPixel[2], perPixel[3]), offset),
+        16);
+    __m256i packed = _mm256_packs_epi32(c0, c1);
+    packed         = _mm256_packus_epi16(packed, packed);
+    // Interleave the byte pairs of the two lanes back into block order
+    return _mm_unpacklo_epi16(_mm256_castsi256_si128(packed),
+                              _mm256_extracti128_si256(packed, 1));
+}
+
+__attribute__((target("avx2"))) static void chroma420Avx2(
+    const YuvMatrix* m, const unsigned char* row0, const unsigned char* row1,
+    int width, unsigned char* u, unsigned char* v) {
+    __m256i zero = _mm256_setzero_si256();
+    int     x    = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i sumsLo[4], sumsHi[4];
+        for (int i = 0; i < 4; i++) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(row0 + 4 * x) + i);
+            __m256i b = _mm256_loadu_si256((const __m256i*)(row1 + 4 * x) + i);
+            sumsLo[i] = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero),
+                                         _mm256_unpacklo_epi8(b, zero));
+            sumsHi[i] = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero),
+                                         _mm256_unpackhi_epi8(b, zero));
+        }
+        _mm_storeu_si128((__m128i*)(u + x / 2),
+                         yuvChroma16Avx2(sumsLo, sumsHi, m->fixed[1]));
+        _mm_storeu_si128((__m128i*)(v + x / 2),
+                         yuvChroma16Avx2(sumsLo, sumsHi, m->fixed[2]));
+    }
+    chroma420ScalarFrom(m, row0, row1, x / 2, width, u, v);
+}
+#endif
+
+/**
+ * Fills `kernels` with every pixel kernel set this CPU can run, slowest
+ * (scalar) first.
+ *
+ * @return Number of sets (at most 3).
+ */
+int pixelAvailableKernels(PixelKernels* kernels) {
+    int count = 0;
+    kernels[count++] = (PixelKernels){"scalar", packRgbScalar, yuv444Scalar,
+                                      lumaScalar, chroma420Scalar};
+#ifdef HAVE_SSSE3
+    if (__builtin_cpu_supports("ssse3")) {
+        kernels[count++] = (PixelKernels){"ssse3", packRgbSsse3, yuv444Ssse3,
+                                          lumaSsse3, chroma420Ssse3};
+    }
+#endif
+#ifdef HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[count++] = (PixelKernels){"avx2", packRgbAvx2, yuv444Avx2,
+                                          lumaAvx2, chroma420Avx2};
+    }
+#endif
+    return count;
+}
+
+static PixelKernels   g_pixelKernels;
+static pthread_once_t g_pixelKernelsOnce = PTHREAD_ONCE_INIT;
+
+static void pixelSelectKernels(void) {
+    PixelKernels kernels[3];
+    g_pixelKernels = kernels[pixelAvailableKernels(kernels) - 1];
+}
+
+/**
+ * The fastest pixel conversion kernels for this CPU.
+ */
+const PixelKernels* pixelKernels(void) {
+    pthread_once(&g_pixelKernelsOnce, pixelSelectKernels);
+    return &g_pixelKernels;
+}
+
+/**
+ * Converts a bottom-up RGBA readback into a top-down frame in `format`; the
+ * vertical flip is folded into the conversion, so no flipped copy is made.
+ *
+ * @param kernels Row kernels to use (pixelKernels() for the fastest).
+ * @param format  Output pixel format.
+ * @param m       Conversion matrix for the YUV formats.
+ * @param pixels  RGBA pixel data as returned by glReadPixels (bottom
+ *                row first).
+ * @param width   Frame width.
+ * @param height  Frame height.
+ * @param out     Receives pixelFormatFrameBytes(format, width, height) bytes.
+ */
+void convertPixels(const PixelKernels* kernels, PixelFormat format,
+                   const YuvMatrix* m, const unsigned char* pixels, int width,
+                   int height, unsigned char* out) {
+    size_t rowBytes = (size_t)width * 4;
+#define BOTTOM_UP_ROW(y) (pixels + (size_t)(height - 1 - (y)) * rowBytes)
+    if (format == PIXEL_RGBA) {
+        for (int y = 0; y < height; y++) {
+            memcpy(out + (size_t)y * rowBytes, BOTTOM_UP_ROW(y), rowBytes);
+        }
+    } else if (format == PIXEL_RGB24 || format == PIXEL_BGR24) {
+        for (int y = 0; y < height; y++) {
+            kernels->packRgb(out + (size_t)y * width * 3, BOTTOM_UP_ROW(y),
+                             width, format == PIXEL_BGR24);
+        }
+    } else if (format == PIXEL_YUV444P) {
+        size_t plane = (size_t)width * height;
+        for (int y = 0; y < height; y++) {
+            size_t offset = (size_t)y * width;
+            kernels->yuv444(m, BOTTOM_UP_ROW(y), width, out + offset,
+                            out + plane + offset, out + 2 * plane + offset);
+        }
+    } else {
+        int chromaWidth, chromaHeight;
+        yuvChromaSize(YUV_420, width, height, &chromaWidth, &chromaHeight);
+        unsigned char* cb = out + (size_t)width * height;
+        unsigned char* cr = cb + (size_t)chromaWidth * chromaHeight;
+        for (int y = 0; y < height; y++) {
+            kernels->luma(m, BOTTOM_UP_ROW(y), width, out + (size_t)y * width);
+        }
+        for (int cy = 0; cy < chromaHeight; cy++) {
+            // The last row is repeated for odd heights
+            int y1 = 2 * cy + 1 < height ? 2 * cy + 1 : 2 * cy;
+            kernels->chroma420(m, BOTTOM_UP_ROW(2 * cy), BOTTOM_UP_ROW(y1),
+                               width, cb + (size_t)cy * chromaWidth,
+                               cr + (size_t)cy * chromaWidth);
         }
+    }
+#undef BOTTOM_UP_ROW
+}
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+/**
+ * 64-bit frame hash in the style of XXH3: eight 64-bit lanes each take one
+ * 8-byte word of every 64-byte stripe, keyed and multiplied 32 x 32 -> 64, with
+ * the raw word also added to the neighbouring lane; the lanes are scrambled
+ * after every 1 KB block and folded with 128-bit multiplies at the end.
+ * The SIMD kernels compute exactly the same value as the scalar one.
+ */
+#define FRAME_HASH_STRIPE        64
+#define FRAME_HASH_BLOCK_STRIPES 16
+#define FRAME_HASH_PRIME32       0x9E3779B1u
+#define FRAME_HASH_PRIME64       0x9E3779B185EBCA87ull
+
+// Keys: stripe s of a block uses words s..s+7, the scramble uses words 16..23
+static uint64_t       g_frameHashSecret[FRAME_HASH_BLOCK_STRIPES + 8];
+static pthread_once_t g_frameHashSecretOnce = PTHREAD_ONCE_INIT;
+
+static void frameHashInitSecret(void) {
+    // splitmix64 from a fixed seed, so hashes are stable across runs
+    uint64_t state = 0x243F6A8885A308D3ull;
+    for (int i = 0; i < FRAME_HASH_BLOCK_STRIPES + 8; i++) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z          = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z          = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        g_frameHashSecret[i] = z ^ (z >> 31);
     }
+}
 
-    log_and_print("Exiting render loop.\n");
+static inline uint64_t frameHashRead64(const unsigned char* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
 
-    glfwDestroyWindow(window);
-    glfwTerminate();
-    log_and_print("OpenGL resources released; GLFW terminated.\n");
+/**
+ * Accumulates `stripes` 64-byte stripes into the lanes; stripe s uses key
+ * words firstKey + s onwards.
+ */
+typedef void (*FrameHashAccumulateFunc)(uint64_t* acc,
+                                        const unsigned char* data,
+                                        size_t stripes, const uint64_t* keys);
+typedef void (*FrameHashScrambleFunc)(uint64_t* acc, const uint64_t* keys);
 
-    // If recording was enabled, assemble the frames into a video
-    if (recordVideo) {
-        log_and_print("Combining frames into video using ffmpeg...\n");
-        char ffmpegCmd[1024];
-        // Compute the bitrate: fps * 2 (in Mbps)
-        int bitrate_mbps = fps * 2;
+static void frameHashAccumulateScalar(uint64_t* acc, const unsigned char* data,
+                                      size_t stripes, const uint64_t* keys) {
+    for (size_t s = 0; s < stripes; s++) {
+        const unsigned char* stripe = data + s * FRAME_HASH_STRIPE;
+        for (int i = 0; i < 8; i++) {
+            uint64_t word  = frameHashRead64(stripe + 8 * i);
+            uint64_t keyed = word ^ keys[s + i];
+            acc[i ^ 1] += word;
+            acc[i] += (keyed & 0xFFFFFFFFu) * (keyed >> 32);
+        }
+    }
+}
 
-        snprintf(
-            ffmpegCmd,
-            sizeof(ffmpegCmd),
-            "ffmpeg -y -framerate %d -i \"%s/frame_%%05d.png\" "
-            "-c:v libx264 -preset veryslow -qp 0 -pix_fmt yuv444p -g 1 -b:v %dM \"%s\"",
-            fps, outputFolder, bitrate_mbps, outputVideo
-        );
+static void frameHashScrambleScalar(uint64_t* acc, const uint64_t* keys) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t value = acc[i];
+        value ^= value >> 47;
+        value ^= keys[i];
+        acc[i] = value * FRAME_HASH_PRIME32;
+    }
+}
 
-        int ret = system(ffmpegCmd);
-        if (ret != 0) {
-            log_and_print("Error: ffmpeg command failed.\n");
-        } else {
-            log_and_print("Video created successfully: %s\n", outputVideo);
-            log_and_print("Removing temporary frame images...\n");
-#ifdef _WIN32
-            char rmCmd[512];
-            snprintf(rmCmd, 512, "del /Q %s\\frame_*.png", outputFolder);
-#else
-            char rmCmd[512];
-            snprintf(rmCmd, 512, "rm -f %s/frame_*.png", outputFolder);
+#ifdef HAVE_SSE2
+static void frameHashAccumulateSse2(uint64_t* acc, const unsigned char* data,
+                                    size_t stripes, const uint64_t* keys) {
+    __m128i lanes[4];
+    for (int i = 0; i < 4; i++) {
+        lanes[i] = _mm_loadu_si128((const __m128i*)acc + i);
+    }
+    for (size_t s = 0; s < stripes; s++) {
+        const __m128i* stripe = (const __m128i*)(data + s * FRAME_HASH_STRIPE);
+        for (int i = 0; i < 4; i++) {
+            __m128i word  = _mm_loadu_si128(stripe + i);
+            __m128i keyed = _mm_xor_si128(
+                word, _mm_loadu_si128((const __m128i*)(keys + s) + i));
+            // Low 32 bits times high 32 bits of each 64-bit word
+            __m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+            // The raw words swap lanes: word i goes to lane i ^ 1
+            __m128i swapped = _mm_shuffle_epi32(word, _MM_SHUFFLE(1, 0, 3, 2));
+            lanes[i]        = _mm_add_epi64(lanes[i],
+                                            _mm_add_epi64(product, swapped));
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i*)acc + i, lanes[i]);
+    }
+}
 #endif
-            system(rmCmd);
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2"))) static void frameHashAccumulateAvx2(
+    uint64_t* acc, const unsigned char* data, size_t stripes,
+    const uint64_t* keys) {
+    __m256i lanes[2];
+    for (int i = 0; i < 2; i++) {
+        lanes[i] = _mm256_loadu_si256((const __m256i*)acc + i);
+    }
+    for (size_t s = 0; s < stripes; s++) {
+        const __m256i* stripe = (const __m256i*)(data + s * FRAME_HASH_STRIPE);
+        for (int i = 0; i < 2; i++) {
+            __m256i word    = _mm256_loadu_si256(stripe + i);
+            __m256i keyed   = _mm256_xor_si256(
+                word, _mm256_loadu_si256((const __m256i*)(keys + s) + i));
+            __m256i product = _mm256_mul_epu32(keyed,
+                                               _mm256_srli_epi64(keyed, 32));
+            __m256i swapped = _mm256_shuffle_epi32(word,
+                                                   _MM_SHUFFLE(1, 0, 3, 2));
+            lanes[i]        = _mm256_add_epi64(
+                lanes[i], _mm256_add_epi64(product, swapped));
         }
     }
+    for (int i = 0; i < 2; i++) {
+        _mm256_storeu_si256((__m256i*)acc + i, lanes[i]);
+    }
+}
+#endif
 
-    log_and_print("----- Program End -----\n");
-    fclose(g_logFile);
-    return 0;
+/**
+ * Frame hash kernels, one set per instruction set.
+ */
+typedef struct {
+    const char*             name;
+    FrameHashAccumulateFunc accumulate;
+} FrameHashKernels;
+
+/**
+ * Fills `kernels` with every frame hash kernel this CPU can run, slowest
+ * (scalar) first.
+ *
+ * @return Number of kernels (at most 3).
+ */
+int frameHashAvailableKernels(FrameHashKernels* kernels) {
+    int count = 0;
+    kernels[count++] = (FrameHashKernels){"scalar", frameHashAccumulateScalar};
+#ifdef HAVE_SSE2
+    kernels[count++] = (FrameHashKernels){"sse2", frameHashAccumulateSse2};
+#endif
+#ifdef HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[count++] = (FrameHashKernels){"avx2", frameHashAccumulateAvx2};
+    }
+#endif
+    return count;
+}
+
+static FrameHashKernels g_frameHashKernels;
+static pthread_once_t   g_frameHashKernelsOnce = PTHREAD_ONCE_INIT;
+
+static void frameHashSelectKernels(void) {
+    FrameHashKernels kernels[3];
+    g_frameHashKernels = kernels[frameHashAvailableKernels(kernels) - 1];
+}
+
+/**
+ * The fastest frame hash kernel for this CPU.
+ */
+const FrameHashKernels* frameHashKernels(void) {
+    pthread_once(&g_frameHashKernelsOnce, frameHashSelectKernels);
+    return &g_frameHashKernels;
+}
+
+// High and low halves of a 64 x 64 -> 128-bit product, xored together
+static inline uint64_t frameHashFold(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t lo = (a & 0xFFFFFFFFu) * (b & 0xFFFFFFFFu);
+    uint64_t m1 = (a >> 32) * (b & 0xFFFFFFFFu);
+    uint64_t m2 = (a & 0xFFFFFFFFu) * (b >> 32);
+    uint64_t hi = (a >> 32) * (b >> 32);
+    uint64_t mid = (lo >> 32) + (m1 & 0xFFFFFFFFu) + (m2 & 0xFFFFFFFFu);
+    return ((lo & 0xFFFFFFFFu) | (mid << 32)) ^
+           (hi + (m1 >> 32) + (m2 >> 32) + (mid >> 32));
+#endif
+}
+
+/**
+ * Hashes `size` bytes with the given kernel (frameHashKernels() for the
+ * fastest). Any input size works; frames go through the SIMD path in 1 KB
+ * blocks and only the last partial stripe is padded.
+ */
+uint64_t frameHash(const FrameHashKernels* kernels, const void* data,
+                   size_t size) {
+    pthread_once(&g_frameHashSecretOnce, frameHashInitSecret);
+    const uint64_t*      keys  = g_frameHashSecret;
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t             acc[8] = {FRAME_HASH_PRIME32, FRAME_HASH_PRIME64,
+                                   keys[0], keys[1], keys[2], keys[3], keys[4],
+                                   FRAME_HASH_PRIME32};
+
+    size_t blockBytes = FRAME_HASH_STRIPE * FRAME_HASH_BLOCK_STRIPES;
+    size_t blocks     = size / blockBytes;
+    for (size_t b = 0; b < blocks; b++) {
+        kernels->accumulate(acc, bytes + b * blockBytes,
+                            FRAME_HASH_BLOCK_STRIPES, keys);
+        frameHashScrambleScalar(acc, keys + FRAME_HASH_BLOCK_STRIPES);
+    }
+    size_t               offset  = blocks * blockBytes;
+    size_t               stripes = (size - offset) / FRAME_HASH_STRIPE;
+    kernels->accumulate(acc, bytes + offset, stripes, keys);
+    offset += stripes * FRAME_HASH_STRIPE;
+    if (offset < size) {
+        unsigned char last[FRAME_HASH_STRIPE] = {0};
+        memcpy(last, bytes + offset, size - offset);
+        kernels->accumulate(acc, last, 1, keys + stripes);
+    }
+
+    uint64_t hash = (uint64_t)size * FRAME_HASH_PRIME64;
+    for (int i = 0; i < 4; i++) {
+        hash += frameHashFold(acc[2 * i] ^ keys[8 + 2 * i],
+                              acc[2 * i + 1] ^ keys[9 + 2 * i]);
+    }
+    // Final avalanche
+    hash ^= hash >> 37;
+    hash *= 0x165667919E3779F9ull;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static const char* g_yuvVertexShader =
+    "#version 410 core\n"
+    "void main() {\n"
+    "    // Full-screen triangle from the vertex index alone\n"
+    "    vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+    "    gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\n";
+
+static const char* g_yuvFragmentShader =
+    "#version 410 core\n"
+    "uniform sampler2D source;\n"
+    "uniform vec4 rows[3];\n"
+    "uniform int pass;\n"
+    "uniform ivec2 subsample;\n"
+    "layout(location = 0) out float plane0;\n"
+    "layout(location = 1) out float plane1;\n"
+    "vec3 fetchTopDown(ivec2 p, ivec2 size) {\n"
+    "    p = min(p, size - 1);\n"
+    "    return texelFetch(source, ivec2(p.x, size.y - 1 - p.y), 0).rgb;\n"
+    "}\n"
+    "void main() {\n"
+    "    // Output row 0 holds the top of the image, so the planes read back "
+    "top-down\n"
+    "    ivec2 size  = textureSize(source, 0);\n"
+    "    ivec2 texel = ivec2(gl_FragCoord.xy);\n"
+    "    if (pass == 0) {\n"
+    "        plane0 = dot(vec4(fetchTopDown(texel, size), 1.0), rows[0]);\n"
+    "        plane1 = 0.0;\n"
+    "        return;\n"
+    "    }\n"
+    "    ivec2 base = texel * subsample;\n"
+    "    vec3  rgb  = vec3(0.0);\n"
+    "    for (int dy = 0; dy < subsample.y; dy++) {\n"
+    "        for (int dx = 0; dx < subsample.x; dx++) {\n"
+    "            rgb += fetchTopDown(base + ivec2(dx, dy), size);\n"
+    "        }\n"
+    "    }\n"
+    "    rgb /= float(subsample.x * subsample.y);\n"
+    "    plane0 = dot(vec4(rgb, 1.0), rows[1]);\n"
+    "    plane1 = dot(vec4(rgb, 1.0), rows[2]);\n"
+    "}\n";
+
+/**
+ * Final render pass converting the rendered frame to planar YUV on the GPU,
+ * so only the planes are read back: half the bytes of RGBA for 4:2:0 and
+ * three quarters for 4:4:4, with no colour conversion left for ffmpeg.
+ */
+typedef struct {
+    YuvLayout    layout;
+    YuvMatrix    matrix;
+    int          width;
+    int          height;
+    int          chromaWidth;
+    int          chromaHeight;
+    GLuint       program;
+    GLint        passLocation;
+    GLint        subsampleLocation;
+    GLuint       vao;               // Empty: the triangle comes from
+                                    // gl_VertexID
+    RenderTarget source;            // Copy of the rendered frame
+    GLuint       planes[3];         // R8 textures: Y, Cb, Cr
+    GLuint       lumaFbo;
+    GLuint       chromaFbo;         // Cb and Cr, written in one pass
+    bool         validate;
+    long         frames;
+    long         validatedFrames;
+    int          maxDifference;     // Largest GPU/CPU sample difference seen
+    uint64_t     samples;
+    uint64_t     mismatches;        // Samples differing from the CPU conversion
+} YuvConverter;
+
+static void yuvConverterReleaseTargets(YuvConverter* c) {
+    renderTargetDestroy(&c->source);
+    glDeleteFramebuffers(1, &c->lumaFbo);
+    glDeleteFramebuffers(1, &c->chromaFbo);
+    glDeleteTextures(3, c->planes);
+    c->lumaFbo   = 0;
+    c->chromaFbo = 0;
+    memset(c->planes, 0, sizeof(c->planes));
+}
+
+static bool yuvConverterCreateTargets(YuvConverter* c, int width, int height) {
+    // Creating framebuffers unbinds the render target; put it back afterwards
+    GLint readFbo, drawFbo;
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readFbo);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFbo);
+
+    c->width  = width;
+    c->height = height;
+    yuvChromaSize(c->layout, width, height, &c->chromaWidth, &c->chromaHeight);
+    if (!renderTargetInit(&c->source, width, height)) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, (GLuint)readFbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, (GLuint)drawFbo);
+        return false;
+    }
+
+    glGenTextures(3, c->planes);
+    for (int i = 0; i < 3; i++) {
+        glBindTexture(GL_TEXTURE_2D, c->planes[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, i == 0 ? width : c->chromaWidth,
+                     i == 0 ? height : c->chromaHeight, 0, GL_RED,
+                     GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    static const GLenum drawBuffers[2] = {GL_COLOR_ATTACHMENT0,
+                                          GL_COLOR_ATTACHMENT1};
+    glGenFramebuffers(1, &c->lumaFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, c->lumaFbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           c->planes[0], 0);
+    GLenum lumaStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glGenFramebuffers(1, &c->chromaFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, c->chromaFbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           c->planes[1], 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D,
+                           c->planes[2], 0);
+    glDrawBuffers(2, drawBuffers);
+    GLenum chromaStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, (GLuint)readFbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, (GLuint)drawFbo);
+
+    if (lumaStatus != GL_FRAMEBUFFER_COMPLETE ||
+        chromaStatus != GL_FRAMEBUFFER_COMPLETE) {
+        log_and_print(
+            "Error: YUV plane framebuffers are incomplete (0x%x, 0x%x).\n",
+            lumaStatus, chromaStatus);
+        yuvConverterReleaseTargets(c);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Compiles the conversion program and creates the plane targets.
+ *
+ * @param c       Converter to initialize.
+ * @param options Layout (YUV_444 or YUV_420), range and validation settings.
+ * @param width   Frame width.
+ * @param height  Frame height.
+ * @return true on success, false otherwise.
+ */
+bool yuvConverterInit(YuvConverter* c, const YuvOptions* options, int width,
+                      int height) {
+    memset(c, 0, sizeof(*c));
+    c->layout   = options->layout;
+    c->matrix   = yuvMatrix(options->fullRange);
+    c->validate = options->validate;
+
+    unsigned int vertexShader   = compileShader(GL_VERTEX_SHADER,
+                                                g_yuvVertexShader);
+    unsigned int fragmentShader = compileShader(GL_FRAGMENT_SHADER,
+                                                g_yuvFragmentShader);
+    c->program                  = createShaderProgram(vertexShader,
+                                                      fragmentShader);
+    if (c->program == 0) {
+        return false;
+    }
+
+    // Shader inputs are normalized, so the offsets are too
+    float rows[3][4];
+    for (int i = 0; i < 3; i++) {
+        memcpy(rows[i], c->matrix.rows[i], sizeof(rows[i]));
+        rows[i][3] /= 255.0f;
+    }
+    glUseProgram(c->program);
+    glUniform1i(glGetUniformLocation(c->program, "source"), 0);
+    glUniform4fv(glGetUniformLocation(c->program, "rows"), 3, &rows[0][0]);
+    glUseProgram(0);
+    c->passLocation      = glGetUniformLocation(c->program, "pass");
+    c->subsampleLocation = glGetUniformLocation(c->program, "subsample");
+    glGenVertexArrays(1, &c->vao);
+
+    if (!yuvConverterCreateTargets(c, width, height)) {
+        glDeleteVertexArrays(1, &c->vao);
+        glDeleteProgram(c->program);
+        return false;
+    }
+    log_and_print("GPU YUV conversion: BT.709 %s range, 4:%s, %.1f MB read "
+                  "back per %d x %d frame (RGBA: %.1f MB).\n",
+                  options->fullRange ? "full" : "limited",
+                  c->layout == YUV_420 ? "2:0" : "4:4",
+                  yuvFrameBytes(c->layout, width, height) / 1e6, width, height,
+                  (double)width * height * 4 / 1e6);
+    return true;
+}
+
+/**
+ * Converts the frame in the bound read framebuffer (the window's back buffer
+ * or the offscreen target) into the plane textures. GL bindings, the viewport
+ * and the program in use are restored afterwards.
+ */
+void yuvConverterRun(YuvConverter* c, int width, int height) {
+    GLint readFbo, drawFbo, program, vao, viewport[4];
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readFbo);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFbo);
+    glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vao);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    if (width != c->width || height != c->height) {
+        yuvConverterReleaseTargets(c);
+        if (!yuvConverterCreateTargets(c, width, height)) {
+            return;
+        }
+    }
+
+    // Copy the frame into a texture the conversion can sample
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, c->source.fbo);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+    glUseProgram(c->program);
+    glBindVertexArray(c->vao);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, c->source.colorTexture);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, c->lumaFbo);
+    glViewport(0, 0, width, height);
+    glUniform1i(c->passLocation, 0);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, c->chromaFbo);
+    glViewport(0, 0, c->chromaWidth, c->chromaHeight);
+    glUniform1i(c->passLocation, 1);
+    glUniform2i(c->subsampleLocation, c->layout == YUV_420 ? 2 : 1,
+                c->layout == YUV_420 ? 2 : 1);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, (GLuint)readFbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, (GLuint)drawFbo);
+    glUseProgram((GLuint)program);
+    glBindVertexArray((GLuint)vao);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    c->frames++;
+}
+
+/**
+ * Reads the planes of the last conversion, Y then Cb then Cr, into `planes`
+ * (yuvFrameBytes bytes), or into the bound pixel-pack buffer when `planes`
+ * is an offset into it.
+ */
+void yuvConverterReadPlanes(YuvConverter* c, unsigned char* planes) {
+    GLint readFbo;
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readFbo);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    size_t lumaBytes   = (size_t)c->width * c->height;
+    size_t chromaBytes = (size_t)c->chromaWidth * c->chromaHeight;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, c->lumaFbo);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glReadPixels(0, 0, c->width, c->height, GL_RED, GL_UNSIGNED_BYTE, planes);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, c->chromaFbo);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glReadPixels(0, 0, c->chromaWidth, c->chromaHeight, GL_RED,
+                 GL_UNSIGNED_BYTE, planes + lumaBytes);
+    glReadBuffer(GL_COLOR_ATTACHMENT1);
+    glReadPixels(0, 0, c->chromaWidth, c->chromaHeight, GL_RED,
+                 GL_UNSIGNED_BYTE, planes + lumaBytes + chromaBytes);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, (GLuint)readFbo);
+}
+
+/**
+ * Validation mode: reads the frame in the bound read framebuffer back as
+ * RGBA, converts it on the CPU and compares the result with the GPU planes.
+ * Rounding can differ by one; anything more is reported.
+ */
+void yuvConverterValidate(YuvConverter* c, const unsigned char* planes) {
+    size_t         rgbaBytes = (size_t)c->width * c->height * 4;
+    size_t         yuvBytes  = yuvFrameBytes(c->layout, c->width, c->height);
+    unsigned char* rgba      = (unsigned char*)malloc(rgbaBytes);
+    unsigned char* expected  = (unsigned char*)malloc(yuvBytes);
+    if (!rgba || !expected) {
+        free(rgba);
+        free(expected);
+        log_and_print("Error: Unable to allocate YUV validation buffers.\n");
+        return;
+    }
+    glReadPixels(0, 0, c->width, c->height, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+    convertPixels(pixelKernels(),
+                  c->layout == YUV_420 ? PIXEL_YUV420P : PIXEL_YUV444P,
+                  &c->matrix, rgba, c->width, c->height, expected);
+
+    int frameMax = 0;
+    for (size_t i = 0; i < yuvBytes; i++) {
+        int difference = abs((int)planes[i] - (int)expected[i]);
+        if (difference > 0) {
+            c->mismatches++;
+            if (difference > frameMax) {
+                frameMax = difference;
+            }
+        }
+    }
+    if (frameMax > 1) {
+        log_and_print("Warning: GPU YUV frame %ld differs from the CPU "
+                      "conversion by up to %d.\n", c->validatedFrames,
+                      frameMax);
+    }
+    if (frameMax > c->maxDifference) {
+        c->maxDifference = frameMax;
+    }
+    c->samples += yuvBytes;
+    c->validatedFrames++;
+    free(rgba);
+    free(expected);
+}
+
+/**
+ * Releases the GL objects and reports the validation results.
+ */
+void yuvConverterDestroy(YuvConverter* c) {
+    if (c->validate) {
+        log_and_print("YUV validation: %ld frames, max difference %d, %.4f%% "
+                      "of samples differ from the CPU conversion (%s).\n",
+                      c->validatedFrames, c->maxDifference,
+                      c->samples ? 100.0 * c->mismatches / c->samples : 0.0,
+                      c->maxDifference <= 1 ? "OK" : "FAILED");
+    }
+    yuvConverterReleaseTargets(c);
+    glDeleteVertexArrays(1, &c->vao);
+    glDeleteProgram(c->program);
+}
+
+// Side in pixels of the blocks compared by the first frame-difference pass
+#define FRAME_DIFF_BLOCK 8
+
+static const char* g_frameDiffFragmentShader =
+    "#version 410 core\n"
+    "uniform sampler2D current;\n"
+    "uniform sampler2D previous;\n"
+    "uniform sampler2D blocks;\n"
+    "uniform int pass;\n"
+    "uniform int span;\n"
+    "layout(location = 0) out float changed;\n"
+    "void main() {\n"
+    "    // Pass 0 marks the blocks of pixels that changed, pass 1 reduces the "
+    "blocks to tiles\n"
+    "    ivec2 size  = pass == 0 ? textureSize(current, 0) : "
+    "textureSize(blocks, 0);\n"
+    "    ivec2 first = ivec2(gl_FragCoord.xy) * span;\n"
+    "    ivec2 last  = min(first + span, size);\n"
+    "    float found = 0.0;\n"
+    "    for (int y = first.y; y < last.y; y++) {\n"
+    "        for (int x = first.x; x < last.x; x++) {\n"
+    "            if (pass == 0) {\n"
+    "                found = max(found, float(texelFetch(current, ivec2(x, y), "
+    "0) !=\n"
+    "                                         texelFetch(previous, ivec2(x, "
+    "y), 0)));\n"
+    "            } else {\n"
+    "                found = max(found, texelFetch(blocks, ivec2(x, y), "
+    "0).r);\n"
+    "            }\n"
+    "        }\n"
+    "    }\n"
+    "    changed = found;\n"
+    "}\n";
+
+/**
+ * Rectangle of a frame that changed, in GL window coordinates (origin at the
+ * bottom left, like the readback).
+ */
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+} DirtyRect;
+
+/**
+ * Finds the tiles that changed since the previous frame on the GPU and reads
+ * back only those. The last two frames are kept in textures; a two-pass
+ * reduction (pixels to 8 x 8 blocks, blocks to tiles) produces a tile mask of
+ * a few hundred bytes, which is all that is read back for an unchanged frame.
+ * Changed tiles are merged into rectangles and read into a CPU copy of the
+ * frame, so sinks still see whole frames plus the rectangles that changed.
+ */
+typedef struct {
+    int            tileSize;      // Multiple of FRAME_DIFF_BLOCK
+    int            width;
+    int            height;
+    int            tilesX;
+    int            tilesY;
+    GLuint         program;
+    GLint          passLocation;
+    GLint          spanLocation;
+    GLuint         vao;           // Empty: the triangle comes from gl_VertexID
+    RenderTarget   targets[2];    // The newest and the previous frame, swapped
+                                  // every frame
+    int            newest;        // Index of the newest frame in `targets`
+    GLuint         blockTexture;  // R8, one texel per block
+    GLuint         blockFbo;
+    GLuint         tileTexture;   // R8, one texel per tile
+    GLuint         tileFbo;
+    unsigned char* mask;          // Tile mask read back, bottom row of
+                                  // tiles first
+    unsigned char* frame;         // Bottom-up RGBA copy of the newest frame
+    DirtyRect*     rects;         // Changed rectangles of the newest frame
+    int*           runs;          // Per tile column: rectangle whose run starts
+                                  // there on the last row, or -1
+    bool           primed;        // `frame` and the previous texture hold a
+                                  // complete frame
+    long           frames;
+    long           unchangedFrames;
+    uint64_t       tilesRead;
+    uint64_t       bytesRead;
+} FrameDiffer;
+
+static void frameDifferReleaseTargets(FrameDiffer* d) {
+    renderTargetDestroy(&d->targets[0]);
+    renderTargetDestroy(&d->targets[1]);
+    glDeleteFramebuffers(1, &d->blockFbo);
+    glDeleteFramebuffers(1, &d->tileFbo);
+    glDeleteTextures(1, &d->blockTexture);
+    glDeleteTextures(1, &d->tileTexture);
+    d->blockFbo     = 0;
+    d->tileFbo      = 0;
+    d->blockTexture = 0;
+    d->tileTexture  = 0;
+    free(d->mask);
+    free(d->rects);
+    free(d->runs);
+    framePoolRelease(&g_framePool, d->frame, (size_t)d->width * d->height * 4);
+    d->mask   = NULL;
+    d->rects  = NULL;
+    d->runs   = NULL;
+    d->frame  = NULL;
+    d->primed = false;
+}
+
+/**
+ * Creates an R8 texture and a framebuffer rendering into it.
+ */
+static GLenum frameDifferCreateMask(GLuint* texture, GLuint* fbo, int width,
+                                    int height) {
+    glGenTextures(1, texture);
+    glBindTexture(GL_TEXTURE_2D, *texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height, 0, GL_RED,
+                 GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glGenFramebuffers(1, fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, *fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           *texture, 0);
+    return glCheckFramebufferStatus(GL_FRAMEBUFFER);
+}
+
+static bool frameDifferCreateTargets(FrameDiffer* d, int width, int height) {
+    // Creating framebuffers unbinds the render target; put it back afterwards
+    GLint readFbo, drawFbo;
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readFbo);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFbo);
+
+    d->width  = width;
+    d->height = height;
+    d->tilesX = (width + d->tileSize - 1) / d->tileSize;
+    d->tilesY = (height + d->tileSize - 1) / d->tileSize;
+    bool ok   = renderTargetInit(&d->targets[0], width, height) &&
+                renderTargetInit(&d->targets[1], width, height);
+    if (ok) {
+        GLenum blockStatus = frameDifferCreateMask(
+            &d->blockTexture, &d->blockFbo,
+            (width + FRAME_DIFF_BLOCK - 1) / FRAME_DIFF_BLOCK,
+            (height + FRAME_DIFF_BLOCK - 1) / FRAME_DIFF_BLOCK);
+        GLenum tileStatus  = frameDifferCreateMask(&d->tileTexture, &d->tileFbo,
+                                                   d->tilesX, d->tilesY);
+        if (blockStatus != GL_FRAMEBUFFER_COMPLETE ||
+            tileStatus != GL_FRAMEBUFFER_COMPLETE) {
+            log_and_print("Error: Frame difference framebuffers are incomplete "
+                          "(0x%x, 0x%x).\n", blockStatus, tileStatus);
+            ok = false;
+        }
+    }
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, (GLuint)readFbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, (GLuint)drawFbo);
+
+    if (ok) {
+        size_t tiles = (size_t)d->tilesX * d->tilesY;
+        d->mask      = (unsigned char*)malloc(tiles);
+        d->rects     = (DirtyRect*)malloc(tiles * sizeof(DirtyRect));
+        d->runs      = (int*)malloc((size_t)d->tilesX * sizeof(int));
+        d->frame     = framePoolAcquire(&g_framePool,
+                                        (size_t)width * height * 4);
+        if (!d->mask || !d->rects || !d->runs || !d->frame) {
+            log_and_print(
+                "Error: Unable to allocate the frame difference buffers.\n");
+            ok = false;
+        }
+    }
+    if (!ok) {
+        frameDifferReleaseTargets(d);
+    }
+    return ok;
+}
+
+/**
+ * Compiles the difference program and creates the frame and mask targets.
+ *
+ * @param d        Differ to initialize.
+ * @param tileSize Side of the tiles changes are tracked in, rounded up to a
+ *                 multiple of FRAME_DIFF_BLOCK.
+ * @param width    Frame width.
+ * @param height   Frame height.
+ * @return true on success, false otherwise.
+ */
+bool frameDifferInit(FrameDiffer* d, int tileSize, int width, int height) {
+    memset(d, 0, sizeof(*d));
+    d->tileSize =
+        (tileSize + FRAME_DIFF_BLOCK - 1) / FRAME_DIFF_BLOCK * FRAME_DIFF_BLOCK;
+    if (d->tileSize < FRAME_DIFF_BLOCK) {
+        d->tileSize = FRAME_DIFF_BLOCK;
+    }
+
+    unsigned int vertexShader   = compileShader(GL_VERTEX_SHADER,
+                                                g_yuvVertexShader);
+    unsigned int fragmentShader = compileShader(GL_FRAGMENT_SHADER,
+                                                g_frameDiffFragmentShader);
+    d->program                  = createShaderProgram(vertexShader,
+                                                      fragmentShader);
+    if (d->program == 0) {
+        return false;
+    }
+    glUseProgram(d->program);
+    glUniform1i(glGetUniformLocation(d->program, "current"), 0);
+    glUniform1i(glGetUniformLocation(d->program, "previous"), 1);
+    glUniform1i(glGetUniformLocation(d->program, "blocks"), 2);
+    glUseProgram(0);
+    d->passLocation = glGetUniformLocation(d->program, "pass");
+    d->spanLocation = glGetUniformLocation(d->program, "span");
+    glGenVertexArrays(1, &d->vao);
+
+    if (!frameDifferCreateTargets(d, width, height)) {
+        glDeleteVertexArrays(1, &d->vao);
+        glDeleteProgram(d->program);
+        return false;
+    }
+    log_and_print("GPU frame difference: %d x %d tiles of %d pixels.\n",
+                  d->tilesX, d->tilesY, d->tileSize);
+    return true;
+}
+
+/**
+ * Merges the changed tiles of the mask into rectangles: runs of tiles along
+ * each row, grown upwards while the row above has a run of the same extent.
+ *
+ * @return Number of rectangles in d->rects.
+ */
+static int frameDifferMergeTiles(FrameDiffer* d) {
+    int count = 0;
+    for (int tx = 0; tx < d->tilesX; tx++) {
+        d->runs[tx] = -1;
+    }
+    for (int ty = 0; ty < d->tilesY; ty++) {
+        const unsigned char* row    = d->mask + (size_t)ty * d->tilesX;
+        int                  y      = ty * d->tileSize;
+        int                  height = y + d->tileSize <= d->height
+                                          ? d->tileSize
+                                          : d->height - y;
+        for (int tx = 0; tx < d->tilesX;) {
+            if (!row[tx]) {
+                // Runs of the row below that stop here can't grow any more
+                d->runs[tx++] = -1;
+                continue;
+            }
+            int first = tx;
+            int below = d->runs[first];
+            while (tx < d->tilesX && row[tx]) {
+                d->runs[tx++] = -1;
+            }
+            int        x     = first * d->tileSize;
+            int        width = (tx * d->tileSize < d->width ? tx * d->tileSize
+                                                            : d->width) - x;
+            DirtyRect* rect  = below >= 0 ? &d->rects[below] : NULL;
+            if (rect && rect->width == width && rect->y + rect->height == y) {
+                rect->height += height;
+                d->runs[first] = below;
+            } else {
+                d->rects[count] = (DirtyRect){x, y, width, height};
+                d->runs[first]  = count++;
+            }
+        }
+    }
+    return count;
+}
+
+/**
+ * Compares the frame in the bound read framebuffer with the previous one and
+ * reads back only the tiles that changed, into d->frame. The first frame (and
+ * the first after a resize) is read back whole. GL bindings, the viewport and
+ * the program in use are restored afterwards.
+ *
+ * @return Number of changed rectangles in d->rects, 0 if the frame is
+ *         unchanged, or -1 if it could not be captured.
+ */
+int frameDifferCapture(FrameDiffer* d, int width, int height) {
+    GLint readFbo, drawFbo, program, vao, viewport[4];
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readFbo);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFbo);
+    glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vao);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    if (width != d->width || height != d->height) {
+        frameDifferReleaseTargets(d);
+        if (!frameDifferCreateTargets(d, width, height)) {
+            return -1;
+        }
+    }
+
+    // Keep the frame as a texture the next frame is compared with
+    int previous = d->newest;
+    int newest   = 1 - d->newest;
+    d->newest    = newest;
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, d->targets[newest].fbo);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+    int count;
+    if (!d->primed) {
+        d->rects[0] = (DirtyRect){0, 0, width, height};
+        count       = 1;
+        d->primed   = true;
+    } else {
+        glUseProgram(d->program);
+        glBindVertexArray(d->vao);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, d->targets[newest].colorTexture);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, d->targets[previous].colorTexture);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, d->blockFbo);
+        glViewport(0, 0, (width + FRAME_DIFF_BLOCK - 1) / FRAME_DIFF_BLOCK,
+                   (height + FRAME_DIFF_BLOCK - 1) / FRAME_DIFF_BLOCK);
+        glUniform1i(d->passLocation, 0);
+        glUniform1i(d->spanLocation, FRAME_DIFF_BLOCK);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+
+        // The block mask is only sampled once it is no longer the render target
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, d->blockTexture);
+        glBindFramebuffer(GL_FRAMEBUFFER, d->tileFbo);
+        glViewport(0, 0, d->tilesX, d->tilesY);
+        glUniform1i(d->passLocation, 1);
+        glUniform1i(d->spanLocation, d->tileSize / FRAME_DIFF_BLOCK);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+
+        for (int unit = 2; unit >= 0; unit--) {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+
+        // A byte per tile: for an unchanged frame this is the whole readback
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, d->tileFbo);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, d->tilesX, d->tilesY, GL_RED, GL_UNSIGNED_BYTE,
+                     d->mask);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        d->bytesRead += (uint64_t)d->tilesX * d->tilesY;
+        count = frameDifferMergeTiles(d);
+    }
+
+    // Patch the CPU copy with the rectangles that changed
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, d->targets[newest].fbo);
+    glPixelStorei(GL_PACK_ROW_LENGTH, width);
+    for (int i = 0; i < count; i++) {
+        const DirtyRect* rect = &d->rects[i];
+        glReadPixels(rect->x, rect->y, rect->width, rect->height, GL_RGBA,
+                     GL_UNSIGNED_BYTE,
+                     d->frame + ((size_t)rect->y * width + rect->x) * 4);
+        d->bytesRead += (uint64_t)rect->width * rect->height * 4;
+    }
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, (GLuint)readFbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, (GLuint)drawFbo);
+    glUseProgram((GLuint)program);
+    glBindVertexArray((GLuint)vao);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    d->frames++;
+    if (count == 0) {
+        d->unchangedFrames++;
+    }
+    return count;
+}
+
+/**
+ * Releases the GL objects and reports how much readback was saved.
+ */
+void frameDifferDestroy(FrameDiffer* d) {
+    double fullBytes = (double)d->frames * d->width * d->height * 4;
+    log_and_print("GPU frame difference: %ld frames, %ld unchanged; read back "
+                  "%.1f MB of %.1f MB (%.1f%%).\n", d->frames,
+                  d->unchangedFrames, d->bytesRead / 1e6, fullBytes / 1e6,
+                  fullBytes > 0.0 ? 100.0 * d->bytesRead / fullBytes : 0.0);
+    frameDifferReleaseTargets(d);
+    glDeleteVertexArrays(1, &d->vao);
+    glDeleteProgram(d->program);
+}
+
+/**
+ * Callback used by GLFW to adjust the OpenGL viewport when the window is resized.
+ */
+void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
+#ifdef __APPLE__
+    // On macOS with Retina displays, the viewport typically needs a 2x scaling.
+    glViewport(0, 0, width * 2, height * 2);
+#else
+    glViewport(0, 0, width, height);
+#endif
+    log_and_print("Window resized: width = %d, height = %d\n", width, height);
+}
+
+// Deflate parameters (RFC 1951)
+#define DEFLATE_WINDOW        32768
+#define DEFLATE_MIN_MATCH     3
+#define DEFLATE_MAX_MATCH     258
+#define DEFLATE_LOOKAHEAD     (DEFLATE_MAX_MATCH + DEFLATE_MIN_MATCH + 1)
+#define DEFLATE_MAX_DISTANCE  (DEFLATE_WINDOW - DEFLATE_LOOKAHEAD)
+#define DEFLATE_HASH_BITS     15
+#define DEFLATE_BLOCK_SYMBOLS 16384
+#define DEFLATE_OUTPUT_BYTES  16384
+#define DEFLATE_MAX_BITS      15  // Longest literal/length and distance code
+#define DEFLATE_MAX_BL_BITS   7   // Longest code-length code
+
+static const unsigned short kLengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char kLengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned short kDistanceBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+    769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const unsigned char kDistanceExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+// Order in which code-length code lengths are sent (RFC 1951, 3.2.7)
+static const unsigned char kCodeLengthOrder[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+/**
+ * Match search settings for one compression level (zlib's table).
+ */
+typedef struct {
+    uint16_t good;   // Search a quarter of the chain once a match this long
+                     // is found
+    uint16_t lazy;   // Lazy levels: no lazy search past this length; greedy
+                     // levels: longest match fully indexed
+    uint16_t nice;   // Stop searching once a match this long is found
+    uint16_t chain;  // Hash chain links followed per search
+} DeflateLevel;
+
+static const DeflateLevel kDeflateLevels[10] = {
+    {0, 0, 0, 0},
+    {4, 4, 8, 4},  // 1-3: greedy matching
+    {4, 5, 16, 8},
+    {4, 6, 32, 32},
+    {4, 4, 16, 16},  // 4-9: lazy matching
+    {8, 16, 32, 32},
+    {8, 16, 128, 128},
+    {8, 32, 128, 256},
+    {32, 128, 258, 1024},
+    {32, 258, 258, 4096},
+};
+
+/**
+ * Receives compressed bytes as the deflater produces them.
+ */
+typedef void (*DeflateWriteFunc)(void* context, const unsigned char* data,
+                                 size_t size);
+
+/**
+ * Streaming zlib compressor. Input is fed in pieces of any size and output is
+ * handed to a callback in chunks, so memory use does not depend on the amount
+ * of data compressed. Each block is sent with dynamic Huffman codes, the fixed
+ * codes or stored, whichever is smallest. Allocate with deflaterCreate (the
+ * state is ~400 KB).
+ */
+typedef struct {
+    DeflateWriteFunc write;
+    void*            context;
+    bool             raw;       // No zlib header or Adler-32 trailer (Adler-32
+                                // is still tracked)
+    DeflateLevel     params;
+    bool             greedy;    // No lazy matching (levels 1-3)
+    unsigned char    window[2 * DEFLATE_WINDOW + 16];  // Padded for 16-byte
+                                                       // match compares
+    int              strstart;  // Next position to encode in the window
+    int              lookahead; // Bytes after strstart not encoded yet
+    int              blockStart;  // Window position of the current block's
+                                  // input (< 0 once slid out)
+    int              blockBytes;  // Input bytes covered by the buffered symbols
+    int32_t          head[1 << DEFLATE_HASH_BITS];
+    int32_t          prev[DEFLATE_WINDOW];
+    uint16_t         symbolLength[DEFLATE_BLOCK_SYMBOLS];    // Literal byte, or
+                                                             // match length
+    uint16_t         symbolDistance[DEFLATE_BLOCK_SYMBOLS];  // 0 for literals
+    int              symbolCount;
+    uint32_t         literalFrequency[286];
+    uint32_t         distanceFrequency[30];
+    uint64_t         bitBuffer;
+    int              bitCount;
+    unsigned char    output[DEFLATE_OUTPUT_BYTES];
+    size_t           outputCount;
+    uint32_t         adler;
+    uint64_t         totalIn;
+    uint64_t         totalOut;
+} Deflater;
+
+/**
+ * Updates an Adler-32 checksum with `size` bytes.
+ */
+uint32_t adler32Update(uint32_t adler, const unsigned char* data, size_t size) {
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+#ifdef HAVE_SSE2
+    // 16 bytes per step: a gains the byte sum, b gains a weighted sum (16..1)
+    // plus 16 times every earlier byte sum of the block
+    const __m128i zero        = _mm_setzero_si128();
+    const __m128i weightsLow  = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i weightsHigh = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+    while (size >= 16) {
+        size_t  chunks   = size / 16 < 5552 / 16 ? size / 16 : 5552 / 16;
+        __m128i sum      = zero;  // Byte sums, in 32-bit lanes
+        __m128i prefix   = zero;  // Sum over chunks of the byte sums
+                                  // before them
+        __m128i weighted = zero;
+        uint64_t b64     = b + (uint64_t)a * 16 * chunks;
+        size    -= chunks * 16;
+        while (chunks--) {
+            __m128i x = _mm_loadu_si128((const __m128i*)data);
+            prefix    = _mm_add_epi32(prefix, sum);
+            sum       = _mm_add_epi32(sum, _mm_sad_epu8(x, zero));
+            weighted  = _mm_add_epi32(
+                weighted,
+                _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), weightsLow));
+            weighted  = _mm_add_epi32(
+                weighted,
+                _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), weightsHigh));
+            data     += 16;
+        }
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i*)lanes, sum);
+        uint64_t byteSum = (uint64_t)lanes[0] + lanes[2];
+        _mm_storeu_si128((__m128i*)lanes, prefix);
+        b64 += 16 * ((uint64_t)lanes[0] + lanes[2]);
+        _mm_storeu_si128((__m128i*)lanes, weighted);
+        b64 += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        a    = (uint32_t)((a + byteSum) % 65521);
+        b    = (uint32_t)(b64 % 65521);
+    }
+#endif
+    while (size > 0) {
+        // 5552 is the largest block that cannot overflow 32-bit sums
+        size_t block = size < 5552 ? size : 5552;
+        size -= block;
+        while (block--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+/**
+ * Combines the Adler-32 of two consecutive pieces of data.
+ *
+ * @param adler1 Checksum of the first piece.
+ * @param adler2 Checksum of the second piece.
+ * @param size2  Length of the second piece.
+ */
+uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, uint64_t size2) {
+    uint32_t rem   = (uint32_t)(size2 % 65521);
+    uint32_t sum1  = adler1 & 0xffff;
+    uint32_t sum2  = (uint32_t)(((uint64_t)rem * sum1) % 65521);
+    sum1          += (adler2 & 0xffff) + 65521 - 1;
+    sum2          += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+    if (sum1 >= 65521) {
+        sum1 -= 65521;
+    }
+    if (sum1 >= 65521) {
+        sum1 -= 65521;
+    }
+    if (sum2 >= 65521 * 2) {
+        sum2 -= 65521 * 2;
+    }
+    if (sum2 >= 65521) {
+        sum2 -= 65521;
+    }
+    return (sum2 << 16) | sum1;
+}
+
+// Slicing-by-8 tables: g_crcTable[k][n] is the CRC of byte n followed by k
+// zero bytes
+static uint32_t       g_crcTable[8][256];
+static pthread_once_t g_crcTableOnce = PTHREAD_ONCE_INIT;
+
+static void buildCrcTable(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        g_crcTable[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            g_crcTable[k][n] = g_crcTable[0][g_crcTable[k - 1][n] & 0xff] ^
+                               (g_crcTable[k - 1][n] >> 8);
+        }
+    }
+}
+
+/**
+ * Updates a CRC-32 (as used by PNG chunks) with `size` bytes.
+ * Start with 0 and pass the previous result to continue.
+ */
+uint32_t crc32Update(uint32_t crc, const unsigned char* data, size_t size) {
+    pthread_once(&g_crcTableOnce, buildCrcTable);
+    crc = ~crc;
+    while (size >= 8) {
+        uint32_t low  = crc ^
+                        ((uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+                         ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24));
+        uint32_t high = (uint32_t)data[4] | ((uint32_t)data[5] << 8) |
+                        ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24);
+        crc = g_crcTable[7][low & 0xff] ^ g_crcTable[6][(low >> 8) & 0xff] ^
+              g_crcTable[5][(low >> 16) & 0xff] ^ g_crcTable[4][low >> 24] ^
+              g_crcTable[3][high & 0xff] ^ g_crcTable[2][(high >> 8) & 0xff] ^
+              g_crcTable[1][(high >> 16) & 0xff] ^ g_crcTable[0][high >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while (size--) {
+        crc = g_crcTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/**
+ * Fills codes[] with the canonical, bit-reversed Huffman codes for the given
+ * code lengths (deflate writes Huffman codes starting from their top bit).
+ */
+static void buildHuffmanCodes(const unsigned char* lengths, int count,
+                              uint16_t* codes) {
+    int lengthCount[16] = {0};
+    int nextCode[16]    = {0};
+    for (int i = 0; i < count; i++) {
+        lengthCount[lengths[i]]++;
+    }
+    lengthCount[0] = 0;
+    for (int bits = 1, code = 0; bits < 16; bits++) {
+        code           = (code + lengthCount[bits - 1]) << 1;
+        nextCode[bits] = code;
+    }
+    for (int i = 0; i < count; i++) {
+        int length = lengths[i];
+        if (length == 0) {
+            codes[i] = 0;
+            continue;
+        }
+        int code     = nextCode[length]++;
+        int reversed = 0;
+        for (int b = 0; b < length; b++) {
+            reversed = (reversed << 1) | ((code >> b) & 1);
+        }
+        codes[i] = (uint16_t)reversed;
+    }
+}
+
+/**
+ * Computes Huffman code lengths of at most `maxBits` bits for the given
+ * symbol frequencies. Unused symbols get length 0; at least two symbols must
+ * be used, so the code is always complete.
+ */
+static void buildHuffmanLengths(const uint32_t* frequencies, int count,
+                                int maxBits, unsigned char* lengths) {
+    int      symbols[288];
+    uint32_t weight[2 * 288];
+    int      parent[2 * 288];
+    int      depth[2 * 288];
+    int      used = 0;
+
+    memset(lengths, 0, (size_t)count);
+    for (int i = 0; i < count; i++) {
+        if (frequencies[i] > 0) {
+            // Insertion sort by frequency, ascending
+            int j = used++;
+            while (j > 0 && frequencies[symbols[j - 1]] > frequencies[i]) {
+                symbols[j] = symbols[j - 1];
+                j--;
+            }
+            symbols[j] = i;
+        }
+    }
+    if (used < 2) {
+        if (used == 1) {
+            lengths[symbols[0]] = 1;
+        }
+        return;
+    }
+
+    // Two-queue Huffman construction: leaves are sorted, and internal nodes
+    // are created in non-decreasing weight order
+    for (int i = 0; i < used; i++) {
+        weight[i] = frequencies[symbols[i]];
+    }
+    int leaf = 0, node = used, next = used;
+    for (int k = 0; k < used - 1; k++) {
+        int pick[2];
+        for (int j = 0; j < 2; j++) {
+            if (leaf < used && (node >= next || weight[leaf] <= weight[node])) {
+                pick[j] = leaf++;
+            } else {
+                pick[j] = node++;
+            }
+        }
+        weight[next]    = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = next;
+        parent[pick[1]] = next;
+        next++;
+    }
+    depth[next - 1] = 0;
+    for (int n = next - 2; n >= 0; n--) {
+        depth[n] = depth[parent[n]] + 1;
+    }
+
+    // Clamp to maxBits, then lengthen codes until the Kraft sum is exact again
+    int lengthCount[33] = {0};
+    for (int i = 0; i < used; i++) {
+        lengthCount[depth[i] < maxBits ? depth[i] : maxBits]++;
+    }
+    uint32_t total = 0;
+    for (int bits = maxBits; bits > 0; bits--) {
+        total += (uint32_t)lengthCount[bits] << (maxBits - bits);
+    }
+    while (total > (1u << maxBits)) {
+        lengthCount[maxBits]--;
+        for (int bits = maxBits - 1; bits > 0; bits--) {
+            if (lengthCount[bits] > 0) {
+                lengthCount[bits]--;
+                lengthCount[bits + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // The rarest symbols get the longest codes
+    for (int bits = maxBits, j = 0; bits > 0; bits--) {
+        for (int k = 0; k < lengthCount[bits]; k++) {
+            lengths[symbols[j++]] = (unsigned char)bits;
+        }
+    }
+}
+
+// Fixed Huffman tables (RFC 1951, 3.2.6) and symbol lookups, built once
+static unsigned char  g_fixedLiteralLengths[288];
+static uint16_t       g_fixedLiteralCodes[288];
+static unsigned char  g_fixedDistanceLengths[30];
+static uint16_t       g_fixedDistanceCodes[30];
+// Match length -> length code (0-28)
+static unsigned char  g_lengthSymbol[DEFLATE_MAX_MATCH + 1];
+static unsigned char  g_distanceSymbol[512];  // See distanceSymbol
+static pthread_once_t g_deflateTablesOnce = PTHREAD_ONCE_INIT;
+
+static void buildDeflateTables(void) {
+    for (int i = 0; i < 288; i++) {
+        g_fixedLiteralLengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    }
+    for (int i = 0; i < 30; i++) {
+        g_fixedDistanceLengths[i] = 5;
+    }
+    buildHuffmanCodes(g_fixedLiteralLengths, 288, g_fixedLiteralCodes);
+    buildHuffmanCodes(g_fixedDistanceLengths, 30, g_fixedDistanceCodes);
+
+    for (int code = 0; code < 29; code++) {
+        for (int length = kLengthBase[code];
+             length < kLengthBase[code] + (1 << kLengthExtra[code]); length++) {
+            if (length <= DEFLATE_MAX_MATCH) {
+                g_lengthSymbol[length] = (unsigned char)code;
+            }
+        }
+    }
+    g_lengthSymbol[DEFLATE_MAX_MATCH] = 28;
+    for (int code = 0; code < 30; code++) {
+        for (int distance = kDistanceBase[code];
+             distance < kDistanceBase[code] + (1 << kDistanceExtra[code]);
+             distance++) {
+            int d = distance - 1;
+            g_distanceSymbol[d < 256 ? d : 256 + (d >> 7)] =
+                (unsigned char)code;
+        }
+    }
+}
+
+// Distance code (0-29) of a match distance, from two table ranges as in zlib
+static inline int distanceSymbol(int distance) {
+    int d = distance - 1;
+    return g_distanceSymbol[d < 256 ? d : 256 + (d >> 7)];
+}
+
+static void deflaterFlushOutput(Deflater* d) {
+    if (d->outputCount > 0) {
+        d->write(d->context, d->output, d->outputCount);
+        d->totalOut    += d->outputCount;
+        d->outputCount  = 0;
+    }
+}
+
+static inline void deflaterPutBits(Deflater* d, uint32_t value, int count) {
+    d->bitBuffer |= (uint64_t)value << d->bitCount;
+    d->bitCount  += count;
+    if (d->bitCount >= 32) {
+        if (d->outputCount + 4 > DEFLATE_OUTPUT_BYTES) {
+            deflaterFlushOutput(d);
+        }
+        unsigned char* out = d->output + d->outputCount;
+        out[0]             = (unsigned char)d->bitBuffer;
+        out[1]             = (unsigned char)(d->bitBuffer >> 8);
+        out[2]             = (unsigned char)(d->bitBuffer >> 16);
+        out[3]             = (unsigned char)(d->bitBuffer >> 24);
+        d->outputCount    += 4;
+        d->bitBuffer     >>= 32;
+        d->bitCount       -= 32;
+    }
+}
+
+static void deflaterPutByte(Deflater* d, unsigned char byte) {
+    deflaterPutBits(d, byte, 8);
+}
+
+// Pads to a byte boundary and moves every pending bit into the output buffer
+static void deflaterAlignToByte(Deflater* d) {
+    if (d->bitCount & 7) {
+        deflaterPutBits(d, 0, 8 - (d->bitCount & 7));
+    }
+    while (d->bitCount > 0) {
+        if (d->outputCount == DEFLATE_OUTPUT_BYTES) {
+            deflaterFlushOutput(d);
+        }
+        d->output[d->outputCount++] = (unsigned char)d->bitBuffer;
+        d->bitBuffer >>= 8;
+        d->bitCount   -= 8;
+    }
+}
+
+// Copies bytes to the output; the bit buffer must be aligned and empty
+static void deflaterPutBytes(Deflater* d, const unsigned char* data,
+                             size_t size) {
+    while (size > 0) {
+        if (d->outputCount == DEFLATE_OUTPUT_BYTES) {
+            deflaterFlushOutput(d);
+        }
+        size_t chunk = DEFLATE_OUTPUT_BYTES - d->outputCount;
+        if (chunk > size) {
+            chunk = size;
+        }
+        memcpy(d->output + d->outputCount, data, chunk);
+        d->outputCount += chunk;
+        data           += chunk;
+        size           -= chunk;
+    }
+}
+
+/**
+ * A code-length symbol (0-18) with its repeat count, as sent in a dynamic
+ * block header.
+ */
+typedef struct {
+    unsigned char symbol;
+    unsigned char extra;  // Repeat count minus the symbol's base
+} DeflateLengthToken;
+
+// Run-length encodes the literal/length and distance code lengths (RFC
+// 1951, 3.2.7)
+static int deflateEncodeLengths(const unsigned char* lengths, int count,
+                                DeflateLengthToken* tokens) {
+    int tokenCount = 0;
+    for (int i = 0; i < count;) {
+        int length = lengths[i];
+        int run    = 1;
+        while (i + run < count && lengths[i + run] == length) {
+            run++;
+        }
+        i += run;
+        if (length == 0) {
+            while (run >= 11) {
+                int repeat             = run < 138 ? run : 138;
+                tokens[tokenCount++]   = (DeflateLengthToken){
+                    18, (unsigned char)(repeat - 11)};
+                run                   -= repeat;
+            }
+            if (run >= 3) {
+                tokens[tokenCount++] = (DeflateLengthToken){
+                    17, (unsigned char)(run - 3)};
+                run                  = 0;
+            }
+        } else {
+            tokens[tokenCount++] = (DeflateLengthToken){(unsigned char)length,
+                                                        0};
+            run--;
+            while (run >= 3) {
+                int repeat             = run < 6 ? run : 6;
+                tokens[tokenCount++]   = (DeflateLengthToken){
+                    16, (unsigned char)(repeat - 3)};
+                run                   -= repeat;
+            }
+        }
+        while (run-- > 0) {
+            tokens[tokenCount++] = (DeflateLengthToken){(unsigned char)length,
+                                                        0};
+        }
+    }
+    return tokenCount;
+}
+
+/**
+ * Writes the buffered symbols as one block: dynamic Huffman, fixed Huffman or
+ * stored, whichever is smallest.
+ */
+static void deflaterEmitBlock(Deflater* d, bool last) {
+    static const unsigned char codeLengthExtra[19] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7};
+
+    pthread_once(&g_deflateTablesOnce, buildDeflateTables);
+    d->literalFrequency[256]++;  // End of block
+
+    // Bits shared by both Huffman encodings, and the fixed-code cost
+    uint64_t extraBits = 0;
+    uint64_t fixedBits = 3;
+    for (int s = 0; s < 286; s++) {
+        fixedBits +=
+            (uint64_t)d->literalFrequency[s] * g_fixedLiteralLengths[s];
+        if (s > 256) {
+            extraBits +=
+                (uint64_t)d->literalFrequency[s] * kLengthExtra[s - 257];
+        }
+    }
+    for (int s = 0; s < 30; s++) {
+        fixedBits += (uint64_t)d->distanceFrequency[s] * 5;
+        extraBits += (uint64_t)d->distanceFrequency[s] * kDistanceExtra[s];
+    }
+    fixedBits += extraBits;
+
+    // Dynamic codes; both alphabets get at least two codes so they are complete
+    uint32_t literalFrequency[286];
+    uint32_t distanceFrequency[30];
+    memcpy(literalFrequency, d->literalFrequency, sizeof(literalFrequency));
+    memcpy(distanceFrequency, d->distanceFrequency, sizeof(distanceFrequency));
+    int literalUsed = 0, distanceUsed = 0;
+    for (int s = 0; s < 286; s++) {
+        literalUsed += literalFrequency[s] > 0;
+    }
+    for (int s = 0; s < 30; s++) {
+        distanceUsed += distanceFrequency[s] > 0;
+    }
+    if (literalUsed < 2) {
+        literalFrequency[literalFrequency[0] ? 1 : 0]++;
+    }
+    for (int s = 0; distanceUsed < 2; s++) {
+        if (distanceFrequency[s] == 0) {
+            distanceFrequency[s] = 1;
+            distanceUsed++;
+        }
+    }
+
+    unsigned char lengths[286 + 30];
+    unsigned char* literalLengths  = lengths;
+    unsigned char  distanceLengths[30];
+    buildHuffmanLengths(literalFrequency, 286, DEFLATE_MAX_BITS,
+                        literalLengths);
+    buildHuffmanLengths(distanceFrequency, 30, DEFLATE_MAX_BITS,
+                        distanceLengths);
+    int literalCount  = 286;
+    int distanceCount = 30;
+    while (literalCount > 257 && literalLengths[literalCount - 1] == 0) {
+        literalCount--;
+    }
+    while (distanceCount > 1 && distanceLengths[distanceCount - 1] == 0) {
+        distanceCount--;
+    }
+    memcpy(lengths + literalCount, distanceLengths, (size_t)distanceCount);
+
+    DeflateLengthToken tokens[286 + 30];
+    int                tokenCount = deflateEncodeLengths(
+        lengths, literalCount + distanceCount, tokens);
+    uint32_t           codeLengthFrequency[19] = {0};
+    for (int t = 0; t < tokenCount; t++) {
+        codeLengthFrequency[tokens[t].symbol]++;
+    }
+    unsigned char codeLengthLengths[19];
+    buildHuffmanLengths(codeLengthFrequency, 19, DEFLATE_MAX_BL_BITS,
+                        codeLengthLengths);
+    int codeLengthCount = 19;
+    while (codeLengthCount > 4 &&
+           codeLengthLengths[kCodeLengthOrder[codeLengthCount - 1]] == 0) {
+        codeLengthCount--;
+    }
+
+    uint64_t dynamicBits =
+        3 + 5 + 5 + 4 + 3 * (uint64_t)codeLengthCount + extraBits;
+    for (int t = 0; t < tokenCount; t++) {
+        dynamicBits += codeLengthLengths[tokens[t].symbol] +
+                       codeLengthExtra[tokens[t].symbol];
+    }
+    for (int s = 0; s < literalCount; s++) {
+        dynamicBits += (uint64_t)d->literalFrequency[s] * literalLengths[s];
+    }
+    for (int s = 0; s < distanceCount; s++) {
+        dynamicBits += (uint64_t)d->distanceFrequency[s] * distanceLengths[s];
+    }
+
+    // Stored blocks need the input, which must still be in the window
+    uint64_t storedBits = UINT64_MAX;
+    if (d->blockStart >= 0) {
+        uint64_t pieces = d->blockBytes > 0
+                              ? ((uint64_t)d->blockBytes + 65534) / 65535
+                              : 1;
+        storedBits      = (3 + 7 + 32) * pieces + 8 * (uint64_t)d->blockBytes;
+    }
+
+    if (storedBits < dynamicBits && storedBits < fixedBits) {
+        const unsigned char* data      = d->window + d->blockStart;
+        int                  remaining = d->blockBytes;
+        do {
+            int piece = remaining < 65535 ? remaining : 65535;
+            remaining -= piece;
+            deflaterPutBits(d, (last && remaining == 0) ? 1 : 0, 1);
+            deflaterPutBits(d, 0, 2);  // Stored
+            deflaterAlignToByte(d);
+            deflaterPutBits(d, (uint32_t)piece, 16);
+            deflaterPutBits(d, (uint32_t)(piece ^ 0xffff), 16);
+            deflaterAlignToByte(d);
+            deflaterPutBytes(d, data, (size_t)piece);
+            data += piece;
+        } while (remaining > 0);
+    } else {
+        const unsigned char* useLiteralLengths  = g_fixedLiteralLengths;
+        const uint16_t*      useLiteralCodes    = g_fixedLiteralCodes;
+        const unsigned char* useDistanceLengths = g_fixedDistanceLengths;
+        const uint16_t*      useDistanceCodes   = g_fixedDistanceCodes;
+        uint16_t             literalCodes[286];
+        uint16_t             distanceCodes[30];
+
+        deflaterPutBits(d, last ? 1 : 0, 1);
+        if (dynamicBits < fixedBits) {
+            uint16_t codeLengthCodes[19];
+            buildHuffmanCodes(literalLengths, literalCount, literalCodes);
+            buildHuffmanCodes(distanceLengths, distanceCount, distanceCodes);
+            buildHuffmanCodes(codeLengthLengths, 19, codeLengthCodes);
+
+            deflaterPutBits(d, 2, 2);  // Dynamic Huffman codes
+            deflaterPutBits(d, (uint32_t)(literalCount - 257), 5);
+            deflaterPutBits(d, (uint32_t)(distanceCount - 1), 5);
+            deflaterPutBits(d, (uint32_t)(codeLengthCount - 4), 4);
+            for (int i = 0; i < codeLengthCount; i++) {
+                deflaterPutBits(d, codeLengthLengths[kCodeLengthOrder[i]], 3);
+            }
+            for (int t = 0; t < tokenCount; t++) {
+                int symbol = tokens[t].symbol;
+                deflaterPutBits(d, codeLengthCodes[symbol],
+                                codeLengthLengths[symbol]);
+                if (codeLengthExtra[symbol] > 0) {
+                    deflaterPutBits(d, tokens[t].extra,
+                                    codeLengthExtra[symbol]);
+                }
+            }
+            useLiteralLengths  = literalLengths;
+            useLiteralCodes    = literalCodes;
+            useDistanceLengths = distanceLengths;
+            useDistanceCodes   = distanceCodes;
+        } else {
+            deflaterPutBits(d, 1, 2);  // Fixed Huffman codes
+        }
+
+        for (int i = 0; i < d->symbolCount; i++) {
+            int length   = d->symbolLength[i];
+            int distance = d->symbolDistance[i];
+            if (distance == 0) {
+                deflaterPutBits(d, useLiteralCodes[length],
+                                useLiteralLengths[length]);
+                continue;
+            }
+            int lcode = g_lengthSymbol[length];
+            deflaterPutBits(d, useLiteralCodes[257 + lcode],
+                            useLiteralLengths[257 + lcode]);
+            deflaterPutBits(d, (uint32_t)(length - kLengthBase[lcode]),
+                            kLengthExtra[lcode]);
+            int dcode = distanceSymbol(distance);
+            deflaterPutBits(d, useDistanceCodes[dcode],
+                            useDistanceLengths[dcode]);
+            deflaterPutBits(d, (uint32_t)(distance - kDistanceBase[dcode]),
+                            kDistanceExtra[dcode]);
+        }
+        // End of block
+        deflaterPutBits(d, useLiteralCodes[256], useLiteralLengths[256]);
+    }
+
+    memset(d->literalFrequency, 0, sizeof(d->literalFrequency));
+    memset(d->distanceFrequency, 0, sizeof(d->distanceFrequency));
+    d->symbolCount  = 0;
+    d->blockStart  += d->blockBytes;
+    d->blockBytes   = 0;
+}
+
+static inline void deflaterEmitSymbol(Deflater* d, int length, int distance) {
+    d->symbolLength[d->symbolCount]   = (uint16_t)length;
+    d->symbolDistance[d->symbolCount] = (uint16_t)distance;
+    if (distance == 0) {
+        d->literalFrequency[length]++;
+        d->blockBytes++;
+    } else {
+        d->literalFrequency[257 + g_lengthSymbol[length]]++;
+        d->distanceFrequency[distanceSymbol(distance)]++;
+        d->blockBytes += length;
+    }
+    if (++d->symbolCount == DEFLATE_BLOCK_SYMBOLS) {
+        deflaterEmitBlock(d, false);
+    }
+}
+
+static inline uint32_t deflateHash(const unsigned char* p) {
+    uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                 ((uint32_t)p[2] << 16);
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static inline void deflaterInsert(Deflater* d, int position) {
+    uint32_t h                                  = deflateHash(
+        d->window + position);
+    d->prev[position & (DEFLATE_WINDOW - 1)]    = d->head[h];
+    d->head[h]                                  = position;
+}
+
+// Number of equal leading bytes of a and b, at most maxLen (reads up to 15
+// bytes past it)
+static inline int deflateMatchLength(const unsigned char* a,
+                                     const unsigned char* b, int maxLen) {
+    int length = 0;
+#ifdef HAVE_SSE2
+    while (length < maxLen) {
+        __m128i  x    = _mm_loadu_si128((const __m128i*)(a + length));
+        __m128i  y    = _mm_loadu_si128((const __m128i*)(b + length));
+        unsigned diff = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^
+                        0xffffu;
+        if (diff) {
+#if defined(__GNUC__)
+            length += __builtin_ctz(diff);
+#else
+            while (!(diff & 1)) {
+                diff >>= 1;
+                length++;
+            }
+#endif
+            break;
+        }
+        length += 16;
+    }
+#else
+    while (length < maxLen && a[length] == b[length]) {
+        length++;
+    }
+#endif
+    return length < maxLen ? length : maxLen;
+}
+
+/**
+ * Finds the longest earlier match for the data at `position`.
+ *
+ * @param previousLength Length of a match already found nearby; searches for
+ *                       a longer one give up sooner when it is good.
+ * @return The match length (0 if not longer than previousLength or shorter
+ *         than DEFLATE_MIN_MATCH); the distance is stored in *distance.
+ */
+static int deflaterLongestMatch(Deflater* d, int position, int previousLength,
+                                int* distance) {
+    const unsigned char* scan   = d->window + position;
+    int                  maxLen = d->strstart + d->lookahead - position;
+    int                  limit  = position > DEFLATE_MAX_DISTANCE
+                                      ? position - DEFLATE_MAX_DISTANCE
+                                      : 0;
+    int                  best   = previousLength > DEFLATE_MIN_MATCH - 1
+                                      ? previousLength
+                                      : DEFLATE_MIN_MATCH - 1;
+    int                  chain  = d->params.chain;
+    int                  nice   = d->params.nice;
+    int                  cur    = d->head[deflateHash(scan)];
+    int                  found  = 0;
+
+    if (previousLength >= d->params.good) {
+        chain >>= 2;
+    }
+    if (maxLen > DEFLATE_MAX_MATCH) {
+        maxLen = DEFLATE_MAX_MATCH;
+    }
+    if (nice > maxLen) {
+        nice = maxLen;
+    }
+    if (maxLen < DEFLATE_MIN_MATCH || best >= maxLen) {
+        return 0;
+    }
+    while (cur >= limit && cur < position && chain-- > 0) {
+        const unsigned char* match = d->window + cur;
+        if (match[best] == scan[best] && match[0] == scan[0] &&
+            match[1] == scan[1]) {
+            int length = deflateMatchLength(match, scan, maxLen);
+            if (length > best) {
+                best      = length;
+                found     = length;
+                *distance = position - cur;
+                if (length >= nice) {
+                    break;
+                }
+            }
+        }
+        int next = d->prev[cur & (DEFLATE_WINDOW - 1)];
+        if (next >= cur) {
+            break;
+        }
+        cur = next;
+    }
+    return found >= DEFLATE_MIN_MATCH ? found : 0;
+}
+
+/**
+ * Encodes buffered input. Unless `flush` is set, enough lookahead is kept for
+ * the longest possible match.
+ */
+static void deflaterProcess(Deflater* d, bool flush) {
+    int keep = flush ? 0 : DEFLATE_LOOKAHEAD - 1;
+    pthread_once(&g_deflateTablesOnce, buildDeflateTables);
+    while (d->lookahead > keep) {
+        int distance = 0;
+        int length   = d->lookahead >= DEFLATE_MIN_MATCH
+                           ? deflaterLongestMatch(d, d->strstart, 0, &distance)
+                           : 0;
+
+        // One step of lazy evaluation: prefer a longer match starting at the
+        // next byte
+        if (!d->greedy && length > 0 && length < d->params.lazy &&
+            d->lookahead > length + 1) {
+            deflaterInsert(d, d->strstart);
+            int nextDistance = 0;
+            int nextLength   = deflaterLongestMatch(d, d->strstart + 1, length,
+                                                    &nextDistance);
+            if (nextLength > length) {
+                deflaterEmitSymbol(d, d->window[d->strstart], 0);
+                d->strstart++;
+                d->lookahead--;
+                continue;
+            }
+            d->head[deflateHash(d->window + d->strstart)] =
+                d->prev[d->strstart & (DEFLATE_WINDOW - 1)];
+        }
+
+        if (length > 0) {
+            deflaterEmitSymbol(d, length, distance);
+            // Greedy levels skip indexing the inside of long matches, as
+            // zlib does
+            int end = (d->greedy && length > d->params.lazy)
+                          ? d->strstart + 1
+                          : d->strstart + length;
+            for (int p = d->strstart; p < end; p++) {
+                if (p + DEFLATE_MIN_MATCH <= d->strstart + d->lookahead) {
+                    deflaterInsert(d, p);
+                }
+            }
+            d->strstart  += length;
+            d->lookahead -= length;
+        } else {
+            if (d->lookahead >= DEFLATE_MIN_MATCH) {
+                deflaterInsert(d, d->strstart);
+            }
+            deflaterEmitSymbol(d, d->window[d->strstart], 0);
+            d->strstart++;
+            d->lookahead--;
+        }
+    }
+}
+
+/**
+ * Moves the upper half of the window down to make room for more input.
+ */
+static void deflaterSlide(Deflater* d) {
+    memmove(d->window, d->window + DEFLATE_WINDOW, DEFLATE_WINDOW);
+    d->strstart   -= DEFLATE_WINDOW;
+    d->blockStart -= DEFLATE_WINDOW;
+    for (int i = 0; i < (1 << DEFLATE_HASH_BITS); i++) {
+        d->head[i] = d->head[i] >= DEFLATE_WINDOW ? d->head[i] - DEFLATE_WINDOW
+                                                  : -1;
+    }
+    for (int i = 0; i < DEFLATE_WINDOW; i++) {
+        d->prev[i] = d->prev[i] >= DEFLATE_WINDOW ? d->prev[i] - DEFLATE_WINDOW
+                                                  : -1;
+    }
+}
+
+/**
+ * Allocates a deflater.
+ *
+ * @param level   Compression level, 1 (fastest) to 9 (smallest).
+ * @param raw     true for a bare deflate stream without zlib header
+ *                and trailer.
+ * @param write   Callback receiving the compressed bytes.
+ * @param context Passed to the callback.
+ * @return The deflater, or NULL if it could not be allocated.
+ */
+Deflater* deflaterCreate(int level, bool raw, DeflateWriteFunc write,
+                         void* context) {
+    Deflater* d = (Deflater*)malloc(sizeof(Deflater));
+    if (!d) {
+        return NULL;
+    }
+    if (level < 1) {
+        level = 1;
+    }
+    if (level > 9) {
+        level = 9;
+    }
+
+    d->write       = write;
+    d->context     = context;
+    d->raw         = raw;
+    d->params      = kDeflateLevels[level];
+    d->greedy      = level <= 3;
+    d->strstart    = 0;
+    d->lookahead   = 0;
+    d->blockStart  = 0;
+    d->blockBytes  = 0;
+    d->symbolCount = 0;
+    d->bitBuffer   = 0;
+    d->bitCount    = 0;
+    d->outputCount = 0;
+    d->adler       = 1;
+    d->totalIn     = 0;
+    d->totalOut    = 0;
+    memset(d->head, 0xff, sizeof(d->head));
+    memset(d->prev, 0xff, sizeof(d->prev));
+    memset(d->literalFrequency, 0, sizeof(d->literalFrequency));
+    memset(d->distanceFrequency, 0, sizeof(d->distanceFrequency));
+    memset(d->window + 2 * DEFLATE_WINDOW, 0, 16);
+
+    if (!raw) {
+        // 32K window, deflate; the level hint keeps the header a multiple of 31
+        static const unsigned char levelHints[10] = {
+            0, 0x01, 0x5e, 0x5e, 0x5e, 0x5e, 0x9c, 0xda, 0xda, 0xda};
+        deflaterPutByte(d, 0x78);
+        deflaterPutByte(d, levelHints[level]);
+    }
+    return d;
+}
+
+/**
+ * Compresses `size` more bytes of input.
+ */
+void deflaterWrite(Deflater* d, const unsigned char* data, size_t size) {
+    d->adler    = adler32Update(d->adler, data, size);
+    d->totalIn += size;
+    while (size > 0) {
+        int end = d->strstart + d->lookahead;
+        if (end == 2 * DEFLATE_WINDOW) {
+            deflaterSlide(d);
+            end = d->strstart + d->lookahead;
+        }
+        size_t room  = (size_t)(2 * DEFLATE_WINDOW - end);
+        size_t chunk = size < room ? size : room;
+        memcpy(d->window + end, data, chunk);
+        d->lookahead += (int)chunk;
+        data         += chunk;
+        size         -= chunk;
+        deflaterProcess(d, false);
+    }
+}
+
+/**
+ * Primes the window with data that precedes the stream (at most 32 KB is
+ * used), so matches can reach back into it. The dictionary is neither
+ * emitted nor counted in the checksum.
+ */
+void deflaterSetDictionary(Deflater* d, const unsigned char* data,
+                           size_t size) {
+    if (size > DEFLATE_WINDOW) {
+        data += size - DEFLATE_WINDOW;
+        size  = DEFLATE_WINDOW;
+    }
+    memcpy(d->window, data, size);
+    for (int p = 0; p + DEFLATE_MIN_MATCH <= (int)size; p++) {
+        deflaterInsert(d, p);
+    }
+    d->strstart   = (int)size;
+    d->lookahead  = 0;
+    d->blockStart = (int)size;
+}
+
+/**
+ * Encodes everything written so far and ends on a byte boundary with an empty
+ * stored block (a zlib sync flush). Another deflate stream can be appended
+ * directly after the output.
+ */
+void deflaterSyncFlush(Deflater* d) {
+    deflaterProcess(d, true);
+    if (d->symbolCount > 0) {
+        deflaterEmitBlock(d, false);
+    }
+    deflaterPutBits(d, 0, 1);  // Not the last block
+    deflaterPutBits(d, 0, 2);  // Stored
+    deflaterAlignToByte(d);
+    deflaterPutByte(d, 0x00);
+    deflaterPutByte(d, 0x00);
+    deflaterPutByte(d, 0xff);
+    deflaterPutByte(d, 0xff);
+    deflaterFlushOutput(d);
+}
+
+/**
+ * Ends the stream: encodes what is left in a final block and, unless raw,
+ * appends the Adler-32 trailer. Everything is handed to the write callback.
+ */
+void deflaterFinish(Deflater* d) {
+    deflaterProcess(d, true);
+    deflaterEmitBlock(d, true);
+    deflaterAlignToByte(d);
+    if (!d->raw) {
+        deflaterPutByte(d, (unsigned char)(d->adler >> 24));
+        deflaterPutByte(d, (unsigned char)(d->adler >> 16));
+        deflaterPutByte(d, (unsigned char)(d->adler >> 8));
+        deflaterPutByte(d, (unsigned char)d->adler);
+    }
+    deflaterFlushOutput(d);
+}
+
+/**
+ * Releases a deflater.
+ */
+void deflaterDestroy(Deflater* d) {
+    free(d);
+}
+
+/**
+ * Growable memory buffer collecting deflate output.
+ */
+typedef struct {
+    unsigned char* data;
+    size_t         size;
+    size_t         capacity;
+    bool           failed;  // An allocation failed; the contents are incomplete
+} DeflateBuffer;
+
+/**
+ * DeflateWriteFunc appending to a DeflateBuffer.
+ */
+static void deflateBufferAppend(void* context, const unsigned char* data,
+                                size_t size) {
+    DeflateBuffer* buffer = (DeflateBuffer*)context;
+    if (buffer->failed) {
+        return;
+    }
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 1 << 16;
+        while (capacity < buffer->size + size) {
+            capacity *= 2;
+        }
+        unsigned char* grown = (unsigned char*)realloc(buffer->data, capacity);
+        if (!grown) {
+            buffer->failed = true;
+            return;
+        }
+        buffer->data     = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+/**
+ * Compresses a buffer into a zlib stream in one call. This is the
+ * STBIW_ZLIB_COMPRESS hook, so stb_image_write's PNGs use this deflater
+ * instead of stb's built-in one.
+ *
+ * @param data      Input data.
+ * @param dataLength Input size.
+ * @param outLength Receives the compressed size.
+ * @param quality   Compression level (stbi_write_png_compression_level), 1
+ *                  to 9.
+ * @return A malloc'ed zlib stream, or NULL on failure.
+ */
+unsigned char* deflateCompress(unsigned char* data, int dataLength,
+                               int* outLength, int quality) {
+    DeflateBuffer buffer   = {NULL, 0, 0, false};
+    Deflater*     deflater = deflaterCreate(quality, false, deflateBufferAppend,
+                                            &buffer);
+    if (!deflater) {
+        return NULL;
+    }
+    deflaterWrite(deflater, data, (size_t)dataLength);
+    deflaterFinish(deflater);
+    deflaterDestroy(deflater);
+    if (buffer.failed) {
+        free(buffer.data);
+        return NULL;
+    }
+    *outLength = (int)buffer.size;
+    return buffer.data;
+}
+
+/**
+ * PNG encoders available for frame files.
+ */
+typedef enum {
+    PNG_WRITER_STB,     // stb_image_write: whole image filtered and
+                        // compressed in memory
+    PNG_WRITER_STREAM,  // PngStream: rows filtered and deflated as they go,
+                        // bounded memory
+} PngWriterKind;
+
+/**
+ * How PNG rows pick their filter. The first five force one filter for every
+ * row; the PNG filter type byte has the same value.
+ */
+typedef enum {
+    PNG_FILTER_NONE,
+    PNG_FILTER_SUB,
+    PNG_FILTER_UP,
+    PNG_FILTER_AVERAGE,
+    PNG_FILTER_PAETH,
+    PNG_FILTER_ADAPTIVE,  // Tries all five filters on every row (smallest
+                          // files)
+    PNG_FILTER_SAMPLED,   // Scores the five filters on a quarter of each row,
+                          // filters it once
+} PngFilterMode;
+
+/**
+ * How frame files are PNG-encoded.
+ */
+typedef struct {
+    PngWriterKind writer;
+    int           level;    // Deflate level of the streaming writer, 1 to 9
+    int           threads;  // Threads compressing each image with the
+                            // streaming writer
+    PngFilterMode filter;
+} PngOptions;
+
+static const char* const g_pngFilterNames[] = {"none", "sub", "up", "average",
+                                               "paeth", "adaptive", "sampled"};
+
+/**
+ * Parses a filter mode name as given to --png-filter.
+ *
+ * @param name Mode name (none, sub, up, average, paeth, adaptive or sampled).
+ * @param mode Receives the parsed mode.
+ * @return true if the name is known.
+ */
+bool parsePngFilterMode(const char* name, PngFilterMode* mode) {
+    for (int m = PNG_FILTER_NONE; m <= PNG_FILTER_SAMPLED; m++) {
+        if (strcmp(name, g_pngFilterNames[m]) == 0) {
+            *mode = (PngFilterMode)m;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Size of the IDAT chunks written by the streaming PNG writer
+#define PNG_IDAT_BYTES 65536
+// Upper bound for the number of threads compressing one PNG
+#define PNG_MAX_THREADS 64
+// Bands shorter than this are not worth a thread of their own
+#define PNG_MIN_BAND_ROWS 16
+
+/**
+ * PNG writer that accepts an image a few rows at a time. Each row is filtered
+ * as it arrives, deflated incrementally and written out in IDAT chunks, so
+ * peak memory is a couple of rows plus the compressor state, whatever the
+ * image size.
+ *
+ * With more than one thread, every batch of rows is cut into horizontal bands
+ * that are filtered and deflated concurrently, pigz-style: each band is a raw
+ * deflate stream primed with the 32 KB of filtered data before it and ended
+ * with a sync flush, so the bands concatenate into one valid zlib stream whose
+ * Adler-32 is combined from the per-band checksums.
+ */
+typedef struct {
+    FILE*          fp;           // NULL when only measuring the encoded size
+    int            width;
+    int            height;
+    int            rowsWritten;
+    size_t         rowBytes;
+    int            level;
+    int            threads;
+    PngFilterMode  filter;
+    uint64_t       fileBytes;    // Bytes of PNG output so far
+    unsigned char* previousRow;  // Unfiltered previous row (zeros before the
+                                 // first row)
+    unsigned char* filtered;     // Filter type byte + best filtered row
+    unsigned char* scratch;      // Candidate filtered row
+    Deflater*      deflater;     // Single-threaded compressor (NULL when
+                                 // threads > 1)
+    uint32_t       adler;        // Adler-32 of the filtered data (threads > 1)
+    unsigned char* dictionary;   // Last 32 KB of filtered data (threads > 1)
+    size_t         dictionaryLength;
+    unsigned char  idat[PNG_IDAT_BYTES];
+    size_t         idatCount;
+    bool           failed;
+} PngStream;
+
+static void pngWriteChunk(PngStream* png, const char* type,
+                          const unsigned char* data, size_t size) {
+    unsigned char header[8] = {
+        (unsigned char)(size >> 24), (unsigned char)(size >> 16),
+        (unsigned char)(size >> 8), (unsigned char)size, (unsigned char)type[0],
+        (unsigned char)type[1], (unsigned char)type[2], (unsigned char)type[3]};
+    uint32_t crc = crc32Update(0, header + 4, 4);
+    crc          = crc32Update(crc, data, size);
+    unsigned char trailer[4] = {
+        (unsigned char)(crc >> 24), (unsigned char)(crc >> 16),
+        (unsigned char)(crc >> 8), (unsigned char)crc};
+
+    png->fileBytes += 12 + size;
+    if (!png->fp) {
+        return;
+    }
+    if (fwrite(header, 1, 8, png->fp) != 8 ||
+        (size > 0 && fwrite(data, 1, size, png->fp) != size) ||
+        fwrite(trailer, 1, 4, png->fp) != 4) {
+        png->failed = true;
+    }
+}
+
+static void pngStreamCollect(void* context, const unsigned char* data,
+                             size_t size) {
+    PngStream* png = (PngStream*)context;
+    while (size > 0) {
+        size_t chunk = PNG_IDAT_BYTES - png->idatCount;
+        if (chunk > size) {
+            chunk = size;
+        }
+        memcpy(png->idat + png->idatCount, data, chunk);
+        png->idatCount += chunk;
+        data           += chunk;
+        size           -= chunk;
+        if (png->idatCount == PNG_IDAT_BYTES) {
+            pngWriteChunk(png, "IDAT", png->idat, png->idatCount);
+            png->idatCount = 0;
+        }
+    }
+}
+
+static inline unsigned char paethPredictor(int a, int b, int c) {
+    int p  = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return (unsigned char)a;
+    }
+    if (pb <= pc) {
+        return (unsigned char)b;
+    }
+    return (unsigned char)c;
+}
+
+/**
+ * Filters byte `i` of an RGBA row with filter `type`. Used for the first pixel
+ * and the row tails, where the vector kernels do not apply.
+ */
+static inline unsigned char pngFilterByte(const unsigned char* row,
+                                          const unsigned char* previous,
+                                          size_t i, int type) {
+    int a = i >= 4 ? row[i - 4] : 0;
+    int b = previous[i];
+    int c = i >= 4 ? previous[i - 4] : 0;
+    switch (type) {
+        case 1:  return (unsigned char)(row[i] - a);
+        case 2:  return (unsigned char)(row[i] - b);
+        case 3:  return (unsigned char)(row[i] - ((a + b) >> 1));
+        case 4:  return (unsigned char)(row[i] - paethPredictor(a, b, c));
+        default: return row[i];
+    }
+}
+
+/**
+ * Applies PNG filter `type` (0-4) to bytes [begin, end) of one RGBA row;
+ * out[i] receives the filtered row[i].
+ *
+ * @param out      Filtered row (same indexing as `row`).
+ * @param row      Current unfiltered row.
+ * @param previous Previous unfiltered row (zeros for the first row).
+ * @param begin    First byte to filter.
+ * @param end      One past the last byte to filter.
+ * @param type     PNG filter type.
+ */
+typedef void (*PngFilterFunc)(unsigned char* out, const unsigned char* row,
+                              const unsigned char* previous, size_t begin,
+                              size_t end, int type);
+
+/**
+ * Sum of the filtered bytes taken as signed values: the usual estimate of how
+ * well a filtered row will compress (smaller is better).
+ */
+typedef uint64_t (*PngCostFunc)(const unsigned char* filtered, size_t size);
+
+static void pngFilterScalar(unsigned char* out, const unsigned char* row,
+                            const unsigned char* previous, size_t begin,
+                            size_t end, int type) {
+    const size_t bpp = 4;
+    size_t       i   = begin;
+    if (type == 0) {
+        memcpy(out + begin, row + begin, end - begin);
+        return;
+    }
+    for (; i < end && i < bpp; i++) {
+        out[i] = pngFilterByte(row, previous, i, type);
+    }
+    switch (type) {
+        case 1:
+            for (; i < end; i++) {
+                out[i] = (unsigned char)(row[i] - row[i - bpp]);
+            }
+            break;
+        case 2:
+            for (; i < end; i++) {
+                out[i] = (unsigned char)(row[i] - previous[i]);
+            }
+            break;
+        case 3:
+            for (; i < end; i++) {
+                out[i] = (unsigned char)(row[i] -
+                                         ((row[i - bpp] + previous[i]) >> 1));
+            }
+            break;
+        case 4:
+            for (; i < end; i++) {
+                out[i] =
+                    (unsigned char)(row[i] - paethPredictor(row[i - bpp],
+                                                            previous[i],
+                                                            previous[i - bpp]));
+            }
+            break;
+    }
+}
+
+static uint64_t pngCostScalar(const unsigned char* filtered, size_t size) {
+    uint64_t cost = 0;
+    for (size_t i = 0; i < size; i++) {
+        cost += (uint64_t)abs((signed char)filtered[i]);
+    }
+    return cost;
+}
+
+#ifdef HAVE_SSE2
+// Paeth predictor on eight 16-bit lanes
+static inline __m128i pngPaethLanesSse2(__m128i a, __m128i b, __m128i c) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i pa   = _mm_sub_epi16(b, c);  // p - a
+    __m128i pb   = _mm_sub_epi16(a, c);  // p - b
+    __m128i pc   = _mm_add_epi16(pa, pb);  // p - c
+    pa           = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+    pb           = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+    pc           = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+    __m128i notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb),
+                                _mm_cmpgt_epi16(pa, pc));
+    __m128i useC = _mm_cmpgt_epi16(pb, pc);
+    __m128i bc   = _mm_or_si128(_mm_and_si128(useC, c),
+                                _mm_andnot_si128(useC, b));
+    return _mm_or_si128(_mm_and_si128(notA, bc), _mm_andnot_si128(notA, a));
+}
+
+// (a + b) >> 1 per byte; _mm_avg_epu8 rounds up, so drop the odd bit
+static inline __m128i pngAverageSse2(__m128i a, __m128i b) {
+    return _mm_sub_epi8(_mm_avg_epu8(a, b),
+                        _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+static void pngFilterSse2(unsigned char* out, const unsigned char* row,
+                          const unsigned char* previous, size_t begin,
+                          size_t end, int type) {
+    const size_t bpp  = 4;
+    size_t       i    = begin;
+    __m128i      zero = _mm_setzero_si128();
+    if (type == 0) {
+        memcpy(out + begin, row + begin, end - begin);
+        return;
+    }
+    for (; i < end && i < bpp; i++) {
+        out[i] = pngFilterByte(row, previous, i, type);
+    }
+    for (; i + 16 <= end; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i a = _mm_loadu_si128((const __m128i*)(row + i - bpp));
+        __m128i b = _mm_loadu_si128((const __m128i*)(previous + i));
+        __m128i predicted;
+        if (type == 1) {
+            predicted = a;
+        } else if (type == 2) {
+            predicted = b;
+        } else if (type == 3) {
+            predicted = pngAverageSse2(a, b);
+        } else {
+            __m128i c  = _mm_loadu_si128((const __m128i*)(previous + i - bpp));
+            __m128i lo = pngPaethLanesSse2(_mm_unpacklo_epi8(a, zero),
+                                           _mm_unpacklo_epi8(b, zero),
+                                           _mm_unpacklo_epi8(c, zero));
+            __m128i hi = pngPaethLanesSse2(_mm_unpackhi_epi8(a, zero),
+                                           _mm_unpackhi_epi8(b, zero),
+                                           _mm_unpackhi_epi8(c, zero));
+            predicted  = _mm_packus_epi16(lo, hi);
+        }
+        _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, predicted));
+    }
+    for (; i < end; i++) {
+        out[i] = pngFilterByte(row, previous, i, type);
+    }
+}
+
+static uint64_t pngCostSse2(const unsigned char* filtered, size_t size) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i sum  = zero;
+    size_t  i    = 0;
+    for (; i + 16 <= size; i += 16) {
+        // |v| of a signed byte is min(v, -v) read as unsigned
+        __m128i v = _mm_loadu_si128((const __m128i*)(filtered + i));
+        sum       = _mm_add_epi64(
+            sum, _mm_sad_epu8(_mm_min_epu8(v, _mm_sub_epi8(zero, v)), zero));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, sum);
+    return lanes[0] + lanes[1] + pngCostScalar(filtered + i, size - i);
+}
+#endif
+
+#ifdef HAVE_AVX2
+// Paeth predictor on sixteen 16-bit lanes
+__attribute__((target("avx2"))) static inline __m256i pngPaethLanesAvx2(
+    __m256i a, __m256i b, __m256i c) {
+    __m256i pa = _mm256_sub_epi16(b, c);
+    __m256i pb = _mm256_sub_epi16(a, c);
+    __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+    pa         = _mm256_abs_epi16(pa);
+    pb         = _mm256_abs_epi16(pb);
+
+    __m256i notA = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb),
+                                   _mm256_cmpgt_epi16(pa, pc));
+    __m256i bc   = _mm256_blendv_epi8(b, c, _mm256_cmpgt_epi16(pb, pc));
+    return _mm256_blendv_epi8(a, bc, notA);
+}
+
+__attribute__((target("avx2"))) static void pngFilterAvx2(
+    unsigned char* out, const unsigned char* row, const unsigned char* previous,
+    size_t begin, size_t end, int type) {
+    const size_t bpp = 4;
+    size_t       i   = begin;
+    if (type == 0) {
+        memcpy(out + begin, row + begin, end - begin);
+        return;
+    }
+    for (; i < end && i < bpp; i++) {
+        out[i] = pngFilterByte(row, previous, i, type);
+    }
+    if (type == 4) {
+        // Paeth needs 16-bit lanes: sixteen pixels' bytes per step
+        for (; i + 16 <= end; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+            __m256i a = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i*)(row + i - bpp)));
+            __m256i b = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i*)(previous + i)));
+            __m256i c = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i*)(previous + i - bpp)));
+            __m256i p = pngPaethLanesAvx2(a, b, c);
+            __m128i predicted = _mm_packus_epi16(
+                _mm256_castsi256_si128(p), _mm256_extracti128_si256(p, 1));
+            _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, predicted));
+        }
+    } else {
+        for (; i + 32 <= end; i += 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)(row + i));
+            __m256i a = _mm256_loadu_si256((const __m256i*)(row + i - bpp));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(previous + i));
+            __m256i predicted;
+            if (type == 1) {
+                predicted = a;
+            } else if (type == 2) {
+                predicted = b;
+            } else {
+                predicted = _mm256_sub_epi8(
+                    _mm256_avg_epu8(a, b),
+                    _mm256_and_si256(_mm256_xor_si256(a, b),
+                                     _mm256_set1_epi8(1)));
+            }
+            _mm256_storeu_si256((__m256i*)(out + i),
+                                _mm256_sub_epi8(x, predicted));
+        }
+    }
+    for (; i < end; i++) {
+        out[i] = pngFilterByte(row, previous, i, type);
+    }
+}
+
+__attribute__((target("avx2"))) static uint64_t pngCostAvx2(
+    const unsigned char* filtered, size_t size) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i sum  = zero;
+    size_t  i    = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(filtered + i));
+        sum       = _mm256_add_epi64(
+            sum, _mm256_sad_epu8(_mm256_min_epu8(v, _mm256_sub_epi8(zero, v)),
+                                 zero));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           pngCostScalar(filtered + i, size - i);
+}
+#endif
+
+/**
+ * A set of PNG filter kernels for one instruction set.
+ */
+typedef struct {
+    const char*   name;
+    PngFilterFunc filter;
+    PngCostFunc   cost;
+} PngKernels;
+
+/**
+ * Lists the kernel sets this build and CPU can run, slowest first.
+ *
+ * @param kernels Receives up to three kernel sets.
+ * @return Number of kernel sets.
+ */
+int pngAvailableKernels(PngKernels* kernels) {
+    int count = 0;
+    kernels[count++] = (PngKernels){"scalar", pngFilterScalar, pngCostScalar};
+#ifdef HAVE_SSE2
+    kernels[count++] = (PngKernels){"sse2", pngFilterSse2, pngCostSse2};
+#endif
+#ifdef HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[count++] = (PngKernels){"avx2", pngFilterAvx2, pngCostAvx2};
+    }
+#endif
+    return count;
+}
+
+static PngKernels     g_pngKernels;
+static pthread_once_t g_pngKernelsOnce = PTHREAD_ONCE_INIT;
+
+static void pngSelectKernels(void) {
+    PngKernels kernels[3];
+    g_pngKernels = kernels[pngAvailableKernels(kernels) - 1];
+}
+
+/**
+ * The fastest PNG filter kernels for this CPU.
+ */
+const PngKernels* pngKernels(void) {
+    pthread_once(&g_pngKernelsOnce, pngSelectKernels);
+    return &g_pngKernels;
+}
+
+// The sampled filter mode scores PNG_SAMPLE_BYTES out of every
+// PNG_SAMPLE_STRIDE bytes
+#define PNG_SAMPLE_STRIDE 64
+#define PNG_SAMPLE_BYTES  16
+
+/**
+ * Filters one row, choosing the filter as `mode` says.
+ *
+ * @param out      Filter type byte followed by the filtered row (rowBytes +
+ *                 1 bytes).
+ * @param row      Current unfiltered row.
+ * @param previous Previous unfiltered row (zeros for the first row).
+ * @param rowBytes Bytes per row.
+ * @param scratch  Temporary row of rowBytes bytes.
+ * @param mode     Fixed filter, or how to pick one.
+ */
+static void pngFilterChoose(unsigned char* out, const unsigned char* row,
+                            const unsigned char* previous, size_t rowBytes,
+                            unsigned char* scratch, PngFilterMode mode) {
+    const PngKernels* kernels = pngKernels();
+    if (mode <= PNG_FILTER_PAETH) {
+        out[0] = (unsigned char)mode;
+        kernels->filter(out + 1, row, previous, 0, rowBytes, mode);
+        return;
+    }
+
+    if (mode == PNG_FILTER_SAMPLED) {
+        // Score every filter on evenly spread slices, then filter the row once
+        uint64_t bestCost = UINT64_MAX;
+        int      bestType = 0;
+        for (int type = 0; type < 5; type++) {
+            uint64_t cost = 0;
+            for (size_t x = 0; x < rowBytes; x += PNG_SAMPLE_STRIDE) {
+                size_t end = x + PNG_SAMPLE_BYTES < rowBytes
+                                 ? x + PNG_SAMPLE_BYTES
+                                 : rowBytes;
+                kernels->filter(scratch, row, previous, x, end, type);
+                cost += kernels->cost(scratch + x, end - x);
+            }
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestType = type;
+            }
+        }
+        out[0] = (unsigned char)bestType;
+        kernels->filter(out + 1, row, previous, 0, rowBytes, bestType);
+        return;
+    }
+
+    // Adaptive: the smallest sum of absolute values over all five filters.
+    // Candidates alternate between out + 1 and scratch, so the best is
+    // never copied more than once.
+    uint64_t       bestCost  = UINT64_MAX;
+    unsigned char* best      = NULL;
+    unsigned char* candidate = out + 1;
+    for (int type = 0; type < 5; type++) {
+        kernels->filter(candidate, row, previous, 0, rowBytes, type);
+        uint64_t cost = kernels->cost(candidate, rowBytes);
+        if (cost < bestCost) {
+            unsigned char* spare = best ? best : scratch;
+            bestCost  = cost;
+            out[0]    = (unsigned char)type;
+            best      = candidate;
+            candidate = spare;
+        }
+    }
+    if (best != out + 1) {
+        memcpy(out + 1, best, rowBytes);
+    }
+}
+
+/**
+ * Creates a PNG file and writes its header; rows follow with
+ * pngStreamWriteRows.
+ *
+ * @param png      Stream to open.
+ * @param filename Output file, or NULL to only measure the encoded size
+ *                 (fileBytes).
+ * @param width    Image width.
+ * @param height   Image height.
+ * @param options  Deflate level, compression threads per batch of rows and
+ *                 filter mode.
+ * @return true on success, false otherwise.
+ */
+bool pngStreamOpen(PngStream* png, const char* filename, int width, int height,
+                   const PngOptions* options) {
+    int level   = options->level;
+    int threads = options->threads;
+    memset(png, 0, sizeof(*png));
+    png->width    = width;
+    png->height   = height;
+    png->rowBytes = (size_t)width * 4;
+    png->level    = level;
+    png->threads  = threads < 1                 ? 1
+                    : threads > PNG_MAX_THREADS ? PNG_MAX_THREADS
+                                                : threads;
+    png->filter   = options->filter;
+    png->adler    = 1;
+
+    png->previousRow = (unsigned char*)calloc(png->rowBytes, 1);
+    png->filtered    = (unsigned char*)malloc(png->rowBytes + 1);
+    png->scratch     = (unsigned char*)malloc(png->rowBytes);
+    if (png->threads > 1) {
+        png->dictionary = (unsigned char*)malloc(DEFLATE_WINDOW);
+    } else {
+        png->deflater = deflaterCreate(level, false, pngStreamCollect, png);
+    }
+    if (!png->previousRow || !png->filtered || !png->scratch ||
+        (png->threads > 1 ? !png->dictionary : !png->deflater)) {
+        log_and_print("Error: Unable to allocate PNG encoder state for %s\n",
+                      filename ? filename : "(memory)");
+        free(png->previousRow);
+        free(png->filtered);
+        free(png->scratch);
+        free(png->dictionary);
+        if (png->deflater) {
+            deflaterDestroy(png->deflater);
+        }
+        return false;
+    }
+
+    png->fp = filename ? fopen(filename, "wb") : NULL;
+    if (filename && !png->fp) {
+        log_and_print("Error: Unable to open %s for writing.\n", filename);
+        free(png->previousRow);
+        free(png->filtered);
+        free(png->scratch);
+        free(png->dictionary);
+        if (png->deflater) {
+            deflaterDestroy(png->deflater);
+        }
+        return false;
+    }
+
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    unsigned char              ihdr[13]     = {
+        (unsigned char)(width >> 24), (unsigned char)(width >> 16),
+        (unsigned char)(width >> 8), (unsigned char)width,
+        (unsigned char)(height >> 24), (unsigned char)(height >> 16),
+        (unsigned char)(height >> 8), (unsigned char)height,
+        8,  // Bit depth
+        6,  // Color type: RGBA
+        0, 0, 0};
+    png->fileBytes = 8;
+    if (png->fp && fwrite(signature, 1, 8, png->fp) != 8) {
+        png->failed = true;
+    }
+    pngWriteChunk(png, "IHDR", ihdr, sizeof(ihdr));
+    if (png->threads > 1) {
+        // The bands are raw deflate streams; the zlib header is written here
+        static const unsigned char zlibHeader[2] = {0x78, 0x9c};
+        pngStreamCollect(png, zlibHeader, 2);
+    }
+    return !png->failed;
+}
+
+/**
+ * One horizontal band of rows compressed by its own thread.
+ */
+typedef struct {
+    const PngStream*     png;
+    const unsigned char* rows;       // First row of the batch
+    ptrdiff_t            stride;
+    int                  firstRow;   // Band start, relative to the batch
+    int                  rowCount;
+    bool                 first;      // First band of the batch
+    DeflateBuffer        output;     // Compressed band
+    uint32_t             adler;      // Adler-32 of the band's filtered data
+    uint64_t             filteredBytes;
+    bool                 failed;
+} PngBand;
+
+/**
+ * Filters the rows of a batch just above the band and stores the last
+ * `capacity` bytes of the result (at most 32 KB) in `dictionary`: the data
+ * the band's stream continues.
+ *
+ * @return Number of bytes stored.
+ */
+static size_t pngBandDictionary(const PngBand* band, unsigned char* dictionary,
+                                size_t capacity, unsigned char* line,
+                                unsigned char* scratch) {
+    const PngStream* png      = band->png;
+    size_t           lineSize = png->rowBytes + 1;
+    int              count    = (int)((capacity + lineSize - 1) / lineSize);
+    if (count > band->firstRow) {
+        count = band->firstRow;
+    }
+
+    size_t length = 0;
+    for (int r = band->firstRow - count; r < band->firstRow; r++) {
+        const unsigned char* row      =
+            band->rows + (ptrdiff_t)r * band->stride;
+        const unsigned char* previous = r > 0 ? row - band->stride
+                                              : png->previousRow;
+        pngFilterChoose(line, row, previous, png->rowBytes, scratch,
+                        png->filter);
+
+        // Keep the trailing `capacity` bytes of the filtered rows
+        if (length + lineSize > capacity) {
+            size_t drop = length + lineSize - capacity;
+            if (drop > length) {
+                drop = length;
+            }
+            memmove(dictionary, dictionary + drop, length - drop);
+            length -= drop;
+        }
+        size_t take = lineSize > capacity ? capacity : lineSize;
+        memcpy(dictionary + length, line + lineSize - take, take);
+        length += take;
+    }
+    return length;
+}
+
+static void* pngBandThreadMain(void* arg) {
+    PngBand*         band     = (PngBand*)arg;
+    const PngStream* png      = band->png;
+    unsigned char*   line     = (unsigned char*)malloc(png->rowBytes + 1);
+    unsigned char*   scratch  = (unsigned char*)malloc(png->rowBytes);
+    unsigned char*   dict     = band->first
+                                    ? NULL
+                                    : (unsigned char*)malloc(DEFLATE_WINDOW);
+    Deflater*        deflater = deflaterCreate(
+        png->level, true, deflateBufferAppend, &band->output);
+    if (!line || !scratch || (!band->first && !dict) || !deflater) {
+        band->failed = true;
+        free(line);
+        free(scratch);
+        free(dict);
+        if (deflater) {
+            deflaterDestroy(deflater);
+        }
+        return NULL;
+    }
+
+    // Continue where the previous band (or the previous batch) leaves off
+    if (band->first) {
+        deflaterSetDictionary(deflater, png->dictionary, png->dictionaryLength);
+    } else {
+        deflaterSetDictionary(
+            deflater, dict,
+            pngBandDictionary(band, dict, DEFLATE_WINDOW, line, scratch));
+    }
+
+    for (int r = band->firstRow; r < band->firstRow + band->rowCount; r++) {
+        const unsigned char* row      =
+            band->rows + (ptrdiff_t)r * band->stride;
+        const unsigned char* previous = r > 0 ? row - band->stride
+                                              : png->previousRow;
+        pngFilterChoose(line, row, previous, png->rowBytes, scratch,
+                        png->filter);
+        deflaterWrite(deflater, line, png->rowBytes + 1);
+    }
+    deflaterSyncFlush(deflater);
+    band->adler         = deflater->adler;
+    band->filteredBytes = deflater->totalIn;
+
+    deflaterDestroy(deflater);
+    free(line);
+    free(scratch);
+    free(dict);
+    return NULL;
+}
+
+/**
+ * Compresses a batch of rows as concurrently deflated bands.
+ */
+static void pngStreamWriteBands(PngStream* png, const unsigned char* rows,
+                                int rowCount, ptrdiff_t stride) {
+    int bandCount = rowCount / PNG_MIN_BAND_ROWS;
+    if (bandCount > png->threads) {
+        bandCount = png->threads;
+    }
+    if (bandCount < 1) {
+        bandCount = 1;
+    }
+
+    PngBand   bands[PNG_MAX_THREADS];
+    pthread_t threads[PNG_MAX_THREADS];
+    bool      started[PNG_MAX_THREADS];
+    memset(bands, 0, sizeof(bands));
+    for (int b = 0; b < bandCount; b++) {
+        bands[b].png      = png;
+        bands[b].rows     = rows;
+        bands[b].stride   = stride;
+        bands[b].firstRow = (int)((int64_t)rowCount * b / bandCount);
+        bands[b].rowCount =
+            (int)((int64_t)rowCount * (b + 1) / bandCount) - bands[b].firstRow;
+        bands[b].first    = (b == 0);
+    }
+
+    // Band 0 is compressed on the calling thread
+    for (int b = 1; b < bandCount; b++) {
+        started[b] = pthread_create(&threads[b], NULL, pngBandThreadMain,
+                                    &bands[b]) == 0;
+    }
+    pngBandThreadMain(&bands[0]);
+    for (int b = 1; b < bandCount; b++) {
+        if (started[b]) {
+            pthread_join(threads[b], NULL);
+        } else {
+            pngBandThreadMain(&bands[b]);
+        }
+    }
+
+    for (int b = 0; b < bandCount; b++) {
+        if (bands[b].failed || bands[b].output.failed) {
+            png->failed = true;
+        } else {
+            pngStreamCollect(png, bands[b].output.data, bands[b].output.size);
+            png->adler = adler32Combine(png->adler, bands[b].adler,
+                                        bands[b].filteredBytes);
+        }
+        free(bands[b].output.data);
+    }
+
+    // The next batch continues after the last 32 KB of filtered data; a short
+    // batch keeps the tail of the previous dictionary in front of its own rows
+    size_t lineSize  = png->rowBytes + 1;
+    size_t batchTail = (size_t)rowCount * lineSize;
+    if (batchTail > DEFLATE_WINDOW) {
+        batchTail = DEFLATE_WINDOW;
+    }
+    size_t keep = DEFLATE_WINDOW - batchTail;
+    if (keep > png->dictionaryLength) {
+        keep = png->dictionaryLength;
+    }
+    memmove(png->dictionary, png->dictionary + png->dictionaryLength - keep,
+            keep);
+
+    PngBand tail  = bands[bandCount - 1];
+    tail.firstRow = rowCount;
+    png->dictionaryLength =
+        keep + pngBandDictionary(&tail, png->dictionary + keep, batchTail,
+                                 png->filtered, png->scratch);
+}
+
+/**
+ * Filters and compresses the next rows of the image, top to bottom.
+ *
+ * @param png      Open stream.
+ * @param rows     First row to write.
+ * @param rowCount Number of rows.
+ * @param stride   Byte offset from one row to the next; negative to walk a
+ *                 bottom-up buffer (such as glReadPixels output) without
+ *                 flipping it.
+ */
+void pngStreamWriteRows(PngStream* png, const unsigned char* rows, int rowCount,
+                        ptrdiff_t stride) {
+    if (rowCount > png->height - png->rowsWritten) {
+        rowCount = png->height - png->rowsWritten;
+    }
+    if (rowCount <= 0) {
+        return;
+    }
+
+    if (png->threads > 1) {
+        pngStreamWriteBands(png, rows, rowCount, stride);
+    } else {
+        for (int r = 0; r < rowCount; r++) {
+            const unsigned char* row      = rows + (ptrdiff_t)r * stride;
+            const unsigned char* previous = r > 0 ? row - stride
+                                                  : png->previousRow;
+            pngFilterChoose(png->filtered, row, previous, png->rowBytes,
+                            png->scratch, png->filter);
+            deflaterWrite(png->deflater, png->filtered, png->rowBytes + 1);
+        }
+    }
+
+    memcpy(png->previousRow, rows + (ptrdiff_t)(rowCount - 1) * stride,
+           png->rowBytes);
+    png->rowsWritten += rowCount;
+}
+
+/**
+ * Flushes the compressor, writes the trailing chunks and closes the file.
+ *
+ * @return true if the complete image was written successfully.
+ */
+bool pngStreamClose(PngStream* png) {
+    if (png->rowsWritten != png->height) {
+        log_and_print("Error: PNG stream closed after %d of %d rows.\n",
+                      png->rowsWritten, png->height);
+        png->failed = true;
+    }
+    if (png->threads > 1) {
+        // An empty final block (fixed Huffman, end-of-block only), then
+        // the Adler-32
+        unsigned char trailer[6] = {
+            0x03, 0x00, (unsigned char)(png->adler >> 24),
+            (unsigned char)(png->adler >> 16), (unsigned char)(png->adler >> 8),
+            (unsigned char)png->adler};
+        pngStreamCollect(png, trailer, sizeof(trailer));
+    } else {
+        deflaterFinish(png->deflater);
+        deflaterDestroy(png->deflater);
+    }
+    if (png->idatCount > 0) {
+        pngWriteChunk(png, "IDAT", png->idat, png->idatCount);
+        png->idatCount = 0;
+    }
+    pngWriteChunk(png, "IEND", NULL, 0);
+    if (png->fp && fclose(png->fp) != 0) {
+        png->failed = true;
+    }
+
+    free(png->previousRow);
+    free(png->filtered);
+    free(png->scratch);
+    free(png->dictionary);
+    return !png->failed;
+}
+
+/**
+ * QOI encoder state (https://qoiformat.org). QOI is a single O(n) pass with
+ * no entropy coding: files are larger than PNGs but encode several times
+ * faster, which suits intermediate frame sequences.
+ */
+typedef struct {
+    FILE*          fp;           // NULL when only measuring the encoded size
+    int            width;
+    uint32_t       index[64];    // Recently seen pixels, by hash
+    unsigned char  previous[4];  // Previous pixel (RGBA)
+    int            run;          // Repeats of the previous pixel not
+                                 // written yet
+    unsigned char* buffer;       // Encoded bytes of the row being written
+    uint64_t       bytes;
+    bool           failed;
+} QoiStream;
+
+/**
+ * Raw dump: the RGBA rows top to bottom, no header.
+ */
+typedef struct {
+    FILE*    fp;
+    uint64_t bytes;
+    bool     failed;
+} RawStream;
+
+typedef struct ImageStream ImageStream;
+
+/**
+ * An image file format for frame files. Every format is written as a stream
+ * of rows, so frames can be encoded from a whole buffer or band by band.
+ */
+typedef struct {
+    const char* extension;  // File extension selecting the format, without
+                            // the dot
+    bool (*open)(ImageStream* image, const char* filename, int width,
+                 int height, const PngOptions* png);
+    void (*writeRows)(ImageStream* image, const unsigned char* rows,
+                      int rowCount, ptrdiff_t stride);
+    bool (*close)(ImageStream* image);
+} ImageFormat;
+
+/**
+ * An image file being written row by row, in any of the frame formats.
+ */
+struct ImageStream {
+    const ImageFormat* format;
+    uint64_t           bytes;  // File size, set by imageStreamClose
+    union {
+        PngStream png;
+        QoiStream qoi;
+        RawStream raw;
+    };
+};
+
+static bool pngImageOpen(ImageStream* image, const char* filename, int width,
+                         int height, const PngOptions* png) {
+    return pngStreamOpen(&image->png, filename, width, height, png);
+}
+
+static void pngImageWriteRows(ImageStream* image, const unsigned char* rows,
+                              int rowCount, ptrdiff_t stride) {
+    pngStreamWriteRows(&image->png, rows, rowCount, stride);
+}
+
+static bool pngImageClose(ImageStream* image) {
+    bool written = pngStreamClose(&image->png);
+    image->bytes = image->png.fileBytes;
+    return written;
+}
+
+static void qoiWrite(QoiStream* qoi, const unsigned char* data, size_t size) {
+    qoi->bytes += size;
+    if (qoi->fp && !qoi->failed && fwrite(data, 1, size, qoi->fp) != size) {
+        qoi->failed = true;
+    }
+}
+
+static bool qoiImageOpen(ImageStream* image, const char* filename, int width,
+                         int height, const PngOptions* png) {
+    (void)png;
+    QoiStream* qoi = &image->qoi;
+    memset(qoi, 0, sizeof(*qoi));
+    qoi->width       = width;
+    qoi->previous[3] = 255;
+    // A row can take up to 5 bytes per pixel, plus a pending run
+    qoi->buffer      = (unsigned char*)malloc((size_t)width * 5 + 1);
+    if (!qoi->buffer) {
+        log_and_print("Error: Unable to allocate QOI encoder state for %s\n",
+                      filename ? filename : "(memory)");
+        return false;
+    }
+    if (filename) {
+        qoi->fp = fopen(filename, "wb");
+        if (!qoi->fp) {
+            log_and_print("Error: Unable to open %s for writing.\n", filename);
+            free(qoi->buffer);
+            return false;
+        }
+    }
+
+    unsigned char header[14] = {
+        'q', 'o', 'i', 'f',
+        (unsigned char)(width >> 24), (unsigned char)(width >> 16),
+        (unsigned char)(width >> 8), (unsigned char)width,
+        (unsigned char)(height >> 24), (unsigned char)(height >> 16),
+        (unsigned char)(height >> 8), (unsigned char)height,
+        4,  // RGBA
+        0}; // sRGB with linear alpha
+    qoiWrite(qoi, header, sizeof(header));
+    return !qoi->failed;
+}
+
+static void qoiImageWriteRows(ImageStream* image, const unsigned char* rows,
+                              int rowCount, ptrdiff_t stride) {
+    QoiStream* qoi = &image->qoi;
+    uint32_t   previous;
+    memcpy(&previous, qoi->previous, 4);
+
+    for (int row = 0; row < rowCount; row++) {
+        const unsigned char* px  = rows + (ptrdiff_t)row * stride;
+        unsigned char*       out = qoi->buffer;
+        for (int x = 0; x < qoi->width; x++, px += 4) {
+            uint32_t pixel;
+            memcpy(&pixel, px, 4);
+            if (pixel == previous) {
+                if (++qoi->run == 62) {
+                    *out++   = (unsigned char)(0xc0 | 61);  // QOI_OP_RUN
+                    qoi->run = 0;
+                }
+                continue;
+            }
+            if (qoi->run > 0) {
+                *out++   = (unsigned char)(0xc0 | (qoi->run - 1));
+                qoi->run = 0;
+            }
+
+            int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) & 63;
+            if (qoi->index[hash] == pixel) {
+                *out++ = (unsigned char)hash;  // QOI_OP_INDEX
+            } else {
+                qoi->index[hash] = pixel;
+                if (px[3] == qoi->previous[3]) {
+                    signed char dr  = (signed char)(px[0] - qoi->previous[0]);
+                    signed char dg  = (signed char)(px[1] - qoi->previous[1]);
+                    signed char db  = (signed char)(px[2] - qoi->previous[2]);
+                    signed char dgr = (signed char)(dr - dg);
+                    signed char dgb = (signed char)(db - dg);
+                    if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 &&
+                        db >= -2 && db <= 1) {
+                        // QOI_OP_DIFF
+                        *out++ = (unsigned char)(0x40 | ((dr + 2) << 4) |
+                                                 ((dg + 2) << 2) | (db + 2));
+                    } else if (dgr >= -8 && dgr <= 7 && dg >= -32 && dg <= 31 &&
+                               dgb >= -8 && dgb <= 7) {
+                        // QOI_OP_LUMA
+                        *out++ = (unsigned char)(0x80 | (dg + 32));
+                        *out++ = (unsigned char)(((dgr + 8) << 4) | (dgb + 8));
+                    } else {
+                        *out++ = 0xfe;  // QOI_OP_RGB
+                        *out++ = px[0];
+                        *out++ = px[1];
+                        *out++ = px[2];
+                    }
+                } else {
+                    *out++ = 0xff;  // QOI_OP_RGBA
+                    memcpy(out, px, 4);
+                    out += 4;
+                }
+            }
+            previous = pixel;
+            memcpy(qoi->previous, px, 4);
+        }
+        qoiWrite(qoi, qoi->buffer, (size_t)(out - qoi->buffer));
+    }
+}
+
+static bool qoiImageClose(ImageStream* image) {
+    static const unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    QoiStream*                 qoi    = &image->qoi;
+    if (qoi->run > 0) {
+        unsigned char op = (unsigned char)(0xc0 | (qoi->run - 1));
+        qoiWrite(qoi, &op, 1);
+    }
+    qoiWrite(qoi, end, sizeof(end));
+    if (qoi->fp && fclose(qoi->fp) != 0) {
+        qoi->failed = true;
+    }
+    free(qoi->buffer);
+    image->bytes = qoi->bytes;
+    return !qoi->failed;
+}
+
+static bool rawImageOpen(ImageStream* image, const char* filename, int width,
+                         int height, const PngOptions* png) {
+    (void)width;
+    (void)height;
+    (void)png;
+    RawStream* raw = &image->raw;
+    memset(raw, 0, sizeof(*raw));
+    if (filename) {
+        raw->fp = fopen(filename, "wb");
+        if (!raw->fp) {
+            log_and_print("Error: Unable to open %s for writing.\n", filename);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void rawImageWriteRows(ImageStream* image, const unsigned char* rows,
+                              int rowCount, ptrdiff_t stride) {
+    RawStream* raw      = &image->raw;
+    size_t     rowBytes = (size_t)(stride < 0 ? -stride : stride);
+    raw->bytes         += rowBytes * (size_t)rowCount;
+    if (!raw->fp || raw->failed) {
+        return;
+    }
+    if (stride > 0) {
+        // Top-down rows are already in file order
+        if (fwrite(rows, rowBytes, (size_t)rowCount,
+                   raw->fp) != (size_t)rowCount) {
+            raw->failed = true;
+        }
+        return;
+    }
+    for (int row = 0; row < rowCount; row++) {
+        if (fwrite(rows + (ptrdiff_t)row * stride, 1, rowBytes,
+                   raw->fp) != rowBytes) {
+            raw->failed = true;
+            return;
+        }
+    }
+}
+
+static bool rawImageClose(ImageStream* image) {
+    RawStream* raw = &image->raw;
+    if (raw->fp && fclose(raw->fp) != 0) {
+        raw->failed = true;
+    }
+    image->bytes = raw->bytes;
+    return !raw->failed;
+}
+
+static const ImageFormat g_imageFormats[] = {
+    {"png", pngImageOpen, pngImageWriteRows, pngImageClose},
+    {"qoi", qoiImageOpen, qoiImageWriteRows, qoiImageClose},
+    {"rgba", rawImageOpen, rawImageWriteRows, rawImageClose},
+};
+
+/**
+ * Looks up a frame format by file extension (without the dot).
+ *
+ * @return The format, or NULL if the extension is not supported.
+ */
+const ImageFormat* imageFormatByExtension(const char* extension) {
+    for (size_t i = 0; i < sizeof(g_imageFormats) / sizeof(g_imageFormats[0]);
+         i++) {
+        if (strcmp(extension, g_imageFormats[i].extension) == 0) {
+            return &g_imageFormats[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Looks up the frame format of a file from its extension.
+ */
+const ImageFormat* imageFormatForFile(const char* filename) {
+    const char* dot = strrchr(filename, '.');
+    return dot ? imageFormatByExtension(dot + 1) : NULL;
+}
+
+/**
+ * Creates an image file whose format follows from the extension of
+ * `filename`; rows follow with imageStreamWriteRows.
+ *
+ * @param image    Stream to open.
+ * @param filename Output file.
+ * @param width    Image width.
+ * @param height   Image height.
+ * @param png      Settings of the PNG format.
+ * @return true on success, false otherwise.
+ */
+bool imageStreamOpen(ImageStream* image, const char* filename, int width,
+                     int height, const PngOptions* png) {
+    image->format = imageFormatForFile(filename);
+    image->bytes  = 0;
+    if (!image->format) {
+        log_and_print("Error: No image format for %s.\n", filename);
+        return false;
+    }
+    return image->format->open(image, filename, width, height, png);
+}
+
+/**
+ * Appends rows, top to bottom, to an image being written.
+ *
+ * @param rows     First (topmost) row.
+ * @param rowCount Number of rows.
+ * @param stride   Byte offset from one row to the next (negative for
+ *                 bottom-up buffers).
+ */
+void imageStreamWriteRows(ImageStream* image, const unsigned char* rows,
+                          int rowCount, ptrdiff_t stride) {
+    image->format->writeRows(image, rows, rowCount, stride);
+}
+
+/**
+ * Finishes the file and releases the stream.
+ *
+ * @return true if the complete image was written successfully.
+ */
+bool imageStreamClose(ImageStream* image) {
+    return image->format->close(image);
+}
+
+/**
+ * stb_image_write callback appending encoded bytes to a FILE*.
+ */
+static void writeToFile(void* context, void* data, int size) {
+    fwrite(data, 1, (size_t)size, (FILE*)context);
+}
+
+/**
+ * Saves a bottom-up RGBA image in the format given by the file extension
+ * (png, qoi or rgba). Rows are fed to the encoder bottom to top, so no
+ * flipped copy is made. Safe to call from any thread.
+ *
+ * @param filename Output filename (e.g., "frames/frame_00000.png").
+ * @param pixels   RGBA pixel data as returned by glReadPixels (bottom
+ *                 row first).
+ * @param width    Image width.
+ * @param height   Image height.
+ * @param options  How PNG files are encoded.
+ * @return true if the file was written successfully.
+ */
+bool writeFrame(const char* filename, const unsigned char* pixels, int width,
+                int height, const PngOptions* options) {
+    // Start at the top row and walk the buffer backwards, because OpenGL's
+    // origin is at the lower left.
+    ptrdiff_t            stride = (ptrdiff_t)width * 4;
+    const unsigned char* top    =
+        pixels + (size_t)(height - 1) * (size_t)stride;
+    const ImageFormat*   format = imageFormatForFile(filename);
+    bool                 written;
+
+    if (format == imageFormatByExtension("png") &&
+        options->writer == PNG_WRITER_STB) {
+        FILE* fp = fopen(filename, "wb");
+        if (!fp) {
+            log_and_print("Error: Unable to open %s for writing.\n", filename);
+            return false;
+        }
+        written = stbi_write_png_to_func(writeToFile, fp, width, height, 4, top,
+                                         -(int)stride) != 0;
+        if (fclose(fp) != 0) {
+            written = false;
+        }
+    } else {
+        ImageStream image;
+        if (!imageStreamOpen(&image, filename, width, height, options)) {
+            return false;
+        }
+        imageStreamWriteRows(&image, top, height, -stride);
+        written = imageStreamClose(&image);
+    }
+
+    if (!written) {
+        log_and_print("Error: Failed to write frame file: %s\n", filename);
+    } else {
+        log_and_print("Saved frame to: %s\n", filename);
+    }
+    return written;
+}
+
+/**
+ * stb_image_write callback that only counts the encoded bytes.
+ */
+static void countBytes(void* context, void* data, int size) {
+    (void)data;
+    *(uint64_t*)context += (uint64_t)size;
+}
+
+/**
+ * Encodes a frame in memory with the given options and reports the best of
+ * `repeats` runs.
+ *
+ * @param pixels  Bottom-up RGBA image.
+ * @param width   Image width.
+ * @param height  Image height.
+ * @param options Encoder settings.
+ * @param repeats Number of runs.
+ * @param bytes   Receives the encoded size.
+ * @return Fastest encode time in seconds.
+ */
+static double benchmarkPngEncode(const unsigned char* pixels, int width,
+                                 int height, const PngOptions* options,
+                                 int repeats, uint64_t* bytes) {
+    ptrdiff_t            stride = (ptrdiff_t)width * 4;
+    const unsigned char* top    =
+        pixels + (size_t)(height - 1) * (size_t)stride;
+    double               best   = 1e30;
+    for (int r = 0; r < repeats; r++) {
+        double start = nowSeconds();
+        if (options->writer == PNG_WRITER_STREAM) {
+            PngStream png;
+            if (!pngStreamOpen(&png, NULL, width, height, options)) {
+                return 0.0;
+            }
+            pngStreamWriteRows(&png, top, height, -stride);
+            pngStreamClose(&png);
+            *bytes = png.fileBytes;
+        } else {
+            *bytes = 0;
+            stbi_write_force_png_filter = options->filter <= PNG_FILTER_PAETH
+                                              ? (int)options->filter
+                                              : -1;
+            stbi_write_png_to_func(countBytes, bytes, width, height, 4, top,
+                                   -(int)stride);
+        }
+        double elapsed = nowSeconds() - start;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+/**
+ * Compares PNG filter kernels and encoder settings on one rendered frame:
+ * filter throughput for each instruction set, then file size against encode
+ * time for each writer, filter mode and deflate level.
+ *
+ * @param pixels  Bottom-up RGBA image.
+ * @param width   Image width.
+ * @param height  Image height.
+ * @param options Current settings (the thread count is kept for the
+ *                streaming writer).
+ */
+void runPngBenchmark(const unsigned char* pixels, int width, int height,
+                     const PngOptions* options) {
+    const int    repeats  = 3;
+    size_t       rowBytes = (size_t)width * 4;
+    double       rawBytes = (double)rowBytes * height;
+    double       mpix     = (double)width * height / 1e6;
+    unsigned char* out    = (unsigned char*)malloc(rowBytes);
+    unsigned char* zeros  = (unsigned char*)calloc(rowBytes, 1);
+    if (!out || !zeros) {
+        free(out);
+        free(zeros);
+        log_and_print("Error: Unable to allocate benchmark buffers.\n");
+        return;
+    }
+
+    log_and_print("PNG benchmark on a %d x %d frame (%.1f MB raw).\n", width,
+                  height, rawBytes / 1e6);
+    log_and_print("Filter kernels (GB/s):\n");
+    log_and_print("  %-8s %8s %8s %8s %8s %8s\n", "kernels", "sub", "up",
+                  "average", "paeth", "cost");
+    PngKernels kernels[3];
+    int        kernelCount = pngAvailableKernels(kernels);
+    for (int k = 0; k < kernelCount; k++) {
+        double            rates[5];
+        volatile uint64_t sink = 0;  // Keeps the cost loop from being
+                                     // optimised away
+        for (int type = 1; type <= 5; type++) {
+            double best = 1e30;
+            for (int r = 0; r < repeats; r++) {
+                double start = nowSeconds();
+                for (int y = 0; y < height; y++) {
+                    const unsigned char* row      =
+                        pixels + (size_t)y * rowBytes;
+                    const unsigned char* previous = y > 0 ? row - rowBytes
+                                                          : zeros;
+                    if (type == 5) {
+                        sink += kernels[k].cost(row, rowBytes);
+                    } else {
+                        kernels[k].filter(out, row, previous, 0, rowBytes,
+                                          type);
+                    }
+                }
+                double elapsed = nowSeconds() - start;
+                if (elapsed < best) {
+                    best = elapsed;
+                }
+            }
+            rates[type - 1] = rawBytes / best / 1e9;
+        }
+        log_and_print("  %-8s %8.2f %8.2f %8.2f %8.2f %8.2f\n", kernels[k].name,
+                      rates[0], rates[1], rates[2], rates[3], rates[4]);
+    }
+
+    static const PngFilterMode streamFilters[] = {
+        PNG_FILTER_ADAPTIVE, PNG_FILTER_SAMPLED, PNG_FILTER_SUB, PNG_FILTER_UP,
+        PNG_FILTER_PAETH};
+    static const int           streamLevels[]  = {1, 6, 9};
+
+    log_and_print("Encoders (best of %d, %s kernels, %d thread(s) per image "
+                  "for stream):\n", repeats, pngKernels()->name,
+                  options->threads);
+    log_and_print("  %-7s %-11s %5s %12s %7s %9s %8s\n", "writer", "filter",
+                  "level", "bytes", "ratio", "ms", "MPix/s");
+    for (int f = PNG_FILTER_NONE; f <= PNG_FILTER_ADAPTIVE; f++) {
+        PngOptions stb   = {PNG_WRITER_STB, stbi_write_png_compression_level, 1,
+                            (PngFilterMode)f};
+        uint64_t   bytes = 0;
+        double     time  = benchmarkPngEncode(pixels, width, height, &stb,
+                                              repeats, &bytes);
+        log_and_print("  %-7s %-9s %5d %12llu %6.1f%% %9.1f %8.1f\n", "stb",
+                      g_pngFilterNames[f], stb.level, (unsigned long long)bytes,
+                      100.0 * bytes / rawBytes, time * 1e3, mpix / time);
+    }
+    stbi_write_force_png_filter = options->filter <= PNG_FILTER_PAETH
+                                      ? (int)options->filter
+                                      : -1;
+
+    for (size_t f = 0; f < sizeof(streamFilters) / sizeof(streamFilters[0]);
+         f++) {
+        for (size_t l = 0; l < sizeof(streamLevels) / sizeof(streamLevels[0]);
+             l++) {
+            PngOptions stream = {PNG_WRITER_STREAM, streamLevels[l],
+                                 options->threads, streamFilters[f]};
+            uint64_t   bytes  = 0;
+            double     time   = benchmarkPngEncode(pixels, width, height,
+                                                   &stream, repeats, &bytes);
+            log_and_print("  %-7s %-9s %5d %12llu %6.1f%% %9.1f %8.1f\n",
+                          "stream", g_pngFilterNames[streamFilters[f]],
+                          stream.level, (unsigned long long)bytes,
+                          100.0 * bytes / rawBytes, time * 1e3, mpix / time);
+        }
+    }
+
+    free(out);
+    free(zeros);
+}
+
+/**
+ * Compares the frame file formats on one rendered frame: size and encode
+ * throughput of PNG (stb and streaming writers, at the current settings),
+ * QOI and raw RGBA. Nothing is written to disk; since the raw writer only
+ * hands rows to stdio, its row times the equivalent copy into memory.
+ *
+ * @param pixels  Bottom-up RGBA image.
+ * @param width   Image width.
+ * @param height  Image height.
+ * @param options Current PNG settings.
+ */
+void runFormatBenchmark(const unsigned char* pixels, int width, int height,
+                        const PngOptions* options) {
+    const int  repeats  = 3;
+    ptrdiff_t  stride   = (ptrdiff_t)width * 4;
+    double     rawBytes = (double)stride * height;
+    double     mpix     = (double)width * height / 1e6;
+    PngOptions stb      = *options;
+    PngOptions stream   = *options;
+    stb.writer          = PNG_WRITER_STB;
+    stream.writer       = PNG_WRITER_STREAM;
+
+    unsigned char* copy = (unsigned char*)malloc((size_t)rawBytes);
+    if (!copy) {
+        log_and_print("Error: Unable to allocate benchmark buffers.\n");
+        return;
+    }
+
+    log_and_print("Frame format benchmark on a %d x %d frame (best of %d, PNG "
+                  "level %d, %s filter).\n", width, height, repeats,
+                  options->level, g_pngFilterNames[options->filter]);
+    log_and_print("  %-10s %12s %7s %9s %8s\n", "format", "bytes", "ratio",
+                  "ms", "MPix/s");
+    for (int f = 0; f < 4; f++) {
+        static const char* names[] = {"png-stb", "png-stream", "qoi", "rgba"};
+        uint64_t           bytes   = 0;
+        double             time;
+        if (f < 2) {
+            time = benchmarkPngEncode(pixels, width, height,
+                                      f == 0 ? &stb : &stream, repeats, &bytes);
+        } else {
+            const ImageFormat*   format = imageFormatByExtension(
+                f == 2 ? "qoi" : "rgba");
+            const unsigned char* top    =
+                pixels + (size_t)(height - 1) * (size_t)stride;
+            time                        = 1e30;
+            for (int r = 0; r < repeats; r++) {
+                ImageStream image;
+                image.format = format;
+                double start = nowSeconds();
+                if (!format->open(&image, NULL, width, height, options)) {
+                    free(copy);
+                    return;
+                }
+                format->writeRows(&image, top, height, -stride);
+                format->close(&image);
+                if (f == 3) {
+                    for (int y = 0; y < height; y++) {
+                        memcpy(copy + (size_t)y * stride,
+                               top - (ptrdiff_t)y * stride, (size_t)stride);
+                    }
+                }
+                double elapsed = nowSeconds() - start;
+                if (elapsed < time) {
+                    time = elapsed;
+                }
+                bytes = image.bytes;
+            }
+        }
+        log_and_print("  %-10s %12llu %6.1f%% %9.1f %8.1f\n", names[f],
+                      (unsigned long long)bytes, 100.0 * bytes / rawBytes,
+                      time * 1e3, mpix / time);
+    }
+    free(copy);
+}
+
+/**
+ * Measures the pixel format conversion of the encoder pipeline: every
+ * kernel set this CPU can run, on synthetic bottom-up RGBA frames of common
+ * video sizes, with the speedup over the scalar kernels and a check that the
+ * output matches theirs byte for byte. The frame hash of the deduplicating
+ * sinks is timed on the same frames.
+ *
+ * @param fullRange Measure full-range instead of limited-range YUV.
+ */
+void runPixelBenchmark(bool fullRange) {
+    static const int sizes[][2] = {{1920, 1080}, {2560, 1440}, {3840, 2160}};
+    const int        repeats    = 5;
+    PixelKernels     kernels[3];
+    int              kernelCount = pixelAvailableKernels(kernels);
+    YuvMatrix        m           = yuvMatrix(fullRange);
+
+    log_and_print("Pixel format benchmark (best of %d, %s range YUV).\n",
+                  repeats, fullRange ? "full" : "limited");
+    log_and_print("  %-11s %-8s %-7s %9s %8s %8s %s\n", "size", "format",
+                  "kernels", "ms", "MPix/s", "speedup", "matches");
+    for (int s = 0; s < 3; s++) {
+        int            width  = sizes[s][0];
+        int            height = sizes[s][1];
+        size_t         bytes  = (size_t)width * height * 4;
+        unsigned char* pixels = (unsigned char*)malloc(bytes);
+        unsigned char* out    = (unsigned char*)malloc(bytes);
+        unsigned char* ref    = (unsigned char*)malloc(bytes);
+        if (!pixels || !out || !ref) {
+            log_and_print("Error: Unable to allocate benchmark buffers.\n");
+            free(pixels);
+            free(out);
+            free(ref);
+            return;
+        }
+        uint32_t state = 0x9e3779b9u;
+        for (size_t i = 0; i < bytes; i++) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            pixels[i] = (unsigned char)state;
+        }
+
+        double mpix = (double)width * height / 1e6;
+        for (int f = PIXEL_RGBA; f <= PIXEL_YUV420P; f++) {
+            size_t frameBytes = pixelFormatFrameBytes((PixelFormat)f, width,
+                                                      height);
+            double scalarTime = 0.0;
+            for (int k = 0; k < kernelCount; k++) {
+                double time = 1e30;
+                for (int r = 0; r < repeats; r++) {
+                    double start = nowSeconds();
+                    convertPixels(&kernels[k], (PixelFormat)f, &m, pixels,
+                                  width, height, k == 0 ? ref : out);
+                    double elapsed = nowSeconds() - start;
+                    if (elapsed < time) {
+                        time = elapsed;
+                    }
+                }
+                if (k == 0) {
+                    scalarTime = time;
+                }
+                char sizeName[16];
+                snprintf(sizeName, sizeof(sizeName), "%dx%d", width, height);
+                log_and_print("  %-11s %-8s %-7s %9.2f %8.1f %7.2fx %s\n",
+                              sizeName, g_pixelFormatNames[f], kernels[k].name,
+                              time * 1e3, mpix / time, scalarTime / time,
+                              k == 0 ? "-" : memcmp(ref, out, frameBytes) == 0
+                                  ? "yes"
+                                  : "NO");
+            }
+        }
+
+        // Frame hashing of the deduplicating sinks, on the same frames
+        FrameHashKernels hashKernels[3];
+        int              hashKernelCount = frameHashAvailableKernels(
+            hashKernels);
+        double           scalarTime      = 0.0;
+        uint64_t         scalarHash      = 0;
+        for (int k = 0; k < hashKernelCount; k++) {
+            double   time = 1e30;
+            uint64_t hash = 0;
+            for (int r = 0; r < repeats; r++) {
+                double start   = nowSeconds();
+                hash           = frameHash(&hashKernels[k], pixels, bytes);
+                double elapsed = nowSeconds() - start;
+                if (elapsed < time) {
+                    time = elapsed;
+                }
+            }
+            if (k == 0) {
+                scalarTime = time;
+                scalarHash = hash;
+            }
+            char sizeName[16];
+            snprintf(sizeName, sizeof(sizeName), "%dx%d", width, height);
+            log_and_print("  %-11s %-8s %-7s %9.2f %8.1f %7.2fx %s\n", sizeName,
+                          "hash", hashKernels[k].name, time * 1e3, mpix / time,
+                          scalarTime / time,
+                          k == 0 ? "-" : hash == scalarHash ? "yes" : "NO");
+        }
+        free(pixels);
+        free(out);
+        free(ref);
+    }
+}
+
+#ifdef STBIW_BUILTIN_DEFLATE
+#define STB_DEFLATE_BACKEND "builtin"
+#else
+#define STB_DEFLATE_BACKEND "bundled"
+#endif
+
+/**
+ * DeflateWriteFunc that only counts the compressed bytes.
+ */
+static void countDeflateBytes(void* context, const unsigned char* data,
+                              size_t size) {
+    (void)data;
+    *(uint64_t*)context += size;
+}
+
+/**
+ * Compares deflate levels on captured frames. The frames are PNG-filtered
+ * (adaptive) first, so the input is what the PNG writers actually compress.
+ * The bundled deflater is measured at every level, then stbi_zlib_compress at
+ * the current level: with a -DSTBIW_BUILTIN_DEFLATE build that is stb's own
+ * compressor, which gives the comparison. Checksum throughput is reported too.
+ *
+ * @param frames     `frameCount` consecutive bottom-up RGBA images.
+ * @param frameCount Number of frames.
+ * @param width      Image width.
+ * @param height     Image height.
+ * @param options    Current settings (level used for the stb row).
+ */
+void runDeflateBenchmark(const unsigned char* frames, int frameCount, int width,
+                         int height, const PngOptions* options) {
+    size_t         rowBytes     = (size_t)width * 4;
+    size_t         filteredSize = (rowBytes + 1) * (size_t)height;
+    unsigned char* filtered     = (unsigned char*)malloc(
+        filteredSize * frameCount);
+    unsigned char* scratch      = (unsigned char*)malloc(rowBytes);
+    unsigned char* zeros        = (unsigned char*)calloc(rowBytes, 1);
+    if (!filtered || !scratch || !zeros) {
+        free(filtered);
+        free(scratch);
+        free(zeros);
+        log_and_print("Error: Unable to allocate benchmark buffers.\n");
+        return;
+    }
+    for (int f = 0; f < frameCount; f++) {
+        const unsigned char* frame = frames + rowBytes * height * f;
+        for (int y = 0; y < height; y++) {
+            // PNG rows go top-down
+            const unsigned char* row      =
+                frame + (size_t)(height - 1 - y) * rowBytes;
+            const unsigned char* previous = y > 0 ? row + rowBytes : zeros;
+            pngFilterChoose(filtered + filteredSize * f + (rowBytes + 1) * y,
+                            row, previous, rowBytes, scratch,
+                            PNG_FILTER_ADAPTIVE);
+        }
+    }
+
+    double totalBytes = (double)filteredSize * frameCount;
+    log_and_print(
+        "Deflate benchmark on %d filtered %d x %d frames (%.1f MB).\n",
+        frameCount, width, height, totalBytes / 1e6);
+
+    double   start = nowSeconds();
+    uint32_t adler = adler32Update(1, filtered, (size_t)totalBytes);
+    double   adlerTime = nowSeconds() - start;
+    start              = nowSeconds();
+    uint32_t crc       = crc32Update(0, filtered, (size_t)totalBytes);
+    double   crcTime   = nowSeconds() - start;
+    log_and_print(
+        "Checksums: Adler-32 %.2f GB/s, CRC-32 %.2f GB/s (%08x %08x).\n",
+        totalBytes / adlerTime / 1e9, totalBytes / crcTime / 1e9, adler, crc);
+
+    log_and_print("  %-11s %5s %12s %7s %9s %9s\n", "backend", "level", "bytes",
+                  "ratio", "ms/frame", "MB/s");
+    for (int level = 1; level <= 10; level++) {
+        uint64_t bytes = 0;
+        start          = nowSeconds();
+        for (int f = 0; f < frameCount; f++) {
+            unsigned char* input = filtered + filteredSize * f;
+            if (level <= 9) {
+                Deflater* deflater = deflaterCreate(level, false,
+                                                    countDeflateBytes, &bytes);
+                if (!deflater) {
+                    break;
+                }
+                deflaterWrite(deflater, input, filteredSize);
+                deflaterFinish(deflater);
+                deflaterDestroy(deflater);
+            } else {
+                int            length     = 0;
+                unsigned char* compressed = stbi_zlib_compress(
+                    input, (int)filteredSize, &length, options->level);
+                bytes                    += (uint64_t)length;
+                free(compressed);
+            }
+        }
+        double elapsed = nowSeconds() - start;
+        log_and_print("  %-11s %5d %12llu %6.1f%% %9.1f %9.1f\n",
+                      level <= 9 ? "bundled" : "stb:" STB_DEFLATE_BACKEND,
+                      level <= 9 ? level : options->level,
+                      (unsigned long long)bytes, 100.0 * bytes / totalBytes,
+                      elapsed * 1e3 / frameCount, totalBytes / elapsed / 1e6);
+    }
+
+    free(filtered);
+    free(scratch);
+    free(zeros);
+}
+
+/**
+ * Append-only record of the frame files a recording has finished, kept as
+ * `<folder>.journal` next to the frames folder so an interrupted recording
+ * can be resumed (--resume). The first line identifies the job; every other
+ * line is a frame file written completely, with its size and content hash,
+ *
+ *     frame_00042.png 183220 9f0c2a1e4d5b6c7a
+ *
+ * a frame the deduplicating sinks folded into the one before it,
+ *
+ *     repeat 43
+ *
+ * or the pixel hash of a distinct frame of a deduplicating sink, which lets a
+ * resumed run tell whether its first frame repeats the last one already done,
+ *
+ *     hash 42 3c5e0f9a81d27b64
+ *
+ * Lines are flushed as they are written and the last entry for a frame wins.
+ * A line torn by a crash has no newline: it is ignored, and cut off before a
+ * resumed run appends to the journal.
+ */
+typedef struct {
+    FILE*           file;
+    pthread_mutex_t lock;
+    char            path[512];
+    bool            failed;  // An entry could not be written; later runs redo
+                             // the frames after it
+} FrameJournal;
+
+/**
+ * Reads a whole file and hashes it with frameHash.
+ *
+ * @return true if the file could be read.
+ */
+static bool hashFrameFile(const char* path, uint64_t* size, uint64_t* hash) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    bool           ok    = fseek(file, 0, SEEK_END) == 0;
+    long           bytes = ok ? ftell(file) : -1;
+    unsigned char* data  =
+        bytes >= 0 ? (unsigned char*)malloc(bytes > 0 ? (size_t)bytes : 1)
+                   : NULL;
+    ok = data && fseek(file, 0, SEEK_SET) == 0 &&
+         fread(data, 1, (size_t)bytes, file) == (size_t)bytes;
+    fclose(file);
+    if (ok) {
+        *size = (uint64_t)bytes;
+        *hash = frameHash(frameHashKernels(), data, (size_t)bytes);
+    }
+    free(data);
+    return ok;
+}
+
+/**
+ * Finds the frames an earlier run of the same recording finished: every
+ * frame file in the journal is read back and must still have the recorded
+ * size and hash. A repeat only counts if the frames before it, back to the
+ * distinct frame it repeats, count too.
+ *
+ * @param path       Journal file.
+ * @param header     First line identifying the recording.
+ * @param folder     Frames folder.
+ * @param repeats    Whether repeats count (the sink deduplicates).
+ * @param frameCount Frames in the recording.
+ * @param done       Receives, per frame, 1 for a verified frame file, 2 for
+ *                   a repeat and 0 for a frame still to render.
+ * @param hashes     Receives, per frame, the journaled pixel hash, or 0 if
+ *                   there is none; NULL when not needed.
+ * @return Number of finished frames, or -1 if there is no journal for this
+ *         recording.
+ */
+long frameJournalResume(const char* path, const char* header,
+                        const char* folder, bool repeats, long frameCount,
+                        unsigned char* done, uint64_t* hashes) {
+    memset(done, 0, (size_t)frameCount);
+    if (hashes) {
+        memset(hashes, 0, (size_t)frameCount * sizeof(uint64_t));
+    }
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        log_and_print("No journal at %s; starting from the first frame.\n",
+                      path);
+        return -1;
+    }
+    char line[1024];
+    if (!fgets(line, sizeof(line), file) ||
+        strncmp(line, header, strlen(header)) != 0 ||
+        line[strlen(header)] != '\n') {
+        log_and_print(
+            "Warning: %s belongs to a different recording; starting over.\n",
+            path);
+        fclose(file);
+        return -1;
+    }
+
+    bool continued = false;  // The chunk read is the rest of a line too long to
+                             // be an entry
+    while (fgets(line, sizeof(line), file)) {
+        size_t length   = strlen(line);
+        bool   complete = length > 0 && line[length - 1] == '\n';
+        bool   skip     = continued || !complete;
+        continued       = !complete;
+        if (skip) {
+            continue;
+        }
+        char               name[512];
+        unsigned long long size, hash;
+        int                index;
+        if (sscanf(line, "repeat %d", &index) == 1) {
+            if (index >= 0 && index < frameCount) {
+                done[index] = repeats ? 2 : 0;
+            }
+        } else if (sscanf(line, "hash %d %llx", &index, &hash) == 2) {
+            if (hashes && index >= 0 && index < frameCount) {
+                hashes[index] = hash;
+            }
+        } else if (sscanf(line, "%511s %llu %llx", name, &size, &hash) == 3 &&
+                   sscanf(name, "frame_%d.", &index) == 1 && index >= 0 &&
+                   index < frameCount) {
+            char     filePath[1024];
+            uint64_t actualSize, actualHash;
+            snprintf(filePath, sizeof(filePath), "%s/%s", folder, name);
+            bool verified = hashFrameFile(filePath, &actualSize, &actualHash) &&
+                            actualSize == size && actualHash == hash;
+            done[index] = verified ? 1 : 0;
+        }
+    }
+    fclose(file);
+
+    long count    = 0;
+    bool chainOk  = false;  // Frames since the last distinct frame are
+                            // all finished
+    for (long i = 0; i < frameCount; i++) {
+        if (done[i] == 2 && !chainOk) {
+            done[i] = 0;
+        }
+        chainOk = done[i] != 0;
+        count += chainOk ? 1 : 0;
+    }
+    return count;
+}
+
+/**
+ * Cuts a journal opened for update back to its last complete line, so an
+ * entry torn by a crash is not glued to the next one, and leaves the file
+ * positioned there.
+ *
+ * @return true on success, false otherwise.
+ */
+static bool frameJournalTrimTornLine(FILE* file) {
+    long offset   = 0;
+    long complete = 0;  // Offset just past the last newline
+    int  c;
+    while ((c = fgetc(file)) != EOF) {
+        offset++;
+        if (c == '\n') {
+            complete = offset;
+        }
+    }
+    if (ferror(file)) {
+        return false;
+    }
+    if (complete < offset) {
+        fflush(file);
+#ifdef _WIN32
+        if (_chsize_s(_fileno(file), complete) != 0) {
+            return false;
+        }
+#else
+        if (ftruncate(fileno(file), (off_t)complete) != 0) {
+            return false;
+        }
+#endif
+    }
+    return fseek(file, complete, SEEK_SET) == 0;
+}
+
+/**
+ * Opens the journal for appending entries after its last complete line, or
+ * starts a new one with just the header line.
+ *
+ * @return true on success, false otherwise.
+ */
+bool frameJournalOpen(FrameJournal* journal, const char* path,
+                      const char* header, bool append) {
+    memset(journal, 0, sizeof(*journal));
+    snprintf(journal->path, sizeof(journal->path), "%s", path);
+    journal->file = fopen(path, append ? "rb+" : "w");
+    if (!journal->file) {
+        log_and_print("Error: Unable to open the journal %s.\n", path);
+        return false;
+    }
+    if (append && !frameJournalTrimTornLine(journal->file)) {
+        log_and_print(
+            "Error: Unable to trim a torn entry from the journal %s.\n", path);
+        fclose(journal->file);
+        journal->file = NULL;
+        return false;
+    }
+    if (!append) {
+        fprintf(journal->file, "%s\n", header);
+        fflush(journal->file);
+    }
+    pthread_mutex_init(&journal->lock, NULL);
+    return true;
+}
+
+static void frameJournalAppend(FrameJournal* journal, const char* entry) {
+    pthread_mutex_lock(&journal->lock);
+    if (!journal->failed &&
+        (fputs(entry, journal->file) < 0 || fflush(journal->file) != 0)) {
+        log_and_print("Warning: Unable to write to %s; a resumed run will redo "
+                      "later frames.\n", journal->path);
+        journal->failed = true;
+    }
+    pthread_mutex_unlock(&journal->lock);
+}
+
+/**
+ * Records a frame file that was written completely. The file is read back
+ * (normally from the page cache) and hashed, so the entry describes exactly
+ * what is on disk. Safe to call from any thread.
+ */
+void frameJournalRecord(FrameJournal* journal, const char* filename) {
+    uint64_t size, hash;
+    if (!hashFrameFile(filename, &size, &hash)) {
+        return;
+    }
+    const char* name = strrchr(filename, '/');
+    char        entry[640];
+    snprintf(entry, sizeof(entry), "%s %llu %016llx\n",
+             name ? name + 1 : filename, (unsigned long long)size,
+             (unsigned long long)hash);
+    frameJournalAppend(journal, entry);
+}
+
+/**
+ * Records a frame that repeats the one before it and has no file of its own.
+ */
+void frameJournalRecordRepeat(FrameJournal* journal, int frameIndex) {
+    char entry[64];
+    snprintf(entry, sizeof(entry), "repeat %d\n", frameIndex);
+    frameJournalAppend(journal, entry);
+}
+
+/**
+ * Records the pixel hash of a distinct frame of a deduplicating sink.
+ */
+void frameJournalRecordHash(FrameJournal* journal, int frameIndex,
+                            uint64_t hash) {
+    char entry[64];
+    snprintf(entry, sizeof(entry), "hash %d %016llx\n", frameIndex,
+             (unsigned long long)hash);
+    frameJournalAppend(journal, entry);
+}
+
+/**
+ * Closes the journal. It stays on disk until the recording it tracks no
+ * longer needs resuming.
+ */
+void frameJournalClose(FrameJournal* journal) {
+    if (!journal->file) {
+        return;
+    }
+    fclose(journal->file);
+    journal->file = NULL;
+    pthread_mutex_destroy(&journal->lock);
+}
+
+/**
+ * A read-back frame waiting to be PNG-encoded.
+ */
+typedef struct {
+    char           filename[512];
+    unsigned char* pixels;  // Bottom-up RGBA from g_framePool, owned by the job
+    int            width;
+    int            height;
+} EncodeJob;
+
+struct EncoderPool;
+
+/**
+ * Per-thread state and throughput counters of the PNG encoder pool.
+ */
+typedef struct {
+    pthread_t           thread;
+    struct EncoderPool* pool;
+    int                 index;
+    long                frames;       // Frames encoded
+    double              pixels;       // Pixels encoded
+    double              busySeconds;  // Time spent encoding and writing
+} EncodeWorker;
+
+/**
+ * Bounded queue of read-back frames drained by a set of PNG encoder threads.
+ * The render thread only blocks when every queue slot is taken.
+ */
+typedef struct EncoderPool {
+    pthread_mutex_t lock;
+    pthread_cond_t  notEmpty;
+    pthread_cond_t  notFull;
+    EncodeJob*      jobs;
+    int             capacity;
+    int             head;
+    int             count;
+    bool            shuttingDown;
+    bool            failed;        // A frame could not be written
+    EncodeWorker*   workers;
+    int             workerCount;
+    long            stalls;        // Submissions that found the queue full
+    double          stallSeconds;  // Time the render thread spent blocked
+    double          startTime;
+    PngOptions      png;
+    FrameJournal*   journal;       // Records every frame file written, or NULL
+} EncoderPool;
+
+static void* encoderThreadMain(void* arg) {
+    EncodeWorker* worker = (EncodeWorker*)arg;
+    EncoderPool*  pool   = worker->pool;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->shuttingDown) {
+            pthread_cond_wait(&pool->notEmpty, &pool->lock);
+        }
+        if (pool->count == 0) {
+            // Shutting down and nothing left to encode
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        EncodeJob job = pool->jobs[pool->head];
+        pool->head    = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        pthread_cond_signal(&pool->notFull);
+        pthread_mutex_unlock(&pool->lock);
+
+        double start   = nowSeconds();
+        bool   written = writeFrame(job.filename, job.pixels, job.width,
+                                    job.height, &pool->png);
+        if (written && pool->journal) {
+            frameJournalRecord(pool->journal, job.filename);
+        }
+        worker->busySeconds += nowSeconds() - start;
+        if (written) {
+            worker->frames++;
+            worker->pixels += (double)job.width * job.height;
+        } else {
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = true;
+            pthread_mutex_unlock(&pool->lock);
+        }
+
+        framePoolRelease(&g_framePool, job.pixels,
+                         (size_t)job.width * job.height * 4);
+    }
+}
+
+/**
+ * Starts the encoder threads.
+ *
+ * @param pool        Pool to initialize.
+ * @param threadCount Number of encoder threads (at least 1).
+ * @param capacity    Number of frames that may wait in the queue.
+ * @param png         How the threads encode frames.
+ * @return true on success, false otherwise.
+ */
+bool encoderPoolInit(EncoderPool* pool, int threadCount, int capacity,
+                     const PngOptions* png) {
+    memset(pool, 0, sizeof(*pool));
+    pool->png = *png;
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    if (capacity < 1) {
+        capacity = 1;
+    }
+
+    pool->jobs    = (EncodeJob*)calloc((size_t)capacity, sizeof(EncodeJob));
+    pool->workers = (EncodeWorker*)calloc((size_t)threadCount,
+                                          sizeof(EncodeWorker));
+    if (!pool->jobs || !pool->workers) {
+        log_and_print("Error: Unable to allocate the encoder queue.\n");
+        free(pool->jobs);
+        free(pool->workers);
+        return false;
+    }
+    pool->capacity  = capacity;
+    pool->startTime = nowSeconds();
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->notEmpty, NULL);
+    pthread_cond_init(&pool->notFull, NULL);
+
+    for (int i = 0; i < threadCount; i++) {
+        EncodeWorker* worker = &pool->workers[i];
+        worker->pool  = pool;
+        worker->index = i;
+        if (pthread_create(&worker->thread, NULL, encoderThreadMain,
+                           worker) != 0) {
+            log_and_print(
+                "Warning: Only %d of %d encoder threads could be started.\n", i,
+                threadCount);
+            break;
+        }
+        pool->workerCount++;
+    }
+    if (pool->workerCount == 0) {
+        log_and_print("Error: Unable to start encoder threads.\n");
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->notEmpty);
+        pthread_cond_destroy(&pool->notFull);
+        free(pool->jobs);
+        free(pool->workers);
+        return false;
+    }
+    log_and_print("Encoder pool started: %d threads, queue of %d frames.\n",
+                  pool->workerCount, capacity);
+    return true;
+}
+
+/**
+ * Queues a copy of a frame for encoding, blocking only while the queue is full.
+ *
+ * @param pool     Running encoder pool.
+ * @param filename Output PNG filename.
+ * @param pixels   RGBA pixel data (bottom row first); copied, so the caller
+ *                 keeps ownership.
+ * @param width    Frame width.
+ * @param height   Frame height.
+ * @return true if the frame was queued, false if it could not be or an
+ *         earlier frame failed to be written.
+ */
+bool encoderPoolSubmit(EncoderPool* pool, const char* filename,
+                       const unsigned char* pixels, int width, int height) {
+    size_t         frameBytes = (size_t)width * height * 4;
+    unsigned char* copy       = framePoolAcquire(&g_framePool, frameBytes);
+    if (!copy) {
+        log_and_print("Error: Unable to allocate memory for queued frame %s\n",
+                      filename);
+        return false;
+    }
+    memcpy(copy, pixels, frameBytes);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->failed) {
+        pthread_mutex_unlock(&pool->lock);
+        framePoolRelease(&g_framePool, copy, frameBytes);
+        return false;
+    }
+    if (pool->count == pool->capacity) {
+        // Backpressure: every slot is taken, wait for an encoder to catch up
+        double start = nowSeconds();
+        pool->stalls++;
+        while (pool->count == pool->capacity) {
+            pthread_cond_wait(&pool->notFull, &pool->lock);
+        }
+        pool->stallSeconds += nowSeconds() - start;
+    }
+    EncodeJob* job = &pool->jobs[(pool->head + pool->count) % pool->capacity];
+    strncpy(job->filename, filename, sizeof(job->filename) - 1);
+    job->filename[sizeof(job->filename) - 1] = '\0';
+    job->pixels = copy;
+    job->width  = width;
+    job->height = height;
+    pool->count++;
+    pthread_cond_signal(&pool->notEmpty);
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+/**
+ * Waits for every queued frame to be written, stops the threads and reports
+ * per-thread encode throughput.
+ *
+ * @return true if every frame was written, false otherwise.
+ */
+bool encoderPoolDestroy(EncoderPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shuttingDown = true;
+    pthread_cond_broadcast(&pool->notEmpty);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->workerCount; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    double elapsed = nowSeconds() - pool->startTime;
+
+    log_and_print("Encoder pool summary (%.2f s wall time):\n", elapsed);
+    long totalFrames = 0;
+    for (int i = 0; i < pool->workerCount; i++) {
+        EncodeWorker* worker = &pool->workers[i];
+        double        busy   = worker->busySeconds > 0.0 ? worker->busySeconds
+                                                         : 1e-9;
+        log_and_print("  Encoder %2d : %5ld frames, %7.2f fps, %8.2f MPix/s, "
+                      "%5.1f%% busy\n", worker->index, worker->frames,
+                      worker->frames / busy, worker->pixels / busy * 1e-6,
+                      elapsed > 0.0 ? 100.0 * worker->busySeconds / elapsed
+                                    : 0.0);
+        totalFrames += worker->frames;
+    }
+    log_and_print("  Total      : %5ld frames, %7.2f fps; render loop blocked "
+                  "%ld times (%.2f s)\n", totalFrames,
+                  elapsed > 0.0 ? totalFrames / elapsed : 0.0, pool->stalls,
+                  pool->stallSeconds);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->notEmpty);
+    pthread_cond_destroy(&pool->notFull);
+    free(pool->jobs);
+    free(pool->workers);
+    return !pool->failed;
+}
+
+/**
+ * A frame waiting for the frame writer thread.
+ */
+typedef struct {
+    int            frameIndex;
+    unsigned char* data;    // Frame from g_framePool, owned by the job
+    size_t         bytes;
+    int            width;
+    int            height;
+    bool           planes;     // Planes converted on the GPU instead of
+                               // bottom-up RGBA
+    bool           delta;      // Only rows that changed: the rest repeats the
+                               // previous frame
+    int            dirtyTop;   // First changed row, counted from the top
+                               // (delta jobs)
+    int            dirtyRows;  // Changed rows, held bottom-up in `data`
+                               // (delta jobs)
+} WriteJob;
+
+// Writes one queued frame on the writer thread, in submission order; false
+// stops the writer
+typedef bool (*FrameWriteFunc)(void* context, const WriteJob* job);
+
+/**
+ * Bounded queue of frames drained, in order, by a single writer thread that
+ * converts them and feeds the encoder (ffmpeg's stdin or a container file),
+ * so the render loop keeps drawing while earlier frames are being encoded.
+ *
+ * Both sides record how long they waited for the other: the render thread on
+ * a full queue (encoding is the bottleneck), the writer on an empty one
+ * (rendering is).
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  notEmpty;
+    pthread_cond_t  notFull;
+    WriteJob*       jobs;
+    int             capacity;
+    int             head;
+    int             count;
+    bool            shuttingDown;
+    bool            failed;        // The write function failed; later frames
+                                   // are dropped
+    pthread_t       thread;
+    FrameWriteFunc  write;
+    void*           context;
+    long            frames;        // Frames written
+    long            stalls;        // Submissions that found the queue full
+    double          stallSeconds;  // Time the render thread spent blocked on a
+                                   // full queue
+    double          idleSeconds;   // Time the writer spent waiting for frames
+    double          busySeconds;   // Time the writer spent converting
+                                   // and writing
+    double          startTime;
+} FrameWriter;
+
+static void* frameWriterThreadMain(void* arg) {
+    FrameWriter* writer = (FrameWriter*)arg;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        if (writer->count == 0 && !writer->shuttingDown) {
+            double start = nowSeconds();
+            while (writer->count == 0 && !writer->shuttingDown) {
+                pthread_cond_wait(&writer->notEmpty, &writer->lock);
+            }
+            writer->idleSeconds += nowSeconds() - start;
+        }
+        if (writer->count == 0) {
+            // Shutting down and nothing left to write
+            pthread_mutex_unlock(&writer->lock);
+            return NULL;
+        }
+        WriteJob job  = writer->jobs[writer->head];
+        bool     skip = writer->failed;
+        writer->head  = (writer->head + 1) % writer->capacity;
+        writer->count--;
+        pthread_cond_signal(&writer->notFull);
+        pthread_mutex_unlock(&writer->lock);
+
+        double start = nowSeconds();
+        bool   ok    = !skip && writer->write(writer->context, &job);
+        double busy  = nowSeconds() - start;
+        framePoolRelease(&g_framePool, job.data, job.bytes);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->busySeconds += busy;
+        if (ok) {
+            writer->frames++;
+        } else {
+            writer->failed = true;
+        }
+    }
+}
+
+/**
+ * Starts the writer thread.
+ *
+ * @param writer   Writer to initialize.
+ * @param capacity Number of frames that may wait in the queue.
+ * @param write    Called on the writer thread for every frame.
+ * @param context  Passed to `write`.
+ * @return true on success, false otherwise.
+ */
+bool frameWriterInit(FrameWriter* writer, int capacity, FrameWriteFunc write,
+                     void* context) {
+    memset(writer, 0, sizeof(*writer));
+    if (capacity < 1) {
+        capacity = 1;
+    }
+    writer->jobs = (WriteJob*)calloc((size_t)capacity, sizeof(WriteJob));
+    if (!writer->jobs) {
+        log_and_print("Error: Unable to allocate the frame writer queue.\n");
+        return false;
+    }
+    writer->capacity  = capacity;
+    writer->write     = write;
+    writer->context   = context;
+    writer->startTime = nowSeconds();
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->notEmpty, NULL);
+    pthread_cond_init(&writer->notFull, NULL);
+
+    if (pthread_create(&writer->thread, NULL, frameWriterThreadMain,
+                       writer) != 0) {
+        log_and_print("Error: Unable to start the frame writer thread.\n");
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->notEmpty);
+        pthread_cond_destroy(&writer->notFull);
+        free(writer->jobs);
+        return false;
+    }
+    log_and_print("Frame writer started: queue of %d frames.\n", capacity);
+    return true;
+}
+
+/**
+ * Queues a copy of a frame for the writer thread, blocking only while the
+ * queue is full.
+ *
+ * @param writer Running frame writer.
+ * @param job    Frame to write; `data` is copied, so the caller
+ *               keeps ownership.
+ * @return true if the frame was queued, false if it was dropped because the
+ *         writer failed or no buffer was available.
+ */
+bool frameWriterSubmit(FrameWriter* writer, const WriteJob* job) {
+    pthread_mutex_lock(&writer->lock);
+    bool failed = writer->failed;
+    pthread_mutex_unlock(&writer->lock);
+    if (failed) {
+        return false;
+    }
+
+    // Delta jobs of unchanged frames carry no data at all
+    unsigned char* copy = NULL;
+    if (job->bytes > 0) {
+        copy = framePoolAcquire(&g_framePool, job->bytes);
+        if (!copy) {
+            log_and_print(
+                "Error: Unable to allocate memory for queued frame %d.\n",
+                job->frameIndex);
+            return false;
+        }
+        memcpy(copy, job->data, job->bytes);
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    if (writer->count == writer->capacity) {
+        // Backpressure: every slot is taken, wait for the encoder to catch up
+        double start = nowSeconds();
+        writer->stalls++;
+        while (writer->count == writer->capacity) {
+            pthread_cond_wait(&writer->notFull, &writer->lock);
+        }
+        writer->stallSeconds += nowSeconds() - start;
+    }
+    WriteJob* slot =
+        &writer->jobs[(writer->head + writer->count) % writer->capacity];
+    *slot          = *job;
+    slot->data     = copy;
+    writer->count++;
+    pthread_cond_signal(&writer->notEmpty);
+    pthread_mutex_unlock(&writer->lock);
+    return true;
+}
+
+/**
+ * Waits for every queued frame to be written, stops the thread and reports
+ * which stage limited the recording.
+ *
+ * @return true if every frame was written.
+ */
+bool frameWriterDestroy(FrameWriter* writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->shuttingDown = true;
+    pthread_cond_broadcast(&writer->notEmpty);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    double elapsed = nowSeconds() - writer->startTime;
+
+    // The side that waited longer for the other was not the bottleneck
+    const char* bottleneck = writer->stallSeconds > writer->idleSeconds
+                                 ? "encoding"
+                                 : "rendering";
+    log_and_print("Frame writer summary (%.2f s wall time):\n", elapsed);
+    log_and_print(
+        "  Written     : %5ld frames, %7.2f fps, writer %5.1f%% busy\n",
+        writer->frames, elapsed > 0.0 ? writer->frames / elapsed : 0.0,
+        elapsed > 0.0 ? 100.0 * writer->busySeconds / elapsed : 0.0);
+    log_and_print("  Encode-bound: render loop blocked %ld times on a full "
+                  "queue (%.2f s)\n", writer->stalls, writer->stallSeconds);
+    log_and_print("  Render-bound: writer waited %.2f s for frames\n",
+                  writer->idleSeconds);
+    log_and_print("  Bottleneck  : %s\n", bottleneck);
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->notEmpty);
+    pthread_cond_destroy(&writer->notFull);
+    free(writer->jobs);
+    return !writer->failed;
+}
+
+#ifdef _WIN32
+#define popen  _popen
+#define pclose _pclose
+#define PIPE_WRITE_MODE "wb"
+#else
+#define PIPE_WRITE_MODE "w"
+#endif
+
+/**
+ * Single-file frame container: every frame is a fixed-size record at a known
+ * offset, so the file is preallocated for the whole recording up front and
+ * frames are written in place. Avoids the per-file metadata cost and the huge
+ * directories of image sequences, which matters on network file systems.
+ */
+typedef enum {
+    CONTAINER_Y4M,  // YUV4MPEG2, 8-bit 4:4:4 or 4:2:0 (BT.709)
+    CONTAINER_RAW,  // Raw top-down frames in any PixelFormat plus a text
+                    // sidecar describing them
+} ContainerKind;
+
+typedef struct {
+    ContainerKind  kind;
+    const char*    filename;
+    int            width;
+    int            height;
+    int            fps;
+    PixelFormat    format;       // Layout of the stored frames
+    bool           fullRange;    // YUV formats use full-range levels
+    YuvMatrix      matrix;       // Converts RGBA rows to the YUV formats
+#ifdef _WIN32
+    FILE*          fp;
+#else
+    int            fd;
+#endif
+    uint64_t       headerBytes;  // Stream header before the first frame
+    uint64_t       frameBytes;   // Size of one frame record, including its
+                                 // FRAME marker
+    uint64_t       capacity;     // Bytes preallocated so far
+    long           frames;       // Highest frame index written + 1
+    unsigned char* map;          // Mapping of the frame being written (NULL
+                                 // when buffered)
+    size_t         mapBytes;
+    size_t         mapSkip;      // Bytes from the start of the mapping to the
+                                 // frame record
+    unsigned char* buffer;       // Frame record staged in memory when mmap is
+                                 // unavailable
+    unsigned char* frame;        // Record of the frame being written (in `map`
+                                 // or `buffer`)
+    long           frameIndex;   // Frame being written, -1 if none
+    bool           failed;
+} FrameContainer;
+
+static const char g_y4mFrameMarker[] = "FRAME\n";
+
+/**
+ * Writes `size` bytes at an absolute file offset.
+ */
+static bool containerWriteAt(FrameContainer* c, uint64_t offset,
+                             const void* data, size_t size) {
+#ifdef _WIN32
+    return _fseeki64(c->fp, (long long)offset, SEEK_SET) == 0 &&
+           fwrite(data, 1, size, c->fp) == size;
+#else
+    const unsigned char* bytes = (const unsigned char*)data;
+    while (size > 0) {
+        ssize_t written = pwrite(c->fd, bytes, size, (off_t)offset);
+        if (written <= 0) {
+            return false;
+        }
+        bytes  += written;
+        offset += (uint64_t)written;
+        size   -= (size_t)written;
+    }
+    return true;
+#endif
+}
+
+/**
+ * Grows the file to `bytes`, allocating the blocks where the file system
+ * supports it and extending it sparsely otherwise.
+ */
+static bool containerReserve(FrameContainer* c, uint64_t bytes) {
+    if (bytes <= c->capacity) {
+        return true;
+    }
+#ifdef _WIN32
+    // The file grows as frames are written
+    c->capacity = bytes;
+    return true;
+#else
+#ifdef __linux__
+    if (fallocate(c->fd, 0, (off_t)c->capacity,
+                  (off_t)(bytes - c->capacity)) == 0) {
+        c->capacity = bytes;
+        return true;
+    }
+#endif
+    if (ftruncate(c->fd, (off_t)bytes) != 0) {
+        log_and_print("Error: Unable to grow %s to %llu bytes.\n", c->filename,
+                      (unsigned long long)bytes);
+        return false;
+    }
+    c->capacity = bytes;
+    return true;
+#endif
+}
+
+/**
+ * Creates a container file for `frameCount` frames of `width` x `height` and
+ * writes its header. The frames can then be written in any order.
+ *
+ * Frames are stored in `format`, which has to be yuv444p or yuv420p for Y4M.
+ *
+ * @return true on success, false otherwise.
+ */
+bool frameContainerOpen(FrameContainer* c, ContainerKind kind,
+                        const char* filename, int width, int height, int fps,
+                        long frameCount, PixelFormat format, bool fullRange) {
+    memset(c, 0, sizeof(*c));
+#ifndef _WIN32
+    c->fd         = -1;  // Closing a container that failed to open leaves
+                         // stdin alone
+#endif
+    c->kind       = kind;
+    c->filename   = filename;
+    c->width      = width;
+    c->height     = height;
+    c->fps        = fps;
+    c->format     = format;
+    c->fullRange  = fullRange;
+    c->matrix     = yuvMatrix(fullRange);
+    c->frameIndex = -1;
+    c->frameBytes = pixelFormatFrameBytes(format, width, height);
+
+    char header[128] = "";
+    if (kind == CONTAINER_Y4M) {
+        if (format != PIXEL_YUV444P && format != PIXEL_YUV420P) {
+            log_and_print("Error: Y4M cannot hold %s frames.\n",
+                          g_pixelFormatNames[format]);
+            return false;
+        }
+        // 420jpeg: chroma sited between the four luma samples it was
+        // averaged from
+        snprintf(header, sizeof(header),
+                 "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 %s XCOLORRANGE=%s\n", width,
+                 height, fps, format == PIXEL_YUV420P ? "C420jpeg" : "C444",
+                 fullRange ? "FULL" : "LIMITED");
+        c->frameBytes += sizeof(g_y4mFrameMarker) - 1;
+    }
+    c->headerBytes = strlen(header);
+
+#ifdef _WIN32
+    c->fp = fopen(filename, "wb");
+    if (!c->fp) {
+        log_and_print("Error: Unable to open %s for writing.\n", filename);
+        return false;
+    }
+#else
+    c->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (c->fd < 0) {
+        log_and_print("Error: Unable to open %s for writing.\n", filename);
+        return false;
+    }
+#endif
+    if (!containerReserve(c, c->headerBytes + c->frameBytes *
+                          (uint64_t)(frameCount > 0 ? frameCount : 1)) ||
+        !containerWriteAt(c, 0, header, (size_t)c->headerBytes)) {
+        c->failed = true;
+        return false;
+    }
+    log_and_print("Container %s: %llu bytes preallocated for %ld frames.\n",
+                  filename, (unsigned long long)c->capacity, frameCount);
+    return true;
+}
+
+/**
+ * Starts writing frame `frameIndex`: maps its record in the file, or stages
+ * it in memory where mapping is unavailable.
+ *
+ * @return true if rows can be written with frameContainerWriteRows.
+ */
+bool frameContainerBeginFrame(FrameContainer* c, long frameIndex) {
+    if (c->failed) {
+        return false;
+    }
+    uint64_t offset = c->headerBytes + c->frameBytes * (uint64_t)frameIndex;
+    if (!containerReserve(c, offset + c->frameBytes)) {
+        c->failed = true;
+        return false;
+    }
+
+#ifndef _WIN32
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t base = offset / page * page;
+    c->mapSkip    = (size_t)(offset - base);
+    c->mapBytes   = c->mapSkip + (size_t)c->frameBytes;
+    c->map        = (unsigned char*)mmap(NULL, c->mapBytes,
+                                         PROT_READ | PROT_WRITE, MAP_SHARED,
+                                         c->fd, (off_t)base);
+    if (c->map == MAP_FAILED) {
+        c->map = NULL;
+    }
+#endif
+    if (c->map) {
+        c->frame = c->map + c->mapSkip;
+    } else {
+        if (!c->buffer) {
+            c->buffer = framePoolAllocate(&g_framePool, (size_t)c->frameBytes);
+            if (!c->buffer) {
+                log_and_print(
+                    "Error: Unable to allocate a frame buffer for %s.\n",
+                    c->filename);
+                c->failed = true;
+                return false;
+            }
+        }
+        c->frame = c->buffer;
+    }
+
+    if (c->kind == CONTAINER_Y4M) {
+        memcpy(c->frame, g_y4mFrameMarker, sizeof(g_y4mFrameMarker) - 1);
+    }
+    c->frameIndex = frameIndex;
+    return true;
+}
+
+/**
+ * Stores RGBA rows of the current frame, starting at row `firstRow` (counted
+ * from the top), converting them to the container's format on the way.
+ * Not available for yuv420p, whose chroma rows need pairs of source rows.
+ *
+ * @param rows     First (topmost) row.
+ * @param rowCount Number of rows.
+ * @param stride   Byte offset from one row to the next (negative for
+ *                 bottom-up buffers).
+ */
+void frameContainerWriteRows(FrameContainer* c, int firstRow,
+                             const unsigned char* rows, int rowCount,
+                             ptrdiff_t stride) {
+    const PixelKernels* kernels = pixelKernels();
+    size_t              plane   = (size_t)c->width * c->height;
+    unsigned char*      frame   = c->frame + (c->kind == CONTAINER_Y4M
+                                                  ? sizeof(g_y4mFrameMarker) - 1
+                                                  : 0);
+    for (int r = 0; r < rowCount && firstRow + r < c->height; r++) {
+        const unsigned char* row = rows + (ptrdiff_t)r * stride;
+        size_t               y   = (size_t)(firstRow + r);
+        switch (c->format) {
+            case PIXEL_RGBA:
+                memcpy(frame + y * c->width * 4, row, (size_t)c->width * 4);
+                break;
+            case PIXEL_RGB24:
+            case PIXEL_BGR24:
+                kernels->packRgb(frame + y * c->width * 3, row, c->width,
+                                 c->format == PIXEL_BGR24);
+                break;
+            case PIXEL_YUV444P: {
+                unsigned char* luma = frame + y * c->width;
+                kernels->yuv444(&c->matrix, row, c->width, luma, luma + plane,
+                                luma + 2 * plane);
+                break;
+            }
+            case PIXEL_YUV420P:
+                break;
+        }
+    }
+}
+
+/**
+ * Converts a whole bottom-up RGBA readback straight into the current frame's
+ * record, in the container's format.
+ */
+void frameContainerConvertFrame(FrameContainer* c,
+                                const unsigned char* pixels) {
+    size_t marker = c->kind == CONTAINER_Y4M ? sizeof(g_y4mFrameMarker) - 1 : 0;
+    convertPixels(pixelKernels(), c->format, &c->matrix, pixels, c->width,
+                  c->height, c->frame + marker);
+}
+
+/**
+ * Stores a whole frame that is already in the container's format.
+ */
+void frameContainerWriteFrame(FrameContainer* c, const unsigned char* data) {
+    size_t marker = c->kind == CONTAINER_Y4M ? sizeof(g_y4mFrameMarker) - 1 : 0;
+    memcpy(c->frame + marker, data, (size_t)c->frameBytes - marker);
+}
+
+/**
+ * Stores frame `target` as a copy of the stored frame `source`, inside the
+ * file: on Linux with copy_file_range, which shares the blocks on file
+ * systems with reflinks and never passes the data through user space.
+ *
+ * @return true if the frame was copied.
+ */
+bool frameContainerCopyFrame(FrameContainer* c, long source, long target) {
+    if (c->failed) {
+        return false;
+    }
+    uint64_t from = c->headerBytes + c->frameBytes * (uint64_t)source;
+    uint64_t to   = c->headerBytes + c->frameBytes * (uint64_t)target;
+    uint64_t left = c->frameBytes;
+    if (!containerReserve(c, to + c->frameBytes)) {
+        c->failed = true;
+        return false;
+    }
+#ifdef __linux__
+    loff_t in = (loff_t)from, out = (loff_t)to;
+    while (left > 0) {
+        ssize_t copied = copy_file_range(c->fd, &in, c->fd, &out, (size_t)left,
+                                         0);
+        if (copied <= 0) {
+            break;
+        }
+        left -= (uint64_t)copied;
+    }
+    from = (uint64_t)in;
+    to   = (uint64_t)out;
+#endif
+    // Elsewhere, or where the file system refuses, copy through a buffer
+    unsigned char chunk[1 << 16];
+    while (left > 0) {
+        size_t size = left < sizeof(chunk) ? (size_t)left : sizeof(chunk);
+#ifdef _WIN32
+        bool read = _fseeki64(c->fp, (long long)from, SEEK_SET) == 0 &&
+                    fread(chunk, 1, size, c->fp) == size;
+#else
+        bool read = pread(c->fd, chunk, size, (off_t)from) == (ssize_t)size;
+#endif
+        if (!read || !containerWriteAt(c, to, chunk, size)) {
+            log_and_print(
+                "Error: Copying frame %ld to frame %ld of %s failed.\n", source,
+                target, c->filename);
+            c->failed = true;
+            return false;
+        }
+        from += size;
+        to += size;
+        left -= size;
+    }
+    if (target + 1 > c->frames) {
+        c->frames = target + 1;
+    }
+    return true;
+}
+
+/**
+ * Completes the current frame: unmaps its record, starting writeback right
+ * away so dirty pages don't pile up, or writes the staged copy in one go.
+ */
+void frameContainerEndFrame(FrameContainer* c) {
+    if (c->frameIndex < 0) {
+        return;
+    }
+    uint64_t offset = c->headerBytes + c->frameBytes * (uint64_t)c->frameIndex;
+#ifndef _WIN32
+    if (c->map) {
+#ifdef __linux__
+        sync_file_range(c->fd, (off_t)offset, (off_t)c->frameBytes,
+                        SYNC_FILE_RANGE_WRITE);
+#endif
+        munmap(c->map, c->mapBytes);
+        c->map = NULL;
+    } else
+#endif
+    if (!containerWriteAt(c, offset, c->frame, (size_t)c->frameBytes)) {
+        log_and_print("Error: Writing frame %ld to %s failed.\n", c->frameIndex,
+                      c->filename);
+        c->failed = true;
+    }
+    if (c->frameIndex + 1 > c->frames) {
+        c->frames = c->frameIndex + 1;
+    }
+    c->frame      = NULL;
+    c->frameIndex = -1;
+}
+
+/**
+ * Trims the preallocated space to the frames actually written, closes the
+ * file and, for raw containers, writes the `<file>.txt` sidecar.
+ *
+ * @return true if every frame was written successfully.
+ */
+bool frameContainerClose(FrameContainer* c) {
+    frameContainerEndFrame(c);
+    uint64_t used = c->headerBytes + c->frameBytes * (uint64_t)c->frames;
+#ifdef _WIN32
+    if (c->fp && fclose(c->fp) != 0) {
+        c->failed = true;
+    }
+    c->fp = NULL;
+#else
+    if (c->fd >= 0) {
+        if (used < c->capacity && ftruncate(c->fd, (off_t)used) != 0) {
+            c->failed = true;
+        }
+        if (close(c->fd) != 0) {
+            c->failed = true;
+        }
+    }
+    c->fd = -1;
+#endif
+    framePoolFree(c->buffer);
+    c->buffer = NULL;
+
+    if (c->kind == CONTAINER_RAW) {
+        char sidecarName[512];
+        snprintf(sidecarName, sizeof(sidecarName), "%s.txt", c->filename);
+        FILE* sidecar = fopen(sidecarName, "w");
+        if (!sidecar) {
+            log_and_print("Error: Unable to write %s.\n", sidecarName);
+            return false;
+        }
+        const char* pixelFormat = g_pixelFormatNames[c->format];
+        char        colorArgs[64] = "";
+        if (c->format == PIXEL_YUV444P || c->format == PIXEL_YUV420P) {
+            snprintf(colorArgs, sizeof(colorArgs),
+                     " -color_range %s -colorspace bt709",
+                     c->fullRange ? "pc" : "tv");
+        }
+        fprintf(sidecar, "format=rawvideo\npix_fmt=%s\nwidth=%d\nheight=%d\n"
+                "fps=%d\nframes=%ld\n", pixelFormat, c->width, c->height,
+                c->fps, c->frames);
+        fprintf(sidecar, "ffmpeg_input=-f rawvideo -pix_fmt %s%s -video_size "
+                "%dx%d -framerate %d -i \"%s\"\n", pixelFormat, colorArgs,
+                c->width, c->height, c->fps, c->filename);
+        fclose(sidecar);
+    }
+    return !c->failed;
+}
+
+/**
+ * Destinations for recorded frames.
+ */
+typedef enum {
+    SINK_PIPE,      // Raw frames streamed into ffmpeg's stdin while rendering
+    SINK_SEQUENCE,  // PNG image sequence kept in the output folder
+    SINK_TWO_PASS,  // PNG image sequence assembled by ffmpeg afterwards,
+                    // then deleted
+    SINK_Y4M,       // Single preallocated YUV4MPEG2 file
+    SINK_RAW,       // Single preallocated raw video file with a text sidecar
+} SinkKind;
+
+/**
+ * Named ffmpeg encoder settings for the video sinks, from the fastest to the
+ * best quality.
+ */
+typedef struct {
+    const char* name;
+    const char* codec;
+    const char* preset;
+    double      gopSeconds;   // Keyframe interval; 0 makes every frame
+                              // a keyframe
+    const char* pixelFormat;  // Encoded pixel format (planar YUV input keeps
+                              // its own)
+    const char* rateControl;  // ffmpeg rate control options
+} EncodeProfile;
+
+#define ENCODE_PROFILE_COUNT 3
+
+static const EncodeProfile g_encodeProfiles[ENCODE_PROFILE_COUNT] = {
+    // Quick looks; encodes faster than most shaders render
+    {"preview", "libx264", "ultrafast", 2.0, "yuv420p", "-crf 28"},
+    // Visually lossless, plays everywhere
+    {"delivery", "libx264", "slow", 2.0, "yuv420p", "-crf 18"},
+    // Lossless all-intra masters
+    {"archival", "libx264", "veryslow", 0.0, "yuv444p", "-qp 0"},
+};
+
+/**
+ * Looks up an encode profile by name.
+ *
+ * @return The profile, or NULL if the name is unknown.
+ */
+const EncodeProfile* encodeProfileByName(const char* name) {
+    for (int i = 0; i < ENCODE_PROFILE_COUNT; i++) {
+        if (strcmp(name, g_encodeProfiles[i].name) == 0) {
+            return &g_encodeProfiles[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * User-facing settings of a frame sink.
+ */
+typedef struct {
+    SinkKind             kind;
+    const char*          folder;          // Frames folder (sequence and
+                                          // two-pass sinks)
+    const char*          video;           // Output video file (pipe and
+                                          // two-pass sinks) or container file
+    int                  fps;
+    int                  encoderThreads;  // Frame encoder threads; 0 encodes on
+                                          // the render thread
+    PngOptions           png;
+    const char*          frameExtension;  // Frame file format: "png", "qoi"
+                                          // or "rgba"
+    long                 frameCount;      // Frames expected, preallocated by
+                                          // the container sinks
+    long                 firstFrame;      // Index of the first frame (frame
+                                          // ranges and shards start later)
+    bool                 partial;         // Records part of a longer recording,
+                                          // next to the other parts
+    PixelFormat          pixelFormat;     // Frame layout sent to ffmpeg or
+                                          // stored in the container
+    bool                 fullRange;       // YUV pixel formats use
+                                          // full-range levels
+    int                  writeQueue;      // Frames queued for the writer
+                                          // thread; 0 writes inline
+    const EncodeProfile* profile;         // ffmpeg encoder settings (pipe and
+                                          // two-pass sinks)
+    int                  segments;        // Parallel two-pass encode segments;
+                                          // 0 picks, 1 = one piece
+    bool                 dedup;           // Repeated frames extend the previous
+                                          // one (image sequence sinks)
+    bool                 resume;          // Keep a journal and skip the frames
+                                          // it verifies (image sequence sinks)
+    bool                 byRows;          // Frames arrive a few rows at a time
+                                          // (tiled renders)
+} SinkConfig;
+
+/**
+ * A distinct frame of a deduplicated recording and how many frames it lasts.
+ */
+typedef struct {
+    int  frameIndex;  // Frame file written for it
+    long frames;      // 1 plus the repeats that followed
+} FrameRun;
+
+/**
+ * Receives every recorded frame, in order, and turns it into the
+ * requested output.
+ */
+typedef struct {
+    SinkConfig     config;
+    int            width;
+    int            height;
+    FILE*          pipe;         // ffmpeg's stdin (pipe sink)
+    EncoderPool    encoders;     // PNG encoder threads (image sequence sinks)
+    bool           useEncoders;
+    ImageStream    rowImage;     // Frame being written row by row (image
+                                 // sequence sinks)
+    FrameContainer container;    // Output file (y4m and raw sinks)
+    unsigned char* converted;    // Frame converted to the pipe's pixel format
+    FrameWriter    writer;       // Converts and writes whole frames off the
+                                 // render thread
+    bool           useWriter;
+    int            rowFrame;     // Index of the frame being written row by row,
+                                 // -1 if none
+    int            rowsLeft;
+    long           frames;       // Frames accepted so far
+    bool           failed;       // Set once the sink stops accepting frames
+    bool           dedup;        // Frames are hashed and repeats become
+                                 // duration extensions
+    uint64_t       lastHash;     // Hash of the last distinct frame
+    bool           lastHashSet;  // lastHash belongs to the frame before
+                                 // this one
+    bool           gpuCompared;  // Repeats were found by the GPU frame
+                                 // difference instead of hashing
+    FrameRun*      runs;         // Distinct frames in recording order
+    long           runCount;
+    long           runCapacity;
+    double         hashSeconds;  // Time spent hashing frames
+    FrameJournal   journal;      // Frames finished so far, for resuming
+    bool           useJournal;
+    unsigned char* done;         // Per frame: finished by an earlier run (see
+                                 // frameJournalResume), or NULL
+    uint64_t*      doneHashes;   // Per frame: pixel hash journaled by an
+                                 // earlier run, 0 if unknown
+    long           doneCount;    // Length of `done`
+} FrameSink;
+
+static bool writeQueuedFrame(void* context, const WriteJob* job);
+
+/**
+ * Whether a sink writes a single container file instead of frame files.
+ */
+static bool sinkIsContainer(SinkKind kind) {
+    return kind == SINK_Y4M || kind == SINK_RAW;
+}
+
+/**
+ * Returns the command line name of a sink kind.
+ */
+const char* sinkKindName(SinkKind kind) {
+    switch (kind) {
+        case SINK_PIPE:
+            return "pipe";
+        case SINK_SEQUENCE:
+            return "sequence";
+        case SINK_TWO_PASS:
+            return "two-pass";
+        case SINK_Y4M:
+            return "y4m";
+        case SINK_RAW:
+            return "raw";
+    }
+    return "unknown";
+}
+
+/**
+ * Parses a sink kind from its command line name.
+ *
+ * @return true if the name is known, false otherwise (kind is left untouched).
+ */
+bool parseSinkKind(const char* name, SinkKind* kind) {
+    if (strcmp(name, "pipe") == 0) {
+        *kind = SINK_PIPE;
+    } else if (strcmp(name, "sequence") == 0) {
+        *kind = SINK_SEQUENCE;
+    } else if (strcmp(name, "two-pass") == 0) {
+        *kind = SINK_TWO_PASS;
+    } else if (strcmp(name, "y4m") == 0) {
+        *kind = SINK_Y4M;
+    } else if (strcmp(name, "raw") == 0) {
+        *kind = SINK_RAW;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Formats the path of a frame file of an image sequence sink.
+ */
+static void formatFrameFile(char* buffer, size_t size, const SinkConfig* config,
+                            int frameIndex) {
+    snprintf(buffer, size, "%s/frame_%05d.%s", config->folder, frameIndex,
+             config->frameExtension);
+}
+
+/**
+ * Formats the path of a working file an image sequence sink keeps in its
+ * frames folder. The parts of a partial recording may share one folder, so
+ * theirs are named after their frames: `name_<first>-<last><suffix>`.
+ *
+ * @param suffix Extension appended to the name, including the dot.
+ */
+static void formatFolderFile(char* buffer, size_t size,
+                             const SinkConfig* config, const char* name,
+                             const char* suffix) {
+    if (config->partial) {
+        snprintf(buffer, size, "%s/%s_%05ld-%05ld%s", config->folder, name,
+                 config->firstFrame,
+                 config->firstFrame + config->frameCount - 1, suffix);
+    } else {
+        snprintf(buffer, size, "%s/%s%s", config->folder, name, suffix);
+    }
+}
+
+/**
+ * Keyframe interval of a profile in frames (1 for intra-only profiles).
+ */
+static long profileGopFrames(const EncodeProfile* profile, int fps) {
+    long gop = profile->gopSeconds > 0.0 ? lround(profile->gopSeconds * fps)
+                                         : 1;
+    return gop > 1 ? gop : 1;
+}
+
+/**
+ * Formats the ffmpeg encoder options of a profile. Frames that already come
+ * as planar YUV are encoded in that layout, so ffmpeg converts nothing.
+ *
+ * @param inputFormat Pixel format of the frames handed to ffmpeg.
+ */
+static void formatEncoderArgs(char* buffer, size_t size, int fps,
+                              const EncodeProfile* profile,
+                              PixelFormat inputFormat) {
+    const char* pixelFormat = profile->pixelFormat;
+    if (inputFormat == PIXEL_YUV444P || inputFormat == PIXEL_YUV420P) {
+        pixelFormat = g_pixelFormatNames[inputFormat];
+    }
+    snprintf(buffer, size, "-c:v %s -preset %s %s -pix_fmt %s -g %ld",
+             profile->codec, profile->preset, profile->rateControl, pixelFormat,
+             profileGopFrames(profile, fps));
+}
+
+/**
+ * Formats the ffmpeg options describing raw frames piped in a pixel format.
+ */
+static void formatPipeInputArgs(char* buffer, size_t size, PixelFormat format,
+                                bool fullRange) {
+    if (format == PIXEL_YUV444P || format == PIXEL_YUV420P) {
+        // Planes converted up front go straight to the encoder, without swscale
+        snprintf(buffer, size, "-pix_fmt %s -color_range %s -colorspace bt709",
+                 g_pixelFormatNames[format], fullRange ? "pc" : "tv");
+    } else {
+        snprintf(buffer, size, "-pix_fmt %s", g_pixelFormatNames[format]);
+    }
+}
+
+/**
+ * Settles the pixel format frames reach a sink in: the image sequence sinks
+ * take RGBA, frames converted on the GPU keep their layout, Y4M holds only
+ * YUV, and tiled frames, which arrive row by row, can't be planar 4:2:0 (nor
+ * planar at all through the pipe).
+ *
+ * @param requested Format asked for with --pixel-format.
+ * @param formatSet Whether --pixel-format was given; only then is a change
+ *                  worth a warning.
+ * @param gpuLayout Layout of the GPU YUV conversion, YUV_OFF if there is none.
+ * @param tiled     Frames are rendered and written as bands of tiles.
+ */
+static PixelFormat resolveSinkPixelFormat(SinkKind kind, PixelFormat requested,
+                                          bool formatSet, YuvLayout gpuLayout,
+                                          bool tiled) {
+    PixelFormat format = requested;
+    if (!sinkIsContainer(kind) && kind != SINK_PIPE) {
+        if (formatSet && format != PIXEL_RGBA) {
+            log_and_print("Warning: --pixel-format only applies to the pipe, "
+                          "y4m and raw sinks; ignoring it.\n");
+        }
+        return PIXEL_RGBA;
+    } else if (gpuLayout != YUV_OFF) {
+        PixelFormat gpuFormat = gpuLayout == YUV_420 ? PIXEL_YUV420P
+                                                     : PIXEL_YUV444P;
+        if (formatSet && format != gpuFormat) {
+            log_and_print("Warning: --yuv converts to %s on the GPU; ignoring "
+                          "--pixel-format.\n", g_pixelFormatNames[gpuFormat]);
+        }
+        format = gpuFormat;
+    } else if (kind == SINK_Y4M && format != PIXEL_YUV444P &&
+               format != PIXEL_YUV420P) {
+        if (formatSet) {
+            log_and_print(
+                "Warning: Y4M only holds YUV frames; using yuv444p.\n");
+        }
+        format = PIXEL_YUV444P;
+    }
+    if (tiled && kind == SINK_PIPE &&
+        (format == PIXEL_YUV444P || format == PIXEL_YUV420P)) {
+        log_and_print("Warning: Tiled frames reach ffmpeg row by row, which "
+                      "planar formats can't do; using rgba.\n");
+        format = PIXEL_RGBA;
+    } else if (tiled && format == PIXEL_YUV420P) {
+        log_and_print("Warning: Tiled frames are converted row by row; using "
+                      "yuv444p instead of yuv420p.\n");
+        format = PIXEL_YUV444P;
+    }
+    return format;
+}
+
+/**
+ * Creates a folder and any missing parent folders, like `mkdir -p`, without
+ * going through the shell.
+ *
+ * @return true if the folder exists afterwards.
+ */
+static bool makeFolder(const char* path) {
+    char partial[512];
+    snprintf(partial, sizeof(partial), "%s", path);
+    size_t length = strlen(partial);
+    for (size_t i = 1; i <= length; i++) {
+        bool end = partial[i] == '/' || partial[i] == '\0';
+#ifdef _WIN32
+        end = end || partial[i] == '\\';
+#endif
+        if (!end) {
+            continue;
+        }
+        char separator = partial[i];
+        partial[i]     = '\0';
+#ifdef _WIN32
+        _mkdir(partial);
+#else
+        mkdir(partial, 0777);
+#endif
+        partial[i] = separator;
+    }
+    struct stat info;
+    return stat(path, &info) == 0 && (info.st_mode & S_IFMT) == S_IFDIR;
+}
+
+/**
+ * Prepares a sink for recording. For the pipe sink this starts ffmpeg reading
+ * raw frames of the given size and pixel format from its stdin; the
+ * container sinks create and preallocate their file; the image sequence sinks
+ * create the frames folder and, if requested, start the PNG encoder threads.
+ *
+ * @param sink   Sink to open.
+ * @param config Sink settings (the strings must outlive the sink).
+ * @param width  Frame width.
+ * @param height Frame height.
+ * @return true on success, false otherwise.
+ */
+bool frameSinkOpen(FrameSink* sink, const SinkConfig* config, int width,
+                   int height) {
+    memset(sink, 0, sizeof(*sink));
+    sink->config   = *config;
+    sink->width    = width;
+    sink->height   = height;
+    sink->rowFrame = -1;
+
+    const char* folder = config->folder;
+    const char* video  = config->video;
+    int         fps    = config->fps;
+
+    if (config->kind == SINK_PIPE) {
+        char encoderArgs[256];
+        char inputArgs[128];
+        formatPipeInputArgs(inputArgs, sizeof(inputArgs), config->pixelFormat,
+                            config->fullRange);
+        formatEncoderArgs(encoderArgs, sizeof(encoderArgs), fps,
+                          config->profile, config->pixelFormat);
+        if (config->pixelFormat != PIXEL_RGBA) {
+            // Frames fed by rows are packed one row at a time
+            size_t bytes =
+                config->byRows
+                    ? (size_t)width * 3
+                    : pixelFormatFrameBytes(config->pixelFormat, width, height);
+            sink->converted = framePoolAllocate(&g_framePool, bytes);
+            if (!sink->converted) {
+                log_and_print(
+                    "Error: Unable to allocate the pixel conversion buffer.\n");
+                return false;
+            }
+        }
+
+        char ffmpegCmd[1024];
+        snprintf(ffmpegCmd, sizeof(ffmpegCmd), "ffmpeg -y -loglevel error -f "
+                 "rawvideo %s -s %dx%d -framerate %d -i - %s \"%s\"", inputArgs,
+                 width, height, fps, encoderArgs, video);
+        log_and_print("Starting ffmpeg: %s\n", ffmpegCmd);
+
+#ifndef _WIN32
+        // A dying ffmpeg must surface as a write error, not kill the app
+        signal(SIGPIPE, SIG_IGN);
+#endif
+        sink->pipe = popen(ffmpegCmd, PIPE_WRITE_MODE);
+        if (!sink->pipe) {
+            log_and_print("Error: Unable to start ffmpeg.\n");
+            return false;
+        }
+#ifndef _WIN32
+        // Keep the pipe out of processes started later (another job's ffmpeg),
+        // or ffmpeg never sees its end
+        fcntl(fileno(sink->pipe), F_SETFD, FD_CLOEXEC);
+#endif
+        setvbuf(sink->pipe, NULL, _IOFBF, 1 << 20);
+    } else if (sinkIsContainer(config->kind)) {
+        if (!frameContainerOpen(&sink->container,
+                                config->kind == SINK_Y4M ? CONTAINER_Y4M
+                                                         : CONTAINER_RAW,
+                                video, width, height, fps, config->frameCount,
+                                config->pixelFormat, config->fullRange)) {
+            return false;
+        }
+    }
+    if (config->kind == SINK_PIPE || sinkIsContainer(config->kind)) {
+        // Encoding overlaps rendering from the first frame: the render thread
+        // only queues frames
+        if (config->writeQueue > 0) {
+            sink->useWriter = frameWriterInit(&sink->writer, config->writeQueue,
+                                              writeQueuedFrame, sink);
+            if (!sink->useWriter) {
+                log_and_print(
+                    "Warning: Writing frames on the render thread instead.\n");
+            }
+        }
+        return true;
+    }
+
+    // Create the output folder if it doesn't exist
+    if (!makeFolder(folder)) {
+        log_and_print("Error: Unable to create the folder %s.\n", folder);
+        return false;
+    }
+
+    if (config->dedup) {
+        sink->runCapacity = config->frameCount > 0 ? config->frameCount : 64;
+        sink->runs        = (FrameRun*)malloc(
+            (size_t)sink->runCapacity * sizeof(FrameRun));
+        if (!sink->runs) {
+            log_and_print(
+                "Error: Unable to allocate the frame deduplication list.\n");
+            return false;
+        }
+        sink->dedup = true;
+    }
+
+    if (config->resume) {
+        // The journal sits next to the folder, so clearing the folder can't
+        // leave a stale one inside
+        char path[512];
+        char header[128];
+        if (config->partial) {
+            snprintf(path, sizeof(path), "%s_%05ld-%05ld.journal", folder,
+                     config->firstFrame,
+                     config->firstFrame + config->frameCount - 1);
+        } else {
+            snprintf(path, sizeof(path), "%s.journal", folder);
+        }
+        snprintf(header, sizeof(header), "shaderapp-journal 1 %dx%d %dfps %s",
+                 width, height, fps, config->frameExtension);
+        // Indexed by absolute frame, so partial recordings keep the frames
+        // before theirs unmarked
+        sink->doneCount = config->frameCount > 0
+                              ? config->firstFrame + config->frameCount
+                              : 0;
+        sink->done      = (unsigned char*)calloc((size_t)sink->doneCount + 1,
+                                                 1);
+        if (!sink->done) {
+            log_and_print("Error: Unable to allocate the resume state.\n");
+            return false;
+        }
+        if (config->dedup) {
+            sink->doneHashes = (uint64_t*)calloc((size_t)sink->doneCount + 1,
+                                                 sizeof(uint64_t));
+            if (!sink->doneHashes) {
+                log_and_print("Error: Unable to allocate the resume state.\n");
+                return false;
+            }
+        }
+        double start = nowSeconds();
+        long   found = frameJournalResume(path, header, folder, config->dedup,
+                                          sink->doneCount, sink->done,
+                                          sink->doneHashes);
+        if (found >= 0) {
+            log_and_print("Resuming: %ld of %ld frames already written and "
+                          "verified in %.2f s.\n", found, config->frameCount,
+                          nowSeconds() - start);
+        }
+        sink->useJournal = frameJournalOpen(&sink->journal, path, header,
+                                            found >= 0);
+        if (!sink->useJournal) {
+            log_and_print("Warning: Recording without a journal; this run "
+                          "can't be resumed.\n");
+        }
+    }
+
+    if (config->encoderThreads > 0) {
+        sink->useEncoders = encoderPoolInit(
+            &sink->encoders, config->encoderThreads, config->encoderThreads * 2,
+            &config->png);
+        if (!sink->useEncoders) {
+            log_and_print(
+                "Warning: Encoding PNGs on the render thread instead.\n");
+        } else if (sink->useJournal) {
+            sink->encoders.journal = &sink->journal;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Converts and writes one RGBA frame, on the writer thread when there is one.
+ */
+static void frameSinkWriteFrame(FrameSink* sink, int frameIndex,
+                                const unsigned char* pixels, int width,
+                                int height) {
+    if (sink->failed) {
+        return;
+    }
+
+    if (sink->config.kind == SINK_PIPE) {
+        if (width != sink->width || height != sink->height) {
+            log_and_print("Error: Frame %d is %d x %d but ffmpeg expects %d x "
+                          "%d; stopping the recording.\n", frameIndex, width,
+                          height, sink->width, sink->height);
+            sink->failed = true;
+            return;
+        }
+        if (sink->converted) {
+            // Convert (and flip) the whole frame, then hand it over in
+            // one write
+            YuvMatrix m     = yuvMatrix(sink->config.fullRange);
+            size_t    bytes = pixelFormatFrameBytes(sink->config.pixelFormat,
+                                                    width, height);
+            convertPixels(pixelKernels(), sink->config.pixelFormat, &m, pixels,
+                          width, height, sink->converted);
+            if (fwrite(sink->converted, 1, bytes, sink->pipe) != bytes) {
+                log_and_print("Error: Writing frame %d to ffmpeg failed; "
+                              "stopping the video.\n", frameIndex);
+                sink->failed = true;
+                return;
+            }
+            sink->frames++;
+            return;
+        }
+        // Send rows top to bottom; OpenGL's origin is at the lower left.
+        size_t rowBytes = (size_t)width * 4;
+        for (int y = height - 1; y >= 0; y--) {
+            if (fwrite(pixels + (size_t)y * rowBytes, 1, rowBytes,
+                       sink->pipe) != rowBytes) {
+                log_and_print("Error: Writing frame %d to ffmpeg failed; "
+                              "stopping the video.\n", frameIndex);
+                sink->failed = true;
+                return;
+            }
+        }
+    } else if (sinkIsContainer(sink->config.kind)) {
+        if (width != sink->width || height != sink->height) {
+            log_and_print("Error: Frame %d is %d x %d but %s holds %d x %d "
+                          "frames; stopping the recording.\n", frameIndex,
+                          width, height, sink->config.video, sink->width,
+                          sink->height);
+            sink->failed = true;
+            return;
+        }
+        if (!frameContainerBeginFrame(&sink->container,
+                                      frameIndex - sink->config.firstFrame)) {
+            sink->failed = true;
+            return;
+        }
+        frameContainerConvertFrame(&sink->container, pixels);
+        frameContainerEndFrame(&sink->container);
+    } else {
+        char frameFile[512];
+        formatFrameFile(frameFile, sizeof(frameFile), &sink->config,
+                        frameIndex);
+        if (sink->useEncoders) {
+            if (!encoderPoolSubmit(&sink->encoders, frameFile, pixels, width,
+                                   height)) {
+                sink->failed = true;
+                return;
+            }
+        } else if (!writeFrame(frameFile, pixels, width, height,
+                               &sink->config.png)) {
+            sink->failed = true;
+            return;
+        } else if (sink->useJournal) {
+            frameJournalRecord(&sink->journal, frameFile);
+        }
+    }
+    sink->frames++;
+}
+
+/**
+ * Writes one frame of GPU-converted planes, on the writer thread when there
+ * is one.
+ */
+static void frameSinkWritePlanes(FrameSink* sink, int frameIndex,
+                                 const unsigned char* planes, int width,
+                                 int height) {
+    if (sink->failed) {
+        return;
+    }
+    if (width != sink->width || height != sink->height) {
+        log_and_print("Error: Frame %d is %d x %d but the %s sink expects %d x "
+                      "%d; stopping the recording.\n", frameIndex, width,
+                      height, sinkKindName(sink->config.kind), sink->width,
+                      sink->height);
+        sink->failed = true;
+        return;
+    }
+
+    size_t bytes = pixelFormatFrameBytes(sink->config.pixelFormat, width,
+                                         height);
+    if (sink->config.kind == SINK_PIPE) {
+        if (fwrite(planes, 1, bytes, sink->pipe) != bytes) {
+            log_and_print("Error: Writing frame %d to ffmpeg failed; stopping "
+                          "the video.\n", frameIndex);
+            sink->failed = true;
+            return;
+        }
+    } else if (sink->config.kind == SINK_Y4M) {
+        if (!frameContainerBeginFrame(&sink->container,
+                                      frameIndex - sink->config.firstFrame)) {
+            sink->failed = true;
+            return;
+        }
+        frameContainerWriteFrame(&sink->container, planes);
+        frameContainerEndFrame(&sink->container);
+    } else {
+        log_and_print(
+            "Error: The %s sink does not take YUV frames; dropping frame %d.\n",
+            sinkKindName(sink->config.kind), frameIndex);
+        return;
+    }
+    sink->frames++;
+}
+
+/**
+ * Writes the rows of a container frame that changed since the previous
+ * frame: the previous record is copied inside the file, then only the
+ * changed rows are converted over it. On the writer thread when there is one.
+ *
+ * @param rows      `dirtyRows` bottom-up RGBA rows, starting at the bottom of
+ *                  the changed band.
+ * @param dirtyTop  First changed row, counted from the top.
+ * @param dirtyRows Number of changed rows (0 for an unchanged frame).
+ */
+static void frameSinkWriteDelta(FrameSink* sink, int frameIndex,
+                                const unsigned char* rows, int width,
+                                int height, int dirtyTop, int dirtyRows) {
+    if (sink->failed) {
+        return;
+    }
+    if (width != sink->width || height != sink->height) {
+        log_and_print("Error: Frame %d is %d x %d but %s holds %d x %d frames; "
+                      "stopping the recording.\n", frameIndex, width, height,
+                      sink->config.video, sink->width, sink->height);
+        sink->failed = true;
+        return;
+    }
+    long record = frameIndex - sink->config.firstFrame;
+    if (dirtyRows < height &&
+        !frameContainerCopyFrame(&sink->container, record - 1, record)) {
+        sink->failed = true;
+        return;
+    }
+    if (dirtyRows > 0) {
+        if (!frameContainerBeginFrame(&sink->container, record)) {
+            sink->failed = true;
+            return;
+        }
+        ptrdiff_t rowBytes = (ptrdiff_t)width * 4;
+        frameContainerWriteRows(&sink->container, dirtyTop,
+                                rows + (dirtyRows - 1) * rowBytes, dirtyRows,
+                                -rowBytes);
+        frameContainerEndFrame(&sink->container);
+    }
+    sink->frames++;
+}
+
+/**
+ * FrameWriteFunc adapter running queued frames through the sink.
+ */
+static bool writeQueuedFrame(void* context, const WriteJob* job) {
+    FrameSink* sink = (FrameSink*)context;
+    if (job->delta) {
+        frameSinkWriteDelta(sink, job->frameIndex, job->data, job->width,
+                            job->height, job->dirtyTop, job->dirtyRows);
+    } else if (job->planes) {
+        frameSinkWritePlanes(sink, job->frameIndex, job->data, job->width,
+                             job->height);
+    } else {
+        frameSinkWriteFrame(sink, job->frameIndex, job->data, job->width,
+                            job->height);
+    }
+    return !sink->failed;
+}
+
+/**
+ * Records a frame of a deduplicating sink: a repeat extends the duration of
+ * the previous distinct frame, anything else starts a new run.
+ *
+ * @return true if the frame must not be written.
+ */
+static bool frameSinkRecordRun(FrameSink* sink, int frameIndex, bool repeat) {
+    if (repeat) {
+        sink->runs[sink->runCount - 1].frames++;
+        sink->frames++;
+        return true;
+    }
+    if (sink->runCount == sink->runCapacity) {
+        FrameRun* runs = (FrameRun*)realloc(
+            sink->runs, (size_t)sink->runCapacity * 2 * sizeof(FrameRun));
+        if (!runs) {
+            log_and_print("Error: Unable to grow the frame deduplication list; "
+                          "stopping the recording.\n");
+            sink->failed = true;
+            return true;
+        }
+        sink->runs = runs;
+        sink->runCapacity *= 2;
+    }
+    sink->runs[sink->runCount++] = (FrameRun){frameIndex, 1};
+    return false;
+}
+
+/**
+ * frameSinkRecordRun for a frame that was just rendered: repeats are also
+ * journaled, since they have no file of their own.
+ */
+static bool frameSinkDedupFrame(FrameSink* sink, int frameIndex, bool repeat) {
+    bool skip = frameSinkRecordRun(sink, frameIndex, repeat);
+    if (repeat && !sink->failed && sink->useJournal) {
+        frameJournalRecordRepeat(&sink->journal, frameIndex);
+    }
+    return skip;
+}
+
+/**
+ * Hashes a frame of a deduplicating sink right after readback. A frame equal
+ * to the previous distinct one only extends that frame's duration; any other
+ * starts a new run.
+ *
+ * @return true if the frame repeats the previous one and must not be written.
+ */
+static bool frameSinkRepeatsFrame(FrameSink* sink, int frameIndex,
+                                  const unsigned char* pixels, int width,
+                                  int height) {
+    double   start = nowSeconds();
+    uint64_t hash  = frameHash(frameHashKernels(), pixels,
+                               (size_t)width * height * 4);
+    sink->hashSeconds += nowSeconds() - start;
+
+    bool repeat       = sink->lastHashSet && hash == sink->lastHash;
+    sink->lastHash    = hash;
+    sink->lastHashSet = true;
+    if (!repeat && sink->useJournal) {
+        frameJournalRecordHash(&sink->journal, frameIndex, hash);
+    }
+    return frameSinkDedupFrame(sink, frameIndex, repeat);
+}
+
+/**
+ * Whether frame `frameIndex` was finished by an earlier run of a resumed
+ * recording, so it needs neither rendering nor encoding.
+ */
+bool frameSinkHasFrame(const FrameSink* sink, int frameIndex) {
+    return sink->done && frameIndex >= 0 && frameIndex < sink->doneCount &&
+           sink->done[frameIndex] != 0;
+}
+
+/**
+ * Accounts for a frame frameSinkHasFrame reported as finished, or a render
+ * worker already wrote, in place of writing it: the frame count and, for
+ * deduplicating sinks, the frame list come out as if the frame had been
+ * rendered here.
+ */
+void frameSinkSkipFrame(FrameSink* sink, int frameIndex) {
+    if (sink->dedup) {
+        bool repeat = sink->done[frameIndex] == 2;
+        if (!frameSinkRecordRun(sink, frameIndex, repeat) && !sink->failed) {
+            sink->frames++;
+            // The next rendered frame is compared with this one through its
+            // journaled hash
+            sink->lastHash    = sink->doneHashes[frameIndex];
+            sink->lastHashSet = sink->lastHash != 0;
+        }
+    } else {
+        sink->frames++;
+    }
+}
+
+/**
+ * Hands one frame to the sink. With a frame writer the frame is copied into
+ * its queue and converted and written on the writer thread. Deduplicating
+ * sinks drop frames that repeat the previous one before any copy or encode.
+ *
+ * @param sink       Open sink.
+ * @param frameIndex Index of the frame in the recording.
+ * @param pixels     RGBA pixel data as returned by glReadPixels (bottom
+ *                   row first).
+ * @param width      Frame width.
+ * @param height     Frame height.
+ */
+void frameSinkWrite(FrameSink* sink, int frameIndex,
+                    const unsigned char* pixels, int width, int height) {
+    if (sink->dedup &&
+        (sink->failed ||
+         frameSinkRepeatsFrame(sink, frameIndex, pixels, width, height))) {
+        return;
+    }
+    if (sink->useWriter) {
+        WriteJob job = {frameIndex, (unsigned char*)pixels,
+                        (size_t)width * height * 4, width, height, false, false,
+                        0, 0};
+        if (!frameWriterSubmit(&sink->writer, &job)) {
+            sink->failed = true;
+        }
+    } else {
+        frameSinkWriteFrame(sink, frameIndex, pixels, width, height);
+    }
+}
+
+/**
+ * Hands one frame converted to planar YUV on the GPU (top-down Y, Cb and Cr
+ * planes in the sink's pixel format) to the pipe or y4m sink.
+ *
+ * @param sink       Open sink.
+ * @param frameIndex Index of the frame in the recording.
+ * @param planes     pixelFormatFrameBytes bytes of planes.
+ * @param width      Frame width.
+ * @param height     Frame height.
+ */
+void frameSinkWriteYuv(FrameSink* sink, int frameIndex,
+                       const unsigned char* planes, int width, int height) {
+    if (sink->useWriter) {
+        WriteJob job = {
+            frameIndex, (unsigned char*)planes,
+            pixelFormatFrameBytes(sink->config.pixelFormat, width, height),
+            width, height, true, false, 0, 0};
+        if (!frameWriterSubmit(&sink->writer, &job)) {
+            sink->failed = true;
+        }
+    } else {
+        frameSinkWritePlanes(sink, frameIndex, planes, width, height);
+    }
+}
+
+/**
+ * Hands one frame to the sink together with the rectangles that changed
+ * since the previous frame (from the GPU frame difference). Sinks use them
+ * where they can: the container sinks write only the rows that changed,
+ * deduplicating sinks take a frame without rectangles as a repeat without
+ * hashing it, and the rest write the whole frame as usual.
+ *
+ * @param sink       Open sink.
+ * @param frameIndex Index of the frame in the recording; frames come in order.
+ * @param pixels     Complete bottom-up RGBA frame.
+ * @param width      Frame width.
+ * @param height     Frame height.
+ * @param rects      Changed rectangles, bottom-up like the frame.
+ * @param rectCount  Number of rectangles; 0 if nothing changed.
+ */
+void frameSinkWriteDirty(FrameSink* sink, int frameIndex,
+                         const unsigned char* pixels, int width, int height,
+                         const DirtyRect* rects, int rectCount) {
+    if (sink->dedup) {
+        sink->gpuCompared = true;
+        bool repeat       = rectCount == 0 && sink->runCount > 0;
+        if (sink->useJournal && (!repeat || sink->lastHashSet)) {
+            // Resumed runs need the hashes: the GPU has nothing to compare a
+            // frame after skipped ones with
+            uint64_t hash = frameHash(frameHashKernels(), pixels,
+                                      (size_t)width * height * 4);
+            repeat        = repeat ||
+                            (sink->lastHashSet && hash == sink->lastHash);
+            if (!repeat) {
+                frameJournalRecordHash(&sink->journal, frameIndex, hash);
+            }
+            sink->lastHashSet = false;
+        }
+        if (!sink->failed && !frameSinkDedupFrame(sink, frameIndex, repeat)) {
+            frameSinkWriteFrame(sink, frameIndex, pixels, width, height);
+        }
+        return;
+    }
+    // yuv420p needs pairs of rows; the first frame always comes as one
+    // rectangle covering it all
+    if (!sinkIsContainer(sink->config.kind) ||
+        sink->config.pixelFormat == PIXEL_YUV420P) {
+        frameSinkWrite(sink, frameIndex, pixels, width, height);
+        return;
+    }
+
+    // Band of rows covering every changed rectangle, counted from the top
+    int top    = height;
+    int bottom = 0;
+    for (int i = 0; i < rectCount; i++) {
+        int rectTop    = height - (rects[i].y + rects[i].height);
+        int rectBottom = height - rects[i].y;
+        top            = rectTop < top ? rectTop : top;
+        bottom         = rectBottom > bottom ? rectBottom : bottom;
+    }
+    int                  dirtyRows = rectCount > 0 ? bottom - top : 0;
+    size_t               rowBytes  = (size_t)width * 4;
+    const unsigned char* rows      =
+        pixels + (size_t)(height - top - dirtyRows) * rowBytes;
+    if (sink->useWriter) {
+        WriteJob job = {frameIndex, (unsigned char*)rows,
+                        (size_t)dirtyRows * rowBytes, width, height, false,
+                        true, top, dirtyRows};
+        if (!frameWriterSubmit(&sink->writer, &job)) {
+            sink->failed = true;
+        }
+    } else {
+        frameSinkWriteDelta(sink, frameIndex, rows, width, height, top,
+                            dirtyRows);
+    }
+}
+
+/**
+ * Starts a frame that will be handed to the sink a few rows at a time, top to
+ * bottom, instead of as one buffer. Image sequence sinks encode it with the
+ * streaming frame writers, so the whole frame never has to be in memory.
+ *
+ * @return true if the sink is ready for the rows.
+ */
+bool frameSinkBeginRows(FrameSink* sink, int frameIndex, int width,
+                        int height) {
+    if (sink->failed) {
+        return false;
+    }
+    if (sink->config.kind == SINK_PIPE) {
+        if (width != sink->width || height != sink->height) {
+            log_and_print("Error: Frame %d is %d x %d but ffmpeg expects %d x "
+                          "%d; stopping the recording.\n", frameIndex, width,
+                          height, sink->width, sink->height);
+            sink->failed = true;
+            return false;
+        }
+    } else if (sinkIsContainer(sink->config.kind)) {
+        if (width != sink->width || height != sink->height) {
+            log_and_print("Error: Frame %d is %d x %d but %s holds %d x %d "
+                          "frames; stopping the recording.\n", frameIndex,
+                          width, height, sink->config.video, sink->width,
+                          sink->height);
+            sink->failed = true;
+            return false;
+        }
+        if (!frameContainerBeginFrame(&sink->container,
+                                      frameIndex - sink->config.firstFrame)) {
+            sink->failed = true;
+            return false;
+        }
+    } else {
+        char frameFile[512];
+        formatFrameFile(frameFile, sizeof(frameFile), &sink->config,
+                        frameIndex);
+        if (!imageStreamOpen(&sink->rowImage, frameFile, width, height,
+                             &sink->config.png)) {
+            sink->failed = true;
+            return false;
+        }
+    }
+    sink->rowFrame = frameIndex;
+    sink->rowsLeft = height;
+    return true;
+}
+
+/**
+ * Hands the next rows of the current row-by-row frame to the sink.
+ *
+ * @param rows     First (topmost) row.
+ * @param rowCount Number of rows.
+ * @param stride   Byte offset from one row to the next (negative for
+ *                 bottom-up buffers).
+ */
+void frameSinkWriteRows(FrameSink* sink, const unsigned char* rows,
+                        int rowCount, ptrdiff_t stride) {
+    if (sink->rowFrame < 0) {
+        return;
+    }
+    if (sink->config.kind == SINK_PIPE) {
+        // Only packed formats can be streamed by rows; planar ones need the
+        // whole frame
+        bool   pack     = sink->config.pixelFormat == PIXEL_RGB24 ||
+                          sink->config.pixelFormat == PIXEL_BGR24;
+        size_t rowBytes = (size_t)sink->width * (pack ? 3 : 4);
+        for (int r = 0; r < rowCount && !sink->failed; r++) {
+            const unsigned char* row = rows + (ptrdiff_t)r * stride;
+            if (pack) {
+                pixelKernels()->packRgb(
+                    sink->converted, row, sink->width,
+                    sink->config.pixelFormat == PIXEL_BGR24);
+                row = sink->converted;
+            }
+            if (fwrite(row, 1, rowBytes, sink->pipe) != rowBytes) {
+                log_and_print("Error: Writing frame %d to ffmpeg failed; "
+                              "stopping the video.\n", sink->rowFrame);
+                sink->failed = true;
+            }
+        }
+    } else if (sinkIsContainer(sink->config.kind)) {
+        frameContainerWriteRows(&sink->container, sink->height - sink->rowsLeft,
+                                rows, rowCount, stride);
+    } else {
+        imageStreamWriteRows(&sink->rowImage, rows, rowCount, stride);
+    }
+    sink->rowsLeft -= rowCount;
+}
+
+/**
+ * Completes the current row-by-row frame.
+ */
+void frameSinkEndRows(FrameSink* sink) {
+    if (sink->rowFrame < 0) {
+        return;
+    }
+    if (sinkIsContainer(sink->config.kind)) {
+        frameContainerEndFrame(&sink->container);
+    } else if (sink->config.kind != SINK_PIPE) {
+        char frameFile[512];
+        formatFrameFile(frameFile, sizeof(frameFile), &sink->config,
+                        sink->rowFrame);
+        if (imageStreamClose(&sink->rowImage)) {
+            log_and_print("Saved frame to: %s\n", frameFile);
+            if (sink->useJournal) {
+                frameJournalRecord(&sink->journal, frameFile);
+            }
+        } else {
+            log_and_print("Error: Failed to write frame file: %s\n", frameFile);
+            sink->failed = true;
+        }
+    } else if (sink->rowsLeft != 0 && !sink->failed) {
+        log_and_print(
+            "Error: Frame %d ended %d rows short; the video is corrupt.\n",
+            sink->rowFrame, sink->rowsLeft);
+        sink->failed = true;
+    }
+    // A failed sink starts no new frames, so this is the one that failed
+    if (!sink->failed) {
+        sink->frames++;
+    }
+    sink->rowFrame = -1;
+}
+
+/**
+ * Adapter letting the tiled renderer feed rows straight into a frame sink.
+ */
+static void emitRowsToSink(void* context, const unsigned char* rows,
+                           int rowCount, ptrdiff_t stride) {
+    frameSinkWriteRows((FrameSink*)context, rows, rowCount, stride);
+}
+
+// Encoder threads per segment; x264 keeps scaling well up to about this many
+// per stream
+#define SEGMENT_ENCODER_THREADS 4
+
+/**
+ * One contiguous range of frame files encoded by its own ffmpeg process.
+ */
+typedef struct {
+    pthread_t thread;
+    int       index;
+    long      firstFrame;
+    long      frameCount;
+    char      output[512];   // Segment video file
+    char      command[1536];
+    int       status;        // Exit status of ffmpeg
+    double    seconds;       // Encode wall time
+} EncodeSegment;
+
+/**
+ * Splits a recording into segments for parallel encoding. Segments start on
+ * keyframes of the profile's GOP, so the joined video keeps its regular
+ * keyframe cadence, and are at least two seconds long, so encoder start-up
+ * and rate-control warm-up stay small against the encode itself.
+ *
+ * @param frames    Frames in the recording.
+ * @param requested Segment count asked for; 0 picks one from the core count.
+ * @param cores     CPU cores available.
+ * @param gopFrames Receives the GOP length segments are aligned to.
+ * @return Number of segments (1 encodes the recording in one piece).
+ */
+int planEncodeSegments(long frames, int fps, const EncodeProfile* profile,
+                       int requested, int cores, long* gopFrames) {
+    long gop       = profileGopFrames(profile, fps);
+    long minFrames = gop > 2L * fps ? gop : 2L * fps;
+    *gopFrames     = gop;
+
+    long count = requested > 0 ? requested : cores / SEGMENT_ENCODER_THREADS;
+    if (requested <= 0 && count > frames / minFrames) {
+        count = frames / minFrames;
+    }
+    // At least one GOP per segment; the last GOP may be partial
+    long gops = (frames + gop - 1) / gop;
+    if (count > gops) {
+        count = gops;
+    }
+    return count < 2 ? 1 : (int)count;
+}
+
+/**
+ * First frame of segment `index`: whole GOPs are spread as evenly as possible.
+ */
+static long segmentFirstFrame(long frames, long gopFrames, int segmentCount,
+                              int index) {
+    long gops  = (frames + gopFrames - 1) / gopFrames;
+    long first = gops * index / segmentCount * gopFrames;
+    return first < frames ? first : frames;
+}
+
+static void* encodeSegmentThreadMain(void* arg) {
+    EncodeSegment* segment = (EncodeSegment*)arg;
+    double         start   = nowSeconds();
+    segment->status        = system(segment->command);
+    segment->seconds       = nowSeconds() - start;
+    return NULL;
+}
+
+/**
+ * Encodes the frame files of a two-pass sink as `segmentCount` segments in
+ * parallel ffmpeg processes, then joins them with the concat demuxer without
+ * re-encoding.
+ *
+ * @param inputArgs   ffmpeg options describing the frame files.
+ * @param encoderArgs ffmpeg encoder options of the profile.
+ * @param gopFrames   GOP length the segments start on.
+ * @return true if the video was produced.
+ */
+static bool encodeSegmented(const FrameSink* sink, const char* inputArgs,
+                            const char* encoderArgs, int segmentCount,
+                            long gopFrames) {
+    const SinkConfig* config    = &sink->config;
+    const char*       extension = strrchr(config->video, '.');
+    if (!extension || strchr(extension, '/') || strchr(extension, '\\')) {
+        extension = ".mkv";
+    }
+    int cores   = cpuCoreCount();
+    int threads = cores / segmentCount > 1 ? cores / segmentCount : 1;
+
+    EncodeSegment* segments = (EncodeSegment*)calloc((size_t)segmentCount,
+                                                     sizeof(EncodeSegment));
+    if (!segments) {
+        log_and_print("Error: Unable to allocate the encode segments.\n");
+        return false;
+    }
+    log_and_print("Encoding %ld frames as %d segments on %ld-frame GOP "
+                  "boundaries (%d threads each)...\n", sink->frames,
+                  segmentCount, gopFrames, threads);
+    double start   = nowSeconds();
+    int    started = 0;
+    for (int i = 0; i < segmentCount; i++) {
+        EncodeSegment* segment = &segments[i];
+        segment->index         = i;
+        segment->firstFrame    =
+            config->firstFrame +
+            segmentFirstFrame(sink->frames, gopFrames, segmentCount, i);
+        segment->frameCount    =
+            config->firstFrame +
+            segmentFirstFrame(sink->frames, gopFrames, segmentCount, i + 1) -
+            segment->firstFrame;
+        char name[32];
+        snprintf(name, sizeof(name), "segment_%03d", i);
+        formatFolderFile(segment->output, sizeof(segment->output), config, name,
+                         extension);
+        snprintf(segment->command, sizeof(segment->command),
+                 "ffmpeg -y -loglevel error -framerate %d %s -start_number %ld "
+                 "-i \"%s/frame_%%05d.%s\" -frames:v %ld %s -threads %d \"%s\"",
+                 config->fps, inputArgs, segment->firstFrame, config->folder,
+                 config->frameExtension, segment->frameCount, encoderArgs,
+                 threads, segment->output);
+        if (pthread_create(&segment->thread, NULL, encodeSegmentThreadMain,
+                           segment) != 0) {
+            log_and_print(
+                "Error: Unable to start the encoder for segment %d.\n", i);
+            break;
+        }
+        started++;
+    }
+
+    bool ok = started == segmentCount;
+    for (int i = 0; i < started; i++) {
+        EncodeSegment* segment = &segments[i];
+        pthread_join(segment->thread, NULL);
+        log_and_print("  Segment %3d: frames %5ld-%5ld, %7.2f s, %7.2f fps%s\n",
+                      i, segment->firstFrame,
+                      segment->firstFrame + segment->frameCount - 1,
+                      segment->seconds, segment->seconds > 0.0
+                          ? segment->frameCount / segment->seconds
+                          : 0.0,
+                      segment->status == 0 ? "" : " FAILED");
+        ok = ok && segment->status == 0;
+    }
+    double encodeSeconds = nowSeconds() - start;
+
+    // Join the segments; every one starts on a keyframe, so the streams are
+    // copied as they are
+    char listFile[512];
+    formatFolderFile(listFile, sizeof(listFile), config, "segments",
+                     ".ffconcat");
+    if (ok) {
+        FILE* list = fopen(listFile, "w");
+        if (list) {
+            fprintf(list, "ffconcat version 1.0\n");
+            for (int i = 0; i < segmentCount; i++) {
+                // Listed relative to the list, which sits next to the segments
+                fprintf(list, "file '%s'\n",
+                        segments[i].output + strlen(config->folder) + 1);
+            }
+            fclose(list);
+            char concatCmd[1280];
+            snprintf(concatCmd, sizeof(concatCmd), "ffmpeg -y -loglevel error "
+                     "-f concat -safe 0 -i \"%s\" -c copy \"%s\"", listFile,
+                     config->video);
+            double joinStart = nowSeconds();
+            ok               = system(concatCmd) == 0;
+            log_and_print(
+                "Segments encoded in %.2f s (%.2f fps), joined in %.2f s.\n",
+                encodeSeconds,
+                encodeSeconds > 0.0 ? sink->frames / encodeSeconds : 0.0,
+                nowSeconds() - joinStart);
+        } else {
+            log_and_print("Error: Unable to write %s.\n", listFile);
+            ok = false;
+        }
+    }
+
+    for (int i = 0; i < segmentCount; i++) {
+        remove(segments[i].output);
+    }
+    remove(listFile);
+    free(segments);
+    return ok;
+}
+
+/**
+ * Writes `folder/frames.ffconcat` (see formatFolderFile), listing the distinct
+ * frame files of a deduplicated recording with how long each one is shown.
+ * ffmpeg's concat demuxer reads it as a variable-frame-rate input.
+ *
+ * @param listFile Receives the path of the list.
+ * @return true if the list was written.
+ */
+static bool writeFrameList(const FrameSink* sink, char* listFile, size_t size) {
+    const SinkConfig* config = &sink->config;
+    formatFolderFile(listFile, size, config, "frames", ".ffconcat");
+    FILE* list = fopen(listFile, "w");
+    if (!list) {
+        log_and_print("Error: Unable to write %s.\n", listFile);
+        return false;
+    }
+    fprintf(list, "ffconcat version 1.0\n");
+    for (long i = 0; i < sink->runCount; i++) {
+        fprintf(list, "file 'frame_%05d.%s'\nduration %.6f\n",
+                sink->runs[i].frameIndex, config->frameExtension,
+                (double)sink->runs[i].frames / config->fps);
+    }
+    if (sink->runCount > 0) {
+        // The demuxer ignores the duration of the last entry unless the file is
+        // listed again
+        fprintf(list, "file 'frame_%05d.%s'\n",
+                sink->runs[sink->runCount - 1].frameIndex,
+                config->frameExtension);
+    }
+    bool written = fclose(list) == 0;
+    if (!written) {
+        log_and_print("Error: Unable to write %s.\n", listFile);
+    }
+    return written;
+}
+
+/**
+ * Finishes the output: waits for ffmpeg on the pipe sink, trims and closes the
+ * file of the container sinks, or runs ffmpeg over the image sequence and
+ * removes the frames on the two-pass sink. Deduplicating sinks log how many
+ * frames repeated and write the frame list with the durations.
+ *
+ * @return true if the output was produced successfully.
+ */
+bool frameSinkClose(FrameSink* sink) {
+    if (sink->useEncoders) {
+        if (!encoderPoolDestroy(&sink->encoders)) {
+            sink->failed = true;
+        }
+        sink->useEncoders = false;
+    }
+    if (sink->useWriter) {
+        frameWriterDestroy(&sink->writer);
+        sink->useWriter = false;
+    }
+    framePoolFree(sink->converted);
+    sink->converted = NULL;
+    free(sink->done);
+    free(sink->doneHashes);
+    sink->done       = NULL;
+    sink->doneHashes = NULL;
+    // Every frame file is on disk and journaled by now; a failed encode below
+    // can still be resumed
+    if (sink->useJournal) {
+        frameJournalClose(&sink->journal);
+    }
+
+    if (sink->config.kind == SINK_PIPE) {
+        if (!sink->pipe) {
+            return false;
+        }
+        log_and_print("Waiting for ffmpeg to finish encoding...\n");
+        int ret = pclose(sink->pipe);
+        sink->pipe = NULL;
+        if (ret != 0 || sink->failed) {
+            log_and_print("Error: ffmpeg command failed.\n");
+            return false;
+        }
+        log_and_print("Video created successfully: %s (%ld frames)\n",
+                      sink->config.video, sink->frames);
+        return true;
+    }
+
+    if (sinkIsContainer(sink->config.kind)) {
+        bool written = frameContainerClose(&sink->container) &&
+                       !sink->failed;
+        if (written) {
+            log_and_print("Frames written to: %s (%ld frames)\n",
+                          sink->config.video, sink->frames);
+        }
+        return written;
+    }
+
+    // Distinct frames and their durations, written before the runs are released
+    char listFile[512] = "";
+    bool repeats       = sink->dedup && sink->runCount < sink->frames;
+    if (sink->dedup) {
+        double hashedBytes =
+            (double)sink->frames * sink->width * sink->height * 4;
+        char   method[64]  = "no frames rendered";
+        if (sink->gpuCompared) {
+            snprintf(method, sizeof(method), "compared on the GPU");
+        } else if (sink->hashSeconds > 0.0) {
+            snprintf(method, sizeof(method), "hashed at %.2f GB/s (%s)",
+                     hashedBytes / sink->hashSeconds / 1e9,
+                     frameHashKernels()->name);
+        }
+        log_and_print(
+            "Deduplication: %ld frames, %ld distinct, %ld repeats skipped "
+            "(%.1f%%); %s.\n",
+            sink->frames, sink->runCount, sink->frames - sink->runCount,
+            sink->frames > 0
+                ? 100.0 * (sink->frames - sink->runCount) / sink->frames
+                : 0.0,
+            method);
+        bool listed = writeFrameList(sink, listFile, sizeof(listFile));
+        free(sink->runs);
+        sink->runs  = NULL;
+        sink->dedup = false;
+        if (!listed) {
+            return false;
+        }
+    }
+
+    if (sink->config.kind == SINK_SEQUENCE) {
+        if (sink->failed) {
+            log_and_print("Error: Frames are missing from %s.\n",
+                          sink->config.folder);
+            return false;
+        }
+        log_and_print("Image sequence written to: %s (%ld frames)\n",
+                      sink->config.folder, sink->frames);
+        if (listFile[0]) {
+            log_and_print("Frame durations: %s\n", listFile);
+        }
+        return true;
+    }
+
+    if (sink->failed) {
+        // The frames that made it stay on disk; encoding them would make a
+        // short video
+        log_and_print("Error: Frames are missing; not encoding %s.\n",
+                      sink->config.video);
+        return false;
+    }
+
+    // Assemble the frames into a video
+    log_and_print("Combining frames into video using ffmpeg...\n");
+    char encoderArgs[256];
+    formatEncoderArgs(encoderArgs, sizeof(encoderArgs), sink->config.fps,
+                      sink->config.profile, PIXEL_RGBA);
+
+    // Raw frames carry no header, so ffmpeg needs their layout spelled out
+    char inputArgs[128] = "";
+    if (strcmp(sink->config.frameExtension, "rgba") == 0) {
+        snprintf(inputArgs, sizeof(inputArgs),
+                 "-f image2 -c:v rawvideo -pix_fmt rgba -video_size %dx%d",
+                 sink->width, sink->height);
+    }
+
+    // Long recordings on many cores are encoded as segments in parallel
+    long gopFrames;
+    int  segmentCount = planEncodeSegments(
+        sink->frames, sink->config.fps, sink->config.profile,
+        sink->config.segments, cpuCoreCount(), &gopFrames);
+    if (repeats) {
+        // Only the distinct frames are encoded, each shown for its duration
+        log_and_print("Encoding %ld distinct frames with their durations "
+                      "(variable frame rate)...\n", sink->runCount);
+        char ffmpegCmd[1024];
+        snprintf(ffmpegCmd, sizeof(ffmpegCmd), "ffmpeg -y -loglevel error -f "
+                 "concat -safe 0 -i \"%s\" -fps_mode vfr %s \"%s\"", listFile,
+                 encoderArgs, sink->config.video);
+        int ret = system(ffmpegCmd);
+        if (ret != 0) {
+            log_and_print("Error: ffmpeg command failed.\n");
+            return false;
+        }
+    } else if (segmentCount > 1) {
+        if (!encodeSegmented(sink, inputArgs, encoderArgs, segmentCount,
+                             gopFrames)) {
+            log_and_print("Error: ffmpeg command failed.\n");
+            return false;
+        }
+    } else {
+        char ffmpegCmd[1024];
+        snprintf(ffmpegCmd, sizeof(ffmpegCmd),
+                 "ffmpeg -y -framerate %d %s -start_number %ld -i "
+                 "\"%s/frame_%%05d.%s\" -frames:v %ld %s \"%s\"",
+                 sink->config.fps, inputArgs, sink->config.firstFrame,
+                 sink->config.folder, sink->config.frameExtension, sink->frames,
+                 encoderArgs, sink->config.video);
+
+        int ret = system(ffmpegCmd);
+        if (ret != 0) {
+            log_and_print("Error: ffmpeg command failed.\n");
+            return false;
+        }
+    }
+    if (listFile[0]) {
+        remove(listFile);
+    }
+    log_and_print("Video created successfully: %s\n", sink->config.video);
+    if (sink->useJournal) {
+        remove(sink->journal.path);
+    }
+    log_and_print("Removing temporary frame images...\n");
+    // Only this recording's frames: other parts of it, or other jobs, may be
+    // using the same folder
+    for (long i = sink->config.firstFrame;
+         i < sink->config.firstFrame + sink->frames; i++) {
+        char frameFile[512];
+        formatFrameFile(frameFile, sizeof(frameFile), &sink->config, (int)i);
+        remove(frameFile);
+    }
+    return true;
+}
+
+/**
+ * Names the output of one shard of a recording after the full output:
+ * `out.mp4` becomes `out.shard002-of-008.mp4`, so the names sort in frame
+ * order for mergeOutputs.
+ */
+static void formatShardOutput(char* buffer, size_t size, const char* output,
+                              int shardIndex, int shardCount) {
+    const char* extension = strrchr(output, '.');
+    if (!extension || strchr(extension, '/') || strchr(extension, '\\')) {
+        extension = output + strlen(output);
+    }
+    snprintf(buffer, size, "%.*s.shard%03d-of-%03d%s",
+             (int)(extension - output), output, shardIndex, shardCount,
+             extension);
+}
+
+/**
+ * Appends the rest of `in`, from its current position, to `out`.
+ *
+ * @return Bytes copied, or -1 on a read or write error.
+ */
+static long long appendFile(FILE* out, FILE* in, unsigned char* buffer,
+                            size_t size) {
+    long long copied = 0;
+    size_t    got;
+    while ((got = fread(buffer, 1, size, in)) > 0) {
+        if (fwrite(buffer, 1, got, out) != got) {
+            return -1;
+        }
+        copied += (long long)got;
+    }
+    return ferror(in) ? -1 : copied;
+}
+
+/**
+ * Joins YUV4MPEG2 files with the same stream header: the header of the first
+ * file, then the frames of every file.
+ */
+static bool mergeY4mFiles(const char* output, int count, char** inputs,
+                          unsigned char* buffer, size_t size) {
+    FILE* out = fopen(output, "wb");
+    if (!out) {
+        log_and_print("Error: Unable to create %s.\n", output);
+        return false;
+    }
+    char first[256] = "";
+    bool ok         = true;
+    for (int i = 0; i < count && ok; i++) {
+        FILE* in = fopen(inputs[i], "rb");
+        char  header[256];
+        if (!in || !fgets(header, sizeof(header), in) ||
+            strncmp(header, "YUV4MPEG2 ", 10) != 0) {
+            log_and_print("Error: %s is not a YUV4MPEG2 file.\n", inputs[i]);
+            ok = false;
+        } else if (i > 0 && strcmp(header, first) != 0) {
+            log_and_print("Error: %s has a different stream header than %s.\n",
+                          inputs[i], inputs[0]);
+            ok = false;
+        } else {
+            if (i == 0) {
+                snprintf(first, sizeof(first), "%s", header);
+                ok = fputs(header, out) >= 0;
+            }
+            ok = ok && appendFile(out, in, buffer, size) >= 0;
+            if (!ok) {
+                log_and_print("Error: Copying %s into %s failed.\n", inputs[i],
+                              output);
+            }
+        }
+        if (in) {
+            fclose(in);
+        }
+    }
+    return fclose(out) == 0 && ok;
+}
+
+/**
+ * Joins raw container files whose sidecars describe the same frames: the
+ * files are concatenated and the sidecar of the first is rewritten for the
+ * output with the total frame count.
+ */
+static bool mergeRawFiles(const char* output, int count, char** inputs,
+                          unsigned char* buffer, size_t size) {
+    // Everything but the frame count and the ffmpeg input line must match
+    char layout[1024]      = "";
+    char ffmpegInput[1024] = "";
+    long frames            = 0;
+    for (int i = 0; i < count; i++) {
+        char sidecarName[512];
+        snprintf(sidecarName, sizeof(sidecarName), "%s.txt", inputs[i]);
+        FILE* sidecar = fopen(sidecarName, "r");
+        if (!sidecar) {
+            log_and_print("Error: Unable to read %s.\n", sidecarName);
+            return false;
+        }
+        char   lines[1024] = "";
+        size_t used        = 0;
+        long   fileFrames  = -1;
+        char   line[512];
+        while (fgets(line, sizeof(line), sidecar)) {
+            if (strncmp(line, "frames=", 7) == 0) {
+                fileFrames = atol(line + 7);
+            } else if (strncmp(line, "ffmpeg_input=", 13) == 0) {
+                if (i == 0) {
+                    snprintf(ffmpegInput, sizeof(ffmpegInput), "%s", line);
+                }
+            } else if (used + strlen(line) < sizeof(lines)) {
+                memcpy(lines + used, line, strlen(line) + 1);
+                used += strlen(line);
+            }
+        }
+        fclose(sidecar);
+        if (fileFrames < 0) {
+            log_and_print("Error: %s has no frame count.\n", sidecarName);
+            return false;
+        }
+        if (i == 0) {
+            snprintf(layout, sizeof(layout), "%s", lines);
+        } else if (strcmp(layout, lines) != 0) {
+            log_and_print("Error: %s holds different frames than %s.\n",
+                          inputs[i], inputs[0]);
+            return false;
+        }
+        frames += fileFrames;
+    }
+
+    FILE* out = fopen(output, "wb");
+    if (!out) {
+        log_and_print("Error: Unable to create %s.\n", output);
+        return false;
+    }
+    bool ok = true;
+    for (int i = 0; i < count && ok; i++) {
+        FILE* in = fopen(inputs[i], "rb");
+        ok       = in && appendFile(out, in, buffer, size) >= 0;
+        if (!ok) {
+            log_and_print("Error: Copying %s into %s failed.\n", inputs[i],
+                          output);
+        }
+        if (in) {
+            fclose(in);
+        }
+    }
+    ok = fclose(out) == 0 && ok;
+    if (!ok) {
+        return false;
+    }
+
+    char sidecarName[512];
+    snprintf(sidecarName, sizeof(sidecarName), "%s.txt", output);
+    FILE* sidecar = fopen(sidecarName, "w");
+    if (!sidecar) {
+        log_and_print("Error: Unable to write %s.\n", sidecarName);
+        return false;
+    }
+    fprintf(sidecar, "%sframes=%ld\n", layout, frames);
+    // The input options stay; only the file they point at changes
+    char* file = strstr(ffmpegInput, " -i \"");
+    if (file) {
+        fprintf(sidecar, "%.*s -i \"%s\"\n", (int)(file - ffmpegInput),
+                ffmpegInput, output);
+    }
+    return fclose(sidecar) == 0;
+}
+
+/**
+ * Joins encoded videos with ffmpeg's concat demuxer, copying the streams.
+ * Each part starts on a keyframe of its own encode, so nothing is re-encoded.
+ */
+static bool mergeVideoFiles(const char* output, int count, char** inputs) {
+    char listFile[512];
+    snprintf(listFile, sizeof(listFile), "%s.ffconcat", output);
+    FILE* list = fopen(listFile, "w");
+    if (!list) {
+        log_and_print("Error: Unable to write %s.\n", listFile);
+        return false;
+    }
+    fprintf(list, "ffconcat version 1.0\n");
+    for (int i = 0; i < count; i++) {
+        // The demuxer resolves relative names against the list, so every part
+        // is listed by its full path
+        char path[4096];
+#ifdef _WIN32
+        bool resolved = _fullpath(path, inputs[i], sizeof(path)) != NULL;
+#else
+        bool resolved = realpath(inputs[i], path) != NULL;
+#endif
+        if (!resolved) {
+            log_and_print("Error: Unable to find %s.\n", inputs[i]);
+            fclose(list);
+            remove(listFile);
+            return false;
+        }
+        fprintf(list, "file '%s'\n", path);
+    }
+    if (fclose(list) != 0) {
+        log_and_print("Error: Unable to write %s.\n", listFile);
+        remove(listFile);
+        return false;
+    }
+    char concatCmd[1280];
+    snprintf(
+        concatCmd, sizeof(concatCmd),
+        "ffmpeg -y -loglevel error -f concat -safe 0 -i \"%s\" -c copy \"%s\"",
+        listFile, output);
+    log_and_print("Starting ffmpeg: %s\n", concatCmd);
+    bool ok = system(concatCmd) == 0;
+    remove(listFile);
+    if (!ok) {
+        log_and_print("Error: ffmpeg command failed.\n");
+    }
+    return ok;
+}
+
+/**
+ * Stitches the outputs of the parts of a recording (--frame-range or --shard)
+ * into the final output, in the order given, without re-encoding. YUV4MPEG2
+ * and raw container files are joined frame for frame; videos are joined by
+ * ffmpeg copying their streams.
+ *
+ * @param output Final output file.
+ * @param count  Number of parts.
+ * @param inputs Part files, in frame order.
+ * @return true if the output was written.
+ */
+bool mergeOutputs(const char* output, int count, char** inputs) {
+    if (count < 1) {
+        log_and_print(
+            "Error: --merge expects an output file and the files to join.\n");
+        return false;
+    }
+    const char* extension = strrchr(output, '.');
+    char        sidecarName[512];
+    snprintf(sidecarName, sizeof(sidecarName), "%s.txt", inputs[0]);
+    FILE* sidecar = fopen(sidecarName, "r");
+    bool  raw     = sidecar != NULL;
+    if (sidecar) {
+        fclose(sidecar);
+    }
+
+    log_and_print("Merging %d parts into %s...\n", count, output);
+    double start = nowSeconds();
+    bool   ok;
+    if ((extension && strcmp(extension, ".y4m") == 0) || raw) {
+        size_t         size   = (size_t)1 << 20;
+        unsigned char* buffer = (unsigned char*)malloc(size);
+        if (!buffer) {
+            log_and_print("Error: Unable to allocate the copy buffer.\n");
+            return false;
+        }
+        ok = raw ? mergeRawFiles(output, count, inputs, buffer, size)
+                 : mergeY4mFiles(output, count, inputs, buffer, size);
+        free(buffer);
+    } else {
+        ok = mergeVideoFiles(output, count, inputs);
+    }
+    if (ok) {
+        log_and_print("Merged %d parts into %s in %.2f s.\n", count, output,
+                      nowSeconds() - start);
+    }
+    return ok;
+}
+
+// Text file where measured encode throughput is kept between runs
+#define PROFILE_CALIBRATION_FILE "shaderapp_profiles.cal"
+
+/**
+ * Number of consecutive sample frames used to calibrate the encode profiles:
+ * enough for the inter-frame profiles to reach their steady state, capped at
+ * about 512 MB of frames.
+ */
+static int profileSampleCount(int width, int height) {
+    size_t frameBytes = (size_t)width * height * 4;
+    size_t fit        = ((size_t)512 << 20) / (frameBytes > 0 ? frameBytes : 1);
+    return fit < 4 ? 4 : fit > 48 ? 48 : (int)fit;
+}
+
+/**
+ * Encode throughput of every profile on this machine, for frames of one size,
+ * pixel format, frame rate and range.
+ */
+typedef struct {
+    int         width;
+    int         height;
+    PixelFormat pixelFormat;
+    int         fps;
+    bool        fullRange;
+    double      encodeFps[ENCODE_PROFILE_COUNT];  // 0 when unknown or the
+                                                  // encode failed
+} ProfileCalibration;
+
+/**
+ * Times every encode profile by piping sample frames through ffmpeg into its
+ * null muxer, exactly as the pipe sink would feed them.
+ *
+ * @param frames      `frameCount` consecutive bottom-up RGBA frames
+ *                    (consecutive frames matter, since most profiles predict
+ *                    between them).
+ * @param frameCount  Number of frames.
+ * @param width       Frame width.
+ * @param height      Frame height.
+ * @param fps         Frame rate, which sets the keyframe interval.
+ * @param pixelFormat Pixel format the frames are piped in.
+ * @param fullRange   YUV pixel formats use full-range levels.
+ * @param cal         Receives the measured frames per second.
+ * @return true if at least one profile could be measured.
+ */
+bool calibrateEncodeProfiles(
+    const unsigned char* frames, int frameCount, int width, int height, int fps,
+    PixelFormat pixelFormat, bool fullRange, ProfileCalibration* cal) {
+    memset(cal, 0, sizeof(*cal));
+    cal->width       = width;
+    cal->height      = height;
+    cal->pixelFormat = pixelFormat;
+    cal->fps         = fps;
+    cal->fullRange   = fullRange;
+
+    size_t         rgbaBytes  = (size_t)width * height * 4;
+    size_t         frameBytes = pixelFormatFrameBytes(pixelFormat, width,
+                                                      height);
+    unsigned char* converted  = (unsigned char*)malloc(frameBytes * frameCount);
+    if (!converted) {
+        log_and_print("Error: Unable to allocate calibration buffers.\n");
+        return false;
+    }
+    YuvMatrix m = yuvMatrix(fullRange);
+    for (int f = 0; f < frameCount; f++) {
+        convertPixels(pixelKernels(), pixelFormat, &m, frames + rgbaBytes * f,
+                      width, height, converted + frameBytes * f);
+    }
+
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    bool measured = false;
+    log_and_print(
+        "Calibrating encode profiles on %d frames of %d x %d (%s input):\n",
+        frameCount, width, height, g_pixelFormatNames[pixelFormat]);
+    for (int p = 0; p < ENCODE_PROFILE_COUNT; p++) {
+        char inputArgs[128], encoderArgs[256], ffmpegCmd[1024];
+        formatPipeInputArgs(inputArgs, sizeof(inputArgs), pixelFormat,
+                            fullRange);
+        formatEncoderArgs(encoderArgs, sizeof(encoderArgs), fps,
+                          &g_encodeProfiles[p], pixelFormat);
+        snprintf(ffmpegCmd, sizeof(ffmpegCmd), "ffmpeg -y -loglevel error -f "
+                 "rawvideo %s -s %dx%d -framerate %d -i - %s -f null -",
+                 inputArgs, width, height, fps, encoderArgs);
+
+        double start = nowSeconds();
+        FILE*  pipe  = popen(ffmpegCmd, PIPE_WRITE_MODE);
+        bool   ok    = pipe != NULL;
+        for (int f = 0; ok && f < frameCount; f++) {
+            ok = fwrite(converted + frameBytes * f, 1, frameBytes,
+                        pipe) == frameBytes;
+        }
+        if (pipe && pclose(pipe) != 0) {
+            ok = false;
+        }
+        double elapsed = nowSeconds() - start;
+        if (ok && elapsed > 0.0) {
+            cal->encodeFps[p] = frameCount / elapsed;
+            measured          = true;
+            log_and_print("  %-9s: %8.2f fps (%s)\n", g_encodeProfiles[p].name,
+                          cal->encodeFps[p], encoderArgs);
+        } else {
+            log_and_print("  %-9s: failed (%s)\n", g_encodeProfiles[p].name,
+                          ffmpegCmd);
+        }
+    }
+    free(converted);
+    return measured;
+}
+
+/**
+ * Appends a calibration to the calibration file; later entries for the same
+ * frame size, pixel format, frame rate and range replace earlier ones when it
+ * is loaded.
+ */
+bool saveProfileCalibration(const char* path, const ProfileCalibration* cal) {
+    FILE* file = fopen(path, "a");
+    if (!file) {
+        log_and_print("Warning: Unable to write %s.\n", path);
+        return false;
+    }
+    for (int p = 0; p < ENCODE_PROFILE_COUNT; p++) {
+        if (cal->encodeFps[p] > 0.0) {
+            fprintf(file, "%dx%d %s %d %s %s %.3f\n", cal->width,
+                    cal->height, g_pixelFormatNames[cal->pixelFormat], cal->fps,
+                    cal->fullRange ? "full" : "limited",
+                    g_encodeProfiles[p].name, cal->encodeFps[p]);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+/**
+ * Reads the calibration of `width` x `height` frames, piped in `pixelFormat`
+ * at `fps` with the given range, from the calibration file.
+ *
+ * @return true if every profile has a measurement.
+ */
+bool loadProfileCalibration(const char* path, int width, int height,
+                            PixelFormat pixelFormat, int fps, bool fullRange,
+                            ProfileCalibration* cal) {
+    memset(cal, 0, sizeof(*cal));
+    cal->width       = width;
+    cal->height      = height;
+    cal->pixelFormat = pixelFormat;
+    cal->fps         = fps;
+    cal->fullRange   = fullRange;
+    FILE* file       = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        int    w, h, rate;
+        char   format[16], range[16], name[64];
+        double encodeFps;
+        if (sscanf(line, "%dx%d %15s %d %15s %63s %lf", &w, &h, format, &rate,
+                   range, name, &encodeFps) != 7 ||
+            w != width || h != height ||
+            strcmp(format, g_pixelFormatNames[pixelFormat]) != 0 ||
+            rate != fps ||
+            strcmp(range, fullRange ? "full" : "limited") != 0) {
+            continue;
+        }
+        const EncodeProfile* profile = encodeProfileByName(name);
+        if (profile) {
+            cal->encodeFps[profile - g_encodeProfiles] = encodeFps;
+        }
+    }
+    fclose(file);
+    for (int p = 0; p < ENCODE_PROFILE_COUNT; p++) {
+        if (cal->encodeFps[p] <= 0.0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Estimates the wall-clock time of a recording with one profile. With the
+ * pipe sink rendering and encoding overlap, so the slower stage sets the pace;
+ * the two-pass sink encodes only after rendering, in parallel segments.
+ *
+ * @param cal        Encode throughput, scaled from its frame size to the
+ *                   recording's.
+ * @param renderFps  Measured rendering and readback throughput.
+ * @param overlapped Whether encoding runs alongside rendering.
+ * @param segments   Segments encoded in parallel after rendering (1 for
+ *                   one piece).
+ * @return Estimated seconds, or a negative value if the profile was
+ *         not measured.
+ */
+double estimateRecordingSeconds(const ProfileCalibration* cal, int profile,
+                                long frames, int width, int height,
+                                double renderFps, bool overlapped,
+                                int segments) {
+    if (cal->encodeFps[profile] <= 0.0 || renderFps <= 0.0) {
+        return -1.0;
+    }
+    double encodeFps =
+        cal->encodeFps[profile] * ((double)cal->width * cal->height) /
+        ((double)width * height);
+    if (overlapped) {
+        return frames / (encodeFps < renderFps ? encodeFps : renderFps);
+    }
+    return frames / renderFps + frames / (encodeFps * segments);
+}
+
+/**
+ * Picks the best-quality profile whose estimated recording time fits in the
+ * budget, or the fastest one if none does.
+ *
+ * @param fps      Frame rate, which sets the GOP the two-pass segments are
+ *                 planned on.
+ * @param segments Two-pass segment count asked for; 0 picks one.
+ * @return The chosen profile.
+ */
+const EncodeProfile* selectEncodeProfile(
+    const ProfileCalibration* cal, long frames, int width, int height, int fps,
+    double renderFps, bool overlapped, int segments, double budgetSeconds) {
+    log_and_print("Choosing an encode profile for %ld frames of %d x %d within "
+                  "%.1f s (rendering at %.2f fps):\n", frames, width, height,
+                  budgetSeconds, renderFps);
+    int fastest = -1;
+    for (int p = ENCODE_PROFILE_COUNT - 1; p >= 0; p--) {
+        // Segments start on keyframes, so their count depends on the GOP
+        int planned = 1;
+        if (!overlapped) {
+            long gopFrames;
+            planned = planEncodeSegments(frames, fps, &g_encodeProfiles[p],
+                                         segments, cpuCoreCount(), &gopFrames);
+        }
+        double seconds = estimateRecordingSeconds(
+            cal, p, frames, width, height, renderFps, overlapped, planned);
+        if (seconds < 0.0) {
+            log_and_print("  %-9s: not measured\n", g_encodeProfiles[p].name);
+            continue;
+        }
+        if (overlapped) {
+            log_and_print("  %-9s: about %.1f s\n", g_encodeProfiles[p].name,
+                          seconds);
+        } else {
+            log_and_print("  %-9s: about %.1f s (%d encode segments)\n",
+                          g_encodeProfiles[p].name, seconds, planned);
+        }
+        if (seconds <= budgetSeconds) {
+            return &g_encodeProfiles[p];
+        }
+        fastest = p;
+    }
+    if (fastest < 0) {
+        fastest = 0;
+    }
+    log_and_print(
+        "Warning: No profile fits in %.1f s; using the fastest, %s.\n",
+        budgetSeconds, g_encodeProfiles[fastest].name);
+    return &g_encodeProfiles[fastest];
+}
+
+/**
+ * Calibrates the encode profiles on rendered sample frames, stores the result
+ * in the calibration file and prints the time each profile would take for a
+ * recording of `frames` frames.
+ *
+ * @param renderSeconds Time taken to render and read back the samples.
+ */
+void runProfileBenchmark(const unsigned char* samples, int sampleCount,
+                         int width, int height, int fps,
+                         PixelFormat pixelFormat, bool fullRange,
+                         double renderSeconds, long frames) {
+    ProfileCalibration cal;
+    if (!calibrateEncodeProfiles(samples, sampleCount, width, height, fps,
+                                 pixelFormat, fullRange, &cal)) {
+        log_and_print("Error: No encode profile could be measured; is ffmpeg "
+                      "installed?\n");
+        return;
+    }
+    saveProfileCalibration(PROFILE_CALIBRATION_FILE, &cal);
+    double renderFps = renderSeconds > 0.0 ? sampleCount / renderSeconds : 0.0;
+    log_and_print(
+        "Rendering: %.2f fps. Estimated time for %ld frames (pipe sink):\n",
+        renderFps, frames);
+    for (int p = 0; p < ENCODE_PROFILE_COUNT; p++) {
+        double seconds = estimateRecordingSeconds(&cal, p, frames, width,
+                                                  height, renderFps, true, 1);
+        if (seconds >= 0.0) {
+            log_and_print("  %-9s: %8.1f s, %s-bound\n",
+                          g_encodeProfiles[p].name, seconds,
+                          cal.encodeFps[p] < renderFps ? "encode" : "render");
+        }
+    }
+    log_and_print("Calibration saved to %s.\n", PROFILE_CALIBRATION_FILE);
+}
+
+/**
+ * Reads the current framebuffer and hands it to the frame sink, as RGBA or,
+ * with a YUV converter, as the planes converted on the GPU.
+ *
+ * @param sink       Open frame sink.
+ * @param yuv        GPU YUV converter, or NULL to read back RGBA.
+ * @param frameIndex Index of the frame in the recording.
+ * @param width      Current framebuffer width.
+ * @param height     Current framebuffer height.
+ */
+void captureFrame(FrameSink* sink, YuvConverter* yuv, int frameIndex, int width,
+                  int height) {
+    size_t         frameBytes = yuv ? yuvFrameBytes(yuv->layout, width, height)
+                                    : (size_t)width * height * 4;
+    unsigned char* pixels     = framePoolAcquire(&g_framePool, frameBytes);
+    if (!pixels) {
+        log_and_print("Error: Unable to allocate memory for frame %d; "
+                      "stopping the recording.\n", frameIndex);
+        sink->failed = true;
+        return;
+    }
+    if (yuv) {
+        yuvConverterRun(yuv, width, height);
+        yuvConverterReadPlanes(yuv, pixels);
+        if (yuv->validate) {
+            yuvConverterValidate(yuv, pixels);
+        }
+        frameSinkWriteYuv(sink, frameIndex, pixels, width, height);
+    } else {
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        frameSinkWrite(sink, frameIndex, pixels, width, height);
+    }
+
+    framePoolRelease(&g_framePool, pixels, frameBytes);
+}
+
+/**
+ * Reads back only what changed since the previous frame, as found by the GPU
+ * frame difference, and hands the frame and its changed rectangles to the sink.
+ *
+ * @param sink       Open frame sink.
+ * @param diff       GPU frame difference.
+ * @param frameIndex Index of the frame in the recording.
+ * @param width      Current framebuffer width.
+ * @param height     Current framebuffer height.
+ */
+void captureFrameDiff(FrameSink* sink, FrameDiffer* diff, int frameIndex,
+                      int width, int height) {
+    int rectCount = frameDifferCapture(diff, width, height);
+    if (rectCount < 0) {
+        // The frame is missing, and the next delta has no previous frame to
+        // start from
+        log_and_print("Error: Unable to capture frame %d.\n", frameIndex);
+        sink->failed = true;
+        diff->primed = false;
+        return;
+    }
+    frameSinkWriteDirty(sink, frameIndex, diff->frame, width, height,
+                        diff->rects, rectCount);
+}
+
+// Upper bound for the number of pixel-buffer objects in the readback ring
+#define PBO_RING_MAX 16
+
+/**
+ * Ring of pixel-buffer objects used for asynchronous framebuffer readback.
+ *
+ * Each captured frame queues a glReadPixels into the next PBO and drops a fence
+ * behind it. A PBO is only mapped once the ring wraps around to it, by which
+ * time the GPU has usually finished the transfer, so rendering of frame N
+ * overlaps with the readback of frame N - depth + 1.
+ */
+typedef struct {
+    GLuint        pbos[PBO_RING_MAX];
+    GLsync        fences[PBO_RING_MAX];
+    int           frameIndices[PBO_RING_MAX];
+    int           depth;    // Number of PBOs in the ring
+    int           head;     // Next slot to receive a readback
+    int           pending;  // Slots holding a readback that was not written
+                            // out yet
+    int           width;
+    int           height;
+    long          frames;   // Frames that went through the ring
+    long          stalls;   // Frames whose fence had not signalled when needed
+    YuvConverter* yuv;      // Reads back GPU-converted YUV planes instead of
+                            // RGBA when set
+} PboRing;
+
+/**
+ * Returns the size of one readback in the ring.
+ */
+static size_t pboRingFrameBytes(const PboRing* ring, int width, int height) {
+    return ring->yuv ? yuvFrameBytes(ring->yuv->layout, width, height)
+                     : (size_t)width * height * 4;
+}
+
+/**
+ * Creates the PBOs backing the ring.
+ *
+ * @param ring   Ring to initialize.
+ * @param depth  Number of PBOs (clamped to 1..PBO_RING_MAX).
+ * @param width  Framebuffer width.
+ * @param height Framebuffer height.
+ * @param yuv    GPU YUV converter whose planes are read back, or NULL for RGBA.
+ * @return true on success, false if the PBOs could not be created.
+ */
+bool pboRingInit(PboRing* ring, int depth, int width, int height,
+                 YuvConverter* yuv) {
+    memset(ring, 0, sizeof(*ring));
+    glGetError();  // Clear stale errors so the check below only sees ours
+    if (depth < 1) {
+        depth = 1;
+    }
+    if (depth > PBO_RING_MAX) {
+        log_and_print("Warning: PBO ring depth %d clamped to %d.\n", depth,
+                      PBO_RING_MAX);
+        depth = PBO_RING_MAX;
+    }
+    ring->depth  = depth;
+    ring->width  = width;
+    ring->height = height;
+    ring->yuv    = yuv;
+
+    glGenBuffers(depth, ring->pbos);
+    for (int i = 0; i < depth; i++) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, ring->pbos[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER,
+                     (GLsizeiptr)pboRingFrameBytes(ring, width, height), NULL,
+                     GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    if (glGetError() != GL_NO_ERROR) {
+        log_and_print("Error: Unable to create %d pixel-buffer objects.\n",
+                      depth);
+        glDeleteBuffers(depth, ring->pbos);
+        return false;
+    }
+    log_and_print("PBO readback ring created (%d buffers of %d x %d).\n", depth,
+                  width, height);
+    return true;
+}
+
+/**
+ * Waits for the oldest pending readback, maps its PBO and hands the frame to
+ * the sink.
+ */
+static void pboRingRetire(PboRing* ring, FrameSink* sink) {
+    int slot = (ring->head - ring->pending + ring->depth) % ring->depth;
+
+    GLenum status = glClientWaitSync(ring->fences[slot],
+                                     GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    if (status == GL_TIMEOUT_EXPIRED) {
+        ring->stalls++;
+        do {
+            status = glClientWaitSync(ring->fences[slot],
+                                      GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        } while (status == GL_TIMEOUT_EXPIRED);
+    }
+    glDeleteSync(ring->fences[slot]);
+    ring->fences[slot] = NULL;
+    if (status == GL_WAIT_FAILED) {
+        // The readback may not have landed: the frame is lost
+        log_and_print("Error: Waiting on readback fence for frame %d failed.\n",
+                      ring->frameIndices[slot]);
+        sink->failed = true;
+        ring->pending--;
+        return;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, ring->pbos[slot]);
+    const unsigned char* pixels = (const unsigned char*)glMapBufferRange(
+        GL_PIXEL_PACK_BUFFER, 0,
+        (GLsizeiptr)pboRingFrameBytes(ring, ring->width, ring->height),
+        GL_MAP_READ_BIT);
+    if (!pixels) {
+        log_and_print("Error: Unable to map pixel-buffer object for frame %d\n",
+                      ring->frameIndices[slot]);
+        sink->failed = true;
+    } else if (ring->yuv) {
+        frameSinkWriteYuv(sink, ring->frameIndices[slot], pixels, ring->width,
+                          ring->height);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        frameSinkWrite(sink, ring->frameIndices[slot], pixels, ring->width,
+                       ring->height);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    ring->pending--;
+}
+
+/**
+ * Hands every pending frame to the sink, oldest first.
+ */
+void pboRingFlush(PboRing* ring, FrameSink* sink) {
+    while (ring->pending > 0) {
+        pboRingRetire(ring, sink);
+    }
+}
+
+/**
+ * Queues an asynchronous readback of the current framebuffer into the ring.
+ * When the ring is full, the oldest frame is handed to the sink first. If the
+ * framebuffer was resized, pending frames are flushed and the PBOs reallocated.
+ *
+ * @param ring       Initialized PBO ring.
+ * @param sink       Frame sink receiving the frames once they are read back.
+ * @param frameIndex Index of the frame in the recording.
+ * @param width      Current framebuffer width.
+ * @param height     Current framebuffer height.
+ */
+void pboRingCapture(PboRing* ring, FrameSink* sink, int frameIndex, int width,
+                    int height) {
+    if (width != ring->width || height != ring->height) {
+        pboRingFlush(ring, sink);
+        for (int i = 0; i < ring->depth; i++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, ring->pbos[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER,
+                         (GLsizeiptr)pboRingFrameBytes(ring, width, height),
+                         NULL, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        ring->width  = width;
+        ring->height = height;
+        log_and_print("PBO ring resized to %d x %d.\n", width, height);
+    }
+    if (ring->pending == ring->depth) {
+        pboRingRetire(ring, sink);
+    }
+
+    int slot = ring->head;
+    if (ring->yuv) {
+        yuvConverterRun(ring->yuv, ring->width, ring->height);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, ring->pbos[slot]);
+    if (ring->yuv) {
+        yuvConverterReadPlanes(ring->yuv, (unsigned char*)0);
+    } else {
+        glReadPixels(0, 0, ring->width, ring->height, GL_RGBA, GL_UNSIGNED_BYTE,
+                     (void*)0);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    ring->fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    ring->frameIndices[slot] = frameIndex;
+
+    ring->head = (ring->head + 1) % ring->depth;
+    ring->pending++;
+    ring->frames++;
+}
+
+/**
+ * Hands every pending frame to the sink, then releases the PBOs and
+ * reports stalls.
+ */
+void pboRingDestroy(PboRing* ring, FrameSink* sink) {
+    pboRingFlush(ring, sink);
+    glDeleteBuffers(ring->depth, ring->pbos);
+    log_and_print("PBO ring: %ld frames read back, %ld stalled waiting on the "
+                  "GPU (depth %d).\n", ring->frames, ring->stalls, ring->depth);
+}
+
+/**
+ * Renders and reads back consecutive frames outside the render loop, for the
+ * benchmarks and the encode profile calibration.
+ *
+ * @param timeStep Shader time between frames.
+ * @param pixels   Receives `count` bottom-up RGBA frames of `width` x `height`.
+ * @return Seconds spent rendering and reading back.
+ */
+double renderSampleFrames(
+    unsigned int program, unsigned int vao, const FrameUniforms* uniforms,
+    int count, double timeStep, int width, int height, unsigned char* pixels) {
+    size_t frameBytes = (size_t)width * height * 4;
+    double start      = nowSeconds();
+    glUseProgram(program);
+    glBindVertexArray(vao);
+    for (int f = 0; f < count; f++) {
+        setFrameUniforms(uniforms, f * timeStep, f, timeStep, width, height);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE,
+                     pixels + frameBytes * f);
+    }
+    return nowSeconds() - start;
+}
+
+#ifndef _WIN32
+// Largest chunk of frames a render worker takes at a time
+#define WORKER_MAX_CHUNK 8
+
+/**
+ * Per-worker counters, kept in the shared mapping for the final report.
+ */
+typedef struct {
+    long   frames;
+    long   chunks;
+    double renderSeconds;  // Rendering, reading back and, for frame
+                           // files, encoding
+    double waitSeconds;    // Waiting for a free frame slot
+} WorkerStats;
+
+/**
+ * Work queue shared by forked render workers and the process collecting
+ * their frames, at the start of an anonymous shared mapping followed by the
+ * frame slots. Workers take chunks of consecutive frames from a shared
+ * cursor, so a fast worker simply takes more chunks. Frame f is read back
+ * into slot f % slotCount once the collector has taken frame f - slotCount:
+ * the worker holding the oldest missing frame always finds its slot free,
+ * and frames are collected in order without ever deadlocking.
+ *
+ * Waiters sleep on a futex of the change counter rather than a condition
+ * variable, which a process killed while waiting could leave unusable.
+ */
+typedef struct {
+    pthread_mutex_t lock;         // Process-shared and, on Linux, robust
+    uint32_t        changes;      // Bumped whenever a chunk, slot or frame
+                                  // changes hands
+    pid_t           parent;       // Collecting process; workers give up if it
+                                  // goes away
+    long            nextFrame;    // First frame of the next chunk
+    long            endFrame;     // One past the last frame
+    long            collected;    // Frames before this one have been collected
+    int             chunkFrames;  // Frames per chunk
+    int             workerCount;
+    int             slotCount;
+    size_t          slotBytes;    // 0 when workers write frame files themselves
+    size_t          slotOffset;   // Page-aligned start of the slots in
+                                  // the mapping
+    size_t          mappedBytes;
+    bool            failed;       // Set by whoever gives up; everyone stops
+    WorkerStats*    stats;        // workerCount entries, inside the mapping
+    long            slotFrame[];  // Frame published in each slot, -1 if free
+} WorkerQueue;
+
+/**
+ * Maps and initializes a work queue for frames [first, end).
+ *
+ * @return The queue, or NULL on failure.
+ */
+static WorkerQueue* workerQueueCreate(int workerCount, int slotCount,
+                                      size_t slotBytes, long first, long end,
+                                      int chunkFrames) {
+    size_t page       = (size_t)sysconf(_SC_PAGESIZE);
+    size_t header     = sizeof(WorkerQueue) + sizeof(long) * slotCount;
+    size_t statsAt    = (header + 15) & ~(size_t)15;
+    size_t slotOffset =
+        (statsAt + sizeof(WorkerStats) * workerCount + page - 1) / page * page;
+    size_t bytes      = slotOffset + slotBytes * slotCount;
+    void*  mapping    = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        log_and_print("Error: Unable to map %.1f MB of frame slots for the "
+                      "render workers.\n", bytes / 1048576.0);
+        return NULL;
+    }
+    WorkerQueue* q = (WorkerQueue*)mapping;
+    q->parent      = getpid();
+    q->nextFrame   = first;
+    q->endFrame    = end;
+    q->collected   = first;
+    q->chunkFrames = chunkFrames;
+    q->workerCount = workerCount;
+    q->slotCount   = slotCount;
+    q->slotBytes   = slotBytes;
+    q->slotOffset  = slotOffset;
+    q->mappedBytes = bytes;
+    q->stats       = (WorkerStats*)((unsigned char*)mapping + statsAt);
+    for (int i = 0; i < slotCount; i++) {
+        q->slotFrame[i] = -1;
+    }
+
+    pthread_mutexattr_t mutexAttr;
+    pthread_mutexattr_init(&mutexAttr);
+    pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+    // A worker killed while holding the lock must not take everyone else
+    // with it
+    pthread_mutexattr_setrobust(&mutexAttr, PTHREAD_MUTEX_ROBUST);
+#endif
+    bool ok = pthread_mutex_init(&q->lock, &mutexAttr) == 0;
+    pthread_mutexattr_destroy(&mutexAttr);
+    if (!ok) {
+        log_and_print("Error: Unable to set up the render worker queue.\n");
+        munmap(mapping, bytes);
+        return NULL;
+    }
+    return q;
+}
+
+static void workerQueueDestroy(WorkerQueue* q) {
+    pthread_mutex_destroy(&q->lock);
+    munmap(q, q->mappedBytes);
+}
+
+/**
+ * Locks the queue. If the previous owner died holding the lock, the job is
+ * failed: the lock is taken over, but that worker's frames will never come.
+ */
+static void workerQueueLock(WorkerQueue* q) {
+    int result = pthread_mutex_lock(&q->lock);
+#ifdef __linux__
+    if (result == EOWNERDEAD) {
+        pthread_mutex_consistent(&q->lock);
+        q->failed = true;
+    }
+#else
+    (void)result;
+#endif
+}
+
+static unsigned char* workerQueueSlot(WorkerQueue* q, long frame) {
+    return (unsigned char*)q + q->slotOffset +
+           q->slotBytes * (size_t)(frame % q->slotCount);
+}
+
+/**
+ * Waits for a change to the queue for at most 100 ms, so waiters can notice
+ * a process that died without saying so. The lock must be held; it is
+ * released while waiting.
+ */
+static void workerQueueWait(WorkerQueue* q) {
+    uint32_t seen = q->changes;
+    pthread_mutex_unlock(&q->lock);
+#ifdef __linux__
+    struct timespec timeout = {0, 100 * 1000000L};
+    syscall(SYS_futex, &q->changes, FUTEX_WAIT, seen, &timeout, NULL, 0);
+#else
+    // Without futexes, poll
+    (void)seen;
+    usleep(500);
+#endif
+    workerQueueLock(q);
+}
+
+/**
+ * Wakes everyone waiting on the queue. The lock must be held.
+ */
+static void workerQueueNotify(WorkerQueue* q) {
+    q->changes++;
+#ifdef __linux__
+    syscall(SYS_futex, &q->changes, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+/**
+ * Stops every worker and the collector.
+ */
+static void workerQueueFail(WorkerQueue* q) {
+    workerQueueLock(q);
+    q->failed = true;
+    workerQueueNotify(q);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Takes the next chunk of frames for a worker.
+ *
+ * @return false once every frame is handed out or the job failed.
+ */
+static bool workerQueueClaim(WorkerQueue* q, long* first, long* end) {
+    workerQueueLock(q);
+    bool claimed = !q->failed && q->nextFrame < q->endFrame;
+    if (claimed) {
+        *first       = q->nextFrame;
+        *end         = q->nextFrame + q->chunkFrames < q->endFrame
+                           ? q->nextFrame + q->chunkFrames
+                           : q->endFrame;
+        q->nextFrame = *end;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return claimed;
+}
+
+/**
+ * Waits until the slot of a frame is free (worker side).
+ *
+ * @return false if the job failed or the collector went away.
+ */
+static bool workerQueueWaitSlot(WorkerQueue* q, long frame) {
+    workerQueueLock(q);
+    while (!q->failed && q->collected <= frame - q->slotCount) {
+        if (getppid() != q->parent) {
+            q->failed = true;
+            break;
+        }
+        workerQueueWait(q);
+    }
+    bool ok = !q->failed;
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+/**
+ * Marks a frame as finished and its slot as filled (worker side).
+ */
+static void workerQueuePublish(WorkerQueue* q, long frame) {
+    workerQueueLock(q);
+    q->slotFrame[frame % q->slotCount] = frame;
+    workerQueueNotify(q);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Waits for the next frame in order (collector side). A worker that exits
+ * with an error or dies fails the job.
+ *
+ * @param workers Process ids of the workers; reaped ones are set to 0.
+ * @return false if the job failed.
+ */
+static bool workerQueueWaitFrame(WorkerQueue* q, long frame, pid_t* workers) {
+    workerQueueLock(q);
+    while (!q->failed && q->slotFrame[frame % q->slotCount] != frame) {
+        pthread_mutex_unlock(&q->lock);
+        for (int i = 0; i < q->workerCount; i++) {
+            int status;
+            if (workers[i] > 0 &&
+                waitpid(workers[i], &status, WNOHANG) == workers[i]) {
+                workers[i] = 0;
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    log_and_print("Error: Render worker %d %s.\n", i,
+                                  WIFSIGNALED(status) ? "was killed"
+                                                      : "failed");
+                    workerQueueFail(q);
+                }
+            }
+        }
+        workerQueueLock(q);
+        if (!q->failed && q->slotFrame[frame % q->slotCount] != frame) {
+            workerQueueWait(q);
+        }
+    }
+    bool ok = !q->failed;
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+/**
+ * Frees the slot of a collected frame (collector side).
+ */
+static void workerQueueRelease(WorkerQueue* q, long frame) {
+    workerQueueLock(q);
+    q->slotFrame[frame % q->slotCount] = -1;
+    q->collected                       = frame + 1;
+    workerQueueNotify(q);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Body of a forked render worker: creates its own headless context and
+ * shader pipeline, then renders chunks of frames until none are left. Frames
+ * of the image sequence sinks are encoded to their files here; the others
+ * are read back into their slot for the collector.
+ *
+ * @return Process exit status (0 on success).
+ */
+static int renderWorkerMain(WorkerQueue* q, int index, const SinkConfig* config,
+                            int width, int height, const char* vertexPath,
+                            const char* fragmentPath) {
+    HeadlessContext context;
+    RenderTarget    target;
+    ShaderPipeline  pipeline;
+    if (!headlessContextCreate(&context)) {
+        workerQueueFail(q);
+        return 1;
+    }
+    if (!gladLoadGLLoader((GLADloadproc)headlessGetProcAddress) ||
+        !renderTargetInit(&target, width, height)) {
+        log_and_print("Error: Render worker %d could not set up OpenGL.\n",
+                      index);
+        headlessContextDestroy(&context);
+        workerQueueFail(q);
+        return 1;
+    }
+    if (!shaderPipelineInit(&pipeline, vertexPath, fragmentPath)) {
+        renderTargetDestroy(&target);
+        headlessContextDestroy(&context);
+        workerQueueFail(q);
+        return 1;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    glViewport(0, 0, width, height);
+    glUseProgram(pipeline.program);
+    glBindVertexArray(pipeline.vao);
+
+    WorkerStats*   stats      = &q->stats[index];
+    bool           files      = q->slotBytes == 0;
+    size_t         frameBytes = (size_t)width * height * 4;
+    unsigned char* pixels     = files
+                                    ? framePoolAcquire(&g_framePool, frameBytes)
+                                    : NULL;
+    bool           ok         = !files || pixels;
+    long           first, end;
+    while (ok && workerQueueClaim(q, &first, &end)) {
+        stats->chunks++;
+        for (long f = first; f < end && ok; f++) {
+            double start = nowSeconds();
+            // The offline clock runs off the absolute frame index, as in the
+            // render loop
+            setFrameUniforms(&pipeline.uniforms, (double)f / config->fps,
+                             (int)f, 1.0 / config->fps, width, height);
+            glClear(GL_COLOR_BUFFER_BIT);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            if (files) {
+                char frameFile[512];
+                glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE,
+                             pixels);
+                formatFrameFile(frameFile, sizeof(frameFile), config, (int)f);
+                ok = writeFrame(frameFile, pixels, width, height, &config->png);
+                if (!ok) {
+                    log_and_print(
+                        "Error: Render worker %d could not write %s.\n", index,
+                        frameFile);
+                }
+            } else {
+                // The draw is queued; the GPU runs it while this worker waits
+                // for the slot
+                double wait = nowSeconds();
+                ok          = workerQueueWaitSlot(q, f);
+                stats->waitSeconds += nowSeconds() - wait;
+                start += nowSeconds() - wait;
+                if (ok) {
+                    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE,
+                                 workerQueueSlot(q, f));
+                }
+            }
+            if (ok) {
+                workerQueuePublish(q, f);
+                stats->frames++;
+                stats->renderSeconds += nowSeconds() - start;
+            }
+        }
+    }
+    if (!ok) {
+        workerQueueFail(q);
+    }
+
+    if (pixels) {
+        framePoolRelease(&g_framePool, pixels, frameBytes);
+    }
+    framePoolDestroy(&g_framePool);
+    shaderPipelineDestroy(&pipeline);
+    renderTargetDestroy(&target);
+    headlessContextDestroy(&context);
+    return ok ? 0 : 1;
+}
+
+/**
+ * Renders a recording with forked worker processes, each with its own
+ * headless context, and hands the frames to a sink in this process, in
+ * order. Image sequence frames are encoded by the workers, so encoding
+ * spreads across the workers too; the other sinks get the read back frames
+ * through shared memory slots (two per worker).
+ *
+ * No context may be current in this process: the workers are forked before
+ * anything touches the GPU, and before the sink starts ffmpeg.
+ *
+ * @param workerCount  Worker processes to fork.
+ * @param config       Sink settings; frames `firstFrame` to `firstFrame +
+ *                     frameCount` are rendered.
+ * @param width        Frame width.
+ * @param height       Frame height.
+ * @param vertexPath   Vertex shader file.
+ * @param fragmentPath Fragment shader file.
+ * @return true if every frame was rendered and the output produced.
+ */
+bool renderWithWorkers(int workerCount, const SinkConfig* config, int width,
+                       int height, const char* vertexPath,
+                       const char* fragmentPath) {
+    long frames     = config->frameCount;
+    bool files      = config->kind == SINK_SEQUENCE ||
+                      config->kind == SINK_TWO_PASS;
+    long chunk      = frames / ((long)workerCount * 8);
+    chunk           = chunk < 1                  ? 1
+                      : chunk > WORKER_MAX_CHUNK ? WORKER_MAX_CHUNK
+                                                 : chunk;
+    long slotCount  = files ? frames : 2L * workerCount;
+    slotCount       = slotCount < frames ? slotCount : frames;
+    size_t slotSize = files ? 0 : (size_t)width * height * 4;
+
+    WorkerQueue* q = workerQueueCreate(workerCount, (int)slotCount, slotSize,
+                                       config->firstFrame,
+                                       config->firstFrame + frames, (int)chunk);
+    if (!q) {
+        return false;
+    }
+    log_and_print("Render workers: %d processes, chunks of %ld frames, %s.\n",
+                  workerCount, chunk,
+                  files ? "frame files encoded by the workers"
+                        : "frames collected through shared memory");
+
+    // The frames folder must exist before the workers write into it
+    SinkConfig sinkConfig     = *config;
+    sinkConfig.encoderThreads = 0;
+    if (files && !makeFolder(config->folder)) {
+        log_and_print("Error: Unable to create the folder %s.\n",
+                      config->folder);
+        workerQueueDestroy(q);
+        return false;
+    }
+
+    // Buffered output would be written once more by every worker
+    fflush(stdout);
+    fflush(g_logFile);
+    pid_t* workers = (pid_t*)calloc((size_t)workerCount, sizeof(pid_t));
+    int    started = 0;
+    for (int i = 0; workers && i < workerCount; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            int status = renderWorkerMain(q, i, config, width, height,
+                                          vertexPath, fragmentPath);
+            // _exit skips the atexit handlers of the parent's libraries, and
+            // with them stdio
+            fflush(stdout);
+            fflush(g_logFile);
+            _exit(status);
+        }
+        if (pid < 0) {
+            log_and_print("Error: Unable to start render worker %d.\n", i);
+            workerQueueFail(q);
+            break;
+        }
+        workers[started++] = pid;
+    }
+
+    double    start = nowSeconds();
+    FrameSink sink;
+    bool      open  = started > 0 &&
+                      frameSinkOpen(&sink, &sinkConfig, width, height);
+    if (started > 0 && !open) {
+        log_and_print("Error: Unable to open the %s sink.\n",
+                      sinkKindName(config->kind));
+        workerQueueFail(q);
+    }
+    for (long f = config->firstFrame; open && f < config->firstFrame + frames;
+         f++) {
+        if (!workerQueueWaitFrame(q, f, workers)) {
+            break;
+        }
+        if (files) {
+            // Already on disk: only counted
+            frameSinkSkipFrame(&sink, (int)f);
+        } else {
+            frameSinkWrite(&sink, (int)f, workerQueueSlot(q, f), width, height);
+        }
+        workerQueueRelease(q, f);
+    }
+    for (int i = 0; i < started; i++) {
+        int status;
+        if (workers[i] > 0 && waitpid(workers[i], &status, 0) == workers[i] &&
+            (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            // Workers stopped by an earlier failure exit with an error too;
+            // that one was reported
+            if (WIFSIGNALED(status) || !q->failed) {
+                log_and_print("Error: Render worker %d %s.\n", i,
+                              WIFSIGNALED(status) ? "was killed" : "failed");
+            }
+            q->failed = true;
+        }
+    }
+    double seconds = nowSeconds() - start;
+    bool   ok      = open && !q->failed && started == workerCount;
+
+    for (int i = 0; i < started; i++) {
+        const WorkerStats* stats = &q->stats[i];
+        log_and_print("  Worker %2d: %6ld frames in %5ld chunks, %7.2f s "
+                      "rendering, %7.2f s waiting for a slot\n", i,
+                      stats->frames, stats->chunks, stats->renderSeconds,
+                      stats->waitSeconds);
+    }
+    if (ok) {
+        log_and_print(
+            "Rendered %ld frames in %.2f s (%.2f fps) with %d workers.\n",
+            frames, seconds, seconds > 0.0 ? frames / seconds : 0.0,
+            workerCount);
+    }
+    if (open) {
+        // A failed job must not be encoded from the frames that happen to exist
+        if (!ok) {
+            sink.failed = true;
+        }
+        ok = frameSinkClose(&sink) && ok;
+    }
+    free(workers);
+    workerQueueDestroy(q);
+    return ok;
+}
+#endif
+
+/**
+ * Kinds of JSON values.
+ */
+typedef enum {
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+} JsonType;
+
+/**
+ * A parsed JSON value. Arrays and objects own their `items`; objects also
+ * own the matching `keys`.
+ */
+typedef struct JsonValue {
+    JsonType          type;
+    bool              boolean;
+    double            number;
+    char*             string;
+    struct JsonValue* items;
+    char**            keys;
+    int               count;
+    int               line;  // Line the value starts on, for messages
+} JsonValue;
+
+/**
+ * Recursive descent over a JSON text.
+ */
+typedef struct {
+    const char* text;
+    const char* at;
+    int         line;
+    char        error[128];
+} JsonParser;
+
+static void jsonSkipSpace(JsonParser* p) {
+    while (*p->at == ' ' || *p->at == '\t' || *p->at == '\r' ||
+           *p->at == '\n') {
+        if (*p->at == '\n') {
+            p->line++;
+        }
+        p->at++;
+    }
+}
+
+static bool jsonFail(JsonParser* p, const char* message) {
+    if (!p->error[0]) {
+        snprintf(p->error, sizeof(p->error), "line %d: %s", p->line, message);
+    }
+    return false;
+}
+
+/**
+ * Appends a code point to a string being decoded, as UTF-8.
+ */
+static size_t jsonEncodeUtf8(char* out, unsigned code) {
+    if (code < 0x80) {
+        out[0] = (char)code;
+        return 1;
+    } else if (code < 0x800) {
+        out[0] = (char)(0xC0 | (code >> 6));
+        out[1] = (char)(0x80 | (code & 0x3F));
+        return 2;
+    } else if (code < 0x10000) {
+        out[0] = (char)(0xE0 | (code >> 12));
+        out[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (code & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (code >> 18));
+    out[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (code & 0x3F));
+    return 4;
+}
+
+static bool jsonParseHex4(JsonParser* p, unsigned* code) {
+    *code = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = *p->at++;
+        int  digit = c >= '0' && c <= '9'   ? c - '0'
+                     : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                     : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                            : -1;
+        if (digit < 0) {
+            return jsonFail(p, "bad \\u escape");
+        }
+        *code = *code * 16 + (unsigned)digit;
+    }
+    return true;
+}
+
+/**
+ * Parses a string literal, the opening quote being at `p->at`.
+ *
+ * @return The decoded string (caller frees), or NULL on error.
+ */
+static char* jsonParseString(JsonParser* p) {
+    const char* start = ++p->at;
+    size_t      bound = 0;
+    while (start[bound] && start[bound] != '"') {
+        bound += start[bound] == '\\' && start[bound + 1] ? 2 : 1;
+    }
+    // Escapes never decode to more bytes than they take
+    char* out = (char*)malloc(bound + 1);
+    if (!out) {
+        jsonFail(p, "out of memory");
+        return NULL;
+    }
+    size_t length = 0;
+    while (*p->at != '"') {
+        char c = *p->at++;
+        if (c == '\0' || c == '\n') {
+            free(out);
+            jsonFail(p, "unterminated string");
+            return NULL;
+        }
+        if (c != '\\') {
+            out[length++] = c;
+            continue;
+        }
+        c = *p->at++;
+        switch (c) {
+            case '"':
+            case '\\':
+            case '/':
+                out[length++] = c;
+                break;
+            case 'b':
+                out[length++] = '\b';
+                break;
+            case 'f':
+                out[length++] = '\f';
+                break;
+            case 'n':
+                out[length++] = '\n';
+                break;
+            case 'r':
+                out[length++] = '\r';
+                break;
+            case 't':
+                out[length++] = '\t';
+                break;
+            case 'u': {
+                unsigned code;
+                if (!jsonParseHex4(p, &code)) {
+                    free(out);
+                    return NULL;
+                }
+                // A high surrogate followed by a low one is a single code point
+                if (code >= 0xD800 && code < 0xDC00 && p->at[0] == '\\' &&
+                    p->at[1] == 'u') {
+                    unsigned low;
+                    p->at += 2;
+                    if (!jsonParseHex4(p, &low)) {
+                        free(out);
+                        return NULL;
+                    }
+                    if (low >= 0xDC00 && low < 0xE000) {
+                        code =
+                            0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                }
+                if (code >= 0xD800 && code < 0xE000) {
+                    free(out);
+                    jsonFail(p, "unpaired surrogate in string");
+                    return NULL;
+                }
+                length += jsonEncodeUtf8(out + length, code);
+                break;
+            }
+            default:
+                free(out);
+                jsonFail(p, "bad escape in string");
+                return NULL;
+        }
+    }
+    p->at++;
+    out[length] = '\0';
+    return out;
+}
+
+static void jsonFree(JsonValue* value);
+
+static bool jsonParseValue(JsonParser* p, JsonValue* value, int depth);
+
+/**
+ * Parses the elements of an array or the members of an object, the opening
+ * bracket being at `p->at`.
+ */
+static bool jsonParseContainer(JsonParser* p, JsonValue* value, int depth) {
+    bool object = *p->at == '{';
+    char close  = object ? '}' : ']';
+    int  capacity = 0;
+    value->type   = object ? JSON_OBJECT : JSON_ARRAY;
+    p->at++;
+    jsonSkipSpace(p);
+    if (*p->at == close) {
+        p->at++;
+        return true;
+    }
+    for (;;) {
+        if (value->count == capacity) {
+            capacity           = capacity ? capacity * 2 : 8;
+            JsonValue* items   = (JsonValue*)realloc(
+                value->items, sizeof(JsonValue) * capacity);
+            char**     keys    =
+                object ? (char**)realloc(value->keys, sizeof(char*) * capacity)
+                       : NULL;
+            if (items) {
+                value->items = items;
+            }
+            if (keys) {
+                value->keys = keys;
+            }
+            if (!items || (object && !keys)) {
+                return jsonFail(p, "out of memory");
+            }
+        }
+        JsonValue* item = &value->items[value->count];
+        memset(item, 0, sizeof(*item));
+        if (object) {
+            jsonSkipSpace(p);
+            if (*p->at != '"') {
+                return jsonFail(p, "expected a member name");
+            }
+            char* key = jsonParseString(p);
+            if (!key) {
+                return false;
+            }
+            value->keys[value->count] = key;
+            jsonSkipSpace(p);
+            if (*p->at != ':') {
+                value->count++;
+                return jsonFail(p, "expected ':'");
+            }
+            p->at++;
+        }
+        value->count++;
+        if (!jsonParseValue(p, item, depth + 1)) {
+            return false;
+        }
+        jsonSkipSpace(p);
+        if (*p->at == ',') {
+            p->at++;
+        } else if (*p->at == close) {
+            p->at++;
+            return true;
+        } else {
+            return jsonFail(p, object ? "expected ',' or '}'"
+                                      : "expected ',' or ']'");
+        }
+    }
+}
+
+static bool jsonParseValue(JsonParser* p, JsonValue* value, int depth) {
+    jsonSkipSpace(p);
+    value->line = p->line;
+    if (depth > 64) {
+        return jsonFail(p, "nested too deeply");
+    }
+    char c = *p->at;
+    if (c == '{' || c == '[') {
+        return jsonParseContainer(p, value, depth);
+    } else if (c == '"') {
+        value->type   = JSON_STRING;
+        value->string = jsonParseString(p);
+        return value->string != NULL;
+    } else if (c == '-' || (c >= '0' && c <= '9')) {
+        char* end;
+        value->type   = JSON_NUMBER;
+        value->number = strtod(p->at, &end);
+        if (end == p->at) {
+            return jsonFail(p, "bad number");
+        }
+        p->at = end;
+        return true;
+    } else if (strncmp(p->at, "true", 4) == 0 ||
+               strncmp(p->at, "false", 5) == 0) {
+        value->type    = JSON_BOOL;
+        value->boolean = c == 't';
+        p->at += value->boolean ? 4 : 5;
+        return true;
+    } else if (strncmp(p->at, "null", 4) == 0) {
+        value->type = JSON_NULL;
+        p->at += 4;
+        return true;
+    }
+    return jsonFail(p, c ? "unexpected character" : "unexpected end of input");
+}
+
+/**
+ * Parses a JSON document.
+ *
+ * @param text  Nul-terminated JSON text.
+ * @param value Receives the document; free it with jsonFree, even on failure.
+ * @param error Receives a message with the line number on failure.
+ * @return true on success, false otherwise.
+ */
+static bool jsonParse(const char* text, JsonValue* value, char* error,
+                      size_t errorSize) {
+    JsonParser parser = {text, text, 1, ""};
+    memset(value, 0, sizeof(*value));
+    bool ok = jsonParseValue(&parser, value, 0);
+    if (ok) {
+        jsonSkipSpace(&parser);
+        ok = *parser.at == '\0' || jsonFail(&parser, "text after the document");
+    }
+    if (!ok) {
+        snprintf(error, errorSize, "%s", parser.error);
+    }
+    return ok;
+}
+
+static void jsonFree(JsonValue* value) {
+    for (int i = 0; i < value->count; i++) {
+        jsonFree(&value->items[i]);
+        if (value->keys) {
+            free(value->keys[i]);
+        }
+    }
+    free(value->items);
+    free(value->keys);
+    free(value->string);
+    memset(value, 0, sizeof(*value));
+}
+
+/**
+ * Looks up a member of an object.
+ *
+ * @return The member, or NULL if there is none (or `object` is not an object).
+ */
+static const JsonValue* jsonGet(const JsonValue* object, const char* key) {
+    if (!object || object->type != JSON_OBJECT) {
+        return NULL;
+    }
+    for (int i = 0; i < object->count; i++) {
+        if (strcmp(object->keys[i], key) == 0) {
+            return &object->items[i];
+        }
+    }
+    return NULL;
+}
+
+#define PROGRAM_CACHE_SIZE 8
+
+/**
+ * A linked program and the shader files it was built from. The files'
+ * modification times are kept so that an edited shader gets rebuilt.
+ */
+typedef struct {
+    char          vertexPath[512];
+    char          fragmentPath[512];
+    long long     vertexTime;
+    long long     fragmentTime;
+    unsigned int  program;
+    FrameUniforms uniforms;
+    unsigned long lastUse;
+} CachedProgram;
+
+/**
+ * GL state kept from one job to the next by batch mode and the render
+ * service: the full-screen triangle, a render target that is only
+ * recreated when the frame size changes, and the most recently used
+ * programs. Needs a current context.
+ */
+typedef struct {
+    ShaderPipeline pipeline;  // The triangle; `program` is the cached program
+                              // in use
+    RenderTarget   target;
+    bool           haveTarget;
+    CachedProgram  programs[PROGRAM_CACHE_SIZE];
+    int            programCount;
+    unsigned long  uses;
+} WarmRenderer;
+
+/**
+ * Modification time of a file in nanoseconds (where the platform keeps
+ * them), 0 if it is missing; used to notice edited shaders.
+ */
+static long long fileModifiedStamp(const char* path) {
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        return 0;
+    }
+#ifdef __linux__
+    return (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+#else
+    return (long long)info.st_mtime * 1000000000LL;
+#endif
+}
+
+static void warmRendererInit(WarmRenderer* r) {
+    memset(r, 0, sizeof(*r));
+    shaderPipelineUploadTriangle(&r->pipeline);
+}
+
+/**
+ * Makes the program of a pair of shader files the pipeline's program. It is
+ * built unless the cache holds it and neither file changed since; a new
+ * program replaces the least recently used one when the cache is full.
+ *
+ * @param reused Set to whether the cached program was used.
+ * @return false if the shaders fail to build.
+ */
+static bool warmRendererUseProgram(WarmRenderer* r, const char* vertexPath,
+                                   const char* fragmentPath, bool* reused) {
+    long long      vertexTime   = fileModifiedStamp(vertexPath);
+    long long      fragmentTime = fileModifiedStamp(fragmentPath);
+    CachedProgram* entry        = NULL;
+    for (int i = 0; i < r->programCount && !entry; i++) {
+        if (strcmp(r->programs[i].vertexPath, vertexPath) == 0 &&
+            strcmp(r->programs[i].fragmentPath, fragmentPath) == 0) {
+            entry = &r->programs[i];
+        }
+    }
+    *reused = entry && entry->vertexTime == vertexTime &&
+              entry->fragmentTime == fragmentTime;
+    if (!*reused) {
+        unsigned int program = buildShaderProgram(vertexPath, fragmentPath);
+        if (program == 0) {
+            return false;
+        }
+        if (!entry && r->programCount < PROGRAM_CACHE_SIZE) {
+            entry = &r->programs[r->programCount++];
+        } else if (!entry) {
+            entry = &r->programs[0];
+            for (int i = 1; i < r->programCount; i++) {
+                if (r->programs[i].lastUse < entry->lastUse) {
+                    entry = &r->programs[i];
+                }
+            }
+        }
+        glDeleteProgram(entry->program);  // 0 (ignored) for a new entry
+        snprintf(entry->vertexPath, sizeof(entry->vertexPath), "%s",
+                 vertexPath);
+        snprintf(entry->fragmentPath, sizeof(entry->fragmentPath), "%s",
+                 fragmentPath);
+        entry->vertexTime   = vertexTime;
+        entry->fragmentTime = fragmentTime;
+        entry->program      = program;
+        entry->uniforms     = queryFrameUniforms(program);
+    }
+    entry->lastUse       = ++r->uses;
+    r->pipeline.program  = entry->program;
+    r->pipeline.uniforms = entry->uniforms;
+    return true;
+}
+
+static void warmRendererDestroy(WarmRenderer* r) {
+    for (int i = 0; i < r->programCount; i++) {
+        glDeleteProgram(r->programs[i].program);
+    }
+    r->pipeline.program = 0;
+    shaderPipelineDestroy(&r->pipeline);
+    if (r->haveTarget) {
+        renderTargetDestroy(&r->target);
+    }
+    memset(r, 0, sizeof(*r));
+}
+
+// Largest frame side and longest duration (or still time, in seconds) of a
+// batch job
+#define BATCH_MAX_SIZE    16384
+#define BATCH_MAX_SECONDS 86400
+
+// Keys a batch job (or the manifest's "defaults") may set
+static const char* const g_batchJobKeys[] = {
+    "name", "vertex", "fragment", "width", "height", "fps", "duration", "time",
+    "sink", "output", "folder", "profile", "pixel_format", "frame_format",
+    "encoders", "segments"};
+
+/**
+ * One job of a batch manifest, with the defaults applied.
+ */
+typedef struct {
+    const char*          name;
+    const char*          vertexPath;
+    const char*          fragmentPath;
+    int                  width;
+    int                  height;
+    int                  fps;
+    double               duration;
+    double               time;            // Shader time of a still
+    bool                 still;           // One frame written straight to
+                                          // `output` (png, qoi or rgba)
+    SinkKind             sinkKind;
+    const char*          output;          // Video, container or still
+                                          // image file
+    const char*          folder;          // Frames folder (image
+                                          // sequence sinks)
+    const EncodeProfile* profile;
+    PixelFormat          pixelFormat;
+    bool                 pixelFormatSet;
+    const char*          frameExtension;
+    int                  encoderThreads;
+    int                  segments;
+} BatchJob;
+
+/**
+ * Timing of one batch job, for the final report.
+ */
+typedef struct {
+    FrameSink sink;
+    pthread_t closer;         // Finishes the output while the next job renders
+    bool      closing;
+    bool      sinkOpen;       // `sink` is left for the caller to close
+    long      frames;
+    double    setupSeconds;   // Program build (or cache lookup) and
+                              // render target
+    double    renderSeconds;  // Rendering, reading back and handing frames to
+                              // the sink
+    double    finishSeconds;  // Draining the sink and ffmpeg, overlapping the
+                              // next job
+    bool      programReused;
+    bool      ok;
+} BatchResult;
+
+/**
+ * Looks up a job setting: the job's own value, else the manifest default.
+ */
+static const JsonValue* batchSetting(
+    const JsonValue* job, const JsonValue* defaults, const char* key) {
+    const JsonValue* value = jsonGet(job, key);
+    return value ? value : jsonGet(defaults, key);
+}
+
+static const char* batchString(const JsonValue* job, const JsonValue* defaults,
+                               const char* key, const char* fallback,
+                               bool* ok) {
+    const JsonValue* value = batchSetting(job, defaults, key);
+    if (!value) {
+        return fallback;
+    }
+    if (value->type != JSON_STRING) {
+        log_and_print("Error: Manifest line %d: \"%s\" must be a string.\n",
+                      value->line, key);
+        *ok = false;
+        return fallback;
+    }
+    return value->string;
+}
+
+/**
+ * Looks up a numeric job setting, which must lie in 0..`max` (so that it
+ * can be cast to an int and frame sizes stay in range).
+ */
+static double batchNumber(const JsonValue* job, const JsonValue* defaults,
+                          const char* key, double fallback, double max,
+                          bool* ok) {
+    const JsonValue* value = batchSetting(job, defaults, key);
+    if (!value) {
+        return fallback;
+    }
+    if (value->type != JSON_NUMBER ||
+        !(value->number >= 0.0 && value->number <= max)) {
+        log_and_print(
+            "Error: Manifest line %d: \"%s\" must be a number from 0 to %g.\n",
+            value->line, key, max);
+        *ok = false;
+        return fallback;
+    }
+    return value->number;
+}
+
+/**
+ * Tells whether a path can be put inside the double quotes of an ffmpeg
+ * command line without the shell expanding any of it. Manifests and
+ * service requests are not trusted with `$`, backquotes, quotes or control
+ * characters in their output paths.
+ */
+static bool batchPathIsSafe(const char* path) {
+    for (const unsigned char* c = (const unsigned char*)path; c && *c; c++) {
+        if (*c < 0x20 || *c == '"' || *c == '$' || *c == '`' || *c == 0x7f) {
+            return false;
+        }
+#ifndef _WIN32
+        if (*c == '\\') {
+            return false;
+        }
+#endif
+    }
+    return true;
+}
+
+/**
+ * Reads one job of a manifest. Unknown keys are reported, since they are
+ * most likely misspelled settings.
+ *
+ * @return true if the job is complete and every setting is valid.
+ */
+static bool batchReadJob(const JsonValue* object, const JsonValue* defaults,
+                         int index, BatchJob* job) {
+    bool ok = true;
+    if (object->type != JSON_OBJECT) {
+        log_and_print("Error: Manifest line %d: job %d is not an object.\n",
+                      object->line, index);
+        return false;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        const JsonValue* settings = pass == 0 ? defaults : object;
+        for (int i = 0; settings && i < settings->count; i++) {
+            bool known = false;
+            for (size_t k = 0;
+                 k < sizeof(g_batchJobKeys) / sizeof(g_batchJobKeys[0]); k++) {
+                known = known ||
+                        strcmp(settings->keys[i], g_batchJobKeys[k]) == 0;
+            }
+            if (!known) {
+                log_and_print(
+                    "Warning: Manifest line %d: unknown setting \"%s\".\n",
+                    settings->items[i].line, settings->keys[i]);
+            }
+        }
+    }
+
+    memset(job, 0, sizeof(*job));
+    job->fragmentPath       = batchString(object, defaults, "fragment", NULL,
+                                          &ok);
+    job->name               = batchString(object, defaults, "name",
+                                          job->fragmentPath, &ok);
+    job->vertexPath         = batchString(object, defaults, "vertex",
+                                          "shaders/vertex_shader.glsl", &ok);
+    job->width              = (int)batchNumber(object, defaults, "width", 1280,
+                                               BATCH_MAX_SIZE, &ok);
+    job->height             = (int)batchNumber(object, defaults, "height", 720,
+                                               BATCH_MAX_SIZE, &ok);
+    job->fps                = (int)batchNumber(object, defaults, "fps", 30,
+                                               1000, &ok);
+    job->duration           = batchNumber(object, defaults, "duration", 5.0,
+                                          BATCH_MAX_SECONDS, &ok);
+    job->time               = batchNumber(object, defaults, "time", 0.0,
+                                          BATCH_MAX_SECONDS, &ok);
+    job->output             = batchString(object, defaults, "output", NULL,
+                                          &ok);
+    job->folder             = batchString(object, defaults, "folder", "frames",
+                                          &ok);
+    job->encoderThreads     = (int)batchNumber(object, defaults, "encoders", 0,
+                                               256, &ok);
+    job->segments           = (int)batchNumber(object, defaults, "segments", 0,
+                                               256, &ok);
+    const char* sink        = batchString(object, defaults, "sink", "pipe",
+                                          &ok);
+    const char* profile     = batchString(object, defaults, "profile",
+                                          "archival", &ok);
+    const char* pixelFormat = batchString(object, defaults, "pixel_format",
+                                          NULL, &ok);
+    const char* frameFormat = batchString(object, defaults, "frame_format",
+                                          "png", &ok);
+
+    const ImageFormat* format = imageFormatByExtension(frameFormat);
+    job->profile              = encodeProfileByName(profile);
+    job->pixelFormat          = PIXEL_RGBA;
+    job->pixelFormatSet       = pixelFormat != NULL;
+    job->frameExtension       = format ? format->extension : NULL;
+    if (!job->fragmentPath) {
+        log_and_print(
+            "Error: Manifest line %d: job %d has no \"fragment\" shader.\n",
+            object->line, index);
+        ok = false;
+    }
+    if (!batchPathIsSafe(job->output) || !batchPathIsSafe(job->folder)) {
+        log_and_print("Error: Manifest line %d: job %d has quotes, $, "
+                      "backquotes, backslashes or control characters in its "
+                      "\"output\" or \"folder\".\n", object->line, index);
+        ok = false;
+    }
+    job->still = strcmp(sink, "still") == 0;
+    if (job->still && (!job->output || !imageFormatForFile(job->output))) {
+        log_and_print("Error: Manifest line %d: still %d needs an \"output\" "
+                      "ending in .png, .qoi or .rgba.\n", object->line, index);
+        ok = false;
+    } else if (!job->still && !parseSinkKind(sink, &job->sinkKind)) {
+        log_and_print("Error: Job %d: sink \"%s\" is not pipe, sequence, "
+                      "two-pass, y4m, raw or still.\n", index, sink);
+        ok = false;
+    } else if (!job->still && job->sinkKind != SINK_SEQUENCE && !job->output) {
+        log_and_print("Error: Manifest line %d: job %d writes a %s but has no "
+                      "\"output\".\n", object->line, index,
+                      sinkKindName(job->sinkKind));
+        ok = false;
+    }
+    if (!job->profile) {
+        log_and_print("Error: Job %d: profile \"%s\" is not preview, delivery "
+                      "or archival.\n", index, profile);
+        ok = false;
+    }
+    if (pixelFormat && !parsePixelFormat(pixelFormat, &job->pixelFormat)) {
+        log_and_print("Error: Job %d: pixel format \"%s\" is not rgba, rgb24, "
+                      "bgr24, yuv444p or yuv420p.\n", index, pixelFormat);
+        ok = false;
+    }
+    if (!format) {
+        log_and_print(
+            "Error: Job %d: frame format \"%s\" is not png, qoi or rgba.\n",
+            index, frameFormat);
+        ok = false;
+    }
+    if (job->width < 1 || job->height < 1 || job->fps < 1) {
+        log_and_print(
+            "Error: Job %d: width, height and fps must be at least 1.\n",
+            index);
+        ok = false;
+    }
+    return ok;
+}
+
+/**
+ * Tells whether a job would write its frames into the folder of a sink that
+ * is still being finished, whose encode reads (and then removes) its frames
+ * from there.
+ *
+ * @param kind   Kind of the sink being finished.
+ * @param folder Its frames folder.
+ */
+static bool batchSharesFolder(SinkKind kind, const char* folder,
+                              const BatchJob* job) {
+    bool closingUsesFolder = kind == SINK_SEQUENCE || kind == SINK_TWO_PASS;
+    bool jobUsesFolder     = !job->still && (job->sinkKind == SINK_SEQUENCE ||
+                                             job->sinkKind == SINK_TWO_PASS);
+    return closingUsesFolder && jobUsesFolder &&
+           strcmp(folder, job->folder) == 0;
+}
+
+static void* batchCloseThreadMain(void* arg) {
+    BatchResult* result = (BatchResult*)arg;
+    double       start  = nowSeconds();
+    result->ok          = frameSinkClose(&result->sink) && result->ok;
+    result->finishSeconds = nowSeconds() - start;
+    return NULL;
+}
+
+/**
+ * Waits for a job's output to be finished.
+ */
+static void batchJoinCloser(BatchResult* result) {
+    if (result->closing) {
+        pthread_join(result->closer, NULL);
+        result->closing = false;
+    }
+}
+
+/**
+ * Renders one job with warm GL state. A still is read back and written to
+ * its file here; the frames of the other jobs go to `result->sink`, which is
+ * left open (`result->sinkOpen`) for the caller to close, possibly while the
+ * next job renders.
+ *
+ * @return true if the job's frames were rendered.
+ */
+static bool batchRenderJob(WarmRenderer* r, const BatchJob* job,
+                           const PngOptions* png, BatchResult* result) {
+    double setup = nowSeconds();
+    bool   ready = warmRendererUseProgram(r, job->vertexPath, job->fragmentPath,
+                                          &result->programReused);
+    if (ready && (!r->haveTarget || r->target.width != job->width ||
+                  r->target.height != job->height)) {
+        if (r->haveTarget) {
+            renderTargetDestroy(&r->target);
+        }
+        ready = r->haveTarget = renderTargetInit(&r->target, job->width,
+                                                 job->height);
+    }
+    result->setupSeconds = nowSeconds() - setup;
+    if (!ready) {
+        return false;
+    }
+
+    long frames = job->still ? 1 : (long)(job->fps * job->duration);
+    if (!job->still) {
+        PixelFormat pixelFormat = resolveSinkPixelFormat(
+            job->sinkKind, job->pixelFormat, job->pixelFormatSet, YUV_OFF,
+            false);
+        SinkConfig  sinkConfig  = {
+            job->sinkKind, job->folder, job->output ? job->output : "",
+            job->fps, job->encoderThreads, *png, job->frameExtension, frames, 0,
+            false, pixelFormat, false, 4, job->profile, job->segments, false,
+            false, false};
+        if (!frameSinkOpen(&result->sink, &sinkConfig, job->width,
+                           job->height)) {
+            return false;
+        }
+        result->sinkOpen = true;
+    }
+
+    double render = nowSeconds();
+    bool   ok     = true;
+    glBindFramebuffer(GL_FRAMEBUFFER, r->target.fbo);
+    glViewport(0, 0, job->width, job->height);
+    glUseProgram(r->pipeline.program);
+    glBindVertexArray(r->pipeline.vao);
+    for (long f = 0; f < frames; f++) {
+        // A still is the frame at its time on the clock of a recording at `fps`
+        double time  = job->still ? job->time : (double)f / job->fps;
+        int    frame = job->still ? (int)(job->time * job->fps) : (int)f;
+        setFrameUniforms(&r->pipeline.uniforms, time, frame, 1.0 / job->fps,
+                         job->width, job->height);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        if (job->still) {
+            size_t         bytes  = (size_t)job->width * job->height * 4;
+            unsigned char* pixels = framePoolAcquire(&g_framePool, bytes);
+            ok                    = pixels != NULL;
+            if (ok) {
+                glReadPixels(0, 0, job->width, job->height, GL_RGBA,
+                             GL_UNSIGNED_BYTE, pixels);
+                ok = writeFrame(job->output, pixels, job->width, job->height,
+                                png);
+            }
+            framePoolRelease(&g_framePool, pixels, bytes);
+            if (!ok) {
+                log_and_print("Error: Unable to write the still %s.\n",
+                              job->output);
+            }
+        } else {
+            captureFrame(&result->sink, NULL, (int)f, job->width, job->height);
+        }
+    }
+    result->frames        = ok ? frames : 0;
+    result->renderSeconds = nowSeconds() - render;
+    return ok;
+}
+
+/**
+ * Renders every job of a manifest in this process, one after the other, in
+ * a single headless context. The context, the full-screen triangle and the
+ * frame buffers are set up once; programs are only rebuilt when the shaders
+ * change and the render target only when the size does. Each job's output
+ * is finished on a thread of its own while the next job renders, so ffmpeg's
+ * tail (or the whole encode of a two-pass job) overlaps the next render.
+ *
+ * A manifest is a JSON object with an array of "jobs" and optional
+ * "defaults" applying to every job; see the README for the settings.
+ *
+ * @param manifestPath JSON manifest.
+ * @param png          PNG settings of the image sequence jobs.
+ * @return true if every job succeeded.
+ */
+bool runBatch(const char* manifestPath, const PngOptions* png) {
+    double start = nowSeconds();
+    FILE*  fp    = fopen(manifestPath, "rb");
+    if (!fp) {
+        log_and_print("Error: Unable to open manifest '%s'.\n", manifestPath);
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long  length = ftell(fp);
+    char* text   = length >= 0 ? (char*)malloc((size_t)length + 1) : NULL;
+    fseek(fp, 0, SEEK_SET);
+    bool read = text && fread(text, 1, (size_t)length, fp) == (size_t)length;
+    fclose(fp);
+    if (!read) {
+        log_and_print("Error: Unable to read manifest '%s'.\n", manifestPath);
+        free(text);
+        return false;
+    }
+    text[length] = '\0';
+
+    JsonValue manifest;
+    char      error[128];
+    bool      parsed = jsonParse(text, &manifest, error, sizeof(error));
+    free(text);
+    const JsonValue* jobList  = jsonGet(&manifest, "jobs");
+    const JsonValue* defaults = jsonGet(&manifest, "defaults");
+    if (!parsed) {
+        log_and_print("Error: Manifest '%s', %s.\n", manifestPath, error);
+        jsonFree(&manifest);
+        return false;
+    }
+    if (!jobList || jobList->type != JSON_ARRAY ||
+        (defaults && defaults->type != JSON_OBJECT)) {
+        log_and_print("Error: Manifest '%s' needs a \"jobs\" array (and "
+                      "\"defaults\", if any, must be an object).\n",
+                      manifestPath);
+        jsonFree(&manifest);
+        return false;
+    }
+
+    // Every job is checked before anything renders, so a typo can't fail a
+    // nightly run halfway
+    int          jobCount = jobList->count;
+    BatchJob*    jobs     = (BatchJob*)calloc(
+        (size_t)(jobCount > 0 ? jobCount : 1), sizeof(BatchJob));
+    BatchResult* results  = (BatchResult*)calloc(
+        (size_t)(jobCount > 0 ? jobCount : 1), sizeof(BatchResult));
+    bool         valid    = jobs && results;
+    for (int i = 0; jobs && results && i < jobCount; i++) {
+        valid = batchReadJob(&jobList->items[i], defaults, i, &jobs[i]) &&
+                valid;
+    }
+    HeadlessContext context;
+    if (!valid || !headlessContextCreate(&context)) {
+        free(jobs);
+        free(results);
+        jsonFree(&manifest);
+        return false;
+    }
+    if (!gladLoadGLLoader((GLADloadproc)headlessGetProcAddress)) {
+        log_and_print("Error loading GLAD.\n");
+        headlessContextDestroy(&context);
+        free(jobs);
+        free(results);
+        jsonFree(&manifest);
+        return false;
+    }
+    double contextSeconds = nowSeconds() - start;
+    log_and_print("Batch: %d jobs from %s; context ready in %.3f s.\n",
+                  jobCount, manifestPath, contextSeconds);
+
+    WarmRenderer renderer;
+    BatchResult* finishing = NULL;  // Job whose output is being finished
+    warmRendererInit(&renderer);
+    for (int i = 0; i < jobCount; i++) {
+        const BatchJob* job    = &jobs[i];
+        BatchResult*    result = &results[i];
+        if (job->still) {
+            log_and_print("Job %d/%d: %s, %d x %d still at %.2f s -> %s\n",
+                          i + 1, jobCount, job->name, job->width, job->height,
+                          job->time, job->output);
+        } else {
+            log_and_print("Job %d/%d: %s, %d x %d, %d fps, %.2f s -> %s\n",
+                          i + 1, jobCount, job->name, job->width, job->height,
+                          job->fps, job->duration,
+                          job->sinkKind == SINK_SEQUENCE ? job->folder
+                                                         : job->output);
+        }
+        if (finishing &&
+            batchSharesFolder(finishing->sink.config.kind,
+                              finishing->sink.config.folder, job)) {
+            batchJoinCloser(finishing);
+            finishing = NULL;
+        }
+        result->ok = batchRenderJob(&renderer, job, png, result);
+        if (!result->ok) {
+            log_and_print(
+                "Error: Job %d (%s) failed; going on with the next one.\n",
+                i + 1, job->name);
+        }
+        if (!result->sinkOpen) {
+            continue;
+        }
+
+        // Finish this output while the next job renders; at most one finishes
+        // at a time
+        if (finishing) {
+            batchJoinCloser(finishing);
+        }
+        finishing       = result;
+        result->closing = pthread_create(&result->closer, NULL,
+                                         batchCloseThreadMain, result) == 0;
+        if (!result->closing) {
+            batchCloseThreadMain(result);
+        }
+    }
+    for (int i = 0; i < jobCount; i++) {
+        batchJoinCloser(&results[i]);
+    }
+
+    warmRendererDestroy(&renderer);
+    headlessContextDestroy(&context);
+
+    // Per-job report
+    int    succeeded   = 0;
+    long   totalFrames = 0;
+    double wall        = nowSeconds() - start;
+    log_and_print("Batch report (%s):\n", manifestPath);
+    log_and_print("  %3s  %-28s %7s %9s %9s %9s %9s  %s\n", "#", "job",
+                  "frames", "setup s", "render s", "fps", "finish s", "result");
+    for (int i = 0; i < jobCount; i++) {
+        const BatchResult* result = &results[i];
+        log_and_print("  %3d  %-28.28s %7ld %9.3f %9.3f %9.1f %9.3f  %s%s\n",
+                      i + 1, jobs[i].name, result->frames, result->setupSeconds,
+                      result->renderSeconds, result->renderSeconds > 0.0
+                          ? result->frames / result->renderSeconds
+                          : 0.0,
+                      result->finishSeconds, result->ok ? "ok" : "FAILED",
+                      result->programReused ? " (cached program)" : "");
+        succeeded += result->ok ? 1 : 0;
+        totalFrames += result->frames;
+    }
+    log_and_print("Batch: %d of %d jobs succeeded, %ld frames in %.2f s "
+                  "(context set up once in %.3f s).\n", succeeded, jobCount,
+                  totalFrames, wall, contextSeconds);
+
+    free(jobs);
+    free(results);
+    jsonFree(&manifest);
+    return succeeded == jobCount;
+}
+
+#ifndef _WIN32
+#define SERVE_REQUEST_BYTES   (64 * 1024)
+#define SERVE_MAX_CONNECTIONS 64  // Connections whose request is still arriving
+
+/**
+ * A render request admitted by the service. The client's connection stays
+ * open until the reply is sent, once the output is finished.
+ */
+typedef struct {
+    int           client;    // Connection the reply goes to
+    int           priority;  // Higher runs first; equal priorities run in
+                             // arrival order
+    unsigned long id;
+    double        arrived;
+    double        started;
+    JsonValue     request;   // Owns the strings of `job`
+    BatchJob      job;
+    BatchResult   result;
+} ServeRequest;
+
+/**
+ * The bounded admission queue between the accepting thread and the render
+ * loop, plus the counters of status replies.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;
+    ServeRequest**  waiting;
+    int             capacity;  // Requests that may wait; more are turned away
+    int             count;
+    int             listener;
+    unsigned long   nextId;
+    bool            stopping;  // No more requests are admitted; the waiting
+                               // ones still run
+    long            served;
+    long            failed;
+    long            rejected;
+    int             programs;  // Programs held by the render loop
+    double          started;
+} ServeQueue;
+
+static volatile sig_atomic_t g_serveStop = 0;
+
+static void serveStopSignal(int sig) {
+    (void)sig;
+    g_serveStop = 1;
+}
+
+/**
+ * Copies `text` into `out` as the inside of a JSON string.
+ */
+static void jsonEscapeString(char* out, size_t size, const char* text) {
+    size_t length = 0;
+    for (const unsigned char* c = (const unsigned char*)(text ? text : "");
+         *c && length + 7 < size; c++) {
+        if (*c == '"' || *c == '\\') {
+            out[length++] = '\\';
+            out[length++] = (char)*c;
+        } else if (*c < 0x20) {
+            length += (size_t)snprintf(out + length, size - length, "\\u%04x",
+                                       *c);
+        } else {
+            out[length++] = (char)*c;
+        }
+    }
+    out[length] = '\0';
+}
+
+/**
+ * Sends a one-line JSON reply; a client that went away is ignored.
+ */
+static void serveReply(int client, const char* format, ...) {
+    char    reply[2048];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(reply, sizeof(reply) - 1, format, args);
+    va_end(args);
+    if (length < 0 || length > (int)sizeof(reply) - 2) {
+        length = (int)sizeof(reply) - 2;
+    }
+    reply[length++] = '\n';
+    for (int sent = 0; sent < length;) {
+        ssize_t n = send(client, reply + sent, (size_t)(length - sent),
+                         MSG_NOSIGNAL);
+        if (n <= 0) {
+            break;
+        }
+        sent += (int)n;
+    }
+}
+
+/**
+ * A connection whose request has not fully arrived yet.
+ */
+typedef struct {
+    int    client;
+    char*  text;      // SERVE_REQUEST_BYTES + 1 bytes
+    size_t length;
+    double deadline;  // The connection is dropped if the request is not
+                      // complete by then
+} ServeConnection;
+
+/**
+ * Handles one request: status and shutdown requests are answered right
+ * away, render requests are checked and queued, or turned away when the
+ * queue is full. Only the admission itself holds the queue lock.
+ */
+static void serveAdmit(ServeQueue* q, int client, const char* text) {
+    ServeRequest* request = (ServeRequest*)calloc(1, sizeof(ServeRequest));
+    char          error[160];
+    char          escaped[320];
+    if (!request || !jsonParse(text, &request->request, error, sizeof(error))) {
+        jsonEscapeString(escaped, sizeof(escaped),
+                         request ? error : "out of memory");
+        serveReply(client, "{\"ok\":false,\"error\":\"%s\"}", escaped);
+        if (request) {
+            jsonFree(&request->request);
+        }
+        free(request);
+        close(client);
+        return;
+    }
+
+    const JsonValue* command  = jsonGet(&request->request, "command");
+    const JsonValue* priority = jsonGet(&request->request, "priority");
+    const JsonValue* job      = jsonGet(&request->request, "job");
+    const char*      name     = command && command->type == JSON_STRING
+                                    ? command->string
+                                    : "render";
+    bool             render   = strcmp(name, "render") == 0;
+    bool             ranked   = !priority || (priority->type == JSON_NUMBER &&
+                                              priority->number >= INT_MIN &&
+                                              priority->number <= INT_MAX);
+    pthread_mutex_lock(&q->lock);
+    request->id = ++q->nextId;
+    pthread_mutex_unlock(&q->lock);
+    request->client   = client;
+    request->arrived  = nowSeconds();
+    request->priority = priority && ranked ? (int)priority->number : 0;
+    bool valid        = render && ranked && job &&
+                        batchReadJob(job, NULL, (int)request->id,
+                                     &request->job);
+
+    // The counters are copied under the lock and the reply is sent after it
+    pthread_mutex_lock(&q->lock);
+    bool   stopping = q->stopping;
+    bool   full     = q->count == q->capacity;
+    int    queued   = q->count;
+    long   served   = q->served;
+    long   failed   = q->failed;
+    long   rejected = q->rejected;
+    int    programs = q->programs;
+    double uptime   = request->arrived - q->started;
+    bool   admitted = valid && !stopping && !full;
+    if (admitted) {
+        q->waiting[q->count++] = request;
+        pthread_cond_signal(&q->ready);
+    } else if (valid && !stopping && full) {
+        q->rejected++;
+    } else if (strcmp(name, "shutdown") == 0) {
+        q->stopping = true;
+        pthread_cond_broadcast(&q->ready);
+    }
+    pthread_mutex_unlock(&q->lock);
+    if (admitted) {
+        return;  // The render loop replies and frees the request
+    }
+
+    if (strcmp(name, "status") == 0) {
+        serveReply(client, "{\"ok\":true,\"queued\":%d,\"capacity\":%d,"
+                   "\"served\":%ld,\"failed\":%ld,\"rejected\":%ld,"
+                   "\"programs\":%d,\"uptime_s\":%.1f}", queued, q->capacity,
+                   served, failed, rejected, programs, uptime);
+    } else if (strcmp(name, "shutdown") == 0) {
+        serveReply(client, "{\"ok\":true,\"stopping\":true,\"queued\":%d}",
+                   queued);
+        log_and_print(
+            "Service: shutdown requested; finishing %d queued requests.\n",
+            queued);
+    } else if (!render) {
+        jsonEscapeString(escaped, sizeof(escaped), name);
+        serveReply(client, "{\"ok\":false,\"error\":\"unknown command '%s'\"}",
+                   escaped);
+    } else if (!ranked) {
+        serveReply(client, "{\"ok\":false,\"error\":\"priority is not a number "
+                   "in the int range\"}");
+    } else if (!valid) {
+        serveReply(
+            client,
+            "{\"ok\":false,\"error\":\"invalid job (see the service log)\"}");
+    } else if (stopping) {
+        serveReply(client, "{\"ok\":false,\"error\":\"shutting down\"}");
+    } else {
+        serveReply(client,
+                   "{\"ok\":false,\"error\":\"queue full\",\"queued\":%d}",
+                   queued);
+    }
+    jsonFree(&request->request);
+    free(request);
+    close(client);
+}
+
+/**
+ * Reads what a connection has sent so far.
+ *
+ * @return true once the request is complete: a newline arrived, the client
+ *         shut down its side, or the request reached its size limit.
+ */
+static bool serveReadConnection(ServeConnection* connection, bool* broken) {
+    while (connection->length < SERVE_REQUEST_BYTES) {
+        ssize_t n = recv(connection->client,
+                         connection->text + connection->length,
+                         SERVE_REQUEST_BYTES - connection->length, 0);
+        if (n < 0) {
+            *broken = errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+        connection->length += (size_t)n;
+        if (memchr(connection->text + connection->length - (size_t)n, '\n',
+                   (size_t)n)) {
+            return true;
+        }
+    }
+    return true;
+}
+
+/**
+ * Accepts connections and reads their requests, polling all of them at
+ * once: a client that connects and sends nothing holds up no one, and is
+ * dropped after 5 s.
+ */
+static void* serveAcceptThreadMain(void* arg) {
+    ServeQueue*     q = (ServeQueue*)arg;
+    ServeConnection connections[SERVE_MAX_CONNECTIONS];
+    struct pollfd   polled[SERVE_MAX_CONNECTIONS + 1];
+    int             count = 0;
+    while (true) {
+        pthread_mutex_lock(&q->lock);
+        if (g_serveStop && !q->stopping) {
+            q->stopping = true;
+            pthread_cond_broadcast(&q->ready);
+            log_and_print("Service: stopping; finishing %d queued requests.\n",
+                          q->count);
+        }
+        bool stopping = q->stopping;
+        pthread_mutex_unlock(&q->lock);
+        if (stopping) {
+            break;
+        }
+
+        // Polled with a timeout, so that a signal or a shutdown request is
+        // noticed within 200 ms
+        polled[0].fd     = q->listener;
+        polled[0].events = POLLIN;
+        for (int i = 0; i < count; i++) {
+            polled[i + 1].fd     = connections[i].client;
+            polled[i + 1].events = POLLIN;
+        }
+        for (int i = 0; i <= count; i++) {
+            polled[i].revents = 0;
+        }
+        if (poll(polled, (nfds_t)count + 1, 200) < 0 && errno != EINTR) {
+            break;
+        }
+
+        double now = nowSeconds();
+        for (int i = count - 1; i >= 0; i--) {
+            ServeConnection* connection = &connections[i];
+            bool             broken     = false;
+            bool             complete   = polled[i + 1].revents != 0 &&
+                                          serveReadConnection(connection,
+                                                              &broken);
+            if (complete) {
+                connection->text[connection->length] = '\0';
+                if (connection->length > 0) {
+                    serveAdmit(q, connection->client, connection->text);
+                } else {
+                    close(connection->client);
+                }
+            } else if (broken || now > connection->deadline) {
+                if (!broken) {
+                    serveReply(
+                        connection->client,
+                        "{\"ok\":false,\"error\":\"request timed out\"}");
+                }
+                close(connection->client);
+            } else {
+                continue;
+            }
+            free(connection->text);
+            connections[i] = connections[--count];
+        }
+
+        if (polled[0].revents & POLLIN) {
+            int client = accept(q->listener, NULL, NULL);
+            if (client < 0) {
+                continue;
+            }
+            fcntl(client, F_SETFD, FD_CLOEXEC);
+            fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+            char* text = count < SERVE_MAX_CONNECTIONS
+                             ? (char*)malloc(SERVE_REQUEST_BYTES + 1)
+                             : NULL;
+            if (!text) {
+                serveReply(client,
+                           "{\"ok\":false,\"error\":\"too many connections\"}");
+                close(client);
+                continue;
+            }
+            ServeConnection* connection = &connections[count++];
+            connection->client          = client;
+            connection->text            = text;
+            connection->length          = 0;
+            connection->deadline        = now + 5.0;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        serveReply(connections[i].client,
+                   "{\"ok\":false,\"error\":\"shutting down\"}");
+        close(connections[i].client);
+        free(connections[i].text);
+    }
+    return NULL;
+}
+
+/**
+ * Replies to a finished request and frees it.
+ */
+static void serveFinish(ServeQueue* q, ServeRequest* request) {
+    const BatchResult* result = &request->result;
+    double             now    = nowSeconds();
+    char               name[256];
+    char               output[1100];
+    jsonEscapeString(name, sizeof(name), request->job.name);
+    jsonEscapeString(
+        output, sizeof(output),
+        !request->job.still && request->job.sinkKind == SINK_SEQUENCE
+            ? request->job.folder
+            : request->job.output);
+    serveReply(
+        request->client, "{\"ok\":%s,\"id\":%lu,\"name\":\"%s\","
+        "\"output\":\"%s\",\"frames\":%ld,\"cached_program\":%s,"
+        "\"queued_ms\":%.3f,\"setup_ms\":%.3f,\"render_ms\":%.3f,"
+        "\"finish_ms\":%.3f,\"total_ms\":%.3f%s}",
+        result->ok ? "true" : "false", request->id, name, output,
+        result->frames, result->programReused ? "true" : "false",
+        (request->started - request->arrived) * 1000.0,
+        result->setupSeconds * 1000.0, result->renderSeconds * 1000.0,
+        result->finishSeconds * 1000.0, (now - request->arrived) * 1000.0,
+        result->ok ? "" : ",\"error\":\"render failed (see the service log)\"");
+    log_and_print("Request %lu (%s): %s in %.1f ms, %.1f ms of it queued.\n",
+                  request->id, request->job.name,
+                  result->ok ? "done" : "FAILED",
+                  (now - request->arrived) * 1000.0,
+                  (request->started - request->arrived) * 1000.0);
+    close(request->client);
+
+    pthread_mutex_lock(&q->lock);
+    if (result->ok) {
+        q->served++;
+    } else {
+        q->failed++;
+    }
+    pthread_mutex_unlock(&q->lock);
+    jsonFree(&request->request);
+    free(request);
+}
+
+typedef struct {
+    ServeQueue*   queue;
+    ServeRequest* request;  // Freed by the closer once it has replied
+    SinkKind      kind;     // What the request wrote, kept for the render loop
+    char          folder[512];
+} ServeCloser;
+
+static void* serveCloseThreadMain(void* arg) {
+    ServeCloser* closer = (ServeCloser*)arg;
+    batchCloseThreadMain(&closer->request->result);
+    serveFinish(closer->queue, closer->request);
+    return NULL;
+}
+
+/**
+ * Runs the render service: a headless context, programs and render targets
+ * kept warm between requests, and a UNIX domain socket taking requests.
+ *
+ * A request is one line of JSON: `{"job": {...}, "priority": n}` renders a
+ * job with the settings of a batch manifest job (a still, an image sequence
+ * or a video) and replies once its output is finished; `{"command":
+ * "status"}` and `{"command": "shutdown"}` are answered right away. Up to
+ * `capacity` render requests wait, highest priority first; more are turned
+ * away. Requests render one at a time, and each output is finished while
+ * the next request renders. SIGINT, SIGTERM or a shutdown request stop the
+ * service once the waiting requests are done.
+ *
+ * @param socketPath Socket to listen on; a stale one is replaced.
+ * @param capacity   Render requests that may wait.
+ * @param png        PNG settings of stills and image sequences.
+ * @return true if the service ran and stopped cleanly.
+ */
+bool runServe(const char* socketPath, int capacity, const PngOptions* png) {
+    double             start = nowSeconds();
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        log_and_print("Error: Socket path '%s' is too long.\n", socketPath);
+        return false;
+    }
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketPath);
+
+    // A socket left behind by a service that died is replaced; one that answers
+    // is not
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0 &&
+        connect(probe, (struct sockaddr*)&address, sizeof(address)) == 0) {
+        log_and_print("Error: A service is already listening on %s.\n",
+                      socketPath);
+        close(probe);
+        return false;
+    }
+    if (probe >= 0) {
+        close(probe);
+    }
+    unlink(socketPath);
+    // Requests name files to read and write, so the socket is created
+    // accessible to this user only
+    int    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask     = umask(077);
+    bool   bound    = listener >= 0 &&
+                      bind(listener, (struct sockaddr*)&address,
+                           sizeof(address)) == 0;
+    umask(mask);
+    if (!bound || listen(listener, 64) != 0) {
+        log_and_print("Error: Unable to listen on %s: %s.\n", socketPath,
+                      strerror(errno));
+        if (listener >= 0) {
+            close(listener);
+        }
+        return false;
+    }
+    fcntl(listener, F_SETFD, FD_CLOEXEC);
+
+    HeadlessContext context;
+    if (!headlessContextCreate(&context)) {
+        close(listener);
+        unlink(socketPath);
+        return false;
+    }
+    if (!gladLoadGLLoader((GLADloadproc)headlessGetProcAddress)) {
+        log_and_print("Error loading GLAD.\n");
+        headlessContextDestroy(&context);
+        close(listener);
+        unlink(socketPath);
+        return false;
+    }
+    WarmRenderer renderer;
+    warmRendererInit(&renderer);
+
+    ServeQueue q;
+    memset(&q, 0, sizeof(q));
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.ready, NULL);
+    q.waiting  = (ServeRequest**)calloc((size_t)capacity,
+                                        sizeof(ServeRequest*));
+    q.capacity = capacity;
+    q.listener = listener;
+    q.started  = start;
+
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = serveStopSignal;
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t acceptor;
+    if (!q.waiting ||
+        pthread_create(&acceptor, NULL, serveAcceptThreadMain, &q) != 0) {
+        log_and_print("Error: Unable to start the service.\n");
+        free(q.waiting);
+        warmRendererDestroy(&renderer);
+        headlessContextDestroy(&context);
+        close(listener);
+        unlink(socketPath);
+        return false;
+    }
+    log_and_print(
+        "Serving on %s: up to %d waiting requests; context ready in %.3f s.\n",
+        socketPath, capacity, nowSeconds() - start);
+
+    pthread_t   closer;
+    bool        closing = false;  // An output is being finished by `closer`
+    ServeCloser closerArgs;
+    while (true) {
+        pthread_mutex_lock(&q.lock);
+        while (q.count == 0 && !q.stopping) {
+            pthread_cond_wait(&q.ready, &q.lock);
+        }
+        if (q.count == 0) {
+            pthread_mutex_unlock(&q.lock);
+            break;
+        }
+        int next = 0;
+        for (int i = 1; i < q.count; i++) {
+            const ServeRequest* r = q.waiting[i];
+            if (r->priority > q.waiting[next]->priority ||
+                (r->priority == q.waiting[next]->priority &&
+                 r->id < q.waiting[next]->id)) {
+                next = i;
+            }
+        }
+        ServeRequest* request = q.waiting[next];
+        q.waiting[next]       = q.waiting[--q.count];
+        pthread_mutex_unlock(&q.lock);
+
+        // A request writing into the frames folder of the output being finished
+        // waits for it
+        const BatchJob* job = &request->job;
+        if (closing &&
+            batchSharesFolder(closerArgs.kind, closerArgs.folder, job)) {
+            pthread_join(closer, NULL);
+            closing = false;
+        }
+        request->started = nowSeconds();
+        log_and_print(
+            "Request %lu (%s, priority %d): %d x %d %s -> %s\n", request->id,
+            job->name, request->priority, job->width, job->height,
+            job->still ? "still" : sinkKindName(job->sinkKind),
+            !job->still && job->sinkKind == SINK_SEQUENCE ? job->folder
+                                                          : job->output);
+        request->result.ok = batchRenderJob(&renderer, job, png,
+                                            &request->result);
+        pthread_mutex_lock(&q.lock);
+        q.programs = renderer.programCount;
+        pthread_mutex_unlock(&q.lock);
+        if (!request->result.sinkOpen) {
+            serveFinish(&q, request);
+            continue;
+        }
+
+        // The reply waits for the output; the next request renders meanwhile
+        if (closing) {
+            pthread_join(closer, NULL);
+        }
+        closerArgs.queue   = &q;
+        closerArgs.request = request;
+        closerArgs.kind    = job->sinkKind;
+        snprintf(closerArgs.folder, sizeof(closerArgs.folder), "%s",
+                 job->folder);
+        closing            = pthread_create(&closer, NULL, serveCloseThreadMain,
+                                            &closerArgs) == 0;
+        if (!closing) {
+            serveCloseThreadMain(&closerArgs);
+        }
+    }
+    if (closing) {
+        pthread_join(closer, NULL);
+    }
+    pthread_join(acceptor, NULL);
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    close(listener);
+    unlink(socketPath);
+    warmRendererDestroy(&renderer);
+    headlessContextDestroy(&context);
+    log_and_print(
+        "Service stopped: %ld requests served, %ld failed, %ld turned away.\n",
+        q.served, q.failed, q.rejected);
+    free(q.waiting);
+    pthread_cond_destroy(&q.ready);
+    pthread_mutex_destroy(&q.lock);
+    return true;
+}
+#endif
+
+int main(int argc, char** argv) {
+    // Default parameters
+    int         windowWidth        = 2560;
+    int         windowHeight       = 1440;
+    const char* windowTitle        = "My First Shader!";
+    const char* vertexShaderPath   = "shaders/vertex_shader.glsl";
+    const char* fragmentShaderPath = "shaders/fragment_shader.glsl";
+
+    // Parameters for optional video recording
+    bool        recordVideo       = false;
+    int         fps               = 30;
+    float       duration          = 5.0f;
+    char        outputFolder[256] = "frames";
+    char        outputVideo[256]  = "output.mp4";
+    int         pboRingDepth      = 0;  // 0 = synchronous glReadPixels
+    int         diffTileSize      = 0;  // Tiles of the GPU frame difference
+                                        // (0 = read back every frame whole)
+    SinkKind    sinkKind          = SINK_PIPE;
+    int         encoderThreads    = 0;  // 0 = encode PNGs on the render thread
+    int         writeQueue        = 4;  // Frames queued for the writer thread;
+                                        // 0 = write on the render thread
+    bool        hugePages         = false;
+    bool        headless          = false;
+    bool        offline           = false;  // No vsync and no presentation
+                                            // while recording
+    int         tiledWidth        = 0;      // Output size of tiled renders (0 =
+                                            // not tiled)
+    int         tiledHeight       = 0;
+    int         tileSize          = 4096;
+    PngOptions  pngOptions        = {PNG_WRITER_STB, 6, 1, PNG_FILTER_ADAPTIVE};
+    const char* benchmark         = NULL;  // Run a benchmark on one rendered
+                                           // frame instead of the loop
+    const char* frameExtension    = "png";  // Frame file format of the image
+                                            // sequence sinks
+    YuvOptions  yuvOptions        = {YUV_OFF, false, false};
+    PixelFormat pixelFormat       = PIXEL_RGBA;  // Frame layout handed to the
+                                                 // pipe and container sinks
+    bool        pixelFormatSet    = false;
+    bool        dedup             = false;  // Skip repeated frames of the image
+                                            // sequence sinks
+    bool        resume            = false;  // Journal frames and skip those an
+                                            // earlier run finished
+    long        rangeStart        = 0;      // First frame recorded
+                                            // (--frame-range)
+    long        rangeEnd          = -1;     // One past the last frame recorded,
+                                            // -1 = the end of the recording
+    int         shardIndex        = 0;      // Part of the recording this
+                                            // process renders (--shard)
+    int         shardCount        = 0;      // 0 = not sharded
+    int         workerCount       = 0;      // Forked render processes (0 =
+                                            // render in this process)
+
+    // Encoder settings of the video sinks
+    const EncodeProfile* encodeProfile  = encodeProfileByName("archival");
+    double               budgetSeconds  = 0.0;  // Wall-clock budget choosing
+                                                // the profile (0 = none)
+    // Parallel two-pass encode segments (0 = from core count)
+    int                  encodeSegments = 0;
+
+    // Open log file
+    g_logFile = fopen("shaderapp_logs.log", "w");
+    if (!g_logFile) {
+        printf("Error: Unable to open log file.\n");
+        return -1;
+    }
+    log_and_print("----- Program Start -----\n");
+
+    // Joining the parts of a recording needs no window and no shaders:
+    //   ./app --merge out.mp4 out.shard000-of-002.mp4 out.shard001-of-002.mp4
+    if (argc >= 2 && strcmp(argv[1], "--merge") == 0) {
+        bool merged = argc >= 4 && mergeOutputs(argv[2], argc - 3, argv + 3);
+        if (argc < 4) {
+            log_and_print("Error: --merge expects an output file and the files "
+                          "to join.\n");
+        }
+        log_and_print("----- Program End -----\n");
+        fclose(g_logFile);
+        return merged ? 0 : 1;
+    }
+    if (argc >= 2 && strcmp(argv[1], "--serve") == 0) {
+        int  capacity = argc == 4 ? atoi(argv[3]) : 16;
+        bool served   = false;
+        if (argc < 3 || argc > 4 || capacity < 1) {
+            log_and_print("Error: --serve expects a socket path and optionally "
+                          "a queue depth of at least 1.\n");
+        } else {
+#ifdef _WIN32
+            log_and_print("Error: --serve is not available on Windows.\n");
+#else
+            served = runServe(argv[2], capacity, &pngOptions);
+#endif
+        }
+        framePoolDestroy(&g_framePool);
+        log_and_print("----- Program End -----\n");
+        fclose(g_logFile);
+        return served ? 0 : 1;
+    }
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+        bool done = argc == 3 && runBatch(argv[2], &pngOptions);
+        if (argc != 3) {
+            log_and_print("Error: --batch expects one manifest file.\n");
+        }
+        framePoolDestroy(&g_framePool);
+        log_and_print("----- Program End -----\n");
+        fclose(g_logFile);
+        return done ? 0 : 1;
+    }
+
+    // Parsing command-line arguments
+    // Example:
+    //   ./app 1024 768 "Window Title" vertex.glsl fragment.glsl --video 1 30 5 frames out.mp4
+    if (argc >= 3) {
+        windowWidth  = atoi(argv[1]);
+        windowHeight = atoi(argv[2]);
+        if (argc >= 4) {
+            windowTitle = argv[3];
+        }
+        if (argc >= 5) {
+            vertexShaderPath = argv[4];
+        }
+        if (argc >= 6) {
+            fragmentShaderPath = argv[5];
+        }
+        // Look for optional flags
+        for (int i = 6; i < argc; i++) {
+            if (strcmp(argv[i], "--video") == 0) {
+                // Expecting 5 more arguments (bool, fps, duration, folder, filename)
+                if (i + 5 < argc) {
+                    recordVideo = (atoi(argv[i + 1]) != 0);
+                    fps         = atoi(argv[i + 2]);
+                    duration    = (float)atof(argv[i + 3]);
+                    strncpy(outputFolder, argv[i + 4], sizeof(outputFolder) - 1);
+                    strncpy(outputVideo, argv[i + 5], sizeof(outputVideo) - 1);
+                    i += 5;
+                } else {
+                    log_and_print("Warning: --video flag provided but not enough parameters.\n");
+                }
+            } else if (strcmp(argv[i], "--pbo-ring") == 0) {
+                // Expecting the number of pixel-buffer objects in the
+                // readback ring
+                if (i + 1 < argc) {
+                    pboRingDepth = atoi(argv[i + 1]);
+                    i += 1;
+                } else {
+                    log_and_print(
+                        "Warning: --pbo-ring flag provided without a depth.\n");
+                }
+            } else if (strcmp(argv[i], "--gpu-diff") == 0) {
+                // Expecting the tile size changes are tracked in
+                if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                    diffTileSize = atoi(argv[i + 1]);
+                    i += 1;
+                } else {
+                    log_and_print(
+                        "Warning: --gpu-diff expects a tile size in pixels.\n");
+                }
+            } else if (strcmp(argv[i], "--sink") == 0) {
+                // Expecting one of: pipe, sequence, two-pass, y4m, raw
+                if (i + 1 < argc && parseSinkKind(argv[i + 1], &sinkKind)) {
+                    i += 1;
+                } else {
+                    log_and_print("Warning: --sink expects pipe, sequence, "
+                                  "two-pass, y4m or raw.\n");
+                }
+            } else if (strcmp(argv[i], "--encoders") == 0) {
+                // Expecting the number of PNG encoder threads
+                if (i + 1 < argc) {
+                    encoderThreads = atoi(argv[i + 1]);
+                    i += 1;
+                } else {
+                    log_and_print("Warning: --encoders flag provided without a "
+                                  "thread count.\n");
+                }
+            } else if (strcmp(argv[i], "--write-queue") == 0) {
+                // Expecting the number of frames the writer thread may
+                // lag behind
+                if (i + 1 < argc) {
+                    writeQueue = atoi(argv[i + 1]);
+                    i += 1;
+                } else {
+                    log_and_print("Warning: --write-queue flag provided "
+                                  "without a frame count.\n");
+                }
+            } else if (strcmp(argv[i], "--hugepages") == 0) {
+                hugePages = true;
+            } else if (strcmp(argv[i], "--headless") == 0) {
+                headless = true;
+            } else if (strcmp(argv[i], "--offline") == 0) {
+                offline = true;
+            } else if (strcmp(argv[i], "--png-writer") == 0) {
+                // Expecting stb or stream
+                if (i + 1 < argc && strcmp(argv[i + 1], "stb") == 0) {
+                    pngOptions.writer = PNG_WRITER_STB;
+                    i += 1;
+                } else if (i + 1 < argc && strcmp(argv[i + 1], "stream") == 0) {
+                    pngOptions.writer = PNG_WRITER_STREAM;
+                    i += 1;
+                } else {
+                    log_and_print(
+                        "Warning: --png-writer expects stb or stream.\n");
+                }
+            } else if (strcmp(argv[i], "--png-filter") == 0) {
+                // Expecting a filter mode name
+                if (i + 1 < argc &&
+                    parsePngFilterMode(argv[i + 1], &pngOptions.filter)) {
+                    i += 1;
+                } else {
+                    log_and_print("Warning: --png-filter expects none, sub, "
+                                  "up, average, paeth, adaptive or sampled.\n");
+                }
+            } else if (strcmp(argv[i], "--bench") == 0) {
+                // Expecting the benchmark to run
+                if (i + 1 < argc && (strcmp(argv[i + 1], "png") == 0 ||
+                                     strcmp(argv[i + 1], "deflate") == 0 ||
+                                     strcmp(argv[i + 1], "formats") == 0 ||
+                                     strcmp(argv[i + 1], "pixels") == 0 ||
+                                     strcmp(argv[i + 1], "profiles") == 0)) {
+                    benchmark = argv[i + 1];
+                    i += 1;
+                } else {
+                    log_and_print("Warning: --bench expects png, deflate, "
+                                  "formats, pixels or profiles.\n");
+                }
+            } else if (strcmp(argv[i], "--profile") == 0) {
+                // Expecting preview, delivery or archival
+                const EncodeProfile* profile =
+                    i + 1 < argc ? encodeProfileByName(argv[i + 1]) : NULL;
+                if (profile) {
+                    encodeProfile = profile;
+                    i += 1;
+                } else {
+                    log_and_print("Warning: --profile expects preview, "
+                                  "delivery or archival.\n");
+                }
+            } else if (strcmp(argv[i], "--dedup") == 0) {
+                dedup = true;
+            } else if (strcmp(argv[i], "--resume") == 0) {
+                resume = true;
+            } else if (strcmp(argv[i], "--frame-range") == 0) {
+                // Expecting start:end (end excluded; start: records to the end)
+                long start = 0, end = -1;
+                int  parsed = i + 1 < argc
+                                  ? sscanf(argv[i + 1], "%ld:%ld", &start, &end)
+                                  : 0;
+                if (parsed >= 1 && start >= 0 && (parsed == 1 || end > start)) {
+                    rangeStart = start;
+                    rangeEnd   = parsed == 2 ? end : -1;
+                    i += 1;
+                } else {
+                    log_and_print("Warning: --frame-range expects start:end "
+                                  "with start < end.\n");
+                }
+            } else if (strcmp(argv[i], "--shard") == 0) {
+                // Expecting i/N, i counting from 0
+                int index = 0, count = 0;
+                if (i + 1 < argc &&
+                    sscanf(argv[i + 1], "%d/%d", &index, &count) == 2 &&
+                    count > 0 && index >= 0 && index < count) {
+                    shardIndex = index;
+                    shardCount = count;
+                    i += 1;
+                } else {
+                    log_and_print(
+                        "Warning: --shard expects i/N with 0 <= i < N.\n");
+                }
+            } else if (strcmp(argv[i], "--workers") == 0) {
+                // Expecting a process count or auto
+                if (i + 1 < argc && (strcmp(argv[i + 1], "auto") == 0 ||
+                                     atoi(argv[i + 1]) > 0)) {
+                    workerCount = strcmp(argv[i + 1], "auto") == 0
+                                      ? cpuCoreCount()
+                                      : atoi(argv[i + 1]);
+                    i += 1;
+                } else {
+                    log_and_print("Warning: --workers expects a process count "
+                                  "or auto.\n");
+                }
+            } else if (strcmp(argv[i], "--segments") == 0) {
+                // Expecting a segment count or auto
+                if (i + 1 < argc && (strcmp(argv[i + 1], "auto") == 0 ||
+                                     atoi(argv[i + 1]) > 0)) {
+                    encodeSegments = strcmp(argv[i + 1], "auto") == 0
+                                         ? 0
+                                         : atoi(argv[i + 1]);
+                    i += 1;
+                } else {
+                    log_and_print("Warning: --segments expects a segment count "
+                                  "or auto.\n");
+                }
+            } else if (strcmp(argv[i], "--budget") == 0) {
+                // Expecting the wall-clock budget of the recording in seconds
+                if (i + 1 < argc && atof(argv[i + 1]) > 0.0) {
+                    budgetSeconds = atof(argv[i + 1]);
+                    i += 1;
+                } else {
+                    log_and_print(
+                        "Warning: --budget expects a number of seconds.\n");
+                }
+            } else if (strcmp(argv[i], "--yuv") == 0) {
+                // Expecting 444 or 420
+                if (i + 1 < argc && strcmp(argv[i + 1], "444") == 0) {
+                    yuvOptions.layout = YUV_444;
+                    i += 1;
+                } else if (i + 1 < argc && strcmp(argv[i + 1], "420") == 0) {
+                    yuvOptions.layout = YUV_420;
+                    i += 1;
+                } else {
+                    log_and_print("Warning: --yuv expects 444 or 420.\n");
+                }
+            } else if (strcmp(argv[i], "--yuv-range") == 0) {
+                // Expecting limited or full
+                if (i + 1 < argc && (strcmp(argv[i + 1], "limited") == 0 ||
+                                     strcmp(argv[i + 1], "full") == 0)) {
+                    yuvOptions.fullRange = strcmp(argv[i + 1], "full") == 0;
+                    i += 1;
+                } else {
+                    log_and_print(
+                        "Warning: --yuv-range expects limited or full.\n");
+                }
+            } else if (strcmp(argv[i], "--yuv-validate") == 0) {
+                yuvOptions.validate = true;
+            } else if (strcmp(argv[i], "--pixel-format") == 0) {
+                // Expecting rgba, rgb24, bgr24, yuv444p or yuv420p
+                if (i + 1 < argc &&
+                    parsePixelFormat(argv[i + 1], &pixelFormat)) {
+                    pixelFormatSet = true;
+                    i += 1;
+                } else {
+                    log_and_print("Warning: --pixel-format expects rgba, "
+                                  "rgb24, bgr24, yuv444p or yuv420p.\n");
+                }
+            } else if (strcmp(argv[i], "--frame-format") == 0) {
+                // Expecting png, qoi or rgba
+                const ImageFormat* format =
+                    i + 1 < argc ? imageFormatByExtension(argv[i + 1]) : NULL;
+                if (format) {
+                    frameExtension = format->extension;
+                    i += 1;
+                } else {
+                    log_and_print(
+                        "Warning: --frame-format expects png, qoi or rgba.\n");
+                }
+            } else if (strcmp(argv[i], "--png-level") == 0) {
+                // Expecting a deflate level from 1 to 9
+                if (i + 1 < argc && atoi(argv[i + 1]) >= 1 &&
+                    atoi(argv[i + 1]) <= 9) {
+                    pngOptions.level = atoi(argv[i + 1]);
+                    i += 1;
+                } else {
+                    log_and_print(
+                        "Warning: --png-level expects a level from 1 to 9.\n");
+                }
+            } else if (strcmp(argv[i], "--png-threads") == 0) {
+                // Expecting the number of threads compressing each PNG
+                if (i + 1 < argc) {
+                    pngOptions.threads = atoi(argv[i + 1]);
+                    i += 1;
+                } else {
+                    log_and_print("Warning: --png-threads flag provided but no "
+                                  "thread count.\n");
+                }
+            } else if (strcmp(argv[i], "--tiled") == 0) {
+                // Expecting output width, output height and tile size
+                if (i + 3 < argc) {
+                    tiledWidth  = atoi(argv[i + 1]);
+                    tiledHeight = atoi(argv[i + 2]);
+                    tileSize    = atoi(argv[i + 3]);
+                    i += 3;
+                } else {
+                    log_and_print("Warning: --tiled flag provided but not "
+                                  "enough parameters.\n");
+                }
+            }
+        }
+        log_and_print("Command line parameters received.\n");
+    } else {
+        // If insufficient arguments, ask interactively
+        log_and_print("No command line parameters detected, launching interactive menu.\n");
+        printf("Welcome to ShaderApp!\n");
+        printf("1. Use default parameters\n");
+        printf("2. Customize parameters\n");
+        printf("Enter your choice (1 or 2): ");
+        int choice = 0;
+        if (scanf("%d", &choice) != 1) {
+            log_and_print("Error reading choice. Using default parameters.\n");
+            choice = 1;
+        }
+        if (choice == 2) {
+            printf("Enter window width: ");
+            scanf("%d", &windowWidth);
+            printf("Enter window height: ");
+            scanf("%d", &windowHeight);
+
+            static char titleBuffer[256];
+            printf("Enter window title: ");
+            scanf(" %[^\n]", titleBuffer);
+            windowTitle = titleBuffer;
+
+            static char vertexBuffer[256];
+            printf("Enter vertex shader path: ");
+            scanf(" %[^\n]", vertexBuffer);
+            vertexShaderPath = vertexBuffer;
+
+            static char fragmentBuffer[256];
+            printf("Enter fragment shader path: ");
+            scanf(" %[^\n]", fragmentBuffer);
+            fragmentShaderPath = fragmentBuffer;
+
+            // Video recording options
+            printf("Record video? (0/1): ");
+            int videoChoice = 0;
+            scanf("%d", &videoChoice);
+            recordVideo = (videoChoice != 0);
+            if (recordVideo) {
+                printf("Enter FPS: ");
+                scanf("%d", &fps);
+                printf("Enter duration (seconds): ");
+                scanf("%f", &duration);
+
+                printf("Output frames folder: ");
+                scanf(" %[^\n]", outputFolder);
+
+                printf("Output video file: ");
+                scanf(" %[^\n]", outputVideo);
+            }
+            log_and_print("User provided custom parameters.\n");
+        } else {
+            log_and_print("Using default parameters.\n");
+        }
+    }
+
+    // Benchmarks render a single frame and never record
+    if (benchmark && recordVideo) {
+        log_and_print(
+            "Warning: --bench renders one frame; ignoring --video.\n");
+        recordVideo = false;
+    }
+
+    // A frame range or shard records part of the recording; frame times stay
+    // those of the whole one
+    long recordingFrames = (long)(fps * duration);
+    bool partial         = false;
+    if (!recordVideo && (shardCount > 0 || rangeStart > 0 || rangeEnd >= 0)) {
+        log_and_print("Warning: --frame-range and --shard only apply to "
+                      "recordings; ignoring them.\n");
+        shardCount = 0;
+    } else if (shardCount > 0) {
+        if (rangeStart > 0 || rangeEnd >= 0) {
+            log_and_print(
+                "Warning: --shard picks the frames; ignoring --frame-range.\n");
+        }
+        // Shards start on keyframes of the profile, so the merged video keeps
+        // its cadence
+        long gopFrames = profileGopFrames(encodeProfile, fps);
+        if ((recordingFrames + gopFrames - 1) / gopFrames < shardCount) {
+            log_and_print("Warning: The recording has fewer GOPs than shards; "
+                          "splitting it between keyframes.\n");
+            gopFrames = 1;
+        }
+        rangeStart = segmentFirstFrame(recordingFrames, gopFrames, shardCount,
+                                       shardIndex);
+        rangeEnd   = segmentFirstFrame(recordingFrames, gopFrames, shardCount,
+                                       shardIndex + 1);
+        if (rangeStart >= rangeEnd) {
+            log_and_print("Error: Shard %d/%d has no frames; %ld frames make "
+                          "at most %ld shards.\n", shardIndex, shardCount,
+                          recordingFrames, recordingFrames);
+            fclose(g_logFile);
+            return 1;
+        }
+    }
+    if (!recordVideo) {
+        rangeStart = 0;
+        rangeEnd   = 0;
+    } else {
+        if (rangeEnd < 0 || rangeEnd > recordingFrames) {
+            rangeEnd = recordingFrames;
+        }
+        if (rangeStart > 0 && rangeStart >= rangeEnd) {
+            log_and_print("Error: --frame-range starts at frame %ld; the "
+                          "recording has %ld frames.\n", rangeStart,
+                          recordingFrames);
+            fclose(g_logFile);
+            return 1;
+        }
+        partial = rangeStart > 0 || rangeEnd < recordingFrames;
+        if (shardCount > 0 && sinkKind != SINK_SEQUENCE) {
+            // Every shard writes its own part for --merge to join
+            char shardOutput[256];
+            formatShardOutput(shardOutput, sizeof(shardOutput), outputVideo,
+                              shardIndex, shardCount);
+            snprintf(outputVideo, sizeof(outputVideo), "%s", shardOutput);
+        }
+    }
+
+    // stb_image_write can force one filter; it has no sampled mode and tries
+    // all five instead
+    stbi_write_force_png_filter      = pngOptions.filter <= PNG_FILTER_PAETH
+                                           ? (int)pngOptions.filter
+                                           : -1;
+    stbi_write_png_compression_level = pngOptions.level;
+
+    // Log final configuration
+    log_and_print("Configuration:\n");
+    log_and_print("  Window Size   : %d x %d\n", windowWidth, windowHeight);
+    log_and_print("  Title         : %s\n", windowTitle);
+    log_and_print("  Headless      : %s\n", headless ? "YES" : "NO");
+    log_and_print("  Vertex Shader : %s\n", vertexShaderPath);
+    log_and_print("  Fragment Shdr : %s\n", fragmentShaderPath);
+    if (recordVideo) {
+        log_and_print("  Video Capture : YES\n");
+        log_and_print("    FPS         : %d\n", fps);
+        log_and_print("    Duration    : %.2f sec\n", duration);
+        if (shardCount > 0) {
+            log_and_print("    Frames      : %ld-%ld of %ld (shard %d/%d)\n",
+                          rangeStart, rangeEnd - 1, recordingFrames, shardIndex,
+                          shardCount);
+        } else if (partial) {
+            log_and_print("    Frames      : %ld-%ld of %ld\n", rangeStart,
+                          rangeEnd - 1, recordingFrames);
+        }
+        log_and_print("    Sink        : %s\n", sinkKindName(sinkKind));
+        if (sinkKind == SINK_SEQUENCE || sinkKind == SINK_TWO_PASS) {
+            log_and_print("    Frames Dir  : %s\n", outputFolder);
+            log_and_print("    Encoders    : %d threads\n", encoderThreads);
+            log_and_print("    Frame Format: %s\n", frameExtension);
+            log_and_print("    PNG Writer  : %s\n",
+                          pngOptions.writer == PNG_WRITER_STREAM ? "stream"
+                                                                 : "stb");
+            log_and_print("    PNG Threads : %d per image\n",
+                          pngOptions.threads);
+            log_and_print("    PNG Filter  : %s\n",
+                          g_pngFilterNames[pngOptions.filter]);
+            log_and_print("    PNG Level   : %d\n", pngOptions.level);
+            log_and_print("    Dedup       : %s\n", dedup ? "YES" : "NO");
+            log_and_print("    Resume      : %s\n", resume ? "YES" : "NO");
+        }
+        if (workerCount > 0) {
+            log_and_print("    Workers     : %d processes\n", workerCount);
+        }
+        if (sinkKind != SINK_SEQUENCE) {
+            log_and_print("    Output Video: %s\n", outputVideo);
+        }
+        if (sinkKind == SINK_PIPE || sinkIsContainer(sinkKind)) {
+            if (writeQueue > 0) {
+                log_and_print("    Write Queue : %d frames\n", writeQueue);
+            } else {
+                log_and_print(
+                    "    Write Queue : off (written on the render thread)\n");
+            }
+        }
+        if (yuvOptions.layout != YUV_OFF) {
+            log_and_print("    GPU YUV     : 4:%s, %s range%s\n",
+                          yuvOptions.layout == YUV_420 ? "2:0" : "4:4",
+                          yuvOptions.fullRange ? "full" : "limited",
+                          yuvOptions.validate ? ", validated" : "");
+        }
+        log_and_print("    Offline     : %s\n",
+                      (offline || headless) ? "YES" : "NO");
+        if (tiledWidth > 0 && tiledHeight > 0) {
+            log_and_print("    Tiled Output: %d x %d (tiles of %d)\n",
+                          tiledWidth, tiledHeight, tileSize);
+        }
+        log_and_print("    Huge Pages  : %s\n", hugePages ? "YES" : "NO");
+        if (pboRingDepth > 0) {
+            log_and_print("    PBO Ring    : %d buffers\n", pboRingDepth);
+        } else {
+            log_and_print("    PBO Ring    : off (synchronous readback)\n");
+        }
+        if (diffTileSize > 0) {
+            log_and_print("    GPU Diff    : tiles of %d\n", diffTileSize);
+        }
+    } else {
+        log_and_print("  Video Capture : NO\n");
+    }
+
+    // Render workers create a context each, so none may exist in this process
+    // when they are forked
+    if (workerCount > 0 && (!recordVideo || !headless)) {
+        log_and_print("Warning: --workers only applies to headless recordings; "
+                      "ignoring it.\n");
+        workerCount = 0;
+    }
+#ifdef _WIN32
+    if (workerCount > 0) {
+        log_and_print(
+            "Warning: --workers needs fork(); rendering in this process.\n");
+        workerCount = 0;
+    }
+#else
+    if (workerCount > 0) {
+        if (tiledWidth > 0 || yuvOptions.layout != YUV_OFF ||
+            diffTileSize > 0 || pboRingDepth > 0 || dedup || resume ||
+            budgetSeconds > 0.0) {
+            log_and_print("Warning: Render workers read back whole RGBA "
+                          "frames; --tiled, --yuv, --gpu-diff, --pbo-ring, "
+                          "--dedup, --resume and --budget are ignored.\n");
+        }
+        pixelFormat = resolveSinkPixelFormat(sinkKind, pixelFormat,
+                                             pixelFormatSet, YUV_OFF, false);
+        if (sinkKind == SINK_PIPE || sinkIsContainer(sinkKind)) {
+            log_and_print("Pixel format: %s (%s kernels)\n",
+                          g_pixelFormatNames[pixelFormat],
+                          pixelKernels()->name);
+        }
+        if (sinkKind == SINK_PIPE || sinkKind == SINK_TWO_PASS) {
+            log_and_print("Encode profile: %s\n", encodeProfile->name);
+        }
+        g_framePool.hugePages = hugePages;
+        SinkConfig sinkConfig = {sinkKind, outputFolder, outputVideo, fps, 0,
+                                 pngOptions, frameExtension,
+                                 rangeEnd - rangeStart, rangeStart, partial,
+                                 pixelFormat, yuvOptions.fullRange, writeQueue,
+                                 encodeProfile, encodeSegments, false, false,
+                                 false};
+        bool rendered = renderWithWorkers(workerCount, &sinkConfig, windowWidth,
+                                          windowHeight, vertexShaderPath,
+                                          fragmentShaderPath);
+        framePoolDestroy(&g_framePool);
+        log_and_print("----- Program End -----\n");
+        fclose(g_logFile);
+        return rendered ? 0 : 1;
+    }
+#endif
+
+    GLFWwindow*     window = NULL;
+    HeadlessContext headlessContext;
+    RenderTarget    offscreen;
+    int             fbWidth, fbHeight;
+
+    if (headless) {
+        // Nothing would ever stop a headless loop that does not record
+        if (!recordVideo && !benchmark) {
+            log_and_print("Error: --headless requires video recording (--video "
+                          "1 ...) or --bench.\n");
+            fclose(g_logFile);
+            return 1;
+        }
+        if (!headlessContextCreate(&headlessContext)) {
+            fclose(g_logFile);
+            return -1;
+        }
+
+        // Load OpenGL function pointers via GLAD
+        if (!gladLoadGLLoader((GLADloadproc)headlessGetProcAddress)) {
+            log_and_print("Error loading GLAD.\n");
+            headlessContextDestroy(&headlessContext);
+            fclose(g_logFile);
+            return -1;
+        }
+        log_and_print("GLAD loaded successfully.\n");
+
+        // Render into an FBO of the requested size; there is no default
+        // framebuffer
+        fbWidth  = windowWidth;
+        fbHeight = windowHeight;
+        if (!renderTargetInit(&offscreen, fbWidth, fbHeight)) {
+            headlessContextDestroy(&headlessContext);
+            fclose(g_logFile);
+            return -1;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, offscreen.fbo);
+        glViewport(0, 0, fbWidth, fbHeight);
+        log_and_print("Rendering offscreen at %d x %d.\n", fbWidth, fbHeight);
+    } else {
+        // Initialize GLFW
+        if (!glfwInit()) {
+            log_and_print("Error initializing GLFW.\n");
+            fclose(g_logFile);
+            return -1;
+        }
+        log_and_print("GLFW initialized successfully.\n");
+
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+        if (recordVideo &&
+            (sinkKind == SINK_PIPE || sinkIsContainer(sinkKind))) {
+            // ffmpeg is told the frame size up front, so it must not change
+            glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+        }
+
+        window = glfwCreateWindow(windowWidth, windowHeight, windowTitle, NULL,
+                                  NULL);
+        if (!window) {
+            log_and_print("Error creating the window.\n");
+            glfwTerminate();
+            fclose(g_logFile);
+            return -1;
+        }
+        log_and_print("Window created successfully.\n");
+
+        glfwMakeContextCurrent(window);
+
+        // Load OpenGL function pointers via GLAD
+        if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
+            log_and_print("Error loading GLAD.\n");
+            glfwTerminate();
+            fclose(g_logFile);
+            return -1;
+        }
+        log_and_print("GLAD loaded successfully.\n");
+
+        // Adjust viewport based on actual framebuffer size
+        glfwGetFramebufferSize(window, &fbWidth, &fbHeight);
+        glViewport(0, 0, fbWidth, fbHeight);
+        glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+
+        if (recordVideo && offline) {
+            // Render as fast as possible; frames are timed by the offline clock
+            glfwSwapInterval(0);
+        }
+    }
+
+    // Load, compile and link the shaders
+    ShaderPipeline pipeline;
+    if (!shaderPipelineInit(&pipeline, vertexShaderPath, fragmentShaderPath)) {
+        if (headless) {
+            renderTargetDestroy(&offscreen);
+            headlessContextDestroy(&headlessContext);
+        } else {
+            glfwTerminate();
+        }
+        fclose(g_logFile);
+        return 1;
+    }
+
+    // A benchmark measures encoders on captured frames instead of running the
+    // loop: the first frame, one frame per second of shader time for deflate,
+    // or a run of consecutive frames for the encode profiles
+    if (benchmark) {
+        bool           profiles    = strcmp(benchmark, "profiles") == 0;
+        int            benchFrames =
+            profiles ? profileSampleCount(fbWidth, fbHeight)
+                     : strcmp(benchmark, "deflate") == 0 ? 4 : 1;
+        size_t         frameBytes  = (size_t)fbWidth * fbHeight * 4;
+        unsigned char* pixels      = (unsigned char*)malloc(
+            frameBytes * benchFrames);
+        if (pixels) {
+            double renderSeconds = renderSampleFrames(
+                pipeline.program, pipeline.vao, &pipeline.uniforms, benchFrames,
+                profiles ? 1.0 / fps : 1.0, fbWidth, fbHeight, pixels);
+            if (profiles) {
+                runProfileBenchmark(pixels, benchFrames, fbWidth, fbHeight, fps,
+                                    pixelFormat, yuvOptions.fullRange,
+                                    renderSeconds, (long)(fps * duration));
+            } else if (strcmp(benchmark, "png") == 0) {
+                runPngBenchmark(pixels, fbWidth, fbHeight, &pngOptions);
+            } else if (strcmp(benchmark, "formats") == 0) {
+                runFormatBenchmark(pixels, fbWidth, fbHeight, &pngOptions);
+            } else if (strcmp(benchmark, "pixels") == 0) {
+                runPixelBenchmark(yuvOptions.fullRange);
+            } else {
+                runDeflateBenchmark(pixels, benchFrames, fbWidth, fbHeight,
+                                    &pngOptions);
+            }
+        } else {
+            log_and_print("Error: Unable to allocate memory for pixel data.\n");
+        }
+        free(pixels);
+    }
+
+    // Tiled renders produce images of their own size, independent of the window
+    TiledRenderer tiler;
+    bool          tiled = false;
+    if (tiledWidth > 0 && tiledHeight > 0) {
+        if (!recordVideo) {
+            log_and_print(
+                "Warning: --tiled only applies to recordings; ignoring it.\n");
+        } else if (!tiledRendererInit(&tiler, tiledWidth, tiledHeight,
+                                      tileSize)) {
+            log_and_print("Error: Unable to set up tiled rendering.\n");
+            if (headless) {
+                renderTargetDestroy(&offscreen);
+                headlessContextDestroy(&headlessContext);
+            } else {
+                glfwTerminate();
+            }
+            fclose(g_logFile);
+            return 1;
+        } else {
+            tiled = true;
+            if (pboRingDepth > 0) {
+                log_and_print("Warning: Tiles are read back directly; "
+                              "--pbo-ring is ignored.\n");
+                pboRingDepth = 0;
+            }
+        }
+    }
+
+    // Optional GPU conversion to planar YUV for the sinks that take it
+    YuvConverter yuvConverter;
+    bool         useYuv = false;
+    if (yuvOptions.layout != YUV_OFF) {
+        if (!recordVideo || (sinkKind != SINK_PIPE && sinkKind != SINK_Y4M)) {
+            log_and_print("Warning: --yuv only applies to the pipe and y4m "
+                          "sinks; ignoring it.\n");
+        } else if (tiled) {
+            log_and_print(
+                "Warning: Tiles are read back as RGBA; --yuv is ignored.\n");
+        } else {
+            useYuv = yuvConverterInit(&yuvConverter, &yuvOptions, fbWidth,
+                                      fbHeight);
+            if (!useYuv) {
+                log_and_print("Warning: Falling back to RGBA readback.\n");
+            }
+        }
+        if (!useYuv) {
+            yuvOptions.layout = YUV_OFF;
+        }
+    }
+    if (yuvOptions.validate) {
+        if (!useYuv) {
+            log_and_print("Warning: --yuv-validate needs the GPU YUV "
+                          "conversion; ignoring it.\n");
+        } else if (pboRingDepth > 0) {
+            log_and_print("Warning: YUV validation reads frames back "
+                          "synchronously; --pbo-ring is ignored.\n");
+            pboRingDepth = 0;
+        }
+    }
+
+    // Pixel format the frames are converted to between readback and the sink
+    if (recordVideo) {
+        pixelFormat = resolveSinkPixelFormat(
+            sinkKind, pixelFormat, pixelFormatSet, yuvOptions.layout, tiled);
+        if (sinkKind == SINK_PIPE || sinkIsContainer(sinkKind)) {
+            log_and_print("Pixel format: %s (%s kernels%s)\n",
+                          g_pixelFormatNames[pixelFormat], pixelKernels()->name,
+                          useYuv ? ", converted on the GPU" : "");
+        }
+    }
+
+    // Repeated frames are only skipped where each frame is a file the frame
+    // list can point at
+    if (recordVideo && dedup) {
+        if (sinkKind != SINK_SEQUENCE && sinkKind != SINK_TWO_PASS) {
+            log_and_print("Warning: --dedup only applies to the sequence and "
+                          "two-pass sinks; ignoring it.\n");
+            dedup = false;
+        } else if (tiled) {
+            log_and_print("Warning: Tiled frames are written as they are "
+                          "rendered; --dedup is ignored.\n");
+            dedup = false;
+        } else if (sinkKind == SINK_TWO_PASS &&
+                   strcmp(frameExtension, "rgba") == 0) {
+            log_and_print("Warning: ffmpeg can't read raw rgba frames through "
+                          "a frame list; --dedup is ignored.\n");
+            dedup = false;
+        } else {
+            log_and_print("Frame dedup: %s hashes\n", frameHashKernels()->name);
+        }
+    }
+
+    // Only frame files can be verified and skipped one by one
+    if (recordVideo && resume && sinkKind != SINK_SEQUENCE &&
+        sinkKind != SINK_TWO_PASS) {
+        log_and_print("Warning: --resume only applies to the sequence and "
+                      "two-pass sinks; ignoring it.\n");
+        resume = false;
+    }
+
+    // A budget picks the best profile that fits, from measured render and
+    // encode speeds
+    if (recordVideo && budgetSeconds > 0.0) {
+        if (sinkKind != SINK_PIPE && sinkKind != SINK_TWO_PASS) {
+            log_and_print("Warning: --budget only applies to the pipe and "
+                          "two-pass sinks; ignoring it.\n");
+        } else if (partial) {
+            // Parts are joined without re-encoding, so they can't each pick
+            // their own profile
+            log_and_print("Warning: --budget could pick a different profile "
+                          "for every part; ignoring it.\n");
+        } else {
+            int            samples = profileSampleCount(fbWidth, fbHeight);
+            unsigned char* pixels  = (unsigned char*)malloc(
+                (size_t)fbWidth * fbHeight * 4 * samples);
+            if (pixels) {
+                double renderSeconds = renderSampleFrames(
+                    pipeline.program, pipeline.vao, &pipeline.uniforms, samples,
+                    1.0 / fps, fbWidth, fbHeight, pixels);
+                // Piped frames are encoded as converted; two-pass ones are read
+                // back as RGBA files
+                PixelFormat        calFormat = sinkKind == SINK_PIPE
+                                                   ? pixelFormat
+                                                   : PIXEL_RGBA;
+                ProfileCalibration cal;
+                bool               calibrated = loadProfileCalibration(
+                    PROFILE_CALIBRATION_FILE, fbWidth, fbHeight, calFormat, fps,
+                    yuvOptions.fullRange, &cal);
+                if (calibrated) {
+                    log_and_print("Using the encode calibration in %s.\n",
+                                  PROFILE_CALIBRATION_FILE);
+                } else if (calibrateEncodeProfiles(
+                               pixels, samples, fbWidth, fbHeight, fps,
+                               calFormat, yuvOptions.fullRange, &cal)) {
+                    saveProfileCalibration(PROFILE_CALIBRATION_FILE, &cal);
+                    calibrated = true;
+                }
+                if (calibrated) {
+                    int    outputWidth  = tiled ? tiledWidth : fbWidth;
+                    int    outputHeight = tiled ? tiledHeight : fbHeight;
+                    double renderFps    =
+                        samples / renderSeconds * ((double)fbWidth * fbHeight) /
+                        ((double)outputWidth * outputHeight);
+                    encodeProfile = selectEncodeProfile(
+                        &cal, (long)(fps * duration), outputWidth, outputHeight,
+                        fps, renderFps, sinkKind == SINK_PIPE, encodeSegments,
+                        budgetSeconds);
+                } else {
+                    log_and_print("Warning: Encode calibration failed; keeping "
+                                  "the %s profile.\n", encodeProfile->name);
+                }
+            } else {
+                log_and_print("Error: Unable to allocate memory for the "
+                              "calibration frames.\n");
+            }
+            free(pixels);
+        }
+    }
+    if (recordVideo && (sinkKind == SINK_PIPE || sinkKind == SINK_TWO_PASS)) {
+        log_and_print("Encode profile: %s\n", encodeProfile->name);
+    }
+
+    // If we want to record video, get the frame sink ready before the
+    // first frame
+    FrameSink sink;
+    if (recordVideo) {
+        // Tiled frames are streamed by rows as they are rendered and bypass
+        // the writer
+        SinkConfig sinkConfig = {
+            sinkKind, outputFolder, outputVideo, fps, encoderThreads,
+            pngOptions, frameExtension, rangeEnd - rangeStart, rangeStart,
+            partial, pixelFormat, yuvOptions.fullRange, tiled ? 0 : writeQueue,
+            encodeProfile, encodeSegments, dedup, resume, tiled};
+        if (!frameSinkOpen(&sink, &sinkConfig, tiled ? tiledWidth : fbWidth,
+                           tiled ? tiledHeight : fbHeight)) {
+            log_and_print("Error: Unable to open the %s sink.\n",
+                          sinkKindName(sinkKind));
+            if (tiled) {
+                tiledRendererDestroy(&tiler);
+            }
+            if (headless) {
+                renderTargetDestroy(&offscreen);
+                headlessContextDestroy(&headlessContext);
+            } else {
+                glfwTerminate();
+            }
+            fclose(g_logFile);
+            return 1;
+        }
+    }
+
+    log_and_print("Starting render loop.\n");
+
+    int frameCount   = recordVideo ? (int)rangeStart : 0;
+    int totalFrames  = recordVideo ? (int)rangeEnd : -1;
+
+    g_framePool.hugePages = hugePages;
+
+    // Optional GPU frame difference, reading back only the tiles that changed
+    FrameDiffer frameDiffer;
+    bool        useDiff = false;
+    if (recordVideo && diffTileSize > 0) {
+        if (tiled) {
+            log_and_print("Warning: Tiled frames are streamed as they are "
+                          "rendered; --gpu-diff is ignored.\n");
+        } else if (useYuv) {
+            log_and_print("Warning: --yuv reads back whole planes; --gpu-diff "
+                          "is ignored.\n");
+        } else {
+            useDiff = frameDifferInit(&frameDiffer, diffTileSize, fbWidth,
+                                      fbHeight);
+            if (!useDiff) {
+                log_and_print(
+                    "Warning: Falling back to reading back whole frames.\n");
+            } else if (pboRingDepth > 0) {
+                // The tile mask decides what to read, so the readback can't be
+                // queued ahead of it
+                log_and_print("Warning: The GPU frame difference reads back "
+                              "synchronously; --pbo-ring is ignored.\n");
+                pboRingDepth = 0;
+            }
+        }
+    } else if (diffTileSize > 0) {
+        log_and_print(
+            "Warning: --gpu-diff only applies to recordings; ignoring it.\n");
+    }
+
+    // Optional asynchronous readback ring
+    PboRing pboRing;
+    bool    usePboRing = false;
+    if (recordVideo && pboRingDepth > 0) {
+        usePboRing = pboRingInit(&pboRing, pboRingDepth, fbWidth, fbHeight,
+                                 useYuv ? &yuvConverter : NULL);
+        if (!usePboRing) {
+            log_and_print("Warning: Falling back to synchronous readback.\n");
+        }
+    }
+
+    // Interactive runs follow the wall clock; recordings use an offline clock
+    // (frame / fps) so every run produces the same frames at any render speed.
+    double startTime    = window ? glfwGetTime() : 0.0;
+    double previousTime = 0.0;
+
+    // Main loop (a headless run always records, so it ends with the last frame)
+    while (!benchmark && (headless || !glfwWindowShouldClose(window))) {
+        // Frames an interrupted run already finished are neither rendered nor
+        // encoded again
+        if (recordVideo && frameSinkHasFrame(&sink, frameCount)) {
+            if (usePboRing) {
+                // Frames reach the sink in order, so the ones still in flight
+                // go first
+                pboRingFlush(&pboRing, &sink);
+            }
+            if (useDiff) {
+                // The next frame follows one that was never rendered: read it
+                // back whole
+                frameDiffer.primed = false;
+            }
+            frameSinkSkipFrame(&sink, frameCount);
+            if (frameCount + 1 >= totalFrames) {
+                break;
+            }
+            frameCount++;
+            continue;
+        }
+
+        double frameTime;
+        double frameDelta;
+        if (recordVideo) {
+            frameTime  = (double)frameCount / fps;
+            frameDelta = 1.0 / fps;
+        } else {
+            frameTime    = glfwGetTime() - startTime;
+            frameDelta   = frameTime - previousTime;
+            previousTime = frameTime;
+        }
+
+        if (window) {
+            glfwGetFramebufferSize(window, &fbWidth, &fbHeight);
+        }
+
+        glUseProgram(pipeline.program);
+        setFrameUniforms(&pipeline.uniforms, frameTime, frameCount, frameDelta,
+                         fbWidth, fbHeight);
+
+        if (tiled) {
+            // The frame is drawn and streamed to the sink one band of tiles at
+            // a time
+            if (frameSinkBeginRows(&sink, frameCount, tiledWidth,
+                                   tiledHeight)) {
+                tiledRendererRender(&tiler, &pipeline.uniforms, pipeline.vao,
+                                    emitRowsToSink, &sink);
+                frameSinkEndRows(&sink);
+            }
+
+            // Restore the regular target for presentation
+            if (headless) {
+                glBindFramebuffer(GL_FRAMEBUFFER, offscreen.fbo);
+            }
+            glViewport(0, 0, fbWidth, fbHeight);
+        } else {
+            glClear(GL_COLOR_BUFFER_BIT);
+            glBindVertexArray(pipeline.vao);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+
+            // Capture frames if recording, at the framebuffer's current size
+            if (recordVideo) {
+                if (useDiff) {
+                    captureFrameDiff(&sink, &frameDiffer, frameCount, fbWidth,
+                                     fbHeight);
+                } else if (usePboRing) {
+                    pboRingCapture(&pboRing, &sink, frameCount, fbWidth,
+                                   fbHeight);
+                } else {
+                    captureFrame(&sink, useYuv ? &yuvConverter : NULL,
+                                 frameCount, fbWidth, fbHeight);
+                }
+            }
+        }
+
+        // Stop once the last frame of the recording has been captured
+        if (recordVideo && frameCount + 1 >= totalFrames) {
+            break;
+        }
+        frameCount++;
+
+        if (window) {
+            // Offline recordings are not presented; events still keep the
+            // window alive
+            if (!(recordVideo && offline)) {
+                glfwSwapBuffers(window);
+            }
+            glfwPollEvents();
+        }
+    }
+
+    log_and_print("Exiting render loop.\n");
+
+    // Write out frames still in flight before the context goes away
+    if (usePboRing) {
+        pboRingDestroy(&pboRing, &sink);
+    }
+    if (useYuv) {
+        yuvConverterDestroy(&yuvConverter);
+    }
+    if (useDiff) {
+        frameDifferDestroy(&frameDiffer);
+    }
+    if (tiled) {
+        tiledRendererDestroy(&tiler);
+    }
+
+    if (headless) {
+        renderTargetDestroy(&offscreen);
+        headlessContextDestroy(&headlessContext);
+        log_and_print(
+            "OpenGL resources released; headless context destroyed.\n");
+    } else {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        log_and_print("OpenGL resources released; GLFW terminated.\n");
+    }
+
+    // If recording was enabled, finish the video or image sequence
+    bool written = true;
+    if (recordVideo) {
+        written = frameSinkClose(&sink);
+        framePoolDestroy(&g_framePool);
+    }
+
+    log_and_print("----- Program End -----\n");
+    fclose(g_logFile);
+    return written ? 0 : 1;
 }
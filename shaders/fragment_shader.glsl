@@ -1,8 +1,11 @@
 #version 410 core
 out vec4 FragColor;
 
+// Pixel offset of the tile being rendered (zero unless --tiled is used)
+uniform vec2 iTileOffset;
+
 void main() {
-    vec2 pos = gl_FragCoord.xy;
+    vec2 pos = gl_FragCoord.xy + iTileOffset;
 
     float time = sin(pos.x / 100.0) * cos(pos.y / 50.0) * 3.14159;
 